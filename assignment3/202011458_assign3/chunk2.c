@@ -0,0 +1,204 @@
+/*--------------------------------------------------------------------*/
+/* chunk2.c                                                           */
+/* Author: Sungjin Kim                                                */
+/*--------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <assert.h>
+
+#include "chunk2.h"
+
+/* The size word holds the size of the chunk in bytes, a multiple of
+ * CHUNK_UNIT, so its low bits are free for the flags. The links are
+ * there only while the chunk is free; they are the start of its data
+ * otherwise. */
+struct Chunk {
+   size_t size;        /* Size in bytes | IN_USE | PREV_IN_USE | MMAPPED */
+   Chunk_T next;       /* Pointer to the next chunk in the free chunk list */
+   Chunk_T prev;       /* Pointer to the prev chunk in the free chunk list */
+};
+
+enum {
+   IN_USE = 1,
+   PREV_IN_USE = 2,
+   MMAPPED = 4,
+   FLAGS = CHUNK_UNIT - 1,
+};
+
+/*--------------------------------------------------------------------*/
+void
+chunk_init(Chunk_T c, int units, int status, int prev_in_use)
+{
+   size_t flags = prev_in_use ? PREV_IN_USE : 0;
+
+   if (status == CHUNK_IN_USE)
+      flags |= IN_USE;
+   else if (status == CHUNK_MMAPPED)
+      flags |= IN_USE | MMAPPED;
+   c->size = (size_t)units * CHUNK_UNIT | flags;
+}
+/*--------------------------------------------------------------------*/
+int
+chunk_get_status(Chunk_T c)
+{
+   if (c->size & MMAPPED)
+      return CHUNK_MMAPPED;
+   return (c->size & IN_USE) ? CHUNK_IN_USE : CHUNK_FREE;
+}
+/*--------------------------------------------------------------------*/
+void
+chunk_set_status(Chunk_T c, int status)
+{
+   c->size &= ~(size_t)(IN_USE | MMAPPED);
+   if (status == CHUNK_IN_USE)
+      c->size |= IN_USE;
+   else if (status == CHUNK_MMAPPED)
+      c->size |= IN_USE | MMAPPED;
+}
+/*--------------------------------------------------------------------*/
+int
+chunk_get_units(Chunk_T c)
+{
+   return (int)(c->size / CHUNK_UNIT);
+}
+
+/*--------------------------------------------------------------------*/
+void
+chunk_set_units(Chunk_T c, int units)
+{
+   c->size = (size_t)units * CHUNK_UNIT | (c->size & FLAGS);
+}
+
+/*--------------------------------------------------------------------*/
+int
+chunk_get_prev_in_use(Chunk_T c)
+{
+   return (c->size & PREV_IN_USE) != 0;
+}
+
+/*--------------------------------------------------------------------*/
+void
+chunk_set_prev_in_use(Chunk_T c, int in_use)
+{
+   if (in_use)
+      c->size |= PREV_IN_USE;
+   else
+      c->size &= ~(size_t)PREV_IN_USE;
+}
+
+/*--------------------------------------------------------------------*/
+void
+chunk_set_footer(Chunk_T c)
+{
+   *(size_t *)((char *)c + (c->size & ~(size_t)FLAGS) - CHUNK_HEADER) =
+      c->size & ~(size_t)FLAGS;
+}
+
+int
+chunk_get_footer_units(Chunk_T c)
+{
+   return (int)(*(size_t *)((char *)c + (c->size & ~(size_t)FLAGS) -
+                            CHUNK_HEADER) / CHUNK_UNIT);
+}
+
+void
+chunk_clear_footer(Chunk_T c)
+{
+   *(size_t *)((char *)c + (c->size & ~(size_t)FLAGS) - CHUNK_HEADER) = 0;
+}
+
+/*--------------------------------------------------------------------*/
+Chunk_T
+chunk_get_next_free_chunk(Chunk_T c)
+{
+  return c->next;
+}
+
+/*--------------------------------------------------------------------*/
+void
+chunk_set_next_free_chunk(Chunk_T c, Chunk_T next)
+{
+   c->next = next;
+}
+
+/*--------------------------------------------------------------------*/
+Chunk_T
+chunk_get_prev_free_chunk(Chunk_T c)
+{
+  return c->prev;
+}
+
+/*--------------------------------------------------------------------*/
+void
+chunk_set_prev_free_chunk(Chunk_T c, Chunk_T prev)
+{
+   c->prev = prev;
+}
+
+/*--------------------------------------------------------------------*/
+Chunk_T
+chunk_get_next(Chunk_T c)
+{
+   return (Chunk_T)((char *)c + (c->size & ~(size_t)FLAGS));
+}
+
+Chunk_T
+chunk_get_next_adjacent(Chunk_T c, void* start, void* end)
+{
+   Chunk_T n;
+
+   assert((void *)c >= start);
+
+   n = chunk_get_next(c);
+
+   /* If 'c' is the last chunk in memory space, then 'n' is the fence,
+    * the size word at the very end of the heap; return NULL. */
+   if ((char *)n + CHUNK_HEADER >= (char *)end)
+      return NULL;
+
+   return n;
+}
+
+Chunk_T
+chunk_get_prev_adjacent(Chunk_T c, void* start, void* end)
+{
+   size_t size;
+
+   assert((void *)c >= start);
+   (void)end;
+
+   /* an in-use chunk has no footer, and the first chunk has its
+    * prev-in-use bit set */
+   if (c->size & PREV_IN_USE)
+      return NULL;
+   if ((char *)c - CHUNK_HEADER <= (char *)start)
+      return NULL;
+
+   size = *(size_t *)((char *)c - CHUNK_HEADER);
+   return (Chunk_T)((char *)c - size);
+}
+
+#ifndef NDEBUG
+/*--------------------------------------------------------------------*/
+int
+chunk_is_valid(Chunk_T c, void *start, void *end)
+/* Return 1 (TRUE) iff c is valid */
+{
+   assert(c != NULL);
+   assert(start != NULL);
+   assert(end != NULL);
+
+   if (c < (Chunk_T)start)
+      {fprintf(stderr, "Bad heap start\n"); return 0; }
+   if (c >= (Chunk_T)end)
+      {fprintf(stderr, "Bad heap end\n"); return 0; }
+   if (chunk_get_units(c) < CHUNK_MIN_UNITS)
+      {fprintf(stderr, "Too few units\n"); return 0; }
+   if (((size_t)c + CHUNK_HEADER) % CHUNK_UNIT != 0)
+      {fprintf(stderr, "Misaligned chunk\n"); return 0; }
+   return 1;
+}
+#endif
@@ -0,0 +1,163 @@
+/*--------------------------------------------------------------------*/
+/* chunk2.h                                                           */
+/* Author: Sungjin Kim                                                */
+/*--------------------------------------------------------------------*/
+
+#ifndef _CHUNK2_H_
+#define _CHUNK2_H_
+
+#pragma once
+
+#include <stdbool.h>
+#include <unistd.h>
+
+
+/*
+   the compact chunk layout of heapmgr2. each chunk starts with a size
+   word of CHUNK_HEADER bytes that packs its size in chunk units, its
+   status, and whether the chunk before it is in use. the data of a
+   chunk follows its size word, at a multiple of CHUNK_UNIT, so chunks
+   start CHUNK_HEADER bytes before one.
+
+   a chunk in use has no footer, and its data runs up to the size word
+   of the next chunk. a free chunk keeps its free list links in its
+   data and a copy of its size in its last CHUNK_HEADER bytes, which the
+   chunk after it finds through its prev-in-use bit.
+
+   the size of a chunk counts all of its units, the size word included.
+   For example, a chunk of 2 units is 32 bytes long and holds 24 bytes
+   of data.
+*/
+
+typedef struct Chunk *Chunk_T;
+
+enum {
+   CHUNK_FREE,
+   CHUNK_IN_USE,
+   CHUNK_MMAPPED,          /* in use, mapped on its own outside the heap */
+};
+
+enum {
+   CHUNK_UNIT = 16,
+   CHUNK_HEADER = 8,       /* the size word */
+   CHUNK_MIN_UNITS = 2,    /* size word, two links and a footer */
+};
+
+/* chunk_init:
+ * Writes the size word of a new chunk, 'c', of 'units' units and the
+ * given status, after a chunk that is in use iff 'prev_in_use' is set.
+ * It stores the word whole without reading it first, which would cost
+ * a second page fault on memory fresh from the kernel. */
+void
+chunk_init(Chunk_T c, int units, int status, int prev_in_use);
+
+/* chunk_get_status:
+ * Returns a chunk's status which shows whether the chunk is in use or free.
+ * Return value is CHUNK_IN_USE, CHUNK_FREE or CHUNK_MMAPPED. */
+int
+chunk_get_status(Chunk_T c);
+
+/* chunk_set_status:
+ * Set the status of the chunk, 'c'.
+ * status can be CHUNK_FREE, CHUNK_IN_USE or CHUNK_MMAPPED */
+void
+chunk_set_status(Chunk_T c, int status);
+
+/* chunk_get_units:
+ * Returns the size of a chunk, 'c', in terms of the number of chunk units. */
+int
+chunk_get_units(Chunk_T c);
+
+/* chunk_set_units:
+ * Sets the current size in 'units' of 'c'. The footer is left alone. */
+void
+chunk_set_units(Chunk_T c, int units);
+
+/* chunk_get_prev_in_use:
+ * Returns 1 if the chunk right before 'c' in memory is not free, or if
+ * there is none, and 0 otherwise. */
+int
+chunk_get_prev_in_use(Chunk_T c);
+
+/* chunk_set_prev_in_use:
+ * Sets whether the chunk right before 'c' in memory is in use. */
+void
+chunk_set_prev_in_use(Chunk_T c, int in_use);
+
+/* chunk_set_footer:
+ * Copies the size of the free chunk 'c' to its footer. */
+void
+chunk_set_footer(Chunk_T c);
+
+/* chunk_get_footer_units:
+ * Returns the size that the footer of the free chunk 'c' holds. */
+int
+chunk_get_footer_units(Chunk_T c);
+
+/* chunk_clear_footer:
+ * Zeroes the footer of 'c', which is part of its data once the chunk is
+ * in use. */
+void
+chunk_clear_footer(Chunk_T c);
+
+/* chunk_get_next_free_chunk:
+ * Returns the next free chunk in free chunk list.
+ * Returns NULL if 'c' is the last free chunk in the list. */
+Chunk_T
+chunk_get_next_free_chunk(Chunk_T c);
+
+/* chunk_set_next_free_chunk:
+ * Sets the next free chunk of 'c' to 'next') */
+void
+chunk_set_next_free_chunk(Chunk_T c, Chunk_T next);
+
+/* chunk_get_prev_free_chunk:
+ * Returns the previous free chunk in free chunk list.
+ * Returns NULL if 'c' is the first free chunk in the list. */
+Chunk_T
+chunk_get_prev_free_chunk(Chunk_T c);
+
+/* chunk_set_prev_free_chunk:
+ * Sets the previous free chunk of 'c' to 'prev' */
+void
+chunk_set_prev_free_chunk(Chunk_T c, Chunk_T prev);
+
+/* chunk_get_next:
+ * Returns the size word right after 'c' in memory, which is the fence
+ * of the heap if 'c' is the last chunk. */
+Chunk_T
+chunk_get_next(Chunk_T c);
+
+/* chunk_get_next_adjacent:
+ * Returns the next adjacent chunk to 'c' in memory space.
+ * start is the pointer to the start of the Heap
+ * end is the the pointer to the end of the Heap
+ * Returns NULL if 'c' is the last chunk in memory space. */
+Chunk_T
+chunk_get_next_adjacent(Chunk_T c, void *start, void *end);
+
+/* chunk_get_prev_adjacent:
+ * Returns the prev adjacent chunk to 'c' in memory space if it is free.
+ * start is the pointer to the start of the Heap
+ * end is the the pointer to the end of the Heap
+ * Returns NULL if the chunk before 'c' is in use, since it has no
+ * footer to be found by, or if 'c' is the first chunk in memory space. */
+Chunk_T
+chunk_get_prev_adjacent(Chunk_T c, void *start, void *end);
+
+/* Following function is for debugging.
+ * It will be removed by C preprocessor if you compile the code with
+ * -DNDEBUG option.
+ */
+#ifndef NDEBUG
+/* chunk_is_valid:
+ * Checks the validity of a chunk, 'c'. Returns 1 if OK otherwise 0.
+ * start is the pointer to the start of the Heap
+ * end is the the pointer to the end of the Heap
+ */
+int
+chunk_is_valid(Chunk_T c, void *start, void *end);
+
+#endif /* NDEBUG */
+
+#endif /* _CHUNK2_H_ */
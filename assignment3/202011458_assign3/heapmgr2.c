@@ -3,631 +3,2257 @@
 /* Author: Sungjin Kim                                                */
 /*--------------------------------------------------------------------*/
 
+#define _GNU_SOURCE   /* mremap() */
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <assert.h>
+#include <stdint.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/mman.h>
 
-#include "chunk.h"
+#include "heapmgr.h"
+#include "chunk2.h"
 
 #define FALSE 0
 #define TRUE  1
 
-#define BIN_COUNT 10
-#define BIN_SIZES {100, 200, 300, 400, 500, 600, 700, 800, 900, 1000}
+/* Bins follow the two-level segregated fit (TLSF) scheme. A chunk of
+ * 'u' units belongs to first level fl = floor(log2(u)), which is split
+ * into SL_COUNT second-level lists of equal width. Chunks smaller than
+ * SL_COUNT units get one list per size. Both levels are found with a
+ * count-leading-zeros, and bitmaps of the non-empty lists give the
+ * first list that can serve a request with a count-trailing-zeros.
+ * Chunks of BIN_MAX units or more go to a red-black tree ordered by
+ * size, which gives the best fit for them in O(log n). */
+enum {
+   SL_LOG2 = 4,
+   SL_COUNT = 1 << SL_LOG2,   /* second-level lists per first level */
+   FL_COUNT = 8,              /* first levels, 0 for the exact sizes */
+   BIN_COUNT = FL_COUNT * SL_COUNT,
+   BIN_MAX = 1 << (FL_COUNT - 1 + SL_LOG2),  /* 2048 units */
+};
 
 enum {
    MEMALLOC_MIN = 1024,
 };
 
-/* g_bins: array of point to each bin list */
-static Chunk_T g_bins[BIN_COUNT] = {NULL};
+/* Requests of MMAP_UNITS units or more get a mapping of their own,
+ * which free() unmaps. A free chunk of TRIM_UNITS units or more at the
+ * top of a heap is cut back to MEMALLOC_MIN units. Once an eighth of a
+ * heap has been freed since the last time, the pages inside its free
+ * chunks of RELEASE_UNITS units or more are given back as well. */
+enum {
+   MMAP_UNITS = 8192,      /* 128 KB */
+   TRIM_UNITS = 8192,
+   RELEASE_UNITS = 8192,
+};
+
+/* A large free chunk keeps its tree links at the start of its data,
+ * where a small one keeps its list links; a large chunk has plenty of
+ * room for them. The tree is ordered by units, then by address, so
+ * every key is distinct. */
+struct TreeNode {
+   Chunk_T left, right, parent;
+   int red;
+};
+
+/* Threads share the heap through arenas, each with its own lock, bins
+ * and tree. The first arena grows the program break. Every other arena
+ * owns a region of ARENA_SIZE bytes mapped at an ARENA_SIZE-aligned
+ * address, so a chunk outside the break heap finds its arena by masking
+ * its address. A thread takes an arena, round robin, when it first
+ * allocates; there are up to two arenas per CPU. */
+enum {
+   ARENA_MAX = 16,
+};
+#define ARENA_SIZE ((size_t)1 << 30)
+
+/* Each thread caches up to TCACHE_COUNT freed chunks of each size up to
+ * TCACHE_UNITS units and hands them out again without any lock. Their
+ * arena sees cached chunks as in use. */
+enum {
+   TCACHE_UNITS = 64,
+   TCACHE_COUNT = 16,
+};
+
+/* Requests of up to SLAB_MAX bytes come from the slab instead, without
+ * any header. The slab is a region of SLAB_SIZE bytes reserved at start
+ * up and cut into pages of SLAB_PAGE bytes. Each page holds objects of
+ * one size class, a multiple of SLAB_STEP bytes, and the descriptor of
+ * a page, found from an address by its page number, keeps its class
+ * and its freed objects. Up to SLAB_EMPTY pages that fall empty are
+ * kept for any class; the pages of the others are given back. */
+enum {
+   SLAB_STEP = 16,
+   SLAB_MAX = 128,
+   SLAB_CLASSES = SLAB_MAX / SLAB_STEP,
+   SLAB_PAGE = 4096,
+   SLAB_EMPTY = 64,
+};
+#define SLAB_SIZE ((size_t)1 << 30)
+
+struct Arena {
+   pthread_mutex_t lock;
+
+   /* bins: head of each bin list, indexed by fl * SL_COUNT + sl */
+   Chunk_T bins[BIN_COUNT];
+
+   /* fl_bitmap: bit fl is set iff a list of first level fl is non-empty.
+    * sl_bitmap: bit sl of entry fl is set iff that list is non-empty */
+   unsigned int fl_bitmap;
+   unsigned int sl_bitmap[FL_COUNT];
+
+   /* tree_root: root of the tree of large free chunks */
+   Chunk_T tree_root;
+
+   /* tree_nil: the sentinel leaf of the tree, black and never a real
+    * chunk. Its parent link is scratch space for tree_remove(). */
+   struct {
+      char header[CHUNK_HEADER];
+      struct TreeNode node;
+   } tree_nil;
+
+   /* heap_start, heap_end: start and end of the heap area. heap_end
+    * will move if you increase the heap, up to heap_limit for a mapped
+    * arena; heap_limit is NULL for the break heap. The chunks start
+    * CHUNK_HEADER bytes into the area, so that their data is aligned,
+    * and the last CHUNK_HEADER bytes are the fence: a size word of no
+    * units that keeps the prev-in-use bit of the last chunk */
+   void *heap_start, *heap_end, *heap_limit;
+
+   /* remote: stack of chunks that threads of other arenas freed, linked
+    * through their data. They push with a compare-and-swap, and a
+    * thread of the arena takes the whole stack under the lock. */
+   Chunk_T remote;
+
+   /* freed: bytes freed since the pages of the free chunks were last
+    * given back */
+   size_t freed;
+
+   /* free_counts, free_bytes: free chunks of each bin and their bytes,
+    * and those of the tree in the last entry */
+   size_t free_counts[BIN_COUNT + 1], free_bytes[BIN_COUNT + 1];
+};
+#define TREE_NIL(a) ((Chunk_T)&(a)->tree_nil)
+
+/* The descriptor of a slab page. An object is freed onto the list of
+ * its page, linked through its first word; the objects past 'carved'
+ * have never been handed out, so a new page needs no set up. */
+struct SlabPage {
+   void *free;
+   struct SlabPage *next, *prev;   /* in the partial list of the class */
+   unsigned short cls, used, carved;
+};
+
+/* Each size class has its own lock and a list of its pages that have
+ * a free object; a full page is in no list. */
+struct SlabClass {
+   pthread_mutex_t lock;
+   struct SlabPage *partial;
+   int size, count;                /* object size, objects per page */
+   size_t pages, used;             /* pages and objects in use */
+};
+
+/* heads: cached chunks of each size, linked through their data.
+ * slabs: cached slab objects of each class, linked through their
+ * first word */
+struct TCache {
+   Chunk_T heads[TCACHE_UNITS + 1];
+   int counts[TCACHE_UNITS + 1];
+   void *slabs[SLAB_CLASSES + 1];
+   int slab_counts[SLAB_CLASSES + 1];
+};
+
+/* g_main_arena: the arena of the break heap.
+ * g_arenas: the arenas made so far, g_arena_count of them; the next
+ * thread takes arena g_arena_next % g_arena_limit */
+static struct Arena g_main_arena;
+static struct Arena *g_arenas[ARENA_MAX] = {&g_main_arena};
+static int g_arena_count = 1, g_arena_next = 0, g_arena_limit = 1;
+static pthread_mutex_t g_arenas_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t g_init_once = PTHREAD_ONCE_INIT;
+
+/* g_tcache_key: flushes the cache of a thread when it exits */
+static pthread_key_t g_tcache_key;
+
+/* g_slab_base: the slab region, NULL if it could not be reserved. Its
+ * first pages hold the descriptors of all of its pages, g_slab_pages.
+ * g_slab_classes: the size classes, class i for objects of up to
+ * i * SLAB_STEP bytes.
+ * g_slab_lock guards the rest: g_slab_top, the first page never used,
+ * and g_slab_empty, the stack of empty pages, g_slab_empty_count of
+ * them, linked through their next links */
+static char *g_slab_base = NULL;
+static struct SlabPage *g_slab_pages;
+static struct SlabClass g_slab_classes[SLAB_CLASSES + 1];
+static pthread_mutex_t g_slab_lock = PTHREAD_MUTEX_INITIALIZER;
+static size_t g_slab_top;
+static struct SlabPage *g_slab_empty = NULL;
+static int g_slab_empty_count = 0;
+
+/* The counters behind heapmgr_stats(), kept up with atomic adds.
+ * g_stat_total: bytes of the heaps, the mapped chunks and the slab pages
+ * in use, and g_stat_peak, its largest value so far.
+ * g_stat_mapped: bytes of the mapped chunks.
+ * g_stat_calls: calls of sbrk() that move the break, of mmap() and
+ * mremap(), of munmap() and of madvise() */
+enum {
+   STAT_SBRK, STAT_MMAP, STAT_MUNMAP, STAT_MADVISE, STAT_CALLS,
+};
+static size_t g_stat_total = 0, g_stat_peak = 0, g_stat_mapped = 0;
+static size_t g_stat_calls[STAT_CALLS];
+
+/* g_stats_period: the statistics go to stderr after every so many
+ * allocations of a thread, counted in t_stats_count; 0 for never */
+static int g_stats_period = 0;
+static __thread unsigned int t_stats_count = 0;
+
+/* t_arena: arena of the calling thread, NULL until it takes one.
+ * t_tcache: cache of small chunks of the calling thread */
+static __thread struct Arena *t_arena = NULL;
+static __thread struct TCache t_tcache;
+
+/*--------------------------------------------------------------------*/
+/* get_bin_index:
+ * Returns the bin that holds free chunks of 'units' units, or -1 if
+ * such chunks go to the large free list. */
+/*--------------------------------------------------------------------*/
+static int
+get_bin_index(int units)
+{
+   int fl;
+
+   if (units < SL_COUNT)
+      return units;
+   if (units >= BIN_MAX)
+      return -1;
+
+   fl = 31 - __builtin_clz((unsigned int)units);
+   return (fl - SL_LOG2 + 1) * SL_COUNT +
+      ((units >> (fl - SL_LOG2)) ^ SL_COUNT);
+}
+/*--------------------------------------------------------------------*/
+/* get_search_index:
+ * Returns the first bin whose chunks all have at least 'units' units,
+ * or -1 if there is no such bin. 'units' is rounded up to the start of
+ * the next list, so any chunk of the returned bin fits. */
+/*--------------------------------------------------------------------*/
+static int
+get_search_index(int units)
+{
+   int fl;
+
+   if (units >= SL_COUNT) {
+      fl = 31 - __builtin_clz((unsigned int)units);
+      units += (1 << (fl - SL_LOG2)) - 1;
+   }
+   return get_bin_index(units);
+}
+/*--------------------------------------------------------------------*/
+/* get_bin_units:
+ * Returns the smallest chunk, in units, that goes to the bin 'idx', or
+ * to the tree if 'idx' is BIN_COUNT. */
+/*--------------------------------------------------------------------*/
+static int
+get_bin_units(int idx)
+{
+   if (idx < SL_COUNT)
+      return idx;
+   return (SL_COUNT + idx % SL_COUNT) << (idx / SL_COUNT - 1);
+}
+/*--------------------------------------------------------------------*/
+/* tree_node:
+ * Returns the tree links of the large free chunk 'c'. */
+/*--------------------------------------------------------------------*/
+static inline struct TreeNode *
+tree_node(Chunk_T c)
+{
+   return (struct TreeNode *)((char *)c + CHUNK_HEADER);
+}
+/*--------------------------------------------------------------------*/
+/* first_chunk, heap_fence:
+ * Return the first chunk of the heap of 'a', and its fence. */
+/*--------------------------------------------------------------------*/
+static inline Chunk_T
+first_chunk(struct Arena *a)
+{
+   return (Chunk_T)((char *)a->heap_start + CHUNK_HEADER);
+}
+
+static inline Chunk_T
+heap_fence(struct Arena *a)
+{
+   return (Chunk_T)((char *)a->heap_end - CHUNK_HEADER);
+}
+/*--------------------------------------------------------------------*/
+/* set_fence:
+ * Writes the fence at the end of the heap of 'a', after a last chunk
+ * that is in use. */
+/*--------------------------------------------------------------------*/
+static void
+set_fence(struct Arena *a)
+{
+   chunk_init(heap_fence(a), 0, CHUNK_IN_USE, TRUE);
+}
+/*--------------------------------------------------------------------*/
+/* slab_owns, slab_page_of, slab_page_data, slab_size_of:
+ * Return TRUE iff 'm' lies in the slab, the descriptor of the slab page
+ * that holds 'm', the page that 'p' describes, and the size of the slab
+ * object 'm'. */
+/*--------------------------------------------------------------------*/
+static inline int
+slab_owns(void *m)
+{
+   return g_slab_base != NULL &&
+      (uintptr_t)m - (uintptr_t)g_slab_base < SLAB_SIZE;
+}
+
+static inline struct SlabPage *
+slab_page_of(void *m)
+{
+   return &g_slab_pages[((char *)m - g_slab_base) / SLAB_PAGE];
+}
+
+static inline char *
+slab_page_data(struct SlabPage *p)
+{
+   return g_slab_base + (size_t)(p - g_slab_pages) * SLAB_PAGE;
+}
+
+static inline size_t
+slab_size_of(void *m)
+{
+   return (size_t)g_slab_classes[slab_page_of(m)->cls].size;
+}
+/*--------------------------------------------------------------------*/
+/* stats_count:
+ * Counts a call of the system call 'call', one of STAT_SBRK through
+ * STAT_MADVISE. */
+/*--------------------------------------------------------------------*/
+static inline void
+stats_count(int call)
+{
+   __atomic_fetch_add(&g_stat_calls[call], 1, __ATOMIC_RELAXED);
+}
+/*--------------------------------------------------------------------*/
+/* stats_grow, stats_shrink:
+ * Add 'bytes' to the memory of the heap manager, keeping up its peak,
+ * and take them away. */
+/*--------------------------------------------------------------------*/
+static void
+stats_grow(size_t bytes)
+{
+   size_t total, peak;
+
+   total = __atomic_add_fetch(&g_stat_total, bytes, __ATOMIC_RELAXED);
+   peak = __atomic_load_n(&g_stat_peak, __ATOMIC_RELAXED);
+   while (total > peak &&
+          !__atomic_compare_exchange_n(&g_stat_peak, &peak, total, TRUE,
+                                       __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+      ;
+}
+
+static inline void
+stats_shrink(size_t bytes)
+{
+   __atomic_sub_fetch(&g_stat_total, bytes, __ATOMIC_RELAXED);
+}
+/*--------------------------------------------------------------------*/
+/* stats_mapped:
+ * Counts a mapped chunk of 'old_bytes' bytes, 0 for none, that is now
+ * 'new_bytes' bytes long, 0 once it is unmapped. */
+/*--------------------------------------------------------------------*/
+static void
+stats_mapped(size_t old_bytes, size_t new_bytes)
+{
+   if (new_bytes > old_bytes) {
+      __atomic_add_fetch(&g_stat_mapped, new_bytes - old_bytes,
+                         __ATOMIC_RELAXED);
+      stats_grow(new_bytes - old_bytes);
+   }
+   else {
+      __atomic_sub_fetch(&g_stat_mapped, old_bytes - new_bytes,
+                         __ATOMIC_RELAXED);
+      stats_shrink(old_bytes - new_bytes);
+   }
+}
+/*--------------------------------------------------------------------*/
+/* tree_less:
+ * Returns TRUE iff 'c1' comes before 'c2' in the tree order. */
+/*--------------------------------------------------------------------*/
+static inline int
+tree_less(Chunk_T c1, Chunk_T c2)
+{
+   int u1 = chunk_get_units(c1), u2 = chunk_get_units(c2);
+
+   return u1 < u2 || (u1 == u2 && c1 < c2);
+}
+
+#ifndef NDEBUG
+/* check_tree:
+ * Checks the subtree at 'x' for order, parent links and the red-black
+ * rules, and counts its chunks into '*count'. Returns its black height,
+ * or -1 on failure. */
+static int
+check_tree(struct Arena *a, Chunk_T x, Chunk_T parent, int *count)
+{
+   struct TreeNode *n;
+   int lh, rh;
 
-/* define each bin size */
-static const int bin_sizes[BIN_COUNT] = BIN_SIZES;
+   if (x == TREE_NIL(a))
+      return 1;
+   n = tree_node(x);
 
-/* g_free_head: point to first chunk in the free list */
-static Chunk_T g_free_head = NULL;
+   if (chunk_get_status(x) != CHUNK_FREE) {
+      fprintf(stderr, "Non-free chunk in the free chunk tree\n");
+      return -1;
+   }
+   if (!chunk_is_valid(x, a->heap_start, a->heap_end))
+      return -1;
+   if (chunk_get_units(x) < BIN_MAX) {
+      fprintf(stderr, "Small chunk in the free chunk tree\n");
+      return -1;
+   }
+   if (n->parent != parent ||
+       (n->left != TREE_NIL(a) && !tree_less(n->left, x)) ||
+       (n->right != TREE_NIL(a) && !tree_less(x, n->right))) {
+      fprintf(stderr, "Free chunk tree out of order\n");
+      return -1;
+   }
+   if (n->red && ((n->left != TREE_NIL(a) && tree_node(n->left)->red) ||
+                  (n->right != TREE_NIL(a) && tree_node(n->right)->red))) {
+      fprintf(stderr, "Red chunk with a red child\n");
+      return -1;
+   }
 
-/* g_heap_start, g_heap_end: start and end of the heap area.
- * g_heap_end will move if you increase the heap */
-static void *g_heap_start = NULL, *g_heap_end = NULL;
+   (*count)++;
+   lh = check_tree(a, n->left, x, count);
+   rh = check_tree(a, n->right, x, count);
+   if (lh < 0 || rh < 0)
+      return -1;
+   if (lh != rh) {
+      fprintf(stderr, "Unbalanced free chunk tree\n");
+      return -1;
+   }
+   return lh + !n->red;
+}
+#endif
 
 #ifndef NDEBUG
 /* check_heap_validity:
  * Validity check for entire data structures for chunks. Note that this
  * is basic sanity check, and passing this test does not guarantee the
- * integrity of your code. 
- * Returns 1 on success or 0 (zero) on failure. 
+ * integrity of your code.
+ * Returns 1 on success or 0 (zero) on failure.
  */
 static int
-check_heap_validity(void)
+check_heap_validity(struct Arena *a)
 {
-   Chunk_T w;
+   Chunk_T w, prev;
+   int i, free_chunks = 0, listed = 0;
+   size_t free_bytes = 0, counts = 0, bytes = 0;
 
-   if (g_heap_start == NULL) {
+   if (a->heap_start == NULL) {
       fprintf(stderr, "Uninitialized heap start\n");
       return FALSE;
    }
 
-   if (g_heap_end == NULL) {
+   if (a->heap_end == NULL) {
       fprintf(stderr, "Uninitialized heap end\n");
       return FALSE;
    }
 
-   if (g_heap_start == g_heap_end) {
-      if (g_free_head == NULL)
+   if (a->heap_start == a->heap_end) {
+      if (a->tree_root == TREE_NIL(a) && a->fl_bitmap == 0)
          return 1;
       fprintf(stderr, "Inconsistent empty heap\n");
       return FALSE;
    }
 
-   for (w = (Chunk_T)g_heap_start; 
-        w && w < (Chunk_T)g_heap_end;
-        w = chunk_get_next_adjacent(w, g_heap_start, g_heap_end)) {
+   prev = NULL;
+   for (w = first_chunk(a);
+        w && w < (Chunk_T)a->heap_end;
+        w = chunk_get_next_adjacent(w, a->heap_start, a->heap_end)) {
 
-      if (!chunk_is_valid(w, g_heap_start, g_heap_end)) 
+      if (!chunk_is_valid(w, a->heap_start, a->heap_end))
          return 0;
-   }
 
-   for (w = g_free_head; w; w = chunk_get_next_free_chunk(w)) {
-      Chunk_T n;
-      if (chunk_get_status(w) != CHUNK_FREE) {
-         fprintf(stderr, "Non-free chunk in the free chunk list\n");
+      if (chunk_get_prev_in_use(w) !=
+          (prev == NULL || chunk_get_status(prev) != CHUNK_FREE)) {
+         fprintf(stderr, "Prev-in-use bit out of date\n");
          return 0;
       }
 
-      if (!chunk_is_valid(w, g_heap_start, g_heap_end))
-         return 0;
+      if (chunk_get_status(w) == CHUNK_FREE) {
+         if (chunk_get_footer_units(w) != chunk_get_units(w)) {
+            fprintf(stderr, "Header and footer disagree\n");
+            return 0;
+         }
+         if (prev != NULL && chunk_get_status(prev) == CHUNK_FREE) {
+            fprintf(stderr, "Uncoalesced chunks\n");
+            return 0;
+         }
+         free_chunks++;
+         free_bytes += (size_t)chunk_get_units(w) * CHUNK_UNIT;
+      }
+      prev = w;
+   }
+
+   /* the last chunk ends at the fence, which knows its status */
+   w = heap_fence(a);
+   if (prev == NULL || chunk_get_next(prev) != w ||
+       chunk_get_units(w) != 0 || chunk_get_status(w) != CHUNK_IN_USE ||
+       chunk_get_prev_in_use(w) != (chunk_get_status(prev) != CHUNK_FREE)) {
+      fprintf(stderr, "Bad fence at the end of the heap\n");
+      return 0;
+   }
+
+   /* check validity of each bin list and its bitmap bits */
+   for (i = 0; i < BIN_COUNT; i++) {
+      int fl = i / SL_COUNT, sl = i % SL_COUNT;
 
-      n = chunk_get_next_adjacent(w, g_heap_start, g_heap_end);
-      if (n != NULL && n == chunk_get_next_free_chunk(w)) {
-         fprintf(stderr, "Uncoalesced chunks\n");
+      if (((a->bins[i] != NULL) != ((a->sl_bitmap[fl] >> sl) & 1)) ||
+          ((a->sl_bitmap[fl] != 0) != ((a->fl_bitmap >> fl) & 1))) {
+         fprintf(stderr, "Bin bitmap out of date\n");
          return 0;
       }
-   }
 
-   // check validity of each bin list
-   for(int i=0; i<BIN_COUNT; i++){
-      for (w = g_bins[i]; w; w = chunk_get_next_free_chunk(w)) {
-         Chunk_T n;
+      prev = NULL;
+      for (w = a->bins[i]; w; w = chunk_get_next_free_chunk(w)) {
          if (chunk_get_status(w) != CHUNK_FREE) {
             fprintf(stderr, "Non-free chunk in the free chunk bin\n");
             return 0;
          }
 
-         if (!chunk_is_valid(w, g_heap_start, g_heap_end))
+         if (!chunk_is_valid(w, a->heap_start, a->heap_end))
             return 0;
 
-         n = chunk_get_next_adjacent(w, g_heap_start, g_heap_end);
-         if (n != NULL && n == chunk_get_next_free_chunk(w)) {
-            fprintf(stderr, "Uncoalesced chunks\n");
+         if (get_bin_index(chunk_get_units(w)) != i) {
+            fprintf(stderr, "Chunk in the wrong bin\n");
+            return 0;
+         }
+
+         if (chunk_get_prev_free_chunk(w) != prev) {
+            fprintf(stderr, "Broken back link in a bin\n");
             return 0;
          }
+         prev = w;
+         listed++;
       }
    }
+
+   if (a->tree_root != TREE_NIL(a) && tree_node(a->tree_root)->red) {
+      fprintf(stderr, "Red root of the free chunk tree\n");
+      return 0;
+   }
+   if (check_tree(a, a->tree_root, TREE_NIL(a), &listed) < 0)
+      return 0;
+
+   if (listed != free_chunks) {
+      fprintf(stderr, "Free chunk missing from the bins and tree\n");
+      return 0;
+   }
+
+   for (i = 0; i <= BIN_COUNT; i++) {
+      counts += a->free_counts[i];
+      bytes += a->free_bytes[i];
+   }
+   if (counts != (size_t)free_chunks || bytes != free_bytes) {
+      fprintf(stderr, "Free chunk counters out of date\n");
+      return 0;
+   }
    return TRUE;
 }
 #endif
 
-/* get_bin_index: return the appropriate index of bin of the unit */
-static int get_bin_index(int unit) {
-    for (int i = 0; i < BIN_COUNT; i++) {
-        if (unit <= bin_sizes[i]) {
-            return i;
-        }
-    }
-    return -1;  // Return -1 if unit doesn't fit into any bin
+#ifndef NDEBUG
+/* check_slab_validity:
+ * Checks the partial pages of the slab class 'cls': their class, links
+ * and counts, and that their free lists hold objects of the page.
+ * Returns 1 on success or 0 (zero) on failure.
+ */
+static int
+check_slab_validity(int cls)
+{
+   struct SlabClass *sc = &g_slab_classes[cls];
+   struct SlabPage *p, *prev = NULL;
+   char *data, *m;
+   int n;
+
+   for (p = sc->partial; p != NULL; prev = p, p = p->next) {
+      if (p->cls != cls || p->prev != prev) {
+         fprintf(stderr, "Bad slab page in a partial list\n");
+         return 0;
+      }
+      if (p->used >= sc->count || p->carved > sc->count ||
+          p->used > p->carved) {
+         fprintf(stderr, "Bad object counts of a slab page\n");
+         return 0;
+      }
+
+      data = slab_page_data(p);
+      n = 0;
+      for (m = p->free; m != NULL; m = *(char **)m) {
+         if (m < data || m >= data + p->carved * sc->size ||
+             (m - data) % sc->size != 0 || ++n > p->carved) {
+            fprintf(stderr, "Bad free object in a slab page\n");
+            return 0;
+         }
+      }
+      if (n != p->carved - p->used) {
+         fprintf(stderr, "Free objects missing from a slab page\n");
+         return 0;
+      }
+   }
+   return TRUE;
 }
+#endif
+
 /*--------------------------------------------------------------*/
 /* size_to_units:
- * Returns capable number of units for 'size' bytes. 
+ * Returns capable number of units for 'size' bytes, the size word
+ * included.
  */
 /*--------------------------------------------------------------*/
 static size_t
 size_to_units(size_t size)
 {
-  return (size + (CHUNK_UNIT-1))/CHUNK_UNIT;
+  size_t units = (size + CHUNK_HEADER + (CHUNK_UNIT-1))/CHUNK_UNIT;
+
+  return (units < CHUNK_MIN_UNITS) ? CHUNK_MIN_UNITS : units;
+}
+/*--------------------------------------------------------------*/
+/* units_to_size:
+ * Returns the number of data bytes of a chunk of 'units' units.
+ */
+/*--------------------------------------------------------------*/
+static inline size_t
+units_to_size(int units)
+{
+  return (size_t)units * CHUNK_UNIT - CHUNK_HEADER;
 }
 /*--------------------------------------------------------------*/
 /* get_chunk_from_data_ptr:
- * Returns the header pointer that contains data 'm'. 
+ * Returns the header pointer that contains data 'm'.
  */
 /*--------------------------------------------------------------*/
 static Chunk_T
 get_chunk_from_data_ptr(void *m)
 {
-  return (Chunk_T)((char *)m - CHUNK_UNIT);
+  return (Chunk_T)((char *)m - CHUNK_HEADER);
 }
-/*--------------------------------------------------------------------*/
-/* init_my_heap: 
- * Initialize data structures and global variables for
- * chunk management. 
+/*--------------------------------------------------------------*/
+/* get_data_ptr:
+ * Returns the data of the chunk 'c'.
  */
+/*--------------------------------------------------------------*/
+static inline void *
+get_data_ptr(Chunk_T c)
+{
+  return (void *)((char *)c + CHUNK_HEADER);
+}
+/*--------------------------------------------------------------------*/
+/* list_push:
+ * Links 'c' at the head of the list at '*head'. A free chunk links to
+ * both of its neighbors in the list. */
 /*--------------------------------------------------------------------*/
 static void
-init_my_heap(void)
+list_push(Chunk_T *head, Chunk_T c)
 {
-   /* Initialize g_heap_start and g_heap_end */
-   g_heap_start = g_heap_end = sbrk(0);
-   if (g_heap_start == (void *)-1) {
-      fprintf(stderr, "sbrk(0) failed\n");
-      exit(-1);
-   }
+   Chunk_T next = *head;
+
+   chunk_set_next_free_chunk(c, next);
+   chunk_set_prev_free_chunk(c, NULL);
+   if (next != NULL)
+      chunk_set_prev_free_chunk(next, c);
+   *head = c;
 }
 /*--------------------------------------------------------------------*/
-/* merge_chunk:
- * Merge two adjacent chunks and move the merged chunk to appropriate bin if needed.
- * return the merged chunk.
- * Returns NULL on error. 
- */
+/* list_remove:
+ * Unlinks 'c' from the list at '*head'. */
 /*--------------------------------------------------------------------*/
 static void
-insert_chunk(Chunk_T c); // function prototype
-
-static Chunk_T
-merge_chunk(Chunk_T c1, Chunk_T c2)
+list_remove(Chunk_T *head, Chunk_T c)
 {
-   /* c1 and c2 must be be adjacent */
-   assert (c1 < c2 && chunk_get_next_adjacent(c1, g_heap_start, g_heap_end) == c2);
-   assert (chunk_get_status(c1) == CHUNK_FREE);
-   assert (chunk_get_status(c2) == CHUNK_FREE);
-
-   int c_bin_idx = get_bin_index(chunk_get_units(c1));
-   Chunk_T prev = chunk_get_next_free_chunk(chunk_get_footer_from_header(c1));
-   Chunk_T next = chunk_get_next_free_chunk(c2);
-
-   /* adjust the units and the next pointer of c1 */
-   int new_unit = chunk_get_units(c1) + chunk_get_units(c2) + 2;
-   chunk_set_units(c1, new_unit);
-   chunk_set_units(chunk_get_footer_from_header(c2), new_unit);
-
-   if(prev == NULL){
-      if(c_bin_idx != -1)
-         g_bins[c_bin_idx] = next;
-      else
-         g_free_head = next;
-   }
-   else{
-      chunk_set_next_free_chunk(prev, next);
-   }
-
-   if(next != NULL){
-      chunk_set_next_free_chunk(chunk_get_footer_from_header(next), prev);
-   }
+   Chunk_T prev = chunk_get_prev_free_chunk(c);
+   Chunk_T next = chunk_get_next_free_chunk(c);
 
-   insert_chunk(c1);
-   return c1;
+   if (prev == NULL)
+      *head = next;
+   else
+      chunk_set_next_free_chunk(prev, next);
+   if (next != NULL)
+      chunk_set_prev_free_chunk(next, prev);
 }
 /*--------------------------------------------------------------------*/
-/* split_chunk:
- * Split 'c' into two chunks s.t. the size of one chunk is 'units' and
- * the size of the other chunk is (original size - 'units' - 1).
- * move each chunk to appropriate bin if needed.
- * returns the chunk with 'units'
- * Returns the data chunk. */
+/* tree_rotate:
+ * Rotates the tree at 'x' to the left, or to the right if 'right' is
+ * set, so that its child on the other side takes its place. */
 /*--------------------------------------------------------------------*/
-static Chunk_T 
-split_chunk(Chunk_T c, size_t units)
+static void
+tree_rotate(struct Arena *a, Chunk_T x, int right)
 {
-   Chunk_T c2;
-   Chunk_T c_footer;
-   int all_units;
-   int c_bin_idx = get_bin_index(chunk_get_units(c));
-
-   assert (c >= (Chunk_T)g_heap_start && c <= (Chunk_T)g_heap_end);
-   assert (chunk_get_status(c) == CHUNK_FREE);
-   assert (chunk_get_units(c) > units + 2); /* assume chunk with header unit */
-   
-   /* adjust the size of the first chunk */
-   all_units = chunk_get_units(c);
-   int c1_bin_idx = get_bin_index(all_units - units - 2);
-   chunk_set_units(c, all_units - units - 2);
-   c_footer = chunk_get_footer_from_header(c);
-   chunk_set_units(c_footer, all_units - units - 2);
-
-   /* prepare for the second chunk */
-   c2 = chunk_get_next_adjacent(c, g_heap_start, g_heap_end);
-   chunk_set_units(c2, units);
-   chunk_set_units(chunk_get_footer_from_header(c2), units);
-   chunk_set_status(c2, CHUNK_IN_USE);
-   
-   Chunk_T c1_next = chunk_get_next_free_chunk(c);
-   Chunk_T c1_prev = chunk_get_next_free_chunk(chunk_get_footer_from_header(c2));
-   if(c_bin_idx != c1_bin_idx){
-      if(c1_prev == NULL){
-         if(c_bin_idx != -1)
-            g_bins[c_bin_idx] = c1_next;
-         else
-            g_free_head = c1_next;
-      }
-      else{
-         chunk_set_next_free_chunk(c1_prev, c1_next);
-      }
-      if(c1_next != NULL)
-         chunk_set_next_free_chunk(chunk_get_footer_from_header(c1_next), c1_prev);
-
-      insert_chunk(c);
-   }
-   else{
-      chunk_set_next_free_chunk(c_footer, c1_prev);
-   }
+   struct TreeNode *xn = tree_node(x), *yn;
+   Chunk_T y = right ? xn->left : xn->right;
+   Chunk_T inner;
+
+   yn = tree_node(y);
+   inner = right ? yn->right : yn->left;
+   if (right)
+      xn->left = inner;
+   else
+      xn->right = inner;
+   if (inner != TREE_NIL(a))
+      tree_node(inner)->parent = x;
+
+   yn->parent = xn->parent;
+   if (xn->parent == TREE_NIL(a))
+      a->tree_root = y;
+   else if (x == tree_node(xn->parent)->left)
+      tree_node(xn->parent)->left = y;
+   else
+      tree_node(xn->parent)->right = y;
 
-   return c2;
+   if (right)
+      yn->right = x;
+   else
+      yn->left = x;
+   xn->parent = y;
 }
 /*--------------------------------------------------------------------*/
-/* split_chunk2:
- * Special split_chunk function that only use in malloc function
- * only c_bin_idx is different from original */
+/* tree_insert:
+ * Adds the large free chunk 'c' to the tree. */
 /*--------------------------------------------------------------------*/
-static Chunk_T 
-split_chunk2(Chunk_T c, size_t units)
+static void
+tree_insert(struct Arena *a, Chunk_T c)
 {
-   Chunk_T c2;
-   Chunk_T c_footer;
-   int all_units;
-   int c_bin_idx = -1;
+   struct TreeNode *n = tree_node(c);
+   Chunk_T x = a->tree_root, p = TREE_NIL(a), g, u;
+   int left;
 
-   assert (c >= (Chunk_T)g_heap_start && c <= (Chunk_T)g_heap_end);
-   assert (chunk_get_status(c) == CHUNK_FREE);
-   assert (chunk_get_units(c) > units + 2); /* assume chunk with header unit */
-   
-   /* adjust the size of the first chunk */
-   all_units = chunk_get_units(c);
-   int c1_bin_idx = get_bin_index(all_units - units - 2);
-   chunk_set_units(c, all_units - units - 2);
-   c_footer = chunk_get_footer_from_header(c);
-   chunk_set_units(c_footer, all_units - units - 2);
-
-   /* prepare for the second chunk */
-   c2 = chunk_get_next_adjacent(c, g_heap_start, g_heap_end);
-   chunk_set_units(c2, units);
-   chunk_set_units(chunk_get_footer_from_header(c2), units);
-   chunk_set_status(c2, CHUNK_IN_USE);
-   
-   Chunk_T c1_next = chunk_get_next_free_chunk(c);
-   Chunk_T c1_prev = chunk_get_next_free_chunk(chunk_get_footer_from_header(c2));
-   if(c_bin_idx != c1_bin_idx){
-      if(c1_prev == NULL){
-         if(c_bin_idx != -1)
-            g_bins[c_bin_idx] = c1_next;
-         else
-            g_free_head = c1_next;
+   while (x != TREE_NIL(a)) {
+      p = x;
+      x = tree_less(c, x) ? tree_node(x)->left : tree_node(x)->right;
+   }
+   n->parent = p;
+   n->left = n->right = TREE_NIL(a);
+   n->red = TRUE;
+   if (p == TREE_NIL(a))
+      a->tree_root = c;
+   else if (tree_less(c, p))
+      tree_node(p)->left = c;
+   else
+      tree_node(p)->right = c;
+
+   /* repaint and rotate until no red chunk has a red parent */
+   while (tree_node(tree_node(c)->parent)->red) {
+      p = tree_node(c)->parent;
+      g = tree_node(p)->parent;
+      left = (p == tree_node(g)->left);
+      u = left ? tree_node(g)->right : tree_node(g)->left;
+      if (tree_node(u)->red) {
+         tree_node(p)->red = FALSE;
+         tree_node(u)->red = FALSE;
+         tree_node(g)->red = TRUE;
+         c = g;
+         continue;
       }
-      else{
-         chunk_set_next_free_chunk(c1_prev, c1_next);
+      if (c == (left ? tree_node(p)->right : tree_node(p)->left)) {
+         c = p;
+         tree_rotate(a, c, !left);
+         p = tree_node(c)->parent;
       }
-      if(c1_next != NULL)
-         chunk_set_next_free_chunk(chunk_get_footer_from_header(c1_next), c1_prev);
-
-      insert_chunk(c);
-   }
-   else{
-      chunk_set_next_free_chunk(c_footer, c1_prev);
+      tree_node(p)->red = FALSE;
+      tree_node(g)->red = TRUE;
+      tree_rotate(a, g, left);
    }
-
-   return c2;
+   tree_node(a->tree_root)->red = FALSE;
 }
 /*--------------------------------------------------------------------*/
-/* insert_chunk:
- * Insert a chunk, 'c', into the head of the bin or free chunk list. 
- * 'c' will be merged with the first chunk if possible.
- * The status of 'c' is set to CHUNK_FREE
- */
+/* tree_replace:
+ * Puts the subtree at 'v' where the one at 'u' hangs. */
 /*--------------------------------------------------------------------*/
 static void
-insert_chunk(Chunk_T c)
+tree_replace(struct Arena *a, Chunk_T u, Chunk_T v)
 {
-   assert (chunk_get_units(c) >= 1);
+   Chunk_T p = tree_node(u)->parent;
 
-   chunk_set_status(c, CHUNK_FREE);
-   int c_bin_idx = get_bin_index(chunk_get_units(c));
-   Chunk_T c_bin_head;
-   if(c_bin_idx != -1){
-      c_bin_head = g_bins[c_bin_idx];
-   }
+   if (p == TREE_NIL(a))
+      a->tree_root = v;
+   else if (u == tree_node(p)->left)
+      tree_node(p)->left = v;
    else
-      c_bin_head = g_free_head;
+      tree_node(p)->right = v;
+   tree_node(v)->parent = p;
+}
+/*--------------------------------------------------------------------*/
+/* tree_remove:
+ * Takes the large free chunk 'c' out of the tree. */
+/*--------------------------------------------------------------------*/
+static void
+tree_remove(struct Arena *a, Chunk_T c)
+{
+   struct TreeNode *n = tree_node(c);
+   Chunk_T x, y, w, p;
+   int black = !n->red, left;
 
-   /* If the free chunk list is empty, chunk c points to itself. */
-   if (c_bin_head == NULL) {
-      if(c_bin_idx != -1){
-         g_bins[c_bin_idx] = c;
+   if (n->left == TREE_NIL(a)) {
+      x = n->right;
+      tree_replace(a, c, x);
+   }
+   else if (n->right == TREE_NIL(a)) {
+      x = n->left;
+      tree_replace(a, c, x);
+   }
+   else {
+      /* the successor of 'c' takes its place and color */
+      for (y = n->right; tree_node(y)->left != TREE_NIL(a); )
+         y = tree_node(y)->left;
+      black = !tree_node(y)->red;
+      x = tree_node(y)->right;
+      if (tree_node(y)->parent == c) {
+         tree_node(x)->parent = y;
       }
-      else{
-         g_free_head = c;
+      else {
+         tree_replace(a, y, x);
+         tree_node(y)->right = n->right;
+         tree_node(n->right)->parent = y;
       }
-      chunk_set_next_free_chunk(c, NULL);
-      chunk_set_next_free_chunk(chunk_get_footer_from_header(c), NULL);
+      tree_replace(a, c, y);
+      tree_node(y)->left = n->left;
+      tree_node(n->left)->parent = y;
+      tree_node(y)->red = n->red;
    }
-   else {
-      chunk_set_next_free_chunk(c, c_bin_head);
-      chunk_set_next_free_chunk(chunk_get_footer_from_header(c), NULL);
-      chunk_set_next_free_chunk(chunk_get_footer_from_header(c_bin_head), c);
-
-      if(c_bin_idx != -1)
-         g_bins[c_bin_idx] = c;
-      else
-         g_free_head = c;
-
-      if (chunk_get_next_adjacent(c, g_heap_start, g_heap_end) == c_bin_head) 
-         merge_chunk(c, c_bin_head);
+   if (!black)
+      return;
+
+   /* 'x' carries an extra black; push it up or rotate it away */
+   while (x != a->tree_root && !tree_node(x)->red) {
+      p = tree_node(x)->parent;
+      left = (x == tree_node(p)->left);
+      w = left ? tree_node(p)->right : tree_node(p)->left;
+      if (tree_node(w)->red) {
+         tree_node(w)->red = FALSE;
+         tree_node(p)->red = TRUE;
+         tree_rotate(a, p, !left);
+         w = left ? tree_node(p)->right : tree_node(p)->left;
+      }
+      if (!tree_node(tree_node(w)->left)->red &&
+          !tree_node(tree_node(w)->right)->red) {
+         tree_node(w)->red = TRUE;
+         x = p;
+         continue;
+      }
+      if (!tree_node(left ? tree_node(w)->right : tree_node(w)->left)->red) {
+         tree_node(left ? tree_node(w)->left : tree_node(w)->right)->red =
+            FALSE;
+         tree_node(w)->red = TRUE;
+         tree_rotate(a, w, left);
+         w = left ? tree_node(p)->right : tree_node(p)->left;
+      }
+      tree_node(w)->red = tree_node(p)->red;
+      tree_node(p)->red = FALSE;
+      tree_node(left ? tree_node(w)->right : tree_node(w)->left)->red = FALSE;
+      tree_rotate(a, p, !left);
+      x = a->tree_root;
    }
+   tree_node(x)->red = FALSE;
 }
 /*--------------------------------------------------------------------*/
-/* insert_chunk_after:
- * Insert a chunk, 'c', after 'e' which is
- * already in the bin or free chunk list. After the operation, 'c' will be the
- * next element of 'e' in the bin or free chunk list.  
- * 'c' will be merged with neighbor free chunks if possible.
- * It will return 'c' (after the merge operation if possible).
- */
+/* tree_best_fit:
+ * Returns the smallest large free chunk of at least 'units' units, or
+ * NULL if there is none. */
 /*--------------------------------------------------------------------*/
 static Chunk_T
-insert_chunk_after(Chunk_T e, Chunk_T c)
+tree_best_fit(struct Arena *a, int units)
 {
-   Chunk_T n;
+   Chunk_T x = a->tree_root, best = NULL;
 
-   assert (e < c);
-   assert (chunk_get_status(e) == CHUNK_FREE);
-   assert (chunk_get_status(c) != CHUNK_FREE);
-
-   chunk_set_next_free_chunk(c, chunk_get_next_free_chunk(e));
-   if(chunk_get_next_free_chunk(e) != NULL){
-      chunk_set_next_free_chunk(chunk_get_footer_from_header(chunk_get_next_free_chunk(e)), c);
+   while (x != TREE_NIL(a)) {
+      if (chunk_get_units(x) >= units) {
+         best = x;
+         x = tree_node(x)->left;
+      }
+      else {
+         x = tree_node(x)->right;
+      }
    }
-   chunk_set_next_free_chunk(e, c);
-   chunk_set_next_free_chunk(chunk_get_footer_from_header(c), e);
-   chunk_set_status(c, CHUNK_FREE);
-
-   /* see if c can be merged with e */
-   if (chunk_get_next_adjacent(e, g_heap_start, g_heap_end) == c) 
-      c = merge_chunk(e, c);
-   
-   /* see if we can merge with n */
-   n = chunk_get_next_adjacent(c, g_heap_start, g_heap_end);
-   if (n != NULL && chunk_get_status(n) == CHUNK_FREE)
-      c = merge_chunk(c, n);
-
-   return c;
+   return best;
 }
 /*--------------------------------------------------------------------*/
-/* remove_chunk_from_list:
- * Removes 'c' from the bin or free chunk list. 'prev' should be the previous
- * free chunk of 'c' or NULL if 'c' is the first chunk
- */
+/* insert_chunk:
+ * Marks 'c' free and adds it to its bin, or to the tree if it is too
+ * large for a bin. It gets a footer, and the chunk after it learns that
+ * it is free. */
 /*--------------------------------------------------------------------*/
 static void
-remove_chunk_from_list(Chunk_T prev, Chunk_T c)
+insert_chunk(struct Arena *a, Chunk_T c)
 {
-   assert (chunk_get_status(c) == CHUNK_FREE);
-
-   int c_bin_idx = get_bin_index(chunk_get_units(c));
-
-   Chunk_T next = chunk_get_next_free_chunk(c);
-
-   if(prev == NULL){
-      if(c_bin_idx != -1)
-         g_bins[c_bin_idx] = next;
-      else
-         g_free_head = next;
-   }
-   else{
-      chunk_set_next_free_chunk(prev, next);
-   }
+   int idx = get_bin_index(chunk_get_units(c));
+   int stat = (idx == -1) ? BIN_COUNT : idx;
 
-   if(next != NULL){
-      chunk_set_next_free_chunk(chunk_get_footer_from_header(next), prev);
+   assert (chunk_get_units(c) >= CHUNK_MIN_UNITS);
+   chunk_set_status(c, CHUNK_FREE);
+   chunk_set_footer(c);
+   chunk_set_prev_in_use(chunk_get_next(c), FALSE);
+   a->free_counts[stat]++;
+   a->free_bytes[stat] += (size_t)chunk_get_units(c) * CHUNK_UNIT;
+
+   if (idx == -1) {
+      tree_insert(a, c);
+      return;
    }
-
-   chunk_set_next_free_chunk(c, NULL);
-   chunk_set_next_free_chunk(chunk_get_footer_from_header(c), NULL);
-   chunk_set_status(c, CHUNK_IN_USE);
+   list_push(&a->bins[idx], c);
+   a->sl_bitmap[idx / SL_COUNT] |= 1U << (idx % SL_COUNT);
+   a->fl_bitmap |= 1U << (idx / SL_COUNT);
 }
 /*--------------------------------------------------------------------*/
-/* remove_chunk_from_list2:
- * Special remove_chunk_from_list function that only use in malloc function
- * only c_bin_idx is different from original */
+/* remove_chunk:
+ * Takes the free chunk 'c' out of its bin or the tree and marks it in
+ * use, for the chunk after it as well. */
 /*--------------------------------------------------------------------*/
 static void
-remove_chunk_from_list2(Chunk_T prev, Chunk_T c)
+remove_chunk(struct Arena *a, Chunk_T c)
 {
-   assert (chunk_get_status(c) == CHUNK_FREE);
-
-   int c_bin_idx = -1;
+   int idx = get_bin_index(chunk_get_units(c));
+   int stat = (idx == -1) ? BIN_COUNT : idx;
 
-   Chunk_T next = chunk_get_next_free_chunk(c);
+   assert (chunk_get_status(c) == CHUNK_FREE);
+   a->free_counts[stat]--;
+   a->free_bytes[stat] -= (size_t)chunk_get_units(c) * CHUNK_UNIT;
 
-   if(prev == NULL){
-      if(c_bin_idx != -1)
-         g_bins[c_bin_idx] = next;
-      else
-         g_free_head = next;
+   if (idx == -1) {
+      tree_remove(a, c);
    }
-   else{
-      chunk_set_next_free_chunk(prev, next);
+   else {
+      list_remove(&a->bins[idx], c);
+      if (a->bins[idx] == NULL) {
+         a->sl_bitmap[idx / SL_COUNT] &= ~(1U << (idx % SL_COUNT));
+         if (a->sl_bitmap[idx / SL_COUNT] == 0)
+            a->fl_bitmap &= ~(1U << (idx / SL_COUNT));
+      }
    }
-
-   if(next != NULL){
-      chunk_set_next_free_chunk(chunk_get_footer_from_header(next), prev);
+   chunk_set_status(c, CHUNK_IN_USE);
+   chunk_set_prev_in_use(chunk_get_next(c), TRUE);
+}
+/*--------------------------------------------------------------------*/
+/* find_chunk:
+ * Returns a free chunk of at least 'units' units, or NULL if there is
+ * none. The bins answer without a list traversal; larger requests, and
+ * those the bins cannot serve, take the best fit from the tree. */
+/*--------------------------------------------------------------------*/
+static Chunk_T
+find_chunk(struct Arena *a, int units)
+{
+   int idx = get_bin_index(units);
+   int fl, sl;
+   unsigned int map;
+
+   /* the head of the request's own list often fits as well, and taking
+    * it keeps chunks of one size in use */
+   if (idx != -1 && a->bins[idx] != NULL &&
+       chunk_get_units(a->bins[idx]) >= units)
+      return a->bins[idx];
+
+   idx = get_search_index(units);
+   if (idx == -1)
+      return tree_best_fit(a, units);
+   fl = idx / SL_COUNT;
+   sl = idx % SL_COUNT;
+
+   /* a larger list of the same first level, or any list of a larger
+    * first level */
+   map = a->sl_bitmap[fl] & (~0U << sl);
+   if (map == 0) {
+      map = (fl + 1 < FL_COUNT) ? a->fl_bitmap & (~0U << (fl + 1)) : 0;
+      if (map == 0)
+         return tree_best_fit(a, units);
+      fl = __builtin_ctz(map);
+      map = a->sl_bitmap[fl];
+   }
+   sl = __builtin_ctz(map);
+   return a->bins[fl * SL_COUNT + sl];
+}
+/*--------------------------------------------------------------------*/
+/* merge_chunk:
+ * Merge two adjacent chunks that are in no list and return the merged
+ * chunk. Chunks in no list count as in use, so nothing else changes. */
+/*--------------------------------------------------------------------*/
+static Chunk_T
+merge_chunk(struct Arena *a, Chunk_T c1, Chunk_T c2)
+{
+   /* c1 and c2 must be be adjacent */
+   assert (c1 < c2 &&
+           chunk_get_next_adjacent(c1, a->heap_start, a->heap_end) == c2);
+
+   chunk_set_units(c1, chunk_get_units(c1) + chunk_get_units(c2));
+   return c1;
+}
+/*--------------------------------------------------------------------*/
+/* coalesce_chunk:
+ * Merges 'c', which is in no bin or tree, with its free neighbors and
+ * files the merged chunk as free. The prev-in-use bit and the footer of
+ * a free chunk give both neighbors without any traversal. Returns the
+ * merged chunk. */
+/*--------------------------------------------------------------------*/
+static Chunk_T
+coalesce_chunk(struct Arena *a, Chunk_T c)
+{
+   Chunk_T n;
+
+   n = chunk_get_prev_adjacent(c, a->heap_start, a->heap_end);
+   if (n != NULL) {
+      remove_chunk(a, n);
+      c = merge_chunk(a, n, c);
    }
 
-   chunk_set_next_free_chunk(c, NULL);
-   chunk_set_next_free_chunk(chunk_get_footer_from_header(c), NULL);
-   chunk_set_status(c, CHUNK_IN_USE);
+   n = chunk_get_next_adjacent(c, a->heap_start, a->heap_end);
+   if (n != NULL && chunk_get_status(n) == CHUNK_FREE) {
+      remove_chunk(a, n);
+      c = merge_chunk(a, c, n);
+   }
+
+   insert_chunk(a, c);
+   return c;
+}
+/*--------------------------------------------------------------------*/
+/* cut_chunk:
+ * Cuts the chunk 'c', which is in no bin or tree, back to 'units'
+ * units. Returns the rest as a chunk in use, or NULL if it is too small
+ * to be one and stays with 'c'. */
+/*--------------------------------------------------------------------*/
+static Chunk_T
+cut_chunk(struct Arena *a, Chunk_T c, int units)
+{
+   Chunk_T c2;
+   int rest = chunk_get_units(c) - units;
+
+   assert (chunk_get_units(c) >= units);
+   (void)a;
+
+   if (rest < CHUNK_MIN_UNITS)
+      return NULL;
+
+   chunk_set_units(c, units);
+
+   c2 = chunk_get_next(c);
+   chunk_init(c2, rest, CHUNK_IN_USE, TRUE);
+   return c2;
+}
+/*--------------------------------------------------------------------*/
+/* split_chunk:
+ * Takes 'units' units from the low end of the free chunk 'c' and
+ * returns them as a chunk in use. The rest is filed as a free chunk,
+ * unless it is too small to be one and stays with the returned chunk. */
+/*--------------------------------------------------------------------*/
+static Chunk_T
+split_chunk(struct Arena *a, Chunk_T c, int units)
+{
+   Chunk_T c2;
+
+   assert (chunk_get_status(c) == CHUNK_FREE);
+
+   remove_chunk(a, c);
+   c2 = cut_chunk(a, c, units);
+   if (c2 != NULL)
+      insert_chunk(a, c2);
+   return c;
+}
+/*--------------------------------------------------------------------*/
+/* arena_grow:
+ * Extends the heap of 'a' by 'bytes' bytes. Returns the start of the
+ * new area, or NULL if the heap cannot grow. */
+/*--------------------------------------------------------------------*/
+static void *
+arena_grow(struct Arena *a, size_t bytes)
+{
+   char *p = a->heap_end;
+
+   if (a->heap_limit == NULL) {
+      stats_count(STAT_SBRK);
+      p = sbrk(bytes);
+      if (p == (void *)-1)
+         return NULL;
+
+      /* somebody else moved the break; the new area is not next to the
+       * heap */
+      if (p != a->heap_end) {
+         stats_count(STAT_SBRK);
+         sbrk(-(intptr_t)bytes);
+         return NULL;
+      }
+   }
+   else if (bytes > (size_t)((char *)a->heap_limit - p)) {
+      return NULL;
+   }
+
+   /* arena_of() reads the end of the break heap without the lock */
+   __atomic_store_n(&a->heap_end, (void *)(p + bytes), __ATOMIC_RELEASE);
+   stats_grow(bytes);
+   return p;
+}
+/*--------------------------------------------------------------------*/
+/* arena_shrink:
+ * Gives back the last 'bytes' bytes of the heap of 'a', which start at
+ * a page boundary. Returns TRUE on success. */
+/*--------------------------------------------------------------------*/
+static int
+arena_shrink(struct Arena *a, size_t bytes)
+{
+   char *end = (char *)a->heap_end - bytes;
+
+   if (a->heap_limit == NULL) {
+      /* only if nobody else moved the break since */
+      if (sbrk(0) != a->heap_end)
+         return FALSE;
+      stats_count(STAT_SBRK);
+      if (sbrk(-(intptr_t)bytes) == (void *)-1)
+         return FALSE;
+   }
+   else {
+      stats_count(STAT_MADVISE);
+      if (madvise(end, bytes, MADV_DONTNEED) != 0)
+         return FALSE;
+   }
+
+   __atomic_store_n(&a->heap_end, (void *)end, __ATOMIC_RELEASE);
+   stats_shrink(bytes);
+   return TRUE;
 }
 /*--------------------------------------------------------------------*/
-/* allocate_more_memory: 
+/* allocate_more_memory:
  * Allocate a new chunk which is capable of holding 'units' chunk
  * units in memory by increasing the heap, and return the new
- * chunk. 'prev' should be the last chunk in the free list.
- * This function also performs chunk merging with "prev" if possible
- * after allocating a new chunk. 
+ * chunk. This function also performs chunk merging with the chunk
+ * below it if possible, and files the result as free.
 */
 /*--------------------------------------------------------------------*/
 static Chunk_T
-allocate_more_memory(Chunk_T prev, size_t units)
+allocate_more_memory(struct Arena *a, int units)
 {
    Chunk_T c;
-   Chunk_T c_footer;
+   int prev_in_use = TRUE;
+   char *p;
 
    if (units < MEMALLOC_MIN)
       units = MEMALLOC_MIN;
-   
-   /* Note that we need to allocate one more unit for header. */
-   c = (Chunk_T)sbrk((units + 1) * CHUNK_UNIT);
-   if (c == (Chunk_T)-1)
+
+   /* The new chunk takes the place of the fence, and a new fence goes
+    * after it. An empty heap needs one more unit for the first fence
+    * and the room before its first chunk. */
+   if (a->heap_start == a->heap_end) {
+      p = arena_grow(a, ((size_t)units + 1) * CHUNK_UNIT);
+      if (p == NULL)
+         return NULL;
+      c = (Chunk_T)(p + CHUNK_HEADER);
+   }
+   else {
+      c = heap_fence(a);
+      prev_in_use = chunk_get_prev_in_use(c);
+      if (arena_grow(a, (size_t)units * CHUNK_UNIT) == NULL)
+         return NULL;
+   }
+
+   chunk_init(c, units, CHUNK_IN_USE, prev_in_use);
+   set_fence(a);
+
+   c = coalesce_chunk(a, c);
+
+   assert(check_heap_validity(a));
+   return c;
+}
+/*--------------------------------------------------------------------*/
+/* trim_heap:
+ * Cuts the free chunk 'c' at the top of the heap of 'a' back to
+ * MEMALLOC_MIN units, rounded up to a page, and gives back the rest. */
+/*--------------------------------------------------------------------*/
+static void
+trim_heap(struct Arena *a, Chunk_T c)
+{
+   size_t page = (size_t)getpagesize();
+   uintptr_t end = (uintptr_t)c + MEMALLOC_MIN * CHUNK_UNIT + CHUNK_HEADER;
+
+   end = (end + page - 1) & ~(page - 1);
+   if (end >= (uintptr_t)a->heap_end)
+      return;
+
+   remove_chunk(a, c);
+   if (arena_shrink(a, (uintptr_t)a->heap_end - end)) {
+      chunk_set_units(c, (int)((end - CHUNK_HEADER - (uintptr_t)c) /
+                               CHUNK_UNIT));
+      set_fence(a);
+   }
+   insert_chunk(a, c);
+}
+/*--------------------------------------------------------------------*/
+/* release_pages:
+ * Gives back the pages inside the large free chunks of the subtree at
+ * 'x'. The size word, the tree links and the footer stay. */
+/*--------------------------------------------------------------------*/
+static void
+release_pages(struct Arena *a, Chunk_T x)
+{
+   uintptr_t page = (uintptr_t)getpagesize(), start, end;
+
+   if (x == TREE_NIL(a))
+      return;
+
+   /* the tree is ordered by size, so nothing on the left of a chunk
+    * too small to release is worth a look */
+   if (chunk_get_units(x) >= RELEASE_UNITS) {
+      release_pages(a, tree_node(x)->left);
+      start = (uintptr_t)(tree_node(x) + 1);
+      start = (start + page - 1) & ~(page - 1);
+      end = ((uintptr_t)chunk_get_next(x) - CHUNK_HEADER) & ~(page - 1);
+      if (end > start) {
+         stats_count(STAT_MADVISE);
+         madvise((void *)start, end - start, MADV_DONTNEED);
+      }
+   }
+   release_pages(a, tree_node(x)->right);
+}
+/*--------------------------------------------------------------------*/
+/* free_chunk:
+ * Merges the chunk 'c', which was in use, into the free chunks of 'a'.
+ * A large free chunk at the top of the heap is trimmed, and the pages
+ * of large free chunks are given back from time to time. */
+/*--------------------------------------------------------------------*/
+static void
+free_chunk(struct Arena *a, Chunk_T c)
+{
+   a->freed += (size_t)chunk_get_units(c) * CHUNK_UNIT;
+
+   /* merge with the free neighbors, and file the result; no address
+    * order is kept, so this takes no traversal */
+   c = coalesce_chunk(a, c);
+
+   if (chunk_get_units(c) >= TRIM_UNITS &&
+       chunk_get_next_adjacent(c, a->heap_start, a->heap_end) == NULL)
+      trim_heap(a, c);
+
+   if (a->freed >= (size_t)((char *)a->heap_end - (char *)a->heap_start) / 8) {
+      release_pages(a, a->tree_root);
+      a->freed = 0;
+   }
+}
+/*--------------------------------------------------------------------*/
+/* mmap_chunk:
+ * Maps a chunk of its own that holds at least 'units' units, and
+ * returns it, or NULL if there is no memory for it. */
+/*--------------------------------------------------------------------*/
+static Chunk_T
+mmap_chunk(int units)
+{
+   size_t page = (size_t)getpagesize();
+   size_t bytes = (((size_t)units + 1) * CHUNK_UNIT + page - 1) & ~(page - 1);
+   char *p;
+   Chunk_T c;
+
+   stats_count(STAT_MMAP);
+   p = mmap(NULL, bytes, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+   if (p == MAP_FAILED)
       return NULL;
-   c_footer = (Chunk_T)sbrk(CHUNK_UNIT);
-   if (c_footer == (Chunk_T)-1)
+   stats_mapped(0, bytes);
+
+   /* the chunk takes the whole mapping but one unit, laid out as the
+    * room before the first chunk and the fence of a heap */
+   c = (Chunk_T)(p + CHUNK_HEADER);
+   chunk_init(c, (int)(bytes / CHUNK_UNIT) - 1, CHUNK_MMAPPED, TRUE);
+   return c;
+}
+/*--------------------------------------------------------------------*/
+/* mmap_base, mmap_bytes:
+ * Return the mapping of the mapped chunk 'c', and its length. */
+/*--------------------------------------------------------------------*/
+static inline void *
+mmap_base(Chunk_T c)
+{
+   return (char *)c - CHUNK_HEADER;
+}
+
+static inline size_t
+mmap_bytes(Chunk_T c)
+{
+   return ((size_t)chunk_get_units(c) + 1) * CHUNK_UNIT;
+}
+/*--------------------------------------------------------------------*/
+/* arena_largest_free:
+ * Returns the units of the largest free chunk of 'a', or 0 if it has
+ * none. The caller holds the lock of 'a'. */
+/*--------------------------------------------------------------------*/
+static int
+arena_largest_free(struct Arena *a)
+{
+   Chunk_T c;
+   int fl, idx, units = 0;
+
+   /* the tree is ordered by size, so its largest chunk ends its right
+    * spine; without it, the largest chunk is in the last bin in use */
+   if (a->tree_root != TREE_NIL(a)) {
+      for (c = a->tree_root; tree_node(c)->right != TREE_NIL(a);
+           c = tree_node(c)->right)
+         ;
+      return chunk_get_units(c);
+   }
+   if (a->fl_bitmap == 0)
+      return 0;
+
+   fl = 31 - __builtin_clz(a->fl_bitmap);
+   idx = fl * SL_COUNT + 31 - __builtin_clz(a->sl_bitmap[fl]);
+   for (c = a->bins[idx]; c != NULL; c = chunk_get_next_free_chunk(c))
+      if (chunk_get_units(c) > units)
+         units = chunk_get_units(c);
+   return units;
+}
+/*--------------------------------------------------------------------*/
+/* arena_init:
+ * Sets up 'a' with an empty heap at 'start' that may grow up to
+ * 'limit', or without limit if 'limit' is NULL. */
+/*--------------------------------------------------------------------*/
+static void
+arena_init(struct Arena *a, void *start, void *limit)
+{
+   pthread_mutex_init(&a->lock, NULL);
+   a->tree_root = TREE_NIL(a);
+   a->heap_start = a->heap_end = start;
+   a->heap_limit = limit;
+}
+/*--------------------------------------------------------------------*/
+/* arena_create:
+ * Maps the region of a new arena and returns the arena, which sits at
+ * the start of its region, or NULL if there is no room. */
+/*--------------------------------------------------------------------*/
+static struct Arena *
+arena_create(void)
+{
+   char *p, *base;
+
+   /* map twice the size and keep the aligned part; untouched pages of
+    * the region cost nothing */
+   stats_count(STAT_MMAP);
+   p = mmap(NULL, 2 * ARENA_SIZE, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+   if (p == MAP_FAILED)
       return NULL;
-   
-   g_heap_end = sbrk(0);
-   chunk_set_units(c, units);
-   chunk_set_units(c_footer, units);
-   chunk_set_next_free_chunk(c, NULL);
-   chunk_set_next_free_chunk(c_footer, NULL);
-   chunk_set_status(c, CHUNK_IN_USE);
-   
-   /* Insert the newly allocated chunk 'c' to the free list.
-    * Note that the list is sorted in ascending order. */
-   
-   if (g_free_head == NULL){
-      g_free_head = c;
-      chunk_set_next_free_chunk(c, NULL);
-      chunk_set_next_free_chunk(chunk_get_footer_from_header(c), NULL);
-      chunk_set_status(c, CHUNK_FREE);
-   }
-      
-   else 
-      c = insert_chunk_after(prev, c);
-
-   assert(check_heap_validity());
+   base = (char *)(((uintptr_t)p + ARENA_SIZE - 1) & ~(ARENA_SIZE - 1));
+   if (base != p) {
+      stats_count(STAT_MUNMAP);
+      munmap(p, base - p);
+   }
+   stats_count(STAT_MUNMAP);
+   munmap(base + ARENA_SIZE, p + ARENA_SIZE - base);
+
+   arena_init((struct Arena *)base,
+              base + (sizeof(struct Arena) + CHUNK_UNIT - 1) /
+              CHUNK_UNIT * CHUNK_UNIT,
+              base + ARENA_SIZE);
+   return (struct Arena *)base;
+}
+/*--------------------------------------------------------------------*/
+/* arena_of:
+ * Returns the arena that owns the chunk 'c'. */
+/*--------------------------------------------------------------------*/
+static struct Arena *
+arena_of(Chunk_T c)
+{
+   if ((void *)c >= g_main_arena.heap_start &&
+       (void *)c < __atomic_load_n(&g_main_arena.heap_end,
+                                   __ATOMIC_ACQUIRE))
+      return &g_main_arena;
+   return (struct Arena *)((uintptr_t)c & ~(ARENA_SIZE - 1));
+}
+/*--------------------------------------------------------------------*/
+/* arena_push_remote:
+ * Hands the chunk 'c' back to 'a' without taking its lock. */
+/*--------------------------------------------------------------------*/
+static void
+arena_push_remote(struct Arena *a, Chunk_T c)
+{
+   Chunk_T head = __atomic_load_n(&a->remote, __ATOMIC_RELAXED);
+
+   do {
+      chunk_set_next_free_chunk(c, head);
+   } while (!__atomic_compare_exchange_n(&a->remote, &head, c, TRUE,
+                                         __ATOMIC_RELEASE,
+                                         __ATOMIC_RELAXED));
+}
+/*--------------------------------------------------------------------*/
+/* arena_drain_remote:
+ * Frees the chunks that other threads handed back to 'a'. The caller
+ * holds the lock of 'a'. */
+/*--------------------------------------------------------------------*/
+static void
+arena_drain_remote(struct Arena *a)
+{
+   Chunk_T c, next;
+
+   if (__atomic_load_n(&a->remote, __ATOMIC_RELAXED) == NULL)
+      return;
+   c = __atomic_exchange_n(&a->remote, NULL, __ATOMIC_ACQUIRE);
+   for (; c != NULL; c = next) {
+      next = chunk_get_next_free_chunk(c);
+      free_chunk(a, c);
+   }
+}
+/*--------------------------------------------------------------------*/
+/* arena_malloc:
+ * Takes a chunk of at least 'units' units from 'a', growing its heap
+ * if needed. Returns the chunk, or NULL if the heap cannot grow. If
+ * 'fresh' is not NULL, sets '*fresh' to the address from which the
+ * data of the chunk is known to be zero, or to NULL. */
+/*--------------------------------------------------------------------*/
+static Chunk_T
+arena_malloc(struct Arena *a, int units, char **fresh)
+{
+   Chunk_T c;
+   char *end;
+
+   if (fresh != NULL)
+      *fresh = NULL;
+
+   pthread_mutex_lock(&a->lock);
+
+   /* see if everything is OK before doing any operations */
+   assert(check_heap_validity(a));
+   arena_drain_remote(a);
+
+   c = find_chunk(a, units);
+
+   /* allocate new memory; it is zero past the old end of the heap and
+    * the tree links that the area had while it was free, but for the
+    * footer of a chunk taken whole */
+   if (c == NULL) {
+      end = a->heap_end;
+      c = allocate_more_memory(a, units);
+      if (c != NULL && fresh != NULL)
+         *fresh = end + sizeof(struct TreeNode);
+   }
+   if (c != NULL) {
+      assert(chunk_get_units(c) >= units);
+      c = split_chunk(a, c, units);
+      if (fresh != NULL && *fresh != NULL)
+         chunk_clear_footer(c);
+   }
+
+   assert(check_heap_validity(a));
+   pthread_mutex_unlock(&a->lock);
    return c;
 }
+/*--------------------------------------------------------------------*/
+/* arena_aligned:
+ * Takes a chunk of at least 'units' units whose data starts at a
+ * multiple of 'align' from 'a', growing its heap if needed. 'align' is
+ * a power of two larger than CHUNK_UNIT. Returns the chunk, or NULL if
+ * the heap cannot grow. */
+/*--------------------------------------------------------------------*/
+static Chunk_T
+arena_aligned(struct Arena *a, int units, size_t align)
+{
+   Chunk_T c, lead;
+   uintptr_t data, at;
+   int total = units + (int)(align / CHUNK_UNIT) + CHUNK_MIN_UNITS;
+
+   pthread_mutex_lock(&a->lock);
+   assert(check_heap_validity(a));
+   arena_drain_remote(a);
+
+   c = find_chunk(a, total);
+   if (c == NULL)
+      c = allocate_more_memory(a, total);
+   if (c != NULL) {
+      c = split_chunk(a, c, total);
+
+      /* move the data up to the next multiple of 'align' that leaves
+       * room for a free chunk below */
+      data = (uintptr_t)get_data_ptr(c);
+      if ((data & (align - 1)) != 0) {
+         at = (data + CHUNK_MIN_UNITS * CHUNK_UNIT + align - 1) &
+            ~(align - 1);
+         lead = c;
+         c = get_chunk_from_data_ptr((void *)at);
+         chunk_init(c, chunk_get_units(lead) -
+                    (int)((at - data) / CHUNK_UNIT), CHUNK_IN_USE, TRUE);
+         chunk_set_units(lead, (int)((at - data) / CHUNK_UNIT));
+         coalesce_chunk(a, lead);
+      }
+
+      lead = cut_chunk(a, c, units);
+      if (lead != NULL)
+         coalesce_chunk(a, lead);
+   }
+
+   assert(check_heap_validity(a));
+   pthread_mutex_unlock(&a->lock);
+   return c;
+}
+/*--------------------------------------------------------------------*/
+/* arena_resize:
+ * Resizes the chunk 'c' of 'a' to 'units' units where it is. It grows
+ * into the free chunk after it, or at the top of the heap, and gives
+ * back what it no longer needs. Returns TRUE on success. */
+/*--------------------------------------------------------------------*/
+static int
+arena_resize(struct Arena *a, Chunk_T c, int units)
+{
+   Chunk_T n;
+   int more, ok;
+
+   pthread_mutex_lock(&a->lock);
+   assert(check_heap_validity(a));
+
+   /* take the free chunk after 'c' if it is enough, or if the top of
+    * the heap comes right after it */
+   n = chunk_get_next_adjacent(c, a->heap_start, a->heap_end);
+   if (chunk_get_units(c) < units &&
+       n != NULL && chunk_get_status(n) == CHUNK_FREE &&
+       (chunk_get_units(c) + chunk_get_units(n) >= units ||
+        chunk_get_next_adjacent(n, a->heap_start, a->heap_end) == NULL)) {
+      remove_chunk(a, n);
+      c = merge_chunk(a, c, n);
+      n = chunk_get_next_adjacent(c, a->heap_start, a->heap_end);
+   }
+
+   /* at the top of the heap, grow the heap by what is missing */
+   more = units - chunk_get_units(c);
+   if (more > 0 && n == NULL) {
+      if (more < MEMALLOC_MIN)
+         more = MEMALLOC_MIN;
+      if (arena_grow(a, (size_t)more * CHUNK_UNIT) != NULL) {
+         chunk_set_units(c, chunk_get_units(c) + more);
+         set_fence(a);
+      }
+   }
+
+   ok = (chunk_get_units(c) >= units);
+   if (ok) {
+      n = cut_chunk(a, c, units);
+      if (n != NULL)
+         free_chunk(a, n);
+   }
+
+   assert(check_heap_validity(a));
+   pthread_mutex_unlock(&a->lock);
+   return ok;
+}
+/*--------------------------------------------------------------------*/
+/* arena_free:
+ * Returns the chunk 'c' to its arena. A thread of that arena merges it
+ * under the lock; any other thread hands it back lock-free. */
+/*--------------------------------------------------------------------*/
+static void
+arena_free(Chunk_T c)
+{
+   struct Arena *a = arena_of(c);
+
+   if (a != t_arena) {
+      arena_push_remote(a, c);
+      return;
+   }
+
+   pthread_mutex_lock(&a->lock);
+
+   /* check everything is OK before freeing 'c' */
+   assert(check_heap_validity(a));
+   arena_drain_remote(a);
+
+   free_chunk(a, c);
+
+   /* double check if everything is OK */
+   assert(check_heap_validity(a));
+   pthread_mutex_unlock(&a->lock);
+}
+/*--------------------------------------------------------------------*/
+/* slab_init:
+ * Reserves the slab region and sets up the size classes. The slab is
+ * left out if the region cannot be mapped. */
+/*--------------------------------------------------------------------*/
+static void
+slab_init(void)
+{
+   size_t desc;
+   int i;
+   char *p;
+
+   for (i = 1; i <= SLAB_CLASSES; i++) {
+      pthread_mutex_init(&g_slab_classes[i].lock, NULL);
+      g_slab_classes[i].size = i * SLAB_STEP;
+      g_slab_classes[i].count = SLAB_PAGE / (i * SLAB_STEP);
+   }
+
+   /* untouched pages of the region cost nothing, and neither do the
+    * descriptors of pages never used */
+   stats_count(STAT_MMAP);
+   p = mmap(NULL, SLAB_SIZE, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+   if (p == MAP_FAILED)
+      return;
+
+   desc = SLAB_SIZE / SLAB_PAGE * sizeof(struct SlabPage);
+   g_slab_top = (desc + SLAB_PAGE - 1) / SLAB_PAGE;
+   g_slab_pages = (struct SlabPage *)p;
+   g_slab_base = p;
+}
+/*--------------------------------------------------------------------*/
+/* slab_push, slab_remove:
+ * Link the slab page 'p' at the head of the partial list of its class,
+ * and take it out of that list. */
+/*--------------------------------------------------------------------*/
+static void
+slab_push(struct SlabClass *sc, struct SlabPage *p)
+{
+   p->prev = NULL;
+   p->next = sc->partial;
+   if (sc->partial != NULL)
+      sc->partial->prev = p;
+   sc->partial = p;
+}
+
+static void
+slab_remove(struct SlabClass *sc, struct SlabPage *p)
+{
+   if (p->prev == NULL)
+      sc->partial = p->next;
+   else
+      p->prev->next = p->next;
+   if (p->next != NULL)
+      p->next->prev = p->prev;
+}
+/*--------------------------------------------------------------------*/
+/* slab_new_page:
+ * Returns an empty slab page for the class 'cls', one that fell empty
+ * if there is any, or NULL if the slab is used up. */
+/*--------------------------------------------------------------------*/
+static struct SlabPage *
+slab_new_page(int cls)
+{
+   struct SlabPage *p = NULL;
+
+   pthread_mutex_lock(&g_slab_lock);
+   if (g_slab_empty != NULL) {
+      p = g_slab_empty;
+      g_slab_empty = p->next;
+      g_slab_empty_count--;
+   }
+   else if (g_slab_top < SLAB_SIZE / SLAB_PAGE) {
+      p = &g_slab_pages[g_slab_top++];
+   }
+   pthread_mutex_unlock(&g_slab_lock);
+
+   if (p != NULL) {
+      p->free = NULL;
+      p->cls = (unsigned short)cls;
+      p->used = p->carved = 0;
+   }
+   return p;
+}
+/*--------------------------------------------------------------------*/
+/* slab_release_page:
+ * Keeps the slab page 'p', which fell empty, for any class, and gives
+ * its memory back if there are SLAB_EMPTY such pages already. */
+/*--------------------------------------------------------------------*/
+static void
+slab_release_page(struct SlabPage *p)
+{
+   pthread_mutex_lock(&g_slab_lock);
+   if (g_slab_empty_count >= SLAB_EMPTY) {
+      stats_count(STAT_MADVISE);
+      madvise(slab_page_data(p), SLAB_PAGE, MADV_DONTNEED);
+   }
+   p->next = g_slab_empty;
+   g_slab_empty = p;
+   g_slab_empty_count++;
+   pthread_mutex_unlock(&g_slab_lock);
+}
+/*--------------------------------------------------------------------*/
+/* slab_alloc:
+ * Returns an object of the slab class 'cls', or NULL if the slab is
+ * used up. */
+/*--------------------------------------------------------------------*/
+static void *
+slab_alloc(int cls)
+{
+   struct SlabClass *sc = &g_slab_classes[cls];
+   struct SlabPage *p;
+   void *m = NULL;
+
+   pthread_mutex_lock(&sc->lock);
+   assert(check_slab_validity(cls));
+
+   p = sc->partial;
+   if (p == NULL) {
+      p = slab_new_page(cls);
+      if (p != NULL) {
+         slab_push(sc, p);
+         sc->pages++;
+         stats_grow(SLAB_PAGE);
+      }
+   }
+   if (p != NULL) {
+      if (p->free != NULL) {
+         m = p->free;
+         p->free = *(void **)m;
+      }
+      else {
+         m = slab_page_data(p) + (size_t)p->carved++ * sc->size;
+      }
+      if (++p->used == sc->count)
+         slab_remove(sc, p);
+      sc->used++;
+   }
+
+   assert(check_slab_validity(cls));
+   pthread_mutex_unlock(&sc->lock);
+   return m;
+}
+/*--------------------------------------------------------------------*/
+/* slab_free:
+ * Returns the slab object 'm' to its page. A page that falls empty is
+ * released, unless it is the only partial page of its class. */
+/*--------------------------------------------------------------------*/
+static void
+slab_free(void *m)
+{
+   struct SlabPage *p = slab_page_of(m);
+   int cls = p->cls;
+   struct SlabClass *sc = &g_slab_classes[cls];
+
+   /* the class of a page stays while it has an object in use */
+   pthread_mutex_lock(&sc->lock);
+   assert(check_slab_validity(cls));
+
+   *(void **)m = p->free;
+   p->free = m;
+   sc->used--;
+   if (p->used-- == sc->count)
+      slab_push(sc, p);
+   if (p->used == 0 && (p->prev != NULL || p->next != NULL)) {
+      slab_remove(sc, p);
+      sc->pages--;
+      stats_shrink(SLAB_PAGE);
+      slab_release_page(p);
+   }
+
+   assert(check_slab_validity(cls));
+   pthread_mutex_unlock(&sc->lock);
+}
+/*--------------------------------------------------------------------*/
+/* tcache_flush:
+ * Returns the cached chunks of the calling thread to their arenas, and
+ * its slab objects to their pages, when it exits. The cache is left
+ * full, so frees that come later skip it. */
+/*--------------------------------------------------------------------*/
+static void
+tcache_flush(void *arg)
+{
+   Chunk_T c;
+   void *m;
+   int units, cls;
+
+   (void)arg;
+   for (units = 1; units <= TCACHE_UNITS; units++) {
+      while ((c = t_tcache.heads[units]) != NULL) {
+         t_tcache.heads[units] = chunk_get_next_free_chunk(c);
+         arena_free(c);
+      }
+      t_tcache.counts[units] = TCACHE_COUNT;
+   }
+   for (cls = 1; cls <= SLAB_CLASSES; cls++) {
+      while ((m = t_tcache.slabs[cls]) != NULL) {
+         t_tcache.slabs[cls] = *(void **)m;
+         slab_free(m);
+      }
+      t_tcache.slab_counts[cls] = TCACHE_COUNT;
+   }
+}
+/*--------------------------------------------------------------------*/
+/* fork_prepare, fork_release:
+ * Hold every lock of the heap manager across fork(), so that the
+ * child gets the heap in a consistent state and with no lock held. */
+/*--------------------------------------------------------------------*/
+static void
+fork_prepare(void)
+{
+   int i;
+
+   pthread_mutex_lock(&g_arenas_lock);
+   for (i = 0; i < g_arena_count; i++)
+      pthread_mutex_lock(&g_arenas[i]->lock);
+   for (i = 1; i <= SLAB_CLASSES; i++)
+      pthread_mutex_lock(&g_slab_classes[i].lock);
+   pthread_mutex_lock(&g_slab_lock);
+}
+
+static void
+fork_release(void)
+{
+   int i;
+
+   pthread_mutex_unlock(&g_slab_lock);
+   for (i = SLAB_CLASSES; i >= 1; i--)
+      pthread_mutex_unlock(&g_slab_classes[i].lock);
+   for (i = g_arena_count - 1; i >= 0; i--)
+      pthread_mutex_unlock(&g_arenas[i]->lock);
+   pthread_mutex_unlock(&g_arenas_lock);
+}
+/*--------------------------------------------------------------------*/
+/* init_my_heap:
+ * Initialize data structures and global variables for
+ * chunk management.
+ */
+/*--------------------------------------------------------------------*/
+static void
+init_my_heap(void)
+{
+   long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+   char *start = sbrk(0);
+   char *env;
+   size_t pad;
+
+   if (start == (void *)-1) {
+      fprintf(stderr, "sbrk(0) failed\n");
+      exit(-1);
+   }
+
+   /* the data of the chunks is aligned only if the heap is */
+   pad = (size_t)-(uintptr_t)start & (CHUNK_UNIT - 1);
+   if (pad != 0) {
+      stats_count(STAT_SBRK);
+      if (sbrk(pad) != (void *)-1)
+         start += pad;
+   }
+   arena_init(&g_main_arena, start, NULL);
+   slab_init();
+
+   /* HEAPMGR_STATS asks for the statistics every so many allocations
+    * of a thread, or 0 for never, and at exit */
+   env = getenv("HEAPMGR_STATS");
+   if (env != NULL) {
+      g_stats_period = (atoi(env) > 0) ? atoi(env) : 0;
+      atexit(heapmgr_print_stats);
+   }
+
+   g_arena_limit = (cpus < 1) ? 1 :
+      (cpus > ARENA_MAX / 2) ? ARENA_MAX : (int)cpus * 2;
+   pthread_key_create(&g_tcache_key, tcache_flush);
+   pthread_atfork(fork_prepare, fork_release, fork_release);
+}
+/*--------------------------------------------------------------------*/
+/* thread_arena:
+ * Returns the arena of the calling thread, and gives it one the first
+ * time. */
+/*--------------------------------------------------------------------*/
+static struct Arena *
+thread_arena(void)
+{
+   struct Arena *a;
+   int i;
+
+   if (t_arena != NULL)
+      return t_arena;
+
+   pthread_once(&g_init_once, init_my_heap);
+
+   pthread_mutex_lock(&g_arenas_lock);
+   i = g_arena_next++ % g_arena_limit;
+   if (i >= g_arena_count) {
+      a = arena_create();
+      if (a != NULL)
+         g_arenas[g_arena_count++] = a;
+      i = g_arena_count - 1;
+   }
+   t_arena = g_arenas[i];
+   pthread_mutex_unlock(&g_arenas_lock);
+
+   /* any non-NULL value makes the key call tcache_flush() at exit */
+   pthread_setspecific(g_tcache_key, t_arena);
+   return t_arena;
+}
+/*--------------------------------------------------------------------*/
+/* allocate:
+ * Returns a slab object or the data of a chunk in use of at least
+ * 'size' bytes, or NULL if there is no memory for it. If 'fresh' is not
+ * NULL, sets '*fresh' to the address from which the data is known to be
+ * zero, or to NULL. */
+/*--------------------------------------------------------------------*/
+static void *
+allocate(size_t size, char **fresh)
+{
+   struct Arena *a;
+   Chunk_T c;
+   void *m;
+   int units, cls;
+
+   if (fresh != NULL)
+      *fresh = NULL;
+   if (g_stats_period != 0 &&
+       ++t_stats_count % (unsigned int)g_stats_period == 0)
+      heapmgr_print_stats();
+   if (size <= 0 || size_to_units(size) > INT_MAX - MEMALLOC_MIN)
+      return NULL;
+
+   /* a small request takes a cached slab object, or one from the slab
+    * under the lock of its class; a slab used up leaves it to the
+    * arenas */
+   if (size <= SLAB_MAX) {
+      cls = (int)((size + SLAB_STEP - 1) / SLAB_STEP);
+      m = t_tcache.slabs[cls];
+      if (m != NULL) {
+         t_tcache.slabs[cls] = *(void **)m;
+         t_tcache.slab_counts[cls]--;
+         return m;
+      }
+      thread_arena();
+      m = slab_alloc(cls);
+      if (m != NULL)
+         return m;
+   }
+
+   units = (int)size_to_units(size);
+
+   /* a cached chunk of the very size needs no lock */
+   if (units <= TCACHE_UNITS && t_tcache.heads[units] != NULL) {
+      c = t_tcache.heads[units];
+      t_tcache.heads[units] = chunk_get_next_free_chunk(c);
+      t_tcache.counts[units]--;
+      return get_data_ptr(c);
+   }
+
+   if (units >= MMAP_UNITS) {
+      c = mmap_chunk(units);
+      if (c == NULL)
+         return NULL;
+      if (fresh != NULL)
+         *fresh = get_data_ptr(c);
+      return get_data_ptr(c);
+   }
+
+   a = thread_arena();
+   c = arena_malloc(a, units, fresh);
+
+   /* a mapped arena that is full falls back on the break heap, and a
+    * heap that cannot grow on a mapping of its own */
+   if (c == NULL && a != &g_main_arena)
+      c = arena_malloc(&g_main_arena, units, fresh);
+   if (c == NULL) {
+      c = mmap_chunk(units);
+      if (c == NULL)
+         return NULL;
+      if (fresh != NULL)
+         *fresh = get_data_ptr(c);
+   }
+   return get_data_ptr(c);
+}
 /*--------------------------------------------------------------*/
 /* heapmgr_malloc:
- * Dynamically allocate a memory capable of holding size bytes. 
- * Substitute for GNU malloc().                                 
+ * Dynamically allocate a memory capable of holding size bytes.
+ * Substitute for GNU malloc().
  */
 /*--------------------------------------------------------------*/
 void *heapmgr_malloc(size_t size) {
-    static int is_init = FALSE;
-    Chunk_T c;
-    size_t units;
-    
-    if (size <= 0)
-        return NULL;
-
-    if (!is_init) {
-        init_my_heap();
-        is_init = TRUE;
-    }
+   return allocate(size, NULL);
+}
+/*--------------------------------------------------------------*/
+/* heapmgr_calloc:
+ * Allocates zeroed memory for an array of 'n' elements of 'size'
+ * bytes. Memory fresh from the kernel is zero already and is not
+ * cleared again. Substitute for GNU calloc().
+ */
+/*--------------------------------------------------------------*/
+void *heapmgr_calloc(size_t n, size_t size) {
+   char *m, *fresh;
 
-   /* see if everything is OK before doing any operations */
-    assert(check_heap_validity());
-
-    units = size_to_units(size);
-
-    /* Check if the request can be satisfied by a bin */
-    int bin_index = get_bin_index(units);
-    if (bin_index != -1) {
-      for(int i=bin_index; i<BIN_COUNT; i++){
-         if (g_bins[i] != NULL) {
-            Chunk_T prev2 = NULL;
-            for (c = g_bins[i]; c != NULL; c = chunk_get_next_free_chunk(c)) {
-               if (chunk_get_units(c) >= units) {
-                  if (chunk_get_units(c) > units + 2)
-                     c = split_chunk(c, units);
-                  else
-                     remove_chunk_from_list(prev2, c);
-
-                  assert(check_heap_validity());
-                  return (void *)((char *)c + CHUNK_UNIT);
-               }
-               prev2 = c;
-            }
-         }
-      }
-      /* Try to allocate from the appropriate bin */
-    }
-
-    /* Traverse the free list for large allocations */
-    Chunk_T prev = NULL;
-    Chunk_T pprev = NULL;
-    for (c = g_free_head; c != NULL; c = chunk_get_next_free_chunk(c)) {
-        if (chunk_get_units(c) >= units) {
-            if (chunk_get_units(c) > units + 2) 
-                c = split_chunk(c, units);
-            else
-                remove_chunk_from_list(prev, c);
-
-            assert(check_heap_validity());
-            return (void *)((char *)c + CHUNK_UNIT);
-        }
-        pprev = prev;
-        prev = c;
-    }
-
-    /* allocate new memory */
-    c = allocate_more_memory(prev, units);
-    if (c == NULL) {
-        assert(check_heap_validity());
-        return NULL;
-    }
-    assert(chunk_get_units(c) >= units);
-
-   /* if c was merged with prev, pprev becomes prev */
-    if (c == prev)
-      prev = pprev;
-
-   if (chunk_get_units(c) > units + 2) 
-      c = split_chunk2(c, units);
-   else 
-      remove_chunk_from_list2(prev, c);
-
-    assert(check_heap_validity());
-    return (void *)((char *)c + CHUNK_UNIT);
+   if (size != 0 && n > SIZE_MAX / size)
+      return NULL;
+
+   m = allocate(n * size, &fresh);
+   if (m == NULL)
+      return NULL;
+   if (fresh == NULL || fresh > m + n * size)
+      fresh = m + n * size;
+   if (fresh > m)
+      memset(m, 0, fresh - m);
+   return m;
 }
 /*--------------------------------------------------------------*/
 /* heapmgr_free:
- * Releases dynamically allocated memory. 
+ * Releases dynamically allocated memory.
  * Substitute for GNU free().                                   */
 /*--------------------------------------------------------------*/
 void heapmgr_free(void *m) {
-    Chunk_T c;
+   Chunk_T c;
+   int units, cls;
+
+   if (m == NULL)
+      return;
+
+   /* a slab object goes back to the cache, or to its page */
+   if (slab_owns(m)) {
+      cls = slab_page_of(m)->cls;
+      if (t_tcache.slab_counts[cls] < TCACHE_COUNT) {
+         if (t_arena == NULL)
+            thread_arena();
+         *(void **)m = t_tcache.slabs[cls];
+         t_tcache.slabs[cls] = m;
+         t_tcache.slab_counts[cls]++;
+         return;
+      }
+      slab_free(m);
+      return;
+   }
 
-    if (m == NULL)
-        return;
+   /* get the chunk header pointer from m */
+   c = get_chunk_from_data_ptr(m);
+   assert(chunk_get_status(c) != CHUNK_FREE);
+
+   if (chunk_get_status(c) == CHUNK_MMAPPED) {
+      stats_count(STAT_MUNMAP);
+      stats_mapped(mmap_bytes(c), 0);
+      munmap(mmap_base(c), mmap_bytes(c));
+      return;
+   }
 
-   /* check everything is OK before freeing 'm' */
-    assert(check_heap_validity());
+   /* keep a small chunk for the next request of its size; a thread
+    * that has only freed so far still needs an arena to flush its
+    * cache at exit */
+   units = chunk_get_units(c);
+   if (units <= TCACHE_UNITS && t_tcache.counts[units] < TCACHE_COUNT) {
+      if (t_arena == NULL)
+         thread_arena();
+      chunk_set_next_free_chunk(c, t_tcache.heads[units]);
+      t_tcache.heads[units] = c;
+      t_tcache.counts[units]++;
+      return;
+   }
 
-   /* get the chunk header pointer from m */
-    c = get_chunk_from_data_ptr(m);
-    assert(chunk_get_status(c) != CHUNK_FREE);
-
-    /* Determine if the chunk should be placed in a bin */
-   int bin_idx = get_bin_index(chunk_get_units(c));
-   if(bin_idx != -1){
-      insert_chunk(c);
-   }
-   else{
-      /* traverse the free chunk list to find the
-         right location for 'c' */
-      Chunk_T prev = c;
-      while(chunk_get_status(prev) != CHUNK_FREE){
-         prev = chunk_get_prev_adjacent(prev, g_heap_start, g_heap_end);
-         if(prev == NULL) break;
+   arena_free(c);
+}
+/*--------------------------------------------------------------*/
+/* heapmgr_realloc:
+ * Changes the size of the memory at 'm' to 'size' bytes. It grows
+ * or shrinks in place when it can, and moves otherwise; a mapped
+ * chunk is remapped. Substitute for GNU realloc().
+ */
+/*--------------------------------------------------------------*/
+void *heapmgr_realloc(void *m, size_t size) {
+   Chunk_T c;
+   size_t units, bytes, old, page;
+   void *m2;
+
+   if (m == NULL)
+      return heapmgr_malloc(size);
+   if (size == 0) {
+      heapmgr_free(m);
+      return NULL;
+   }
+   if (size_to_units(size) > INT_MAX - MEMALLOC_MIN)
+      return NULL;
+
+   c = get_chunk_from_data_ptr(m);
+   units = size_to_units(size);
+
+   /* a slab object stays if its class is large enough */
+   if (slab_owns(m)) {
+      if (size <= slab_size_of(m))
+         return m;
+   }
+   else if (chunk_get_status(c) == CHUNK_MMAPPED) {
+      if (units >= MMAP_UNITS) {
+         page = (size_t)getpagesize();
+         bytes = ((units + 1) * CHUNK_UNIT + page - 1) & ~(page - 1);
+         old = mmap_bytes(c);
+         stats_count(STAT_MMAP);
+         m2 = mremap(mmap_base(c), old, bytes, MREMAP_MAYMOVE);
+         if (m2 == MAP_FAILED)
+            return NULL;
+         stats_mapped(old, bytes);
+         c = (Chunk_T)((char *)m2 + CHUNK_HEADER);
+         chunk_set_units(c, (int)(bytes / CHUNK_UNIT) - 1);
+         return get_data_ptr(c);
       }
+   }
+   else if (arena_resize(arena_of(c), c, (int)units)) {
+      return m;
+   }
+
+   m2 = heapmgr_malloc(size);
+   if (m2 == NULL)
+      return NULL;
+   bytes = slab_owns(m) ? slab_size_of(m) :
+      units_to_size(chunk_get_units(c));
+   memcpy(m2, m, (bytes < size) ? bytes : size);
+   heapmgr_free(m);
+   return m2;
+}
+/*--------------------------------------------------------------*/
+/* heapmgr_aligned_alloc:
+ * Allocates 'size' bytes at a multiple of 'alignment', which must
+ * be a power of two. Substitute for C11 aligned_alloc().
+ */
+/*--------------------------------------------------------------*/
+void *heapmgr_aligned_alloc(size_t alignment, size_t size) {
+   struct Arena *a;
+   Chunk_T c;
+   int units;
+
+   if (alignment == 0 || (alignment & (alignment - 1)) != 0)
+      return NULL;
+   if (alignment <= CHUNK_UNIT)
+      return heapmgr_malloc(size);
+   if (size <= 0 || alignment > INT_MAX / 2 ||
+       size_to_units(size) + size_to_units(alignment) >
+       INT_MAX - MEMALLOC_MIN - 3)
+      return NULL;
 
-      /* insert the new free chunk into the free list */
-      if (prev == NULL)
-         insert_chunk(c);
-      else{
-         insert_chunk_after(prev, c);
+   units = (int)size_to_units(size);
+   a = thread_arena();
+   c = arena_aligned(a, units, alignment);
+   if (c == NULL && a != &g_main_arena)
+      c = arena_aligned(&g_main_arena, units, alignment);
+   if (c == NULL)
+      return NULL;
+   return get_data_ptr(c);
+}
+/*--------------------------------------------------------------*/
+/* heapmgr_usable_size:
+ * Returns the number of bytes usable at 'm', which may exceed the
+ * size asked for, or 0 if 'm' is NULL. Substitute for GNU
+ * malloc_usable_size().
+ */
+/*--------------------------------------------------------------*/
+size_t heapmgr_usable_size(void *m) {
+   if (m == NULL)
+      return 0;
+   if (slab_owns(m))
+      return slab_size_of(m);
+   return units_to_size(chunk_get_units(get_chunk_from_data_ptr(m)));
+}
+/*--------------------------------------------------------------*/
+/* heapmgr_stats:
+ * Fills '*stats' from the counters of the arenas, the slab classes
+ * and the system calls. Only the largest free chunk is looked for,
+ * at the end of the tree or in the last bin in use of each arena.
+ */
+/*--------------------------------------------------------------*/
+void heapmgr_stats(struct HeapMgrStats *stats) {
+   struct Arena *a;
+   struct SlabClass *sc;
+   size_t heap, free_bytes, chunk_free = 0;
+   int i, j, count, units, largest = 0;
+
+   assert(BIN_COUNT + 1 <= HEAPMGR_STATS_BINS);
+   pthread_once(&g_init_once, init_my_heap);
+   memset(stats, 0, sizeof(*stats));
+
+   stats->i_bins = BIN_COUNT + 1;
+   for (j = 0; j <= BIN_COUNT; j++)
+      stats->as_bins[j].ui_min_bytes =
+         (size_t)(j < BIN_COUNT ? get_bin_units(j) : BIN_MAX) * CHUNK_UNIT;
+
+   pthread_mutex_lock(&g_arenas_lock);
+   count = g_arena_count;
+   pthread_mutex_unlock(&g_arenas_lock);
+
+   for (i = 0; i < count; i++) {
+      a = g_arenas[i];
+      pthread_mutex_lock(&a->lock);
+      free_bytes = 0;
+      for (j = 0; j <= BIN_COUNT; j++) {
+         stats->as_bins[j].ui_count += a->free_counts[j];
+         stats->as_bins[j].ui_bytes += a->free_bytes[j];
+         free_bytes += a->free_bytes[j];
       }
+
+      /* what is not free in a heap is in use, but for the room before
+       * its first chunk and its fence */
+      heap = (size_t)((char *)a->heap_end - (char *)a->heap_start);
+      if (heap != 0)
+         stats->ui_in_use += heap - CHUNK_UNIT - free_bytes;
+      chunk_free += free_bytes;
+      units = arena_largest_free(a);
+      pthread_mutex_unlock(&a->lock);
+      if (units > largest)
+         largest = units;
    }
 
-   /* double check if everything is OK */
-    assert(check_heap_validity());
-}
\ No newline at end of file
+   for (i = 1; i <= SLAB_CLASSES; i++) {
+      sc = &g_slab_classes[i];
+      pthread_mutex_lock(&sc->lock);
+      stats->ui_in_use += sc->used * sc->size;
+      stats->ui_free += (sc->pages * sc->count - sc->used) * sc->size;
+      pthread_mutex_unlock(&sc->lock);
+   }
+
+   stats->ui_in_use += __atomic_load_n(&g_stat_mapped, __ATOMIC_RELAXED);
+   stats->ui_free += chunk_free;
+   stats->ui_total = __atomic_load_n(&g_stat_total, __ATOMIC_RELAXED);
+   stats->ui_peak = __atomic_load_n(&g_stat_peak, __ATOMIC_RELAXED);
+   stats->ui_largest_free = (size_t)largest * CHUNK_UNIT;
+   if (chunk_free != 0)
+      stats->d_fragmentation =
+         1.0 - (double)stats->ui_largest_free / (double)chunk_free;
+
+   stats->ui_sbrk_calls = __atomic_load_n(&g_stat_calls[STAT_SBRK],
+                                          __ATOMIC_RELAXED);
+   stats->ui_mmap_calls = __atomic_load_n(&g_stat_calls[STAT_MMAP],
+                                          __ATOMIC_RELAXED);
+   stats->ui_munmap_calls = __atomic_load_n(&g_stat_calls[STAT_MUNMAP],
+                                            __ATOMIC_RELAXED);
+   stats->ui_madvise_calls = __atomic_load_n(&g_stat_calls[STAT_MADVISE],
+                                             __ATOMIC_RELAXED);
+}
+/*--------------------------------------------------------------*/
+/* print_line:
+ * Writes the 'n' bytes of 'line' to stderr.
+ */
+/*--------------------------------------------------------------*/
+static void
+print_line(const char *line, int n)
+{
+   ssize_t done;
+
+   while (n > 0 && (done = write(STDERR_FILENO, line, n)) > 0) {
+      line += done;
+      n -= (int)done;
+   }
+}
+/*--------------------------------------------------------------*/
+/* heapmgr_print_stats:
+ * Prints the statistics of the heap to stderr, with a line for each
+ * bin that holds a free chunk. It writes to the file descriptor, so
+ * that it neither allocates nor takes the lock of stderr.
+ */
+/*--------------------------------------------------------------*/
+void heapmgr_print_stats(void) {
+   struct HeapMgrStats stats;
+   char line[256];
+   int i, n;
+
+   heapmgr_stats(&stats);
+
+   n = snprintf(line, sizeof(line),
+                "heapmgr: in use %zu, free %zu, total %zu, peak %zu\n"
+                "heapmgr: largest free %zu, fragmentation %.3f\n",
+                stats.ui_in_use, stats.ui_free, stats.ui_total,
+                stats.ui_peak, stats.ui_largest_free,
+                stats.d_fragmentation);
+   print_line(line, n);
+   n = snprintf(line, sizeof(line),
+                "heapmgr: sbrk %zu, mmap %zu, munmap %zu, madvise %zu\n",
+                stats.ui_sbrk_calls, stats.ui_mmap_calls,
+                stats.ui_munmap_calls, stats.ui_madvise_calls);
+   print_line(line, n);
+
+   for (i = 0; i < stats.i_bins; i++) {
+      if (stats.as_bins[i].ui_count == 0)
+         continue;
+      n = snprintf(line, sizeof(line),
+                   "heapmgr: bin %zu+: %zu free, %zu bytes\n",
+                   stats.as_bins[i].ui_min_bytes, stats.as_bins[i].ui_count,
+                   stats.as_bins[i].ui_bytes);
+      print_line(line, n);
+   }
+}
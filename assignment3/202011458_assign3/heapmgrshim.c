@@ -0,0 +1,270 @@
+/*--------------------------------------------------------------------*/
+/* heapmgrshim.c                                                      */
+/* Author: Sungjin Kim                                                */
+/*--------------------------------------------------------------------*/
+
+/* Replaces the malloc family of the C library with heapmgr, so that a
+ * real program runs on it when this is built as a shared library and
+ * loaded with LD_PRELOAD:
+ *
+ *    LD_PRELOAD=./libheapmgr2.so ./program
+ *
+ * The C library calls these as well, and so may heapmgr itself through
+ * the functions it uses. A call made while the same thread is already
+ * inside heapmgr is served from a small static bootstrap area instead,
+ * whose blocks are never reused. */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "heapmgr.h"
+
+#define FALSE 0
+#define TRUE  1
+
+/* Each bootstrap block starts with a header of BOOT_ALIGN bytes that
+ * holds its size. */
+enum {
+   BOOT_SIZE = 256 * 1024,
+   BOOT_ALIGN = 16,
+};
+
+/* g_boot: the bootstrap area. g_boot_used: bytes of it handed out */
+static char g_boot[BOOT_SIZE] __attribute__((aligned(BOOT_ALIGN)));
+static size_t g_boot_used = 0;
+
+/* t_busy: TRUE while the calling thread is inside heapmgr */
+static __thread int t_busy = FALSE;
+
+/*--------------------------------------------------------------------*/
+/* boot_alloc:
+ * Returns 'size' bytes at a multiple of BOOT_ALIGN from the bootstrap
+ * area, or NULL if it is used up. */
+/*--------------------------------------------------------------------*/
+static void *
+boot_alloc(size_t size)
+{
+   size_t bytes, at;
+
+   if (size > BOOT_SIZE)
+      return NULL;
+   bytes = (size + 2 * BOOT_ALIGN - 1) & ~(size_t)(BOOT_ALIGN - 1);
+   at = __atomic_fetch_add(&g_boot_used, bytes, __ATOMIC_RELAXED);
+   if (at + bytes > BOOT_SIZE)
+      return NULL;
+
+   *(size_t *)(g_boot + at) = size;
+   return g_boot + at + BOOT_ALIGN;
+}
+/*--------------------------------------------------------------------*/
+/* is_boot:
+ * Returns TRUE iff 'm' came from the bootstrap area. */
+/*--------------------------------------------------------------------*/
+static inline int
+is_boot(void *m)
+{
+   return (char *)m >= g_boot && (char *)m < g_boot + BOOT_SIZE;
+}
+/*--------------------------------------------------------------------*/
+/* boot_size:
+ * Returns the size of the bootstrap block at 'm'. */
+/*--------------------------------------------------------------------*/
+static inline size_t
+boot_size(void *m)
+{
+   return *(size_t *)((char *)m - BOOT_ALIGN);
+}
+/*--------------------------------------------------------------------*/
+/* enter, leave:
+ * Mark the calling thread as inside heapmgr. enter() returns FALSE if
+ * it is already, and the call must use the bootstrap area. */
+/*--------------------------------------------------------------------*/
+static inline int
+enter(void)
+{
+   if (t_busy)
+      return FALSE;
+   t_busy = TRUE;
+   return TRUE;
+}
+
+static inline void
+leave(void)
+{
+   t_busy = FALSE;
+}
+/*--------------------------------------------------------------------*/
+/* checked:
+ * Returns 'm', and sets errno to ENOMEM if it is NULL. */
+/*--------------------------------------------------------------------*/
+static inline void *
+checked(void *m)
+{
+   if (m == NULL)
+      errno = ENOMEM;
+   return m;
+}
+/*--------------------------------------------------------------------*/
+void *
+malloc(size_t size)
+{
+   void *m;
+
+   if (!enter())
+      return checked(boot_alloc(size));
+
+   /* malloc(0) returns a unique pointer, as the C library does */
+   m = heapmgr_malloc(size ? size : 1);
+   leave();
+   return checked(m);
+}
+/*--------------------------------------------------------------------*/
+void
+free(void *m)
+{
+   if (m == NULL || is_boot(m))
+      return;
+
+   /* heapmgr may hold a lock here; leaking the block is the safe way */
+   if (!enter())
+      return;
+   heapmgr_free(m);
+   leave();
+}
+/*--------------------------------------------------------------------*/
+void *
+calloc(size_t n, size_t size)
+{
+   void *m;
+
+   if (size != 0 && n > SIZE_MAX / size) {
+      errno = ENOMEM;
+      return NULL;
+   }
+
+   /* the bootstrap area is zero until it is handed out */
+   if (!enter())
+      return checked(boot_alloc(n * size));
+
+   m = (n == 0 || size == 0) ? heapmgr_malloc(1) : heapmgr_calloc(n, size);
+   leave();
+   return checked(m);
+}
+/*--------------------------------------------------------------------*/
+void *
+realloc(void *m, size_t size)
+{
+   void *m2;
+
+   if (m != NULL && is_boot(m)) {
+      /* a bootstrap block moves to the heap, and its old copy stays */
+      m2 = malloc(size ? size : 1);
+      if (m2 != NULL)
+         memcpy(m2, m, (boot_size(m) < size) ? boot_size(m) : size);
+      return m2;
+   }
+
+   if (!enter())
+      return checked(boot_alloc(size));
+
+   if (m == NULL)
+      m2 = heapmgr_malloc(size ? size : 1);
+   else
+      m2 = heapmgr_realloc(m, size);
+   leave();
+   return (size != 0) ? checked(m2) : m2;
+}
+/*--------------------------------------------------------------------*/
+void *
+reallocarray(void *m, size_t n, size_t size)
+{
+   if (size != 0 && n > SIZE_MAX / size) {
+      errno = ENOMEM;
+      return NULL;
+   }
+   return realloc(m, n * size);
+}
+/*--------------------------------------------------------------------*/
+/* aligned:
+ * Returns 'size' bytes at a multiple of 'align', a power of two, or
+ * NULL if there is no memory for them. */
+/*--------------------------------------------------------------------*/
+static void *
+aligned(size_t align, size_t size)
+{
+   void *m;
+
+   if (!enter())
+      return (align <= BOOT_ALIGN) ? boot_alloc(size) : NULL;
+
+   m = heapmgr_aligned_alloc(align, size ? size : 1);
+   leave();
+   return m;
+}
+/*--------------------------------------------------------------------*/
+int
+posix_memalign(void **mp, size_t align, size_t size)
+{
+   void *m;
+
+   if (align < sizeof(void *) || (align & (align - 1)) != 0)
+      return EINVAL;
+
+   m = aligned(align, size);
+   if (m == NULL)
+      return ENOMEM;
+   *mp = m;
+   return 0;
+}
+/*--------------------------------------------------------------------*/
+void *
+aligned_alloc(size_t align, size_t size)
+{
+   if (align == 0 || (align & (align - 1)) != 0) {
+      errno = EINVAL;
+      return NULL;
+   }
+   return checked(aligned(align, size));
+}
+/*--------------------------------------------------------------------*/
+void *
+memalign(size_t align, size_t size)
+{
+   return aligned_alloc(align, size);
+}
+/*--------------------------------------------------------------------*/
+void *
+valloc(size_t size)
+{
+   return aligned_alloc((size_t)getpagesize(), size);
+}
+/*--------------------------------------------------------------------*/
+void *
+pvalloc(size_t size)
+{
+   size_t page = (size_t)getpagesize();
+
+   return aligned_alloc(page, (size + page - 1) & ~(page - 1));
+}
+/*--------------------------------------------------------------------*/
+void
+malloc_stats(void)
+{
+   if (!enter())
+      return;
+   heapmgr_print_stats();
+   leave();
+}
+/*--------------------------------------------------------------------*/
+size_t
+malloc_usable_size(void *m)
+{
+   if (m != NULL && is_boot(m))
+      return boot_size(m);
+   return heapmgr_usable_size(m);
+}
@@ -19,4 +19,68 @@ void heapmgr_free(void *pv_bytes);
    pointer to space that was not previously allocated by
    heapmgr_malloc(). */
 
+void *heapmgr_calloc(size_t ui_count, size_t ui_bytes);
+/* Return a pointer to space for an array of ui_count objects of size
+   ui_bytes, all set to zero. Return NULL if the size is 0 or the
+   request cannot be satisfied. */
+
+void *heapmgr_realloc(void *pv_bytes, size_t ui_bytes);
+/* Change the size of the space pointed to by pv_bytes to ui_bytes,
+   keeping its contents up to the lesser of the old and new sizes, and
+   return a pointer to it, which may differ from pv_bytes. Act as
+   heapmgr_malloc() if pv_bytes is NULL, and as heapmgr_free() with a
+   NULL result if ui_bytes is 0. Return NULL and leave the space alone
+   if the request cannot be satisfied. */
+
+void *heapmgr_aligned_alloc(size_t ui_alignment, size_t ui_bytes);
+/* Return a pointer to space for an object of size ui_bytes at a
+   multiple of ui_alignment, which must be a power of two. Return
+   NULL if ui_bytes is 0, ui_alignment is not a power of two, or the
+   request cannot be satisfied. The space is uninitialized and is
+   freed with heapmgr_free(). */
+
+size_t heapmgr_usable_size(void *pv_bytes);
+/* Return the number of bytes usable in the space pointed to by
+   pv_bytes, which is at least the size asked for, or 0 if pv_bytes is
+   NULL. */
+
+enum {HEAPMGR_STATS_BINS = 256};
+
+struct HeapMgrStats
+{
+   size_t ui_in_use;         /* bytes handed out, those that wait in a
+                                thread cache included */
+   size_t ui_free;           /* bytes free in the heap */
+   size_t ui_total;          /* bytes the heap manager holds */
+   size_t ui_peak;           /* the largest ui_total so far */
+   size_t ui_largest_free;   /* bytes of the largest free chunk */
+   double d_fragmentation;   /* 1 - ui_largest_free / the bytes of all
+                                free chunks, or 0 if there are none */
+   size_t ui_sbrk_calls;     /* calls that moved the program break */
+   size_t ui_mmap_calls;     /* calls of mmap() and mremap() */
+   size_t ui_munmap_calls;
+   size_t ui_madvise_calls;
+   int i_bins;               /* entries of as_bins in use */
+   struct HeapMgrBin
+   {
+      size_t ui_min_bytes;   /* the smallest chunk the bin holds */
+      size_t ui_count;       /* free chunks in the bin */
+      size_t ui_bytes;       /* their bytes */
+   } as_bins[HEAPMGR_STATS_BINS];
+};
+/* Statistics of the heap, as heapmgr_stats() gives them. Sizes count
+   whole chunks, headers included. */
+
+void heapmgr_stats(struct HeapMgrStats *ps_stats);
+/* Fill *ps_stats with the statistics of the heap. They come from
+   counters that the heap manager keeps up as it goes, so this does not
+   walk the heap. Each part of the heap is read under its own lock, so
+   the figures of busy threads may be a little apart in time. */
+
+void heapmgr_print_stats(void);
+/* Print the statistics of the heap to stderr. If the environment
+   variable HEAPMGR_STATS is set to a count, they are printed after
+   every that many allocations of a thread, and at exit; 0 prints them
+   only at exit. */
+
 #endif
\ No newline at end of file
@@ -0,0 +1,609 @@
+/*--------------------------------------------------------------------*/
+/* heaptrace.c                                                        */
+/* Author: Sungjin Kim                                                */
+/*--------------------------------------------------------------------*/
+
+/* Records the malloc family calls of a real program into a trace, as
+   heaptrace.h describes, when this is built as a shared library and
+   loaded with LD_PRELOAD:
+
+      HEAPTRACE=trace.%p LD_PRELOAD=./libheaptrace.so ./program
+
+   The calls are served by the C library itself.  HEAPTRACE names the
+   trace file, with %p replaced by the process id; it is heaptrace.%p
+   by default.  Use %p for a program that starts others, since they
+   record too.  A child that a fork() makes without an exec() does not
+   record.  The table that maps addresses to ids and the stack of free
+   ids live in mmap()ed memory, so recording never calls malloc(). */
+
+#define _GNU_SOURCE
+
+#include "heaptrace.h"
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+enum {FALSE, TRUE};
+
+/* The C library's own functions, which malloc() and the others here
+   replace. */
+extern void *__libc_malloc(size_t ui_bytes);
+extern void __libc_free(void *pv_bytes);
+extern void *__libc_calloc(size_t ui_count, size_t ui_bytes);
+extern void *__libc_realloc(void *pv_bytes, size_t ui_bytes);
+extern void *__libc_memalign(size_t ui_alignment, size_t ui_bytes);
+
+/*--------------------------------------------------------------------*/
+
+/* The states of the recorder. */
+enum {STATE_INIT, STATE_ON, STATE_OFF};
+
+/* The size of the buffer of events that are not written yet, and the
+   least number of slots in the address table. */
+enum {BUFFER_SIZE = 1 << 16, TABLE_MIN = 1 << 12, IDS_MIN = 1 << 12};
+
+/* A slot of the address table.  An empty slot has a ui_address of
+   EMPTY, and a slot whose address was removed has TOMBSTONE. */
+struct Entry
+{
+   uintptr_t ui_address;
+   uint64_t ui_id;
+};
+
+enum {EMPTY = 0, TOMBSTONE = 1};
+
+/* Guards everything below.  Events are written in the order in which
+   they take it. */
+static pthread_mutex_t s_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int i_state = STATE_INIT;
+static int i_fd = -1;
+
+static char ac_buffer[BUFFER_SIZE];
+static size_t ui_buffer_used = 0;
+
+/* The address table: ui_table_size slots, a power of two, of which
+   ui_table_used are not EMPTY. */
+static struct Entry *ps_table = NULL;
+static size_t ui_table_size = 0;
+static size_t ui_table_used = 0;
+static size_t ui_table_live = 0;
+
+/* The ids that were freed, and the next id that was never used. */
+static uint64_t *pui_ids = NULL;
+static size_t ui_ids_size = 0;
+static size_t ui_ids_count = 0;
+static uint64_t ui_next_id = 0;
+
+/*--------------------------------------------------------------------*/
+
+static void *map(size_t ui_bytes)
+
+/* Return ui_bytes of zeroed memory from mmap(), or NULL if there is
+   none. */
+
+{
+   void *pv = mmap(NULL, ui_bytes, PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+   return (pv == MAP_FAILED) ? NULL : pv;
+}
+
+/*--------------------------------------------------------------------*/
+
+static void write_all(const char *pc, size_t ui_bytes)
+
+/* Write ui_bytes from pc to the trace file.  Stop recording if it
+   fails. */
+
+{
+   ssize_t i_written;
+
+   while (ui_bytes > 0)
+   {
+      i_written = write(i_fd, pc, ui_bytes);
+      if (i_written < 0 && errno == EINTR)
+         continue;
+      if (i_written <= 0)
+      {
+         i_state = STATE_OFF;
+         return;
+      }
+      pc += i_written;
+      ui_bytes -= (size_t)i_written;
+   }
+}
+
+/*--------------------------------------------------------------------*/
+
+static void flush(void)
+
+/* Write the buffered events to the trace file. */
+
+{
+   if (i_state == STATE_ON && ui_buffer_used > 0)
+      write_all(ac_buffer, ui_buffer_used);
+   ui_buffer_used = 0;
+}
+
+/*--------------------------------------------------------------------*/
+
+static void put_number(uint64_t ui)
+
+/* Append ui to the buffer, seven bits at a time. */
+
+{
+   while (ui >= 0x80)
+   {
+      ac_buffer[ui_buffer_used++] = (char)(ui | 0x80);
+      ui >>= 7;
+   }
+   ac_buffer[ui_buffer_used++] = (char)ui;
+}
+
+/*--------------------------------------------------------------------*/
+
+static void put_event(int i_op, uint64_t ui_id, uint64_t ui_size,
+   uint64_t ui_alignment)
+
+/* Append an event with op i_op to the buffer.  ui_size is ignored by
+   HEAPTRACE_FREE, and ui_alignment by all but HEAPTRACE_ALIGNED. */
+
+{
+   if (ui_buffer_used + HEAPTRACE_EVENT_MAX > BUFFER_SIZE)
+      flush();
+   ac_buffer[ui_buffer_used++] = (char)i_op;
+   put_number(ui_id);
+   if (i_op == HEAPTRACE_ALIGNED)
+      put_number(ui_alignment);
+   if (i_op != HEAPTRACE_FREE)
+      put_number(ui_size);
+}
+
+/*--------------------------------------------------------------------*/
+
+static void open_trace(void)
+
+/* Open the trace file that HEAPTRACE names and write the magic
+   bytes to it.  Stop recording if that fails. */
+
+{
+   char ac_name[4096];
+   const char *pc_pattern = getenv("HEAPTRACE");
+   char ac_pid[24];
+   size_t ui_used = 0;
+   size_t ui_pid;
+   long l_pid;
+
+   if (pc_pattern == NULL || *pc_pattern == '\0')
+      pc_pattern = "heaptrace.%p";
+
+   /* Write the process id backwards, once. */
+   l_pid = (long)getpid();
+   ui_pid = 0;
+   do
+   {
+      ac_pid[ui_pid++] = (char)('0' + l_pid % 10);
+      l_pid /= 10;
+   } while (l_pid > 0);
+
+   for (; *pc_pattern != '\0' && ui_used < sizeof(ac_name) - 24;
+        pc_pattern++)
+      if (pc_pattern[0] == '%' && pc_pattern[1] == 'p')
+      {
+         size_t ui = ui_pid;
+         while (ui > 0)
+            ac_name[ui_used++] = ac_pid[--ui];
+         pc_pattern++;
+      }
+      else
+         ac_name[ui_used++] = *pc_pattern;
+   ac_name[ui_used] = '\0';
+
+   i_fd = open(ac_name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+   if (i_fd < 0)
+   {
+      i_state = STATE_OFF;
+      return;
+   }
+   i_state = STATE_ON;
+   write_all(HEAPTRACE_MAGIC, HEAPTRACE_MAGIC_SIZE);
+}
+
+/*--------------------------------------------------------------------*/
+
+static size_t hash(uintptr_t ui_address)
+
+/* Return the first slot of the address table to try for
+   ui_address. */
+
+{
+   return (size_t)(((uint64_t)ui_address * 0x9E3779B97F4A7C15ULL) >> 20)
+      & (ui_table_size - 1);
+}
+
+/*--------------------------------------------------------------------*/
+
+static int grow_table(void)
+
+/* Rebuild the address table without its tombstones, twice as big if
+   it is more than a quarter full of live addresses.  Return FALSE if
+   there is no memory for it. */
+
+{
+   struct Entry *ps_old = ps_table;
+   size_t ui_old_size = ui_table_size;
+   size_t ui_size = ui_table_size;
+   size_t i, j;
+
+   if (ui_size == 0)
+      ui_size = TABLE_MIN;
+   else if (ui_table_live > ui_size / 4)
+      ui_size *= 2;
+
+   ps_table = map(ui_size * sizeof(struct Entry));
+   if (ps_table == NULL)
+   {
+      ps_table = ps_old;
+      return FALSE;
+   }
+   ui_table_size = ui_size;
+   ui_table_used = ui_table_live;
+
+   for (i = 0; i < ui_old_size; i++)
+   {
+      if (ps_old[i].ui_address == EMPTY ||
+          ps_old[i].ui_address == TOMBSTONE)
+         continue;
+      for (j = hash(ps_old[i].ui_address);
+           ps_table[j].ui_address != EMPTY; j = (j + 1) & (ui_size - 1))
+         ;
+      ps_table[j] = ps_old[i];
+   }
+   if (ps_old != NULL)
+      munmap(ps_old, ui_old_size * sizeof(struct Entry));
+   return TRUE;
+}
+
+/*--------------------------------------------------------------------*/
+
+static int insert_address(void *pv, uint64_t ui_id)
+
+/* Map the address pv, which is not in the table, to ui_id.  Return
+   FALSE if there is no memory for it.  A tombstone is reused, since
+   the C library hands the same addresses out again and again, and
+   would otherwise make a run of tombstones for each of them. */
+
+{
+   size_t j;
+
+   if ((ui_table_used + 1) * 2 > ui_table_size && !grow_table())
+      return FALSE;
+
+   for (j = hash((uintptr_t)pv); ps_table[j].ui_address != EMPTY &&
+        ps_table[j].ui_address != TOMBSTONE;
+        j = (j + 1) & (ui_table_size - 1))
+      ;
+   if (ps_table[j].ui_address == EMPTY)
+      ui_table_used++;
+   ps_table[j].ui_address = (uintptr_t)pv;
+   ps_table[j].ui_id = ui_id;
+   ui_table_live++;
+   return TRUE;
+}
+
+/*--------------------------------------------------------------------*/
+
+static int remove_address(void *pv, uint64_t *pui_id)
+
+/* Remove the address pv from the table and store its id in *pui_id.
+   Return FALSE if pv is not in the table. */
+
+{
+   size_t j;
+
+   if (ui_table_size == 0)
+      return FALSE;
+
+   for (j = hash((uintptr_t)pv); ps_table[j].ui_address != EMPTY;
+        j = (j + 1) & (ui_table_size - 1))
+      if (ps_table[j].ui_address == (uintptr_t)pv)
+      {
+         ps_table[j].ui_address = TOMBSTONE;
+         ui_table_live--;
+         *pui_id = ps_table[j].ui_id;
+         return TRUE;
+      }
+   return FALSE;
+}
+
+/*--------------------------------------------------------------------*/
+
+static uint64_t take_id(void)
+
+/* Return an id that no live object has. */
+
+{
+   if (ui_ids_count > 0)
+      return pui_ids[--ui_ids_count];
+   return ui_next_id++;
+}
+
+/*--------------------------------------------------------------------*/
+
+static void give_id(uint64_t ui_id)
+
+/* Let ui_id be taken again.  Keep it out of use if there is no memory
+   for that. */
+
+{
+   uint64_t *pui_old = pui_ids;
+   size_t ui_size = ui_ids_size ? ui_ids_size * 2 : IDS_MIN;
+
+   if (ui_ids_count == ui_ids_size)
+   {
+      pui_ids = map(ui_size * sizeof(uint64_t));
+      if (pui_ids == NULL)
+      {
+         pui_ids = pui_old;
+         return;
+      }
+      if (pui_old != NULL)
+      {
+         memcpy(pui_ids, pui_old, ui_ids_count * sizeof(uint64_t));
+         munmap(pui_old, ui_ids_size * sizeof(uint64_t));
+      }
+      ui_ids_size = ui_size;
+   }
+   pui_ids[ui_ids_count++] = ui_id;
+}
+
+/*--------------------------------------------------------------------*/
+
+static int lock(void)
+
+/* Take s_lock and return TRUE if the process records, starting to
+   record if it has not yet.  Otherwise return FALSE. */
+
+{
+   pthread_mutex_lock(&s_lock);
+   if (i_state == STATE_INIT)
+      open_trace();
+   if (i_state == STATE_ON)
+      return TRUE;
+   pthread_mutex_unlock(&s_lock);
+   return FALSE;
+}
+
+/*--------------------------------------------------------------------*/
+
+static void record_new(int i_op, void *pv, size_t ui_size,
+   size_t ui_alignment)
+
+/* Record an event with op i_op that made the object pv of ui_size
+   bytes.  Do nothing if pv is NULL. */
+
+{
+   uint64_t ui_id;
+
+   if (pv == NULL || !lock())
+      return;
+   ui_id = take_id();
+   if (insert_address(pv, ui_id))
+      put_event(i_op, ui_id, ui_size, ui_alignment);
+   pthread_mutex_unlock(&s_lock);
+}
+
+/*--------------------------------------------------------------------*/
+
+static void fork_prepare(void)
+
+/* Keep other threads out of the recorder while the process forks. */
+
+{
+   pthread_mutex_lock(&s_lock);
+}
+
+static void fork_parent(void)
+{
+   pthread_mutex_unlock(&s_lock);
+}
+
+static void fork_child(void)
+
+/* Stop recording in the child, which would write events that the
+   parent buffered, and would share its file. */
+
+{
+   if (i_fd >= 0)
+      close(i_fd);
+   i_fd = -1;
+   i_state = STATE_OFF;
+   ui_buffer_used = 0;
+   pthread_mutex_unlock(&s_lock);
+}
+
+/*--------------------------------------------------------------------*/
+
+__attribute__((constructor))
+static void start(void)
+
+/* Prepare for fork() before the program runs. */
+
+{
+   pthread_atfork(fork_prepare, fork_parent, fork_child);
+}
+
+/*--------------------------------------------------------------------*/
+
+__attribute__((destructor))
+static void finish(void)
+
+/* Write the buffered events when the program exits. */
+
+{
+   pthread_mutex_lock(&s_lock);
+   flush();
+   pthread_mutex_unlock(&s_lock);
+}
+
+/*--------------------------------------------------------------------*/
+
+void *malloc(size_t ui_bytes)
+{
+   void *pv = __libc_malloc(ui_bytes);
+   record_new(HEAPTRACE_MALLOC, pv, ui_bytes, 0);
+   return pv;
+}
+
+/*--------------------------------------------------------------------*/
+
+void *calloc(size_t ui_count, size_t ui_bytes)
+{
+   void *pv = __libc_calloc(ui_count, ui_bytes);
+   record_new(HEAPTRACE_CALLOC, pv, ui_count * ui_bytes, 0);
+   return pv;
+}
+
+/*--------------------------------------------------------------------*/
+
+void free(void *pv_bytes)
+
+/* Record the free before pv_bytes goes back to the C library, which
+   may hand it to another thread. */
+
+{
+   uint64_t ui_id;
+
+   if (pv_bytes != NULL && lock())
+   {
+      if (remove_address(pv_bytes, &ui_id))
+      {
+         put_event(HEAPTRACE_FREE, ui_id, 0, 0);
+         give_id(ui_id);
+      }
+      pthread_mutex_unlock(&s_lock);
+   }
+   __libc_free(pv_bytes);
+}
+
+/*--------------------------------------------------------------------*/
+
+void *realloc(void *pv_bytes, size_t ui_bytes)
+
+/* Record a realloc() of an object as a change of the size of its id.
+   The address comes out of the table before the C library may free
+   it, and goes back in if the realloc() fails. */
+
+{
+   uint64_t ui_id;
+   int i_found = FALSE;
+   void *pv;
+
+   if (pv_bytes == NULL)
+      return malloc(ui_bytes);
+   if (ui_bytes == 0)
+   {
+      free(pv_bytes);
+      return NULL;
+   }
+
+   if (lock())
+   {
+      i_found = remove_address(pv_bytes, &ui_id);
+      pthread_mutex_unlock(&s_lock);
+   }
+
+   pv = __libc_realloc(pv_bytes, ui_bytes);
+
+   if (!i_found)
+      record_new(HEAPTRACE_MALLOC, pv, ui_bytes, 0);
+   else if (lock())
+   {
+      if (pv == NULL)
+         insert_address(pv_bytes, ui_id);
+      else if (insert_address(pv, ui_id))
+         put_event(HEAPTRACE_REALLOC, ui_id, ui_bytes, 0);
+      pthread_mutex_unlock(&s_lock);
+   }
+   return pv;
+}
+
+/*--------------------------------------------------------------------*/
+
+void *reallocarray(void *pv_bytes, size_t ui_count, size_t ui_bytes)
+{
+   if (ui_bytes != 0 && ui_count > SIZE_MAX / ui_bytes)
+   {
+      errno = ENOMEM;
+      return NULL;
+   }
+   return realloc(pv_bytes, ui_count * ui_bytes);
+}
+
+/*--------------------------------------------------------------------*/
+
+static void *aligned(size_t ui_alignment, size_t ui_bytes)
+
+/* Return ui_bytes at a multiple of ui_alignment, a power of two, from
+   the C library, and record them. */
+
+{
+   void *pv = __libc_memalign(ui_alignment, ui_bytes);
+   record_new(HEAPTRACE_ALIGNED, pv, ui_bytes, ui_alignment);
+   return pv;
+}
+
+/*--------------------------------------------------------------------*/
+
+int posix_memalign(void **ppv, size_t ui_alignment, size_t ui_bytes)
+{
+   void *pv;
+
+   if (ui_alignment < sizeof(void *) ||
+       (ui_alignment & (ui_alignment - 1)) != 0)
+      return EINVAL;
+   pv = aligned(ui_alignment, ui_bytes);
+   if (pv == NULL)
+      return ENOMEM;
+   *ppv = pv;
+   return 0;
+}
+
+/*--------------------------------------------------------------------*/
+
+void *aligned_alloc(size_t ui_alignment, size_t ui_bytes)
+{
+   if (ui_alignment == 0 || (ui_alignment & (ui_alignment - 1)) != 0)
+   {
+      errno = EINVAL;
+      return NULL;
+   }
+   return aligned(ui_alignment, ui_bytes);
+}
+
+/*--------------------------------------------------------------------*/
+
+void *memalign(size_t ui_alignment, size_t ui_bytes)
+{
+   return aligned_alloc(ui_alignment, ui_bytes);
+}
+
+/*--------------------------------------------------------------------*/
+
+void *valloc(size_t ui_bytes)
+{
+   return aligned((size_t)getpagesize(), ui_bytes);
+}
+
+/*--------------------------------------------------------------------*/
+
+void *pvalloc(size_t ui_bytes)
+{
+   size_t ui_page = (size_t)getpagesize();
+   return aligned(ui_page, (ui_bytes + ui_page - 1) & ~(ui_page - 1));
+}
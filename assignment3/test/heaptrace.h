@@ -0,0 +1,40 @@
+/*--------------------------------------------------------------------*/
+/* heaptrace.h                                                        */
+/* Author: Sungjin Kim                                                */
+/*--------------------------------------------------------------------*/
+
+#ifndef HEAPTRACE_INCLUDED
+#define HEAPTRACE_INCLUDED
+
+/* The allocation trace that libheaptrace.so records and replayheapmgr
+   replays.  A trace is the HEAPTRACE_MAGIC bytes followed by events.
+   Each event is an op byte followed by its numbers, each written
+   seven bits at a time, low bits first, with the high bit of every
+   byte but the last one set:
+
+      HEAPTRACE_MALLOC id size
+      HEAPTRACE_CALLOC id size         size is count * size
+      HEAPTRACE_REALLOC id size        the object keeps its id
+      HEAPTRACE_ALIGNED id alignment size
+      HEAPTRACE_FREE id
+
+   An id names a live object instead of its address.  Ids are reused
+   once their objects are freed, so they stay below the largest number
+   of objects that are ever live at once. */
+
+#define HEAPTRACE_MAGIC "HEAPTRC1"
+
+enum {HEAPTRACE_MAGIC_SIZE = 8};
+
+enum {
+   HEAPTRACE_MALLOC = 'm',
+   HEAPTRACE_CALLOC = 'c',
+   HEAPTRACE_REALLOC = 'r',
+   HEAPTRACE_ALIGNED = 'a',
+   HEAPTRACE_FREE = 'f'
+};
+
+/* The most bytes that an event takes. */
+enum {HEAPTRACE_EVENT_MAX = 1 + 3 * 10};
+
+#endif
@@ -0,0 +1,480 @@
+/*--------------------------------------------------------------------*/
+/* replayheapmgr.c                                                    */
+/* Author: Sungjin Kim                                                */
+/*--------------------------------------------------------------------*/
+
+#define _GNU_SOURCE
+
+#include "heapmgr.h"
+#include "heaptrace.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+
+/* heapmgrgnu, heapmgrkr, heapmgrbase and heapmgr1 have only
+   heapmgr_malloc() and heapmgr_free().  The others are replayed with
+   those two when they are missing. */
+#pragma weak heapmgr_calloc
+#pragma weak heapmgr_realloc
+#pragma weak heapmgr_aligned_alloc
+
+/*--------------------------------------------------------------------*/
+
+/* The size of the buffer that the trace is read through, and the
+   number of samples taken by default. */
+enum {BUFFER_SIZE = 1 << 20, DEFAULT_SAMPLES = 20};
+
+/* The trace file and the part of it that was read but not decoded. */
+static int i_fd;
+static char ac_buffer[BUFFER_SIZE];
+static size_t ui_buffer_at;
+static size_t ui_buffer_end;
+
+/* The counts of the events by op, indexed by the op byte. */
+static long long al_op_counts[256];
+
+/* The objects of the trace by id, and the bytes asked for each. */
+static char **ppc_objects;
+static size_t *pui_sizes;
+static uint64_t ui_id_count;
+
+/* The time spent replaying, and when the running part of it
+   started. */
+static double d_replay_time;
+static double d_start_time;
+
+/*--------------------------------------------------------------------*/
+
+static double get_time(void)
+
+/* Return the time of a monotonic clock in seconds. */
+
+{
+   struct timespec s_time;
+   clock_gettime(CLOCK_MONOTONIC, &s_time);
+   return (double)s_time.tv_sec + (double)s_time.tv_nsec / 1e9;
+}
+
+/*--------------------------------------------------------------------*/
+
+static void start_timer(void)
+{
+   d_start_time = get_time();
+}
+
+static void stop_timer(void)
+{
+   d_replay_time += get_time() - d_start_time;
+}
+
+/*--------------------------------------------------------------------*/
+
+static long long get_rss(void)
+
+/* Return the number of bytes of the process that are resident in
+   memory.  Read them without stdio, which would allocate. */
+
+{
+   char ac_statm[128];
+   ssize_t i_read;
+   long long l_pages = 0;
+   long long l_rss = 0;
+   int i_fd_statm = open("/proc/self/statm", O_RDONLY);
+
+   if (i_fd_statm < 0)
+      return 0;
+   i_read = read(i_fd_statm, ac_statm, sizeof(ac_statm) - 1);
+   close(i_fd_statm);
+   if (i_read <= 0)
+      return 0;
+   ac_statm[i_read] = '\0';
+   if (sscanf(ac_statm, "%lld %lld", &l_pages, &l_rss) != 2)
+      return 0;
+   return l_rss * (long long)getpagesize();
+}
+
+/*--------------------------------------------------------------------*/
+
+static void open_trace(const char *pc_name)
+
+/* Open the trace file pc_name and read past its magic bytes.  Exit
+   if it is not a trace. */
+
+{
+   i_fd = open(pc_name, O_RDONLY);
+   if (i_fd < 0)
+   {
+      perror(pc_name);
+      exit(EXIT_FAILURE);
+   }
+   ui_buffer_at = ui_buffer_end = 0;
+   if (read(i_fd, ac_buffer, HEAPTRACE_MAGIC_SIZE) != HEAPTRACE_MAGIC_SIZE
+       || memcmp(ac_buffer, HEAPTRACE_MAGIC, HEAPTRACE_MAGIC_SIZE) != 0)
+   {
+      fprintf(stderr, "%s is not a heap trace\n", pc_name);
+      exit(EXIT_FAILURE);
+   }
+}
+
+/*--------------------------------------------------------------------*/
+
+static void fill_buffer(void)
+
+/* Move the bytes that are left to the start of the buffer, and read
+   as much of the trace after them as fits. */
+
+{
+   ssize_t i_read;
+
+   memmove(ac_buffer, ac_buffer + ui_buffer_at,
+      ui_buffer_end - ui_buffer_at);
+   ui_buffer_end -= ui_buffer_at;
+   ui_buffer_at = 0;
+   while (ui_buffer_end < BUFFER_SIZE)
+   {
+      i_read = read(i_fd, ac_buffer + ui_buffer_end,
+         BUFFER_SIZE - ui_buffer_end);
+      if (i_read <= 0)
+         break;
+      ui_buffer_end += (size_t)i_read;
+   }
+}
+
+/*--------------------------------------------------------------------*/
+
+static uint64_t get_number(void)
+
+/* Decode a number of an event from the buffer. */
+
+{
+   uint64_t ui = 0;
+   int i_shift = 0;
+   unsigned char c;
+
+   do
+   {
+      if (ui_buffer_at == ui_buffer_end)
+      {
+         fprintf(stderr, "The trace ends in the middle of an event\n");
+         exit(EXIT_FAILURE);
+      }
+      c = (unsigned char)ac_buffer[ui_buffer_at++];
+      ui |= (uint64_t)(c & 0x7F) << i_shift;
+      i_shift += 7;
+   } while (c & 0x80);
+   return ui;
+}
+
+/*--------------------------------------------------------------------*/
+
+static int get_event(int *pi_op, uint64_t *pui_id, size_t *pui_size,
+   size_t *pui_alignment)
+
+/* Decode the next event of the trace into its op *pi_op, id *pui_id,
+   size *pui_size, and alignment *pui_alignment.  Return 0 at the end
+   of the trace. */
+
+{
+   if (ui_buffer_end - ui_buffer_at < HEAPTRACE_EVENT_MAX)
+   {
+      /* Reading the trace is not part of the replay. */
+      stop_timer();
+      fill_buffer();
+      start_timer();
+      if (ui_buffer_at == ui_buffer_end)
+         return 0;
+   }
+
+   *pi_op = (unsigned char)ac_buffer[ui_buffer_at++];
+   *pui_id = get_number();
+   *pui_alignment = 0;
+   *pui_size = 0;
+   switch (*pi_op)
+   {
+      case HEAPTRACE_ALIGNED:
+         *pui_alignment = (size_t)get_number();
+         *pui_size = (size_t)get_number();
+         break;
+      case HEAPTRACE_MALLOC:
+      case HEAPTRACE_CALLOC:
+      case HEAPTRACE_REALLOC:
+         *pui_size = (size_t)get_number();
+         break;
+      case HEAPTRACE_FREE:
+         break;
+      default:
+         fprintf(stderr, "The trace has an unknown op %d\n", *pi_op);
+         exit(EXIT_FAILURE);
+   }
+   return 1;
+}
+
+/*--------------------------------------------------------------------*/
+
+static void *map_array(size_t ui_bytes)
+
+/* Return ui_bytes of zeroed memory outside of the heap, made
+   resident so that the heap memory measured leaves it out. */
+
+{
+   void *pv = mmap(NULL, ui_bytes ? ui_bytes : 1, PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+   if (pv == MAP_FAILED)
+   {
+      perror("mmap");
+      exit(EXIT_FAILURE);
+   }
+   return pv;
+}
+
+/*--------------------------------------------------------------------*/
+
+static void scan_trace(const char *pc_name, long long *pl_events)
+
+/* Count the events of the trace pc_name by op into al_op_counts and
+   in all into *pl_events, make room for all of its ids, and leave
+   the trace open at its first event. */
+
+{
+   int i_op;
+   uint64_t ui_id;
+   size_t ui_size;
+   size_t ui_alignment;
+
+   open_trace(pc_name);
+   *pl_events = 0;
+   ui_id_count = 0;
+   while (get_event(&i_op, &ui_id, &ui_size, &ui_alignment))
+   {
+      al_op_counts[i_op]++;
+      (*pl_events)++;
+      if (ui_id >= ui_id_count)
+         ui_id_count = ui_id + 1;
+   }
+   close(i_fd);
+
+   ppc_objects = map_array(ui_id_count * sizeof(char *));
+   pui_sizes = map_array(ui_id_count * sizeof(size_t));
+   open_trace(pc_name);
+}
+
+/*--------------------------------------------------------------------*/
+
+static void touch(char *pc, size_t ui_from, size_t ui_to)
+
+/* Write to a byte of each page of the bytes from ui_from to ui_to of
+   pc, as the program that allocated them would. */
+
+{
+   size_t ui_page = 4096;
+   size_t ui;
+
+   for (ui = ui_from; ui < ui_to; ui += ui_page)
+      pc[ui] = (char)ui;
+}
+
+/*--------------------------------------------------------------------*/
+
+static char *replay_realloc(char *pc, size_t ui_old, size_t ui_new)
+
+/* Change the object pc of ui_old bytes to ui_new bytes with
+   heapmgr_realloc(), or as it would without it. */
+
+{
+   char *pc_new;
+
+   if (heapmgr_realloc != NULL)
+      return heapmgr_realloc(pc, ui_new);
+   pc_new = heapmgr_malloc(ui_new);
+   if (pc_new != NULL)
+   {
+      memcpy(pc_new, pc, (ui_old < ui_new) ? ui_old : ui_new);
+      heapmgr_free(pc);
+   }
+   return pc_new;
+}
+
+/*--------------------------------------------------------------------*/
+
+static void replay_event(int i_op, uint64_t ui_id, size_t ui_size,
+   size_t ui_alignment)
+
+/* Replay an event with op i_op on the object ui_id.  Exit if the heap
+   manager cannot satisfy it.  heapmgr_malloc() returns NULL for 0
+   bytes, which the C library does not, so ask for 1 byte instead. */
+
+{
+   char *pc = ppc_objects[ui_id];
+   size_t ui_old = pui_sizes[ui_id];
+
+   if (ui_size == 0)
+      ui_size = 1;
+
+   switch (i_op)
+   {
+      case HEAPTRACE_MALLOC:
+         pc = heapmgr_malloc(ui_size);
+         ui_old = 0;
+         break;
+      case HEAPTRACE_CALLOC:
+         if (heapmgr_calloc != NULL)
+            pc = heapmgr_calloc(1, ui_size);
+         else if ((pc = heapmgr_malloc(ui_size)) != NULL)
+            memset(pc, 0, ui_size);
+         ui_old = ui_size;
+         break;
+      case HEAPTRACE_ALIGNED:
+         if (heapmgr_aligned_alloc != NULL)
+            pc = heapmgr_aligned_alloc(ui_alignment, ui_size);
+         else
+            pc = heapmgr_malloc(ui_size);
+         ui_old = 0;
+         break;
+      case HEAPTRACE_REALLOC:
+         pc = replay_realloc(pc, ui_old, ui_size);
+         break;
+      case HEAPTRACE_FREE:
+         heapmgr_free(pc);
+         ppc_objects[ui_id] = NULL;
+         pui_sizes[ui_id] = 0;
+         return;
+   }
+
+   if (pc == NULL)
+   {
+      fprintf(stderr, "The heap manager cannot allocate %zu bytes\n",
+         ui_size);
+      exit(EXIT_FAILURE);
+   }
+   touch(pc, ui_old, ui_size);
+   ppc_objects[ui_id] = pc;
+   pui_sizes[ui_id] = ui_size;
+}
+
+/*--------------------------------------------------------------------*/
+
+static void print_sample(long long l_events, long long l_live,
+   long long l_rss, long long l_break)
+
+/* Print the heap memory after l_events events: l_live bytes are
+   asked for by live objects, and the heap manager holds l_rss
+   resident bytes and l_break bytes of the program break for them. */
+
+{
+   printf("%12lld %12lld %12lld %12lld %7.1f\n", l_events,
+      l_live / 1024, l_rss / 1024, l_break / 1024,
+      (l_rss > l_live) ? 100.0 * (double)(l_rss - l_live) / (double)l_rss
+                       : 0.0);
+}
+
+/*--------------------------------------------------------------------*/
+
+int main(int argc, char *argv[])
+
+/* Replay the heap trace argv[1], which libheaptrace.so recorded, with
+   heapmgr_malloc() and the other functions of heapmgr.h.
+
+   argv[2], which is optional, is the number of times to sample the
+   heap memory during the replay.  It is DEFAULT_SAMPLES by default.
+
+   Each sample writes the number of events replayed so far, the
+   kilobytes asked for by live objects, the kilobytes that the heap
+   manager holds in resident memory and in the program break, and the
+   fragmentation: the percentage of the resident memory that live
+   objects do not ask for.  The replay writes a byte to each page of
+   every object, so that its memory is resident.
+
+   At the end, write the time per event, which leaves out reading the
+   trace and the samples, and the peak heap memory, and return 0.  The
+   peak program break is the largest one that the samples saw. */
+
+{
+   int i_samples = DEFAULT_SAMPLES;
+   long long l_events;
+   long long l_every;
+   long long l_done = 0;
+   long long l_live = 0;
+   long long l_peak_live = 0;
+   long long l_peak_break = 0;
+   long long l_peak_rss = 0;
+   long long l_initial_rss;
+   long long l_rss;
+   long long l_break;
+   char *pc_initial_break;
+   struct rusage s_usage;
+   int i_op;
+   uint64_t ui_id;
+   size_t ui_size;
+   size_t ui_alignment;
+
+   if (argc != 2 && argc != 3)
+   {
+      fprintf(stderr, "Usage: %s tracefile [samples]\n", argv[0]);
+      exit(EXIT_FAILURE);
+   }
+   if (argc == 3 && (sscanf(argv[2], "%d", &i_samples) != 1 ||
+                     i_samples <= 0))
+   {
+      fprintf(stderr, "Usage: %s tracefile [samples]\n", argv[0]);
+      fprintf(stderr, "Samples must be positive\n");
+      exit(EXIT_FAILURE);
+   }
+
+   scan_trace(argv[1], &l_events);
+   printf("%s %s: %lld events, %lld malloc, %lld calloc, %lld realloc, "
+      "%lld aligned, %lld free, %llu ids\n", argv[0], argv[1], l_events,
+      al_op_counts[HEAPTRACE_MALLOC], al_op_counts[HEAPTRACE_CALLOC],
+      al_op_counts[HEAPTRACE_REALLOC], al_op_counts[HEAPTRACE_ALIGNED],
+      al_op_counts[HEAPTRACE_FREE], (unsigned long long)ui_id_count);
+   printf("%12s %12s %12s %12s %7s\n",
+      "events", "live KB", "rss KB", "break KB", "frag %");
+   fflush(stdout);
+
+   l_every = l_events / i_samples;
+   if (l_every == 0)
+      l_every = 1;
+
+   l_initial_rss = get_rss();
+   pc_initial_break = sbrk(0);
+
+   d_replay_time = 0.0;
+   start_timer();
+   while (get_event(&i_op, &ui_id, &ui_size, &ui_alignment))
+   {
+      l_live -= (long long)pui_sizes[ui_id];
+      replay_event(i_op, ui_id, ui_size, ui_alignment);
+      l_live += (long long)pui_sizes[ui_id];
+      if (l_live > l_peak_live)
+         l_peak_live = l_live;
+
+      if (++l_done % l_every == 0 || l_done == l_events)
+      {
+         stop_timer();
+         l_rss = get_rss() - l_initial_rss;
+         if (l_rss > l_peak_rss)
+            l_peak_rss = l_rss;
+         l_break = (long long)((char *)sbrk(0) - pc_initial_break);
+         if (l_break > l_peak_break)
+            l_peak_break = l_break;
+         print_sample(l_done, l_live, l_rss, l_break);
+         start_timer();
+      }
+   }
+   stop_timer();
+
+   /* The kernel may not have counted the latest peak yet. */
+   getrusage(RUSAGE_SELF, &s_usage);
+   if ((long long)s_usage.ru_maxrss * 1024 - l_initial_rss > l_peak_rss)
+      l_peak_rss = (long long)s_usage.ru_maxrss * 1024 - l_initial_rss;
+   printf("time: %.1f ns/event\n",
+      (l_events > 0) ? d_replay_time * 1e9 / (double)l_events : 0.0);
+   printf("peak: live %lld KB, rss %lld KB, break %lld KB\n",
+      l_peak_live / 1024, l_peak_rss / 1024, l_peak_break / 1024);
+   return 0;
+}
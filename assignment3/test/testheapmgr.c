@@ -11,6 +11,7 @@
 #include <assert.h>
 #include <sys/time.h>
 #include <sys/resource.h>
+#include <pthread.h>
 
 #ifndef __USE_MISC
 #define __USE_MISC
@@ -19,6 +20,11 @@
 
 enum {FALSE, TRUE};
 
+/* Only heapmgr2 keeps statistics; the other heap managers leave
+   heapmgr_stats undefined, and the address of the weak reference is
+   then NULL. */
+#pragma weak heapmgr_stats
+
 /*--------------------------------------------------------------------*/
 
 /* These arrays are too big for the stack section, so store
@@ -33,12 +39,24 @@ static char *apc_chunks[MAX_CALLS];
 /* Randomly generated chunk sizes.  */
 static int ai_sizes[MAX_CALLS];
 
+/* The maximum allowable number of threads of the threads_ tests. */
+enum {MAX_THREADS = 64};
+
+/* The number of threads of the threads_ tests.  Each thread works on
+   its own slice of MAX_CALLS / i_thread_count elements of apc_chunks
+   and ai_sizes. */
+static int i_thread_count = 1;
+
+/* Keeps the threads of threads_handoff in step. */
+static pthread_barrier_t s_barrier;
+
 /*--------------------------------------------------------------------*/
 
 /* Function declarations. */
 
 static void get_args(int argc, char *argv[],
    int *pi_test_num, int *pi_count, int *pi_size);
+static double get_wall_time(void);
 static void set_cpu_limit(void);
 static void test_LIFO_fixed(int i_count, int i_size);
 static void test_FIFO_fixed(int i_count, int i_size);
@@ -47,6 +65,8 @@ static void test_FIFO_random(int i_count, int i_size);
 static void test_random_fixed(int i_count, int i_size);
 static void test_random_random(int i_count, int i_size);
 static void test_worst(int i_count, int i_size);
+static void test_threads_random(int i_count, int i_size);
+static void test_threads_handoff(int i_count, int i_size);
 
 /*--------------------------------------------------------------------*/
 
@@ -55,7 +75,8 @@ static void test_worst(int i_count, int i_size);
 static char *apc_test_name[] =
 {
    "LIFO_fixed", "FIFO_fixed", "LIFO_random", "FIFO_random",
-   "random_fixed", "random_random", "worst"
+   "random_fixed", "random_random", "worst",
+   "threads_random", "threads_handoff"
 };
 
 /*--------------------------------------------------------------------*/
@@ -68,7 +89,8 @@ typedef void (*test_function)(int, int);
 static test_function apf_test_function[] =
 {
    test_LIFO_fixed, test_FIFO_fixed, test_LIFO_random, test_FIFO_random,
-   test_random_fixed, test_random_random, test_worst
+   test_random_fixed, test_random_random, test_worst,
+   test_threads_random, test_threads_handoff
 };
 
 /*--------------------------------------------------------------------*/
@@ -84,18 +106,31 @@ int main(int argc, char *argv[])
       FIFO_random: FIFO with random size chunks,
       random_fixed: random order with fixed size chunks,
       random_random: random order with random size chunks,
-      worst: worst case for single linked list implementation.
+      worst: worst case for single linked list implementation,
+      threads_random: random_random in each of several threads,
+      threads_handoff: each of several threads frees the chunks that
+         another one allocated.
 
    argv[2] is the number of calls of heapmgr_malloc() and heapmgr_free()
-   to execute.  argv[2] cannot be greater than MAX_CALLS.
+   to execute.  argv[2] cannot be greater than MAX_CALLS.  The threads_
+   tests share the calls among their threads.
 
    argv[3] is the (maximum) size of each memory chunk.
 
+   argv[4], which is optional, is the number of threads of the
+   threads_ tests.  It is 1 by default and cannot be greater than
+   MAX_THREADS.  The threads_ tests need a thread-safe heapmgr.
+
    If the NDEBUG macro is not defined, then initialize and check
    the contents of each memory chunk.
 
    At the end of the process, write the heap memory and CPU time
-   consumed to stdout, and return 0. */
+   consumed to stdout, and return 0.  The threads_ tests write the
+   elapsed wall time instead, which shows how they scale with the
+   number of threads, and the heap memory counts the program break
+   only.  A heap manager that provides heapmgr_stats() also gets the
+   most memory it held at once, which counts what it got from mmap()
+   too; the others get a "-" in that column. */
 
 {
    int i_test_num = 0;
@@ -106,7 +141,9 @@ int main(int argc, char *argv[])
    char *pc_initial_break;
    char *pc_final_break;
    long long i_memory_consumed;
+   struct HeapMgrStats s_stats;
    double d_time_consumed;
+   double d_initial_wall_time;
 
    srand((unsigned int)time(NULL));
 
@@ -119,6 +156,7 @@ int main(int argc, char *argv[])
 
    /* Save the initial clock and program break. */
    i_initial_clock = clock();
+   d_initial_wall_time = get_wall_time();
    pc_initial_break = sbrk(0);
 
    /* Set the process's CPU time limit. */
@@ -136,9 +174,18 @@ int main(int argc, char *argv[])
    i_memory_consumed = (long long)(pc_final_break - pc_initial_break);
    d_time_consumed =
       ((double)(i_final_clock - i_initial_clock)) / CLOCKS_PER_SEC;
+   if (strncmp(argv[1], "threads_", 8) == 0)
+      d_time_consumed = get_wall_time() - d_initial_wall_time;
 
    /* Finish printing the results. */
-   printf("%6.2f %10lld\n", d_time_consumed, i_memory_consumed);
+   printf("%6.2f %10lld", d_time_consumed, i_memory_consumed);
+   if (heapmgr_stats != NULL)
+   {
+      heapmgr_stats(&s_stats);
+      printf(" %10zu\n", s_stats.ui_peak);
+   }
+   else
+      printf(" %10s\n", "-");
    return 0;
 }
 
@@ -155,9 +202,9 @@ static void get_args(int argc, char *argv[],
    int i;
    int i_test_count;
 
-   if (argc != 4)
+   if (argc != 4 && argc != 5)
    {
-      fprintf(stderr, "Usage: %s testname count size\n", argv[0]);
+      fprintf(stderr, "Usage: %s testname count size [threads]\n", argv[0]);
       exit(EXIT_FAILURE);
    }
 
@@ -171,7 +218,7 @@ static void get_args(int argc, char *argv[],
       }
    if (i == i_test_count)
    {
-      fprintf(stderr, "Usage: %s testname count size\n", argv[0]);
+      fprintf(stderr, "Usage: %s testname count size [threads]\n", argv[0]);
       fprintf(stderr, "Valid testnames:\n");
       for (i = 0; i < i_test_count; i++)
          fprintf(stderr, " %s", apc_test_name[i]);
@@ -182,19 +229,19 @@ static void get_args(int argc, char *argv[],
    /* Get the count. */
    if (sscanf(argv[2], "%d", pi_count) != 1)
    {
-      fprintf(stderr, "Usage: %s testname count size\n", argv[0]);
+      fprintf(stderr, "Usage: %s testname count size [threads]\n", argv[0]);
       fprintf(stderr, "Count must be numeric\n");
       exit(EXIT_FAILURE);
    }
    if (*pi_count <= 0)
    {
-      fprintf(stderr, "Usage: %s testname count size\n", argv[0]);
+      fprintf(stderr, "Usage: %s testname count size [threads]\n", argv[0]);
       fprintf(stderr, "Count must be positive\n");
       exit(EXIT_FAILURE);
    }
    if (*pi_count > MAX_CALLS)
    {
-      fprintf(stderr, "Usage: %s testname count size\n", argv[0]);
+      fprintf(stderr, "Usage: %s testname count size [threads]\n", argv[0]);
       fprintf(stderr, "Count cannot be greater than %d\n", MAX_CALLS);
       exit(EXIT_FAILURE);
    }
@@ -202,16 +249,41 @@ static void get_args(int argc, char *argv[],
    /* Get the size. */
    if (sscanf(argv[3], "%d", pi_size) != 1)
    {
-      fprintf(stderr, "Usage: %s testname count size\n", argv[0]);
+      fprintf(stderr, "Usage: %s testname count size [threads]\n", argv[0]);
       fprintf(stderr, "Size must be numeric\n");
       exit(EXIT_FAILURE);
    }
    if (*pi_size <= 0)
    {
-      fprintf(stderr, "Usage: %s testname count size\n", argv[0]);
+      fprintf(stderr, "Usage: %s testname count size [threads]\n", argv[0]);
       fprintf(stderr, "Size must be positive\n");
       exit(EXIT_FAILURE);
    }
+
+   /* Get the number of threads. */
+   if (argc == 5)
+   {
+      if (sscanf(argv[4], "%d", &i_thread_count) != 1 ||
+          i_thread_count <= 0 || i_thread_count > MAX_THREADS)
+      {
+         fprintf(stderr, "Usage: %s testname count size [threads]\n",
+            argv[0]);
+         fprintf(stderr, "Threads must be from 1 to %d\n", MAX_THREADS);
+         exit(EXIT_FAILURE);
+      }
+   }
+}
+
+/*--------------------------------------------------------------------*/
+
+static double get_wall_time(void)
+
+/* Return the time of day in seconds. */
+
+{
+   struct timeval s_time;
+   gettimeofday(&s_time, NULL);
+   return (double)s_time.tv_sec + (double)s_time.tv_usec / 1000000.0;
 }
 
 /*--------------------------------------------------------------------*/
@@ -688,4 +760,164 @@ static void test_worst(int i_count, int i_size)
    /* Free all chunks. */
    for (i = 0; i < i_count; i++)
       heapmgr_free(apc_chunks[i]);
-}
\ No newline at end of file
+}
+
+/*--------------------------------------------------------------------*/
+
+static void run_threads(void *(*pf_thread)(void *))
+
+/* Run pf_thread in i_thread_count threads, passing each its number,
+   and wait for all of them. */
+
+{
+   pthread_t at_threads[MAX_THREADS];
+   long i;
+
+   pthread_barrier_init(&s_barrier, NULL, (unsigned)i_thread_count);
+   for (i = 0; i < i_thread_count; i++)
+      if (pthread_create(&at_threads[i], NULL, pf_thread, (void*)i) != 0)
+      {
+         fprintf(stderr, "Cannot create thread %ld\n", i);
+         exit(EXIT_FAILURE);
+      }
+   for (i = 0; i < i_thread_count; i++)
+      pthread_join(at_threads[i], NULL);
+   pthread_barrier_destroy(&s_barrier);
+}
+
+/*--------------------------------------------------------------------*/
+
+/* The count and size of the running threads_ test. */
+static int i_thread_calls;
+static int i_thread_size;
+
+static void *thread_random(void *pv_thread)
+
+/* Allocate and free i_thread_calls memory chunks, each of some random
+   size less than i_thread_size, in a random order, within the slice of
+   thread number pv_thread. */
+
+{
+   int i_thread = (int)(long)pv_thread;
+   char **ppc_chunks = apc_chunks + i_thread * (MAX_CALLS / i_thread_count);
+   int *pi_sizes = ai_sizes + i_thread * (MAX_CALLS / i_thread_count);
+   unsigned int ui_seed = (unsigned int)rand() + (unsigned int)i_thread;
+   int i;
+   int i_rand;
+   int i_logical_array_size;
+
+   i_logical_array_size = (i_thread_calls / 3) + 1;
+   for (i = 0; i < i_logical_array_size; i++)
+      pi_sizes[i] = (rand_r(&ui_seed) % i_thread_size) + 1;
+
+   i_rand = 0;
+   for (i = 0; i < i_thread_calls; i++)
+   {
+      ppc_chunks[i_rand] = (char*)heapmgr_malloc((size_t)pi_sizes[i_rand]);
+      ASSURE(ppc_chunks[i_rand] != NULL);
+
+      #ifndef NDEBUG
+      memset(ppc_chunks[i_rand], (i_rand % 10) + '0',
+         (size_t)pi_sizes[i_rand]);
+      #endif
+
+      i_rand = rand_r(&ui_seed) % i_logical_array_size;
+      if (ppc_chunks[i_rand] != NULL)
+      {
+         #ifndef NDEBUG
+         {
+            int i_col;
+            char c = (char)((i_rand % 10) + '0');
+            for (i_col = 0; i_col < pi_sizes[i_rand]; i_col++)
+               ASSURE(ppc_chunks[i_rand][i_col] == c);
+         }
+         #endif
+
+         heapmgr_free(ppc_chunks[i_rand]);
+         ppc_chunks[i_rand] = NULL;
+      }
+   }
+
+   for (i = 0; i < i_logical_array_size; i++)
+   {
+      if (ppc_chunks[i] != NULL)
+      {
+         heapmgr_free(ppc_chunks[i]);
+         ppc_chunks[i] = NULL;
+      }
+   }
+   return NULL;
+}
+
+/*--------------------------------------------------------------------*/
+
+static void test_threads_random(int i_count, int i_size)
+
+/* Run the random_random pattern in each of i_thread_count threads,
+   which share the i_count calls. */
+
+{
+   i_thread_calls = i_count / i_thread_count;
+   i_thread_size = i_size;
+   run_threads(thread_random);
+}
+
+/*--------------------------------------------------------------------*/
+
+/* The number of chunks that a thread of threads_handoff allocates
+   before it hands them over. */
+enum {HANDOFF_BATCH = 1000};
+
+static void *thread_handoff(void *pv_thread)
+
+/* In rounds, allocate a batch of chunks of random sizes up to
+   i_thread_size into the slice of thread number pv_thread, then free
+   the batch that the previous thread allocated, so that most chunks
+   are freed by a thread other than the one that allocated them. */
+
+{
+   int i_thread = (int)(long)pv_thread;
+   int i_slice = MAX_CALLS / i_thread_count;
+   int i_batch = (i_slice < HANDOFF_BATCH) ? i_slice : HANDOFF_BATCH;
+   char **ppc_mine = apc_chunks + i_thread * i_slice;
+   char **ppc_theirs = apc_chunks +
+      ((i_thread + i_thread_count - 1) % i_thread_count) * i_slice;
+   unsigned int ui_seed = (unsigned int)rand() + (unsigned int)i_thread;
+   int i_round;
+   int i;
+
+   for (i_round = 0; i_round < i_thread_calls / (2 * i_batch); i_round++)
+   {
+      for (i = 0; i < i_batch; i++)
+      {
+         size_t ui_size = (size_t)(rand_r(&ui_seed) % i_thread_size) + 1;
+         ppc_mine[i] = (char*)heapmgr_malloc(ui_size);
+         ASSURE(ppc_mine[i] != NULL);
+         ppc_mine[i][0] = (char)i;
+      }
+
+      pthread_barrier_wait(&s_barrier);
+
+      for (i = 0; i < i_batch; i++)
+      {
+         ASSURE(ppc_theirs[i][0] == (char)i);
+         heapmgr_free(ppc_theirs[i]);
+      }
+
+      pthread_barrier_wait(&s_barrier);
+   }
+   return NULL;
+}
+
+/*--------------------------------------------------------------------*/
+
+static void test_threads_handoff(int i_count, int i_size)
+
+/* Run thread_handoff in each of i_thread_count threads, which share
+   the i_count calls. */
+
+{
+   i_thread_calls = i_count / i_thread_count;
+   i_thread_size = i_size;
+   run_threads(thread_handoff);
+}
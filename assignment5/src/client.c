@@ -13,6 +13,8 @@
 #include <netdb.h>
 #include <getopt.h>
 #include <errno.h>
+#include <stddef.h>
+#include <sys/un.h>
 #include "common.h"
 /*---------------------------------------------------------------------------*/
 int main(int argc, char *argv[])
@@ -20,6 +22,7 @@ int main(int argc, char *argv[])
     char *ip = DEFAULT_LOOPBACK_IP;
     int port = DEFAULT_PORT;
     int interactive = 0; /* Default is non-interactive mode */
+    char *unix_path = NULL;
     int opt;
 
 /*---------------------------------------------------------------------------*/
@@ -29,7 +32,7 @@ int main(int argc, char *argv[])
 /*---------------------------------------------------------------------------*/
 
     /* parse command line options */
-    while ((opt = getopt(argc, argv, "i:p:th")) != -1)
+    while ((opt = getopt(argc, argv, "i:p:u:th")) != -1)
     {
         switch (opt)
         {
@@ -44,13 +47,16 @@ int main(int argc, char *argv[])
                 exit(EXIT_FAILURE);
             }
             break;
+        case 'u':
+            unix_path = optarg;
+            break;
         case 't':
             interactive = 1;
             break;
         case 'h':
         default:
             printf("Usage: %s [-i server_ip_or_domain (%s)] "
-                   "[-p port (%d)] [-t]\n",
+                   "[-p port (%d)] [-u unix_socket_path] [-t]\n",
                    argv[0],
                    DEFAULT_LOOPBACK_IP, 
                    DEFAULT_PORT);
@@ -60,6 +66,34 @@ int main(int argc, char *argv[])
 
 /*---------------------------------------------------------------------------*/
     /* edit here */
+    if (unix_path) {
+        struct sockaddr_un uaddr;
+        socklen_t addrlen;
+        size_t plen = strlen(unix_path);
+
+        if (plen == 0 || plen >= sizeof(uaddr.sun_path)) {
+            fprintf(stderr, "Invalid unix socket path: %s\n", unix_path);
+            exit(EXIT_FAILURE);
+        }
+        if ((s = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+            perror("socket() failed");
+            return -1;
+        }
+        memset(&uaddr, 0, sizeof(uaddr));
+        uaddr.sun_family = AF_UNIX;
+        memcpy(uaddr.sun_path, unix_path, plen);
+        addrlen = offsetof(struct sockaddr_un, sun_path) + plen;
+        if (unix_path[0] == '@')
+            uaddr.sun_path[0] = '\0'; /* abstract namespace */
+        else
+            addrlen++;
+        if (connect(s, (struct sockaddr *)&uaddr, addrlen) < 0) {
+            fprintf(stderr, "Could not connect to %s\n", unix_path);
+            exit(EXIT_FAILURE);
+        }
+        goto connected;
+    }
+
     /* create a socket for connection */
     if ((s = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP)) < 0) {
         perror("socket() failed");
@@ -92,8 +126,12 @@ int main(int argc, char *argv[])
         exit(EXIT_FAILURE);
     }
 
+connected:
     if(interactive){
-        printf("Connected to %s:%d\n", ip, port);
+        if (unix_path)
+            printf("Connected to unix:%s\n", unix_path);
+        else
+            printf("Connected to %s:%d\n", ip, port);
         while (1){
             printf("Enter command: ");
             fgets(buffer, sizeof(buffer), stdin);
@@ -0,0 +1,250 @@
+/*---------------------------------------------------------------------------*/
+/* clientbench.c                                                             */
+/* Author: Kim Sungjin                                                       */
+/*---------------------------------------------------------------------------*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <getopt.h>
+#include <time.h>
+#include "skvsclient.h"
+/*---------------------------------------------------------------------------*/
+#define DEFAULT_REQUESTS 100000
+#define DEFAULT_DEPTH 32
+#define DEFAULT_KEYS 1000
+#define DEFAULT_READ_RATIO 90
+/*---------------------------------------------------------------------------*/
+struct bench
+{
+    struct skvs_client *cli;
+    long requests;
+    int depth;
+    int keys;
+    int read_ratio;
+    unsigned int seed;
+
+    long done;   // completed requests
+    long errors; // failed requests
+};
+/*---------------------------------------------------------------------------*/
+static double now_sec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+/*---------------------------------------------------------------------------*/
+static int make_request(struct bench *b, unsigned int *seed, char *req,
+                        size_t size)
+{
+    int key = rand_r(seed) % b->keys;
+
+    if ((int)(rand_r(seed) % 100) < b->read_ratio)
+    {
+        return snprintf(req, size, "READ key%d", key);
+    }
+    return snprintf(req, size, "UPDATE key%d value%d", key, rand_r(seed));
+}
+/*---------------------------------------------------------------------------*/
+static void bench_done(void *arg, long id, int status,
+                       const char *resp, size_t len)
+{
+    struct bench *b = arg;
+
+    b->done++;
+    if (status != SKVS_OK)
+    {
+        b->errors++;
+    }
+}
+/*---------------------------------------------------------------------------*/
+/* keeps depth requests in flight from a single thread */
+static void run_pipelined(struct bench *b)
+{
+    char req[BUFFER_SIZE];
+    long sent = 0;
+    int len;
+
+    while (b->done < b->requests)
+    {
+        while (sent < b->requests && sent - b->done < b->depth)
+        {
+            len = make_request(b, &b->seed, req, sizeof(req));
+            if (skvs_client_submit(b->cli, req, len, bench_done, b) < 0)
+            {
+                fprintf(stderr, "submit failed\n");
+                return;
+            }
+            sent++;
+        }
+        if (skvs_client_poll(b->cli, TIMEOUT * 1000) < 0)
+        {
+            fprintf(stderr, "poll failed\n");
+            return;
+        }
+    }
+}
+/*---------------------------------------------------------------------------*/
+struct worker
+{
+    pthread_t tid;
+    struct bench *b;
+    long requests;
+    unsigned int seed;
+    long errors;
+};
+/*---------------------------------------------------------------------------*/
+/* blocking calls from many threads sharing the connection pool */
+static void *run_worker(void *arg)
+{
+    struct worker *w = arg;
+    char req[BUFFER_SIZE], resp[BUFFER_SIZE + 1];
+    long i;
+
+    for (i = 0; i < w->requests; i++)
+    {
+        make_request(w->b, &w->seed, req, sizeof(req));
+        if (skvs_client_call(w->b->cli, req, resp, sizeof(resp)) < 0)
+        {
+            w->errors++;
+        }
+    }
+
+    return NULL;
+}
+/*---------------------------------------------------------------------------*/
+int main(int argc, char *argv[])
+{
+    struct bench b;
+    struct skvs_client_stats st;
+    struct worker *workers;
+    char *ip = DEFAULT_LOOPBACK_IP, *unix_path = NULL;
+    char req[BUFFER_SIZE], resp[BUFFER_SIZE + 1];
+    int port = DEFAULT_PORT, conns = SKVS_CLIENT_POOL_SIZE, threads = 0;
+    int opt, i;
+    double start, elapsed;
+
+    memset(&b, 0, sizeof(b));
+    b.requests = DEFAULT_REQUESTS;
+    b.depth = DEFAULT_DEPTH;
+    b.keys = DEFAULT_KEYS;
+    b.read_ratio = DEFAULT_READ_RATIO;
+    b.seed = 1;
+
+    while ((opt = getopt(argc, argv, "i:p:u:c:t:n:d:k:r:h")) != -1)
+    {
+        switch (opt)
+        {
+        case 'i':
+            ip = optarg;
+            break;
+        case 'p':
+            port = atoi(optarg);
+            break;
+        case 'u':
+            unix_path = optarg;
+            break;
+        case 'c':
+            conns = atoi(optarg);
+            break;
+        case 't':
+            threads = atoi(optarg);
+            break;
+        case 'n':
+            b.requests = atol(optarg);
+            break;
+        case 'd':
+            b.depth = atoi(optarg);
+            break;
+        case 'k':
+            b.keys = atoi(optarg);
+            break;
+        case 'r':
+            b.read_ratio = atoi(optarg);
+            break;
+        case 'h':
+        default:
+            printf("Usage: %s [-i server_ip (%s)] [-p port (%d)] "
+                   "[-u unix_socket_path] "
+                   "[-c connections (%d)] [-t threads (0: pipelined)] "
+                   "[-n requests (%d)] [-d depth (%d)] [-k keys (%d)] "
+                   "[-r read_percent (%d)]\n",
+                   argv[0], DEFAULT_LOOPBACK_IP, DEFAULT_PORT,
+                   SKVS_CLIENT_POOL_SIZE, DEFAULT_REQUESTS, DEFAULT_DEPTH,
+                   DEFAULT_KEYS, DEFAULT_READ_RATIO);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (b.keys <= 0 || b.depth <= 0 || b.requests <= 0)
+    {
+        fprintf(stderr, "Invalid benchmark parameters\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (unix_path)
+    {
+        b.cli = skvs_client_create_unix(unix_path, conns);
+    }
+    else
+    {
+        b.cli = skvs_client_create(ip, port, conns);
+    }
+    if (b.cli == NULL)
+    {
+        fprintf(stderr, "Could not connect to %s\n",
+                unix_path ? unix_path : ip);
+        exit(EXIT_FAILURE);
+    }
+
+    /* populate the key space; COLLISION is fine on reruns */
+    for (i = 0; i < b.keys; i++)
+    {
+        snprintf(req, sizeof(req), "CREATE key%d value%d", i, i);
+        if (skvs_client_call(b.cli, req, resp, sizeof(resp)) < 0)
+        {
+            fprintf(stderr, "Failed to populate keys\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    start = now_sec();
+    if (threads <= 0)
+    {
+        run_pipelined(&b);
+    }
+    else
+    {
+        workers = calloc(threads, sizeof(struct worker));
+        for (i = 0; i < threads; i++)
+        {
+            workers[i].b = &b;
+            workers[i].requests = b.requests / threads;
+            workers[i].seed = i + 1;
+            pthread_create(&workers[i].tid, NULL, run_worker, &workers[i]);
+        }
+        for (i = 0; i < threads; i++)
+        {
+            pthread_join(workers[i].tid, NULL);
+            b.done += workers[i].requests;
+            b.errors += workers[i].errors;
+        }
+        free(workers);
+    }
+    elapsed = now_sec() - start;
+
+    skvs_client_get_stats(b.cli, &st);
+    printf("requests: %ld, errors: %ld, elapsed: %.3f s, %.0f ops/sec\n",
+           b.done, b.errors, elapsed, b.done / elapsed);
+    printf("client: %.0f ns/op in library, %.0f ns/op waiting, "
+           "%.2f requests/write, %.2f requests/flush\n",
+           (double)st.lib_ns / st.submitted,
+           (double)st.wait_ns / st.submitted,
+           st.write_calls ? (double)st.submitted / st.write_calls : 0.0,
+           st.flushes ? (double)st.submitted / st.flushes : 0.0);
+
+    skvs_client_destroy(b.cli);
+    return 0;
+}
@@ -9,6 +9,7 @@
 /*---------------------------------------------------------------------------*/
 #define MAX_KEY_LEN 32
 #define BUFFER_SIZE 4096
+#define MAX_BULK_LEN (8 * 1024 * 1024) // largest "$<len>" bulk value
 #define DEFAULT_PORT 8080
 #define DEFAULT_LOOPBACK_IP "127.0.0.1"
 #define DEFAULT_ANY_IP "0.0.0.0"
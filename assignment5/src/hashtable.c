@@ -3,112 +3,430 @@
 /* Author: Junghan Yoon, KyoungSoo Park                                      */
 /* Modified by: Kim Sungjin                                                  */
 /*---------------------------------------------------------------------------*/
+#include <stdarg.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sched.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include "hashtable.h"
+#include "lz4.h"
 /*---------------------------------------------------------------------------*/
 int hash(const char *key, size_t hash_size)
 {
     TRACE_PRINT();
-    unsigned int hash = 0;
-    while (*key)
+
+    return hash_key(key, strlen(key)) % hash_size;
+}
+/*---------------------------------------------------------------------------*/
+uint64_t hash_key(const char *key, size_t len)
+{
+    uint64_t h = len * 0x9E3779B97F4A7C15ULL, w;
+    size_t i;
+
+    /* 8 bytes per multiply; the tail is zero-padded */
+    for (i = 0; i < len; i += sizeof(w))
+    {
+        w = 0;
+        memcpy(&w, key + i, len - i < sizeof(w) ? len - i : sizeof(w));
+        h = (h ^ w) * 0xFF51AFD7ED558CCDULL;
+        h ^= h >> 32;
+    }
+    h ^= h >> 29;
+    h *= 0xC4CEB9FE1A85EC53ULL;
+    h ^= h >> 32;
+    return h;
+}
+/*---------------------------------------------------------------------------*/
+/* a key being looked up, in the form nodes keep it */
+typedef struct hash_lookup_t
+{
+    uint64_t hash;
+    size_t len;
+    _Alignas(16) char key[HASH_KEY_WIDTH + 1];
+} hash_lookup_t;
+/*---------------------------------------------------------------------------*/
+/* prepares the lookup of key.
+ * returns -1 when key is too long to ever be stored, 0 otherwise. */
+static inline int hash_lookup_init(hash_lookup_t *k, const char *key)
+{
+    k->len = strnlen(key, MAX_KEY_LEN + 1);
+    if (k->len > MAX_KEY_LEN)
+    {
+        return -1;
+    }
+    memset(k->key, 0, sizeof(k->key));
+    memcpy(k->key, key, k->len);
+    k->hash = hash_key(key, k->len);
+    return 0;
+}
+/*---------------------------------------------------------------------------*/
+/* returns 1 when node holds the key of k. the hash and the length turn
+ * away almost every other node before a key byte is loaded. */
+static inline int hash_key_eq(const node_t *node, const hash_lookup_t *k)
+{
+    if (node->hash != k->hash || node->key_size != k->len)
     {
-        hash = (hash << 5) + *key++;
+        return 0;
     }
+#ifdef __SSE2__
+    __m128i lo, hi;
 
-    return hash % hash_size;
+    lo = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)node->key),
+                        _mm_loadu_si128((const __m128i *)k->key));
+    hi = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(node->key + 16)),
+                        _mm_loadu_si128((const __m128i *)(k->key + 16)));
+    return _mm_movemask_epi8(_mm_and_si128(lo, hi)) == 0xFFFF;
+#else
+    return memcmp(node->key, k->key, HASH_KEY_WIDTH) == 0;
+#endif
 }
 /*---------------------------------------------------------------------------*/
-hashtable_t *hash_init(size_t hash_size, int delay)
+/* must be called with the bucket write lock held, after the bucket is
+ * modified, so that a cached copy validated against the new version is
+ * never older than the bucket */
+static inline void bump_version(hash_gen_t *gen, size_t index)
 {
-    TRACE_PRINT();
-    int i, j, ret;
-    hashtable_t *table = malloc(sizeof(hashtable_t));
+    __atomic_add_fetch(&gen->versions[index], 1, __ATOMIC_RELEASE);
+}
+/*---------------------------------------------------------------------------*/
+/* counter stripe of the calling thread, picked on its first operation */
+static __thread int t_stripe = -1;
+static unsigned int g_next_stripe;
+/*---------------------------------------------------------------------------*/
+/* registers an operation in flight and returns the generation it starts
+ * in, which stays allocated until hash_leave(ticket). the counter is
+ * raised before the generation is loaded, so a resize that finds it
+ * zero after replacing the generation knows that later operations see
+ * the new one. when the epoch moved before the counter was raised, a
+ * resize may already be waiting on the other parity only, so the
+ * ticket is dropped and taken again in the current epoch. */
+static inline hash_gen_t *hash_enter(hashtable_t *table,
+                                     unsigned long **ticket)
+{
+    unsigned long epoch = __atomic_load_n(&table->epoch, __ATOMIC_ACQUIRE);
+    unsigned long now;
 
-    if (table == NULL)
+    if (t_stripe < 0)
     {
-        DEBUG_PRINT("Failed to allocate memory for hash table");
+        t_stripe = __atomic_fetch_add(&g_next_stripe, 1, __ATOMIC_RELAXED) %
+                   HASH_STRIPES;
+    }
+    for (;;)
+    {
+        *ticket = &table->active[t_stripe].count[epoch & 1];
+        __atomic_add_fetch(*ticket, 1, __ATOMIC_SEQ_CST);
+        now = __atomic_load_n(&table->epoch, __ATOMIC_SEQ_CST);
+        if (now == epoch)
+        {
+            break;
+        }
+        __atomic_sub_fetch(*ticket, 1, __ATOMIC_RELEASE);
+        epoch = now;
+    }
+    return __atomic_load_n(&table->gen, __ATOMIC_SEQ_CST);
+}
+/*---------------------------------------------------------------------------*/
+static inline void hash_leave(unsigned long *ticket)
+{
+    __atomic_sub_fetch(ticket, 1, __ATOMIC_RELEASE);
+}
+/*---------------------------------------------------------------------------*/
+/* a locked bucket, see hash_lock() */
+typedef struct hash_bucket_t
+{
+    hash_gen_t *gen;
+    size_t index;
+    int write;
+    unsigned long *ticket; // from hash_enter()
+} hash_bucket_t;
+/*---------------------------------------------------------------------------*/
+/* enters table and locks the bucket of k for reading or writing. when a
+ * resize has already moved the bucket, its lock is dropped for the one
+ * of the key in the next generation; a moved bucket is never written
+ * again, so nothing can change in between. */
+static void hash_lock(hashtable_t *table, const hash_lookup_t *k, int write,
+                      hash_bucket_t *b)
+{
+    hash_gen_t *gen = hash_enter(table, &b->ticket);
+    size_t index;
+
+    for (;;)
+    {
+        index = k->hash % gen->hash_size;
+        if (write)
+        {
+            rwlock_write_lock(&gen->locks[index]);
+        }
+        else
+        {
+            rwlock_read_lock(&gen->locks[index]);
+        }
+        if (!gen->moved[index])
+        {
+            break;
+        }
+        if (write)
+        {
+            rwlock_write_unlock(&gen->locks[index]);
+        }
+        else
+        {
+            rwlock_read_unlock(&gen->locks[index]);
+        }
+        gen = gen->next;
+    }
+    b->gen = gen;
+    b->index = index;
+    b->write = write;
+}
+/*---------------------------------------------------------------------------*/
+static void hash_unlock(hash_bucket_t *b)
+{
+    if (b->write)
+    {
+        rwlock_write_unlock(&b->gen->locks[b->index]);
+    }
+    else
+    {
+        rwlock_read_unlock(&b->gen->locks[b->index]);
+    }
+    hash_leave(b->ticket);
+}
+/*---------------------------------------------------------------------------*/
+hash_val_t *hash_val_alloc(size_t len)
+{
+    hash_val_t *val = malloc(sizeof(hash_val_t) + len + 1);
+
+    if (val == NULL)
+    {
+        DEBUG_PRINT("Failed to allocate memory for value");
         return NULL;
     }
+    val->refs = 1;
+    val->len = len;
+    val->raw_len = 0;
+    val->bulk = 0;
+    val->data[len] = '\0';
+    return val;
+}
+/*---------------------------------------------------------------------------*/
+void hash_val_get(hash_val_t *val)
+{
+    __atomic_add_fetch(&val->refs, 1, __ATOMIC_RELAXED);
+}
+/*---------------------------------------------------------------------------*/
+void hash_val_put(hash_val_t *val)
+{
+    if (__atomic_sub_fetch(&val->refs, 1, __ATOMIC_ACQ_REL) == 0)
+    {
+        free(val);
+    }
+}
+/*---------------------------------------------------------------------------*/
+/* copies a NUL-terminated value into a new hash_val_t */
+static hash_val_t *hash_val_dup(const char *value)
+{
+    size_t len = strlen(value);
+    hash_val_t *val = hash_val_alloc(len);
 
-    table->hash_size = hash_size;
-    table->total_entries = 0;
+    if (val != NULL)
+    {
+        memcpy(val->data, value, len);
+    }
+    return val;
+}
+/*---------------------------------------------------------------------------*/
+/* compresses val into a new value when compression is on for its size.
+ * returns NULL when val is better stored as it is. */
+static hash_val_t *hash_val_compress(hashtable_t *table, hash_val_t *val)
+{
+    hash_val_t *zval = NULL;
+    size_t cap, len;
+    char *tmp;
 
-    table->buckets = malloc(hash_size * sizeof(node_t *));
-    if (table->buckets == NULL)
+    if (table->compress_min == 0 || val->len < table->compress_min ||
+        val->raw_len)
     {
-        DEBUG_PRINT("Failed to allocate memory for hash table buckets");
-        free(table);
         return NULL;
     }
 
-    table->locks = malloc(hash_size * sizeof(rwlock_t));
-    if (table->locks == NULL)
+    /* keep it only when it saves at least an eighth */
+    cap = val->len - val->len / 8;
+    tmp = malloc(cap);
+    if (!tmp)
     {
-        DEBUG_PRINT("Failed to allocate memory for hash table locks");
-        free(table->buckets);
-        free(table);
         return NULL;
     }
+    len = lz4_compress(val->data, val->len, tmp, cap);
+    /* an exact-size copy keeps the heap free of shrunk blocks */
+    if (len > 0 && (zval = hash_val_alloc(len)) != NULL)
+    {
+        memcpy(zval->data, tmp, len);
+        zval->raw_len = val->len;
+        zval->bulk = val->bulk;
+    }
+    free(tmp);
+    return zval;
+}
+/*---------------------------------------------------------------------------*/
+hash_val_t *hash_val_inflate(hash_val_t *val)
+{
+    hash_val_t *raw;
 
-    table->bucket_sizes = malloc(hash_size * sizeof(*table->bucket_sizes));
-    if (table->bucket_sizes == NULL)
+    if (!val->raw_len)
+    {
+        hash_val_get(val);
+        return val;
+    }
+
+    raw = hash_val_alloc(val->raw_len);
+    if (!raw)
     {
-        DEBUG_PRINT("Failed to allocate memory for hash table bucket sizes");
-        free(table->buckets);
-        free(table->locks);
-        free(table);
+        return NULL;
+    }
+    if (lz4_decompress(val->data, val->len, raw->data, raw->len) !=
+        (long)raw->len)
+    {
+        DEBUG_PRINT("Corrupted compressed value");
+        hash_val_put(raw);
+        return NULL;
+    }
+    raw->bulk = val->bulk;
+    return raw;
+}
+/*---------------------------------------------------------------------------*/
+/* frees a generation and its locks; its buckets must be empty or their
+ * nodes owned elsewhere */
+static void hash_gen_free(hash_gen_t *gen)
+{
+    free(gen->buckets);
+    free(gen->locks);
+    free(gen->bucket_sizes);
+    free(gen->versions);
+    free(gen->moved);
+    free(gen);
+}
+/*---------------------------------------------------------------------------*/
+/* allocates a generation of hash_size empty buckets.
+ * returns NULL when any internal errors occur. */
+static hash_gen_t *hash_gen_create(size_t hash_size, int delay,
+                                   int max_writers, unsigned long id)
+{
+    hash_gen_t *gen = calloc(1, sizeof(hash_gen_t));
+    size_t i, j;
+
+    if (gen == NULL)
+    {
+        DEBUG_PRINT("Failed to allocate memory for hash table");
+        return NULL;
+    }
+    gen->hash_size = hash_size;
+    gen->id = id;
+
+    gen->buckets = calloc(hash_size, sizeof(node_t *));
+    /* zeroed so that rwlock_init() sees no stale writer_ring to free */
+    gen->locks = calloc(hash_size, sizeof(rwlock_t));
+    gen->bucket_sizes = calloc(hash_size, sizeof(*gen->bucket_sizes));
+    gen->versions = calloc(hash_size, sizeof(*gen->versions));
+    gen->moved = calloc(hash_size, sizeof(*gen->moved));
+    if (gen->buckets == NULL || gen->locks == NULL ||
+        gen->bucket_sizes == NULL || gen->versions == NULL ||
+        gen->moved == NULL)
+    {
+        DEBUG_PRINT("Failed to allocate memory for hash table buckets");
+        hash_gen_free(gen);
         return NULL;
     }
 
     for (i = 0; i < hash_size; i++)
     {
-        table->buckets[i] = NULL;
-        table->bucket_sizes[i] = 0;
-        ret = rwlock_init(&table->locks[i], delay);
-        if (ret != 0)
+        if (rwlock_init(&gen->locks[i], delay, max_writers) != 0)
         {
             DEBUG_PRINT("Failed to initialize read-write lock");
             for (j = 0; j < i; j++)
             {
-                rwlock_destroy(&table->locks[j]);
+                rwlock_destroy(&gen->locks[j]);
             }
-            free(table->buckets);
-            free(table->locks);
-            free(table->bucket_sizes);
-            free(table);
+            free(gen->locks[i].writer_ring);
+            hash_gen_free(gen);
             return NULL;
         }
     }
 
+    return gen;
+}
+/*---------------------------------------------------------------------------*/
+/* destroys the locks of a generation and frees it.
+ * returns -1 when a lock could not be destroyed, 0 otherwise. */
+static int hash_gen_destroy(hash_gen_t *gen)
+{
+    size_t i;
+    int ret = 0;
+
+    for (i = 0; i < gen->hash_size; i++)
+    {
+        if (rwlock_destroy(&gen->locks[i]) != 0)
+        {
+            DEBUG_PRINT("Failed to destroy read-write lock");
+            ret = -1;
+        }
+    }
+    hash_gen_free(gen);
+    return ret;
+}
+/*---------------------------------------------------------------------------*/
+hashtable_t *hash_init(size_t hash_size, int delay, int max_writers)
+{
+    TRACE_PRINT();
+    /* the counter stripes must not share cache lines with anything */
+    hashtable_t *table = aligned_alloc(_Alignof(hashtable_t),
+                                       sizeof(hashtable_t));
+
+    if (table == NULL)
+    {
+        DEBUG_PRINT("Failed to allocate memory for hash table");
+        return NULL;
+    }
+    memset(table, 0, sizeof(hashtable_t));
+    table->delay = delay;
+    table->max_writers = max_writers;
+
+    table->gen = hash_gen_create(hash_size, delay, max_writers, 1);
+    if (table->gen == NULL)
+    {
+        free(table);
+        return NULL;
+    }
+    pthread_rwlock_init(&table->resize_lock, NULL);
+
     return table;
 }
 /*---------------------------------------------------------------------------*/
 int hash_destroy(hashtable_t *table)
 {
     TRACE_PRINT();
+    hash_gen_t *gen = table->gen;
     node_t *node, *tmp;
-    int i;
+    size_t i;
 
-    for (i = 0; i < table->hash_size; i++)
+    for (i = 0; i < gen->hash_size; i++)
     {
-        node = table->buckets[i];
+        node = gen->buckets[i];
         while (node)
         {
             tmp = node;
             node = node->next;
-            free(tmp->key);
-            free(tmp->value);
+            hash_val_put(tmp->val);
             free(tmp);
         }
-        if (rwlock_destroy(&table->locks[i]) != 0)
-        {
-            DEBUG_PRINT("Failed to destroy read-write lock");
-            return -1;
-        }
     }
-
-    free(table->buckets);
-    free(table->locks);
-    free(table->bucket_sizes);
+    if (hash_gen_destroy(gen) < 0)
+    {
+        return -1;
+    }
+    pthread_rwlock_destroy(&table->resize_lock);
     free(table);
     
     return 0;
@@ -117,20 +435,44 @@ int hash_destroy(hashtable_t *table)
 int hash_insert(hashtable_t *table, const char *key, const char *value)
 {
     TRACE_PRINT();
-    node_t *node;
-    rwlock_t *lock;
-    unsigned int index = hash(key, table->hash_size);
+    hash_val_t *val;
+    int ret;
 
 /*---------------------------------------------------------------------------*/
     /* edit here */
-    lock = &table->locks[index];
-    rwlock_write_lock(lock);
-    node = table->buckets[index];
+    /* copy the value before taking the lock */
+    val = hash_val_dup(value);
+    if (!val)
+    {
+        return -1; // Memory allocation error
+    }
+    ret = hash_insert_val(table, key, val);
+    hash_val_put(val);
+/*---------------------------------------------------------------------------*/
+
+    return ret;
+}
+/*---------------------------------------------------------------------------*/
+/* links a new node holding val into its bucket */
+static int hash_insert_node(hashtable_t *table, const char *key,
+                            hash_val_t *val)
+{
+    node_t *node;
+    hash_bucket_t b;
+    hash_lookup_t k;
+
+    if (hash_lookup_init(&k, key) < 0)
+    {
+        DEBUG_PRINT("Key too long");
+        return -1;
+    }
+    hash_lock(table, &k, 1, &b);
+    node = b.gen->buckets[b.index];
     while (node)
     {
-        if (strcmp(node->key, key) == 0)
+        if (hash_key_eq(node, &k))
         {
-            rwlock_write_unlock(lock);
+            hash_unlock(&b);
             return 0; // Collision
         }
         node = node->next;
@@ -139,173 +481,807 @@ int hash_insert(hashtable_t *table, const char *key, const char *value)
     if (!new_node)
     {
         DEBUG_PRINT("Failed to allocate memory for new node");
-        rwlock_write_unlock(lock);
+        hash_unlock(&b);
         return -1; // Memory allocation error
     }
+    new_node->hash = k.hash;
+    new_node->key_size = k.len;
+    memcpy(new_node->key, k.key, sizeof(new_node->key));
+    hash_val_get(val);
+    new_node->val = val;
+    new_node->value = val->data;
+    new_node->value_size = val->len;
+    new_node->compressed = val->raw_len != 0;
+    new_node->next = b.gen->buckets[b.index];
+    b.gen->buckets[b.index] = new_node;
 
-    new_node->key = strdup(key);
-    new_node->key_size = strlen(key);
-    new_node->value = strdup(value);
-    new_node->value_size = strlen(value);
-    new_node->next = table->buckets[index];
-    table->buckets[index] = new_node;
-
-    table->bucket_sizes[index]++;
-    table->total_entries++;
+    b.gen->bucket_sizes[b.index]++;
+    /* shared by all buckets, so the bucket lock does not cover it */
+    __atomic_add_fetch(&table->total_entries, 1, __ATOMIC_RELAXED);
+    bump_version(b.gen, b.index);
+    if (table->on_write)
+    {
+        table->on_write(table->on_write_arg, HASH_WRITE_SET, key, val);
+    }
 
-    rwlock_write_unlock(lock);
-/*---------------------------------------------------------------------------*/
+    hash_unlock(&b);
 
     /* inserted */
     return 1;
 }
 /*---------------------------------------------------------------------------*/
+int hash_insert_val(hashtable_t *table, const char *key, hash_val_t *val)
+{
+    TRACE_PRINT();
+    hash_val_t *zval;
+    int ret;
+
+    /* compress before taking the lock */
+    zval = hash_val_compress(table, val);
+    ret = hash_insert_node(table, key, zval ? zval : val);
+    if (zval)
+    {
+        hash_val_put(zval);
+    }
+
+    return ret;
+}
+/*---------------------------------------------------------------------------*/
 int hash_search(hashtable_t *table, const char *key, const char **value)
 {
     TRACE_PRINT();
     node_t *node;
-    rwlock_t *lock;
-    unsigned int index = hash(key, table->hash_size);
+    hash_bucket_t b;
+    hash_lookup_t k;
+    int ret;
 
 /*---------------------------------------------------------------------------*/
     /* edit here */
-    lock = &table->locks[index];
-    rwlock_read_lock(lock);
+    if (hash_lookup_init(&k, key) < 0)
+    {
+        return 0; // too long to be stored
+    }
+    hash_lock(table, &k, 0, &b);
 
-    node = table->buckets[index];
+    node = b.gen->buckets[b.index];
     while (node)
     {
-        if (strcmp(node->key, key) == 0)
+        if (hash_key_eq(node, &k))
         {
             *value = node->value;
-            rwlock_read_unlock(lock);
-            return 1; // Successfully found
+            /* compressed bytes are no use to the caller */
+            ret = node->compressed ? HASH_FOUND_BULK : 1;
+            hash_unlock(&b);
+            return ret;
         }
         node = node->next;
     }
 
-    rwlock_read_unlock(lock);
+    hash_unlock(&b);
 /*---------------------------------------------------------------------------*/
 
     /* key not found */
     return 0;
 }
 /*---------------------------------------------------------------------------*/
-int hash_update(hashtable_t *table, const char *key, const char *value)
+int hash_search_val(hashtable_t *table, const char *key, hash_val_t **val)
 {
     TRACE_PRINT();
     node_t *node;
-    rwlock_t *lock;
-    char *new_value;
-    unsigned int index = hash(key, table->hash_size);
+    hash_bucket_t b;
+    hash_lookup_t k;
+
+    if (hash_lookup_init(&k, key) < 0)
+    {
+        return 0; // too long to be stored
+    }
+    hash_lock(table, &k, 0, &b);
+
+    for (node = b.gen->buckets[b.index]; node; node = node->next)
+    {
+        if (hash_key_eq(node, &k))
+        {
+            /* the reference outlives the lock */
+            hash_val_get(node->val);
+            *val = node->val;
+            hash_unlock(&b);
+            return 1; // Successfully found
+        }
+    }
+
+    hash_unlock(&b);
 
+    /* key not found */
+    return 0;
+}
 /*---------------------------------------------------------------------------*/
-    /* edit here */
-    lock = &table->locks[index];
+int hash_search_cached(hashtable_t *table, hash_cache_t *cache,
+                       const char *key, const char **value)
+{
+    TRACE_PRINT();
+    node_t *node;
+    hash_bucket_t b;
+    hash_gen_t *gen;
+    hash_cache_entry_t *entry;
+    unsigned long version, *ticket;
+    size_t raw_size, index;
+    char *copy;
+    hash_lookup_t k;
 
-    rwlock_write_lock(lock);
+    if (hash_lookup_init(&k, key) < 0)
+    {
+        return 0; // too long to be stored
+    }
 
-    node = table->buckets[index];
+    /* a resize bumps the version of every bucket it moves, so a copy
+     * validated against the bucket it was made from is still current */
+    gen = hash_enter(table, &ticket);
+    index = k.hash % gen->hash_size;
+    while (__atomic_load_n(&gen->moved[index], __ATOMIC_ACQUIRE))
+    {
+        gen = gen->next;
+        index = k.hash % gen->hash_size;
+    }
+    entry = &cache->entries[index & (HASH_CACHE_SIZE - 1)];
+    version = __atomic_load_n(&gen->versions[index], __ATOMIC_ACQUIRE);
+    if (entry->valid && entry->gen == gen->id && entry->index == index &&
+        entry->version == version && memcmp(entry->key, k.key, k.len + 1) == 0)
+    {
+        /* no write hit the bucket since the copy was made */
+        hash_leave(ticket);
+        __atomic_add_fetch(&cache->hits, 1, __ATOMIC_RELAXED);
+        *value = entry->value;
+        return 1;
+    }
+    hash_leave(ticket);
+    __atomic_add_fetch(&cache->misses, 1, __ATOMIC_RELAXED);
+
+    hash_lock(table, &k, 0, &b);
+    entry = &cache->entries[b.index & (HASH_CACHE_SIZE - 1)];
+
+    /* writers are excluded, so the version matches the bucket content */
+    version = __atomic_load_n(&b.gen->versions[b.index], __ATOMIC_RELAXED);
+    node = b.gen->buckets[b.index];
     while (node)
     {
-        if (strcmp(node->key, key) == 0)
+        if (hash_key_eq(node, &k))
         {
-            new_value = strdup(value);
-            if (!new_value)
+            if (node->val->bulk)
+            {
+                /* too large to be worth a private copy */
+                hash_unlock(&b);
+                return HASH_FOUND_BULK;
+            }
+            raw_size = node->compressed ? node->val->raw_len
+                                        : node->value_size;
+            if (entry->value_cap < raw_size + 1)
+            {
+                copy = realloc(entry->value, raw_size + 1);
+                if (!copy)
+                {
+                    DEBUG_PRINT("Failed to allocate memory for cached value");
+                    hash_unlock(&b);
+                    return -1;
+                }
+                entry->value = copy;
+                entry->value_cap = raw_size + 1;
+            }
+            if (!node->compressed)
             {
-                DEBUG_PRINT("Failed to allocate memory for updated value");
-                rwlock_write_unlock(lock);
-                return -1; // Memory allocation error
+                memcpy(entry->value, node->value, raw_size + 1);
             }
+            else if (lz4_decompress(node->value, node->value_size,
+                                    entry->value, raw_size) == (long)raw_size)
+            {
+                /* later reads are served from the inflated copy */
+                entry->value[raw_size] = '\0';
+            }
+            else
+            {
+                DEBUG_PRINT("Corrupted compressed value");
+                entry->valid = 0;
+                hash_unlock(&b);
+                return -1;
+            }
+            memcpy(entry->key, k.key, k.len + 1);
+            entry->gen = b.gen->id;
+            entry->index = b.index;
+            entry->version = version;
+            entry->valid = 1;
+
+            *value = entry->value;
+            hash_unlock(&b);
+            return 1; // Successfully found
+        }
+        node = node->next;
+    }
+
+    hash_unlock(&b);
+
+    /* key not found */
+    return 0;
+}
+/*---------------------------------------------------------------------------*/
+hash_cache_t *hash_cache_create(void)
+{
+    TRACE_PRINT();
+    return calloc(1, sizeof(hash_cache_t));
+}
+/*---------------------------------------------------------------------------*/
+void hash_cache_destroy(hash_cache_t *cache)
+{
+    TRACE_PRINT();
+    int i;
+
+    if (cache == NULL)
+    {
+        return;
+    }
+    for (i = 0; i < HASH_CACHE_SIZE; i++)
+    {
+        free(cache->entries[i].value);
+    }
+    free(cache);
+}
+/*---------------------------------------------------------------------------*/
+int hash_update(hashtable_t *table, const char *key, const char *value)
+{
+    TRACE_PRINT();
+    hash_val_t *val;
+    int ret;
+
+/*---------------------------------------------------------------------------*/
+    /* edit here */
+    /* copy the value before taking the lock */
+    val = hash_val_dup(value);
+    if (!val)
+    {
+        DEBUG_PRINT("Failed to allocate memory for updated value");
+        return -1; // Memory allocation error
+    }
+    ret = hash_update_val(table, key, val);
+    hash_val_put(val);
+/*---------------------------------------------------------------------------*/
+
+    return ret;
+}
+/*---------------------------------------------------------------------------*/
+/* makes the node of key hold val */
+static int hash_update_node(hashtable_t *table, const char *key,
+                            hash_val_t *val)
+{
+    node_t *node;
+    hash_bucket_t b;
+    hash_val_t *old;
+    hash_lookup_t k;
+
+    if (hash_lookup_init(&k, key) < 0)
+    {
+        return 0; // too long to be stored
+    }
+    hash_lock(table, &k, 1, &b);
 
-            free(node->value);
-            node->value = new_value;
-            node->value_size = strlen(value);
+    node = b.gen->buckets[b.index];
+    while (node)
+    {
+        if (hash_key_eq(node, &k))
+        {
+            old = node->val;
+            hash_val_get(val);
+            node->val = val;
+            node->value = val->data;
+            node->value_size = val->len;
+            node->compressed = val->raw_len != 0;
+            bump_version(b.gen, b.index);
+            if (table->on_write)
+            {
+                table->on_write(table->on_write_arg, HASH_WRITE_SET, key,
+                                val);
+            }
 
-            rwlock_write_unlock(lock);
+            hash_unlock(&b);
+            /* readers holding a reference keep the old value alive */
+            hash_val_put(old);
             return 1; // Successfully updated
         }
         node = node->next;
     }
 
-    rwlock_write_unlock(lock);
-/*---------------------------------------------------------------------------*/
+    hash_unlock(&b);
 
     /* key not found */
     return 0;
 }
 /*---------------------------------------------------------------------------*/
+int hash_update_val(hashtable_t *table, const char *key, hash_val_t *val)
+{
+    TRACE_PRINT();
+    hash_val_t *zval;
+    int ret;
+
+    /* compress before taking the lock */
+    zval = hash_val_compress(table, val);
+    ret = hash_update_node(table, key, zval ? zval : val);
+    if (zval)
+    {
+        hash_val_put(zval);
+    }
+
+    return ret;
+}
+/*---------------------------------------------------------------------------*/
 int hash_delete(hashtable_t *table, const char *key)
 {
     TRACE_PRINT();
     node_t *node, *prev;
-    rwlock_t *lock;
-    unsigned int index = hash(key, table->hash_size);
+    hash_bucket_t b;
+    hash_lookup_t k;
 
 /*---------------------------------------------------------------------------*/
     /* edit here */
-    lock = &table->locks[index];
-
-    rwlock_write_lock(lock);
+    if (hash_lookup_init(&k, key) < 0)
+    {
+        return 0; // too long to be stored
+    }
+    hash_lock(table, &k, 1, &b);
 
-    node = table->buckets[index];
+    node = b.gen->buckets[b.index];
     prev = NULL;
     while (node)
     {
-        if (strcmp(node->key, key) == 0)
+        if (hash_key_eq(node, &k))
         {
             if (prev)
                 prev->next = node->next;
             else
-                table->buckets[index] = node->next;
+                b.gen->buckets[b.index] = node->next;
 
-            free(node->key);
-            free(node->value);
+            hash_val_put(node->val);
             free(node);
 
-            table->bucket_sizes[index]--;
-            table->total_entries--;
+            b.gen->bucket_sizes[b.index]--;
+            __atomic_sub_fetch(&table->total_entries, 1, __ATOMIC_RELAXED);
+            bump_version(b.gen, b.index);
+            if (table->on_write)
+            {
+                table->on_write(table->on_write_arg, HASH_WRITE_DEL, key,
+                                NULL);
+            }
 
-            rwlock_write_unlock(lock);
+            hash_unlock(&b);
             return 1; // Successfully deleted
         }
         prev = node;
         node = node->next;
     }
 
-    rwlock_write_unlock(lock);
+    hash_unlock(&b);
 /*---------------------------------------------------------------------------*/
 
     /* key not found */
     return 0;
 }
 /*---------------------------------------------------------------------------*/
-/* function to dump the contents of the hash table, including locks status */
-void hash_dump(hashtable_t *table)
+void hash_set_write_hook(hashtable_t *table, hash_write_hook_t hook,
+                         void *arg)
+{
+    TRACE_PRINT();
+    table->on_write = hook;
+    table->on_write_arg = arg;
+}
+/*---------------------------------------------------------------------------*/
+void hash_set_compression(hashtable_t *table, size_t min_len)
+{
+    table->compress_min = min_len;
+}
+/*---------------------------------------------------------------------------*/
+size_t hash_scan_begin(hashtable_t *table)
 {
     TRACE_PRINT();
+    pthread_rwlock_rdlock(&table->resize_lock);
+    return table->gen->hash_size;
+}
+/*---------------------------------------------------------------------------*/
+void hash_scan_end(hashtable_t *table)
+{
+    TRACE_PRINT();
+    pthread_rwlock_unlock(&table->resize_lock);
+}
+/*---------------------------------------------------------------------------*/
+unsigned long hash_scan_generation(hashtable_t *table)
+{
+    return table->gen->id;
+}
+/*---------------------------------------------------------------------------*/
+int hash_scan_bucket(hashtable_t *table, size_t index, hash_scan_fn_t fn,
+                     void *arg)
+{
+    TRACE_PRINT();
+    /* no resize runs during a scan, so the generation is stable */
+    hash_gen_t *gen = table->gen;
     node_t *node;
-    int i;
-
-    printf("[Hash Table Dump]");
-    printf("Total Entries: %ld\n", table->total_entries);
+    int ret = 0;
 
-    for (i = 0; i < table->hash_size; i++)
+    rwlock_read_lock(&gen->locks[index]);
+    for (node = gen->buckets[index]; node; node = node->next)
     {
-        if (!table->bucket_sizes[i])
+        if (fn(arg, node->key, node->val) < 0)
         {
-            continue;
+            ret = -1;
+            break;
         }
-        printf("Bucket %d: %ld entries\n", i, table->bucket_sizes[i]);
-        printf("  Lock State -> Read Count: %d, Write Count: %d\n",
-               table->locks[i].read_count, table->locks[i].write_count);
-        node = table->buckets[i];
+    }
+    rwlock_read_unlock(&gen->locks[index]);
+
+    return ret;
+}
+/*---------------------------------------------------------------------------*/
+size_t hash_bucket_count(hashtable_t *table)
+{
+    unsigned long *ticket;
+    size_t hash_size = hash_enter(table, &ticket)->hash_size;
+
+    hash_leave(ticket);
+    return hash_size;
+}
+/*---------------------------------------------------------------------------*/
+void hash_clear(hashtable_t *table)
+{
+    TRACE_PRINT();
+    hash_gen_t *gen;
+    node_t *node, *tmp;
+    size_t hash_size, i;
+
+    hash_size = hash_scan_begin(table);
+    gen = table->gen;
+    for (i = 0; i < hash_size; i++)
+    {
+        rwlock_write_lock(&gen->locks[i]);
+        node = gen->buckets[i];
+        gen->buckets[i] = NULL;
+        __atomic_sub_fetch(&table->total_entries, gen->bucket_sizes[i],
+                           __ATOMIC_RELAXED);
+        gen->bucket_sizes[i] = 0;
+        bump_version(gen, i);
+        rwlock_write_unlock(&gen->locks[i]);
+
         while (node)
         {
-            printf("    Key:   %s\n"
-                   "    Value: %s\n", node->key, node->value);
+            tmp = node;
             node = node->next;
+            hash_val_put(tmp->val);
+            free(tmp);
+        }
+    }
+    hash_scan_end(table);
+}
+/*---------------------------------------------------------------------------*/
+/* waits until no operation that started in an epoch of the given parity
+ * is still in flight */
+static void hash_wait_idle(hashtable_t *table, int parity)
+{
+    unsigned long busy;
+    int i;
+
+    for (;;)
+    {
+        busy = 0;
+        for (i = 0; i < HASH_STRIPES; i++)
+        {
+            busy += __atomic_load_n(&table->active[i].count[parity],
+                                    __ATOMIC_SEQ_CST);
         }
+        if (busy == 0)
+        {
+            break;
+        }
+        sched_yield();
     }
-    printf("End of Dump\n");
-}
\ No newline at end of file
+}
+/*---------------------------------------------------------------------------*/
+int hash_resize(hashtable_t *table, size_t hash_size)
+{
+    TRACE_PRINT();
+    hash_gen_t *old, *gen;
+    node_t *node, *next;
+    size_t i, j;
+    int parity;
+
+    if (hash_size == 0)
+    {
+        return -1;
+    }
+    pthread_rwlock_wrlock(&table->resize_lock);
+    old = table->gen;
+    if (hash_size == old->hash_size)
+    {
+        pthread_rwlock_unlock(&table->resize_lock);
+        return 0;
+    }
+    gen = hash_gen_create(hash_size, table->delay, table->max_writers,
+                          old->id + 1);
+    if (gen == NULL)
+    {
+        pthread_rwlock_unlock(&table->resize_lock);
+        return -1;
+    }
+    /* operations find it through the first moved flag they see */
+    old->next = gen;
+
+    for (i = 0; i < old->hash_size; i++)
+    {
+        /* a bucket is moved as a whole under its write lock, so an
+         * operation sees its entries either all here or all there */
+        rwlock_write_lock(&old->locks[i]);
+        node = old->buckets[i];
+        old->buckets[i] = NULL;
+        old->bucket_sizes[i] = 0;
+        while (node)
+        {
+            next = node->next;
+            j = node->hash % hash_size;
+            rwlock_write_lock(&gen->locks[j]);
+            node->next = gen->buckets[j];
+            gen->buckets[j] = node;
+            gen->bucket_sizes[j]++;
+            bump_version(gen, j);
+            rwlock_write_unlock(&gen->locks[j]);
+            node = next;
+        }
+        __atomic_store_n(&old->moved[i], 1, __ATOMIC_RELEASE);
+        bump_version(old, i);
+        rwlock_write_unlock(&old->locks[i]);
+    }
+
+    /* operations from here on start in the new generation; the old one
+     * is freed once those that may have started in it are done */
+    __atomic_store_n(&table->gen, gen, __ATOMIC_SEQ_CST);
+    parity = __atomic_fetch_add(&table->epoch, 1, __ATOMIC_SEQ_CST) & 1;
+    hash_wait_idle(table, parity);
+    hash_gen_destroy(old);
+
+    pthread_rwlock_unlock(&table->resize_lock);
+    return 0;
+}
+/*---------------------------------------------------------------------------*/
+/* one entry of the bucket being dumped */
+struct hash_dump_entry
+{
+    char *key;
+    hash_val_t *val;
+};
+/*---------------------------------------------------------------------------*/
+/* state of hash_dump_fd() */
+struct hash_dump_out
+{
+    int fd;
+    int format;
+    size_t len;              // bytes in buf
+    char buf[HASH_DUMP_BUF_SIZE];
+    struct hash_dump_entry *ents; // current bucket
+    size_t nents;
+    size_t cap;
+};
+/*---------------------------------------------------------------------------*/
+static int dump_flush(struct hash_dump_out *out, const char *p, size_t n)
+{
+    ssize_t res;
+
+    while (n > 0)
+    {
+        res = write(out->fd, p, n);
+        if (res < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            perror("write");
+            return -1;
+        }
+        p += res;
+        n -= res;
+    }
+    return 0;
+}
+/*---------------------------------------------------------------------------*/
+/* buffers n bytes at p; data larger than the buffer is written directly.
+ * returns -1 on error, 0 on success. */
+static int dump_put(struct hash_dump_out *out, const void *p, size_t n)
+{
+    if (out->len + n > sizeof(out->buf))
+    {
+        if (dump_flush(out, out->buf, out->len) < 0)
+        {
+            return -1;
+        }
+        out->len = 0;
+        if (n > sizeof(out->buf))
+        {
+            return dump_flush(out, p, n);
+        }
+    }
+    memcpy(out->buf + out->len, p, n);
+    out->len += n;
+    return 0;
+}
+/*---------------------------------------------------------------------------*/
+static int dump_printf(struct hash_dump_out *out, const char *fmt, ...)
+{
+    char line[BUFFER_SIZE];
+    va_list ap;
+    int n;
+
+    va_start(ap, fmt);
+    n = vsnprintf(line, sizeof(line), fmt, ap);
+    va_end(ap);
+    if (n < 0)
+    {
+        return -1;
+    }
+    return dump_put(out, line, (size_t)n < sizeof(line) ? n : sizeof(line) - 1);
+}
+/*---------------------------------------------------------------------------*/
+/* scan callback; only takes references, the writing waits for the unlock */
+static int dump_collect(void *arg, const char *key, const hash_val_t *val)
+{
+    struct hash_dump_out *out = arg;
+    struct hash_dump_entry *ents;
+
+    if (out->nents == out->cap)
+    {
+        out->cap = out->cap ? out->cap * 2 : 16;
+        ents = realloc(out->ents, out->cap * sizeof(*ents));
+        if (!ents)
+        {
+            return -1;
+        }
+        out->ents = ents;
+    }
+    ents = &out->ents[out->nents];
+    if ((ents->key = strdup(key)) == NULL)
+    {
+        return -1;
+    }
+    ents->val = (hash_val_t *)val;
+    hash_val_get(ents->val);
+    out->nents++;
+    return 0;
+}
+/*---------------------------------------------------------------------------*/
+static int dump_entry(struct hash_dump_out *out, const char *key,
+                      hash_val_t *val)
+{
+    hash_val_t *raw;
+    uint32_t lens[2];
+    uint8_t bulk;
+    int ret;
+
+    if (out->format == HASH_DUMP_TEXT && val->bulk)
+    {
+        return dump_printf(out, "    Key:   %s\n    Value: <%zu bytes>\n",
+                           key, val->raw_len ? val->raw_len : val->len);
+    }
+    raw = hash_val_inflate(val);
+    if (!raw)
+    {
+        return -1;
+    }
+    if (out->format == HASH_DUMP_TEXT)
+    {
+        ret = dump_printf(out, "    Key:   %s\n    Value: ", key);
+        if (ret == 0)
+        {
+            ret = dump_put(out, raw->data, raw->len);
+        }
+        if (ret == 0)
+        {
+            ret = dump_put(out, "\n", 1);
+        }
+    }
+    else
+    {
+        lens[0] = strlen(key);
+        lens[1] = raw->len;
+        bulk = raw->bulk;
+        ret = dump_put(out, lens, sizeof(lens));
+        if (ret == 0)
+        {
+            ret = dump_put(out, &bulk, sizeof(bulk));
+        }
+        if (ret == 0)
+        {
+            ret = dump_put(out, key, lens[0]);
+        }
+        if (ret == 0)
+        {
+            ret = dump_put(out, raw->data, raw->len);
+        }
+    }
+    hash_val_put(raw);
+    return ret;
+}
+/*---------------------------------------------------------------------------*/
+int hash_dump_fd(hashtable_t *table, int fd, int format)
+{
+    TRACE_PRINT();
+    struct hash_dump_out *out = calloc(1, sizeof(struct hash_dump_out));
+    uint32_t version = 1, end = 0;
+    hash_gen_t *gen;
+    size_t hash_size, i, j;
+    int ret = 0;
+
+    if (!out)
+    {
+        DEBUG_PRINT("Failed to allocate dump buffer");
+        return -1;
+    }
+    out->fd = fd;
+    out->format = format;
+
+    if (format == HASH_DUMP_TEXT)
+    {
+        ret = dump_printf(out, "[Hash Table Dump]Total Entries: %ld\n",
+                          __atomic_load_n(&table->total_entries,
+                                          __ATOMIC_RELAXED));
+    }
+    else
+    {
+        ret = dump_put(out, "SKVSDUMP", 8);
+        if (ret == 0)
+        {
+            ret = dump_put(out, &version, sizeof(version));
+        }
+    }
+
+    hash_size = hash_scan_begin(table);
+    gen = table->gen;
+    for (i = 0; i < hash_size && ret == 0; i++)
+    {
+        /* the read lock is held only while references are taken */
+        ret = hash_scan_bucket(table, i, dump_collect, out);
+        if (ret == 0 && out->nents > 0 && format == HASH_DUMP_TEXT)
+        {
+            ret = dump_printf(out, "Bucket %zu: %zu entries\n"
+                              "  Lock State -> Read Count: %d, "
+                              "Write Count: %d\n", i, out->nents,
+                              gen->locks[i].read_count,
+                              gen->locks[i].write_count);
+        }
+        for (j = 0; j < out->nents; j++)
+        {
+            if (ret == 0)
+            {
+                ret = dump_entry(out, out->ents[j].key, out->ents[j].val);
+            }
+            free(out->ents[j].key);
+            hash_val_put(out->ents[j].val);
+        }
+        out->nents = 0;
+    }
+    hash_scan_end(table);
+
+    if (ret == 0)
+    {
+        ret = format == HASH_DUMP_TEXT ? dump_printf(out, "End of Dump\n")
+                                       : dump_put(out, &end, sizeof(end));
+    }
+    if (ret == 0)
+    {
+        ret = dump_flush(out, out->buf, out->len);
+    }
+    free(out->ents);
+    free(out);
+
+    return ret;
+}
+/*---------------------------------------------------------------------------*/
+/* function to dump the contents of the hash table, including locks status */
+void hash_dump(hashtable_t *table)
+{
+    TRACE_PRINT();
+
+    /* keep earlier stdio output in front of the dump */
+    fflush(stdout);
+    hash_dump_fd(table, STDOUT_FILENO, HASH_DUMP_TEXT);
+}
@@ -8,38 +8,149 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
 #include "rwlock.h"
 #include "common.h"
 /*---------------------------------------------------------------------------*/
 #define DEFAULT_HASH_SIZE 1024
+#define MAX_HASH_SIZE (1 << 24) // most buckets a resize is asked for
+#define HASH_CACHE_SIZE 64 // entries in a per-thread read cache (power of 2)
+#define HASH_FOUND_BULK 2 // see hash_search_cached()
+#define HASH_DUMP_BUF_SIZE (64 * 1024) // output buffered by a dump
+#define HASH_KEY_WIDTH 32 // bytes compared at once; keys are zero-padded
+#define HASH_STRIPES 64   // counters of operations in flight, see hash_resize()
+#if MAX_KEY_LEN > HASH_KEY_WIDTH
+#error "MAX_KEY_LEN does not fit in HASH_KEY_WIDTH"
+#endif
 /*---------------------------------------------------------------------------*/
+/* refcounted value storage. a reader that takes a reference under the
+ * bucket lock may keep using the value after the lock is dropped, even if
+ * the key is updated or deleted meanwhile */
+typedef struct hash_val_t
+{
+    unsigned long refs; // updated atomically
+    size_t len;
+    size_t raw_len;     // length before compression; 0 when not compressed
+    int bulk;           // stored with bulk framing and returned the same way
+    char data[];        // len bytes followed by a NUL
+} hash_val_t;
+/*---------------------------------------------------------------------------*/
+/* a lookup compares the hash and the key length before any key byte, and
+ * then all HASH_KEY_WIDTH bytes at once; keys longer than MAX_KEY_LEN are
+ * never stored */
 typedef struct node_t
 {
-    char *key;
+    uint64_t hash;     // hash_key() of key
     size_t key_size;
-    char *value;
-    size_t value_size;
+    _Alignas(16) char key[HASH_KEY_WIDTH + 1]; // NUL-padded
+    char *value;       // val->data
+    size_t value_size; // val->len
+    hash_val_t *val;
+    int compressed;    // value holds an LZ4 block of val->raw_len bytes
     struct node_t *next;
 } node_t;
 /*---------------------------------------------------------------------------*/
-typedef struct hashtable_t
+/* kinds of writes reported to a write hook */
+enum HASH_WRITE
+{
+    HASH_WRITE_SET, // key now holds value (insert or update)
+    HASH_WRITE_DEL  // key was deleted, value is NULL
+};
+/*---------------------------------------------------------------------------*/
+/**
+ * called after every successful write while the bucket write lock is
+ * still held, so calls for the same key arrive in the order the writes
+ * were applied. val is NULL for deletes. must not call back into the
+ * table.
+ */
+typedef void (*hash_write_hook_t)(void *arg, int op, const char *key,
+                                  const hash_val_t *val);
+/*---------------------------------------------------------------------------*/
+/**
+ * called for each entry of a scanned bucket while its read lock is held.
+ * returns -1 to stop the scan, 0 to continue.
+ */
+typedef int (*hash_scan_fn_t)(void *arg, const char *key,
+                              const hash_val_t *val);
+/*---------------------------------------------------------------------------*/
+/* output formats of hash_dump_fd() */
+enum HASH_DUMP
+{
+    HASH_DUMP_TEXT,  // the human-readable layout of hash_dump()
+    HASH_DUMP_BINARY // length-prefixed records, see hash_dump_fd()
+};
+/*---------------------------------------------------------------------------*/
+/* one array of buckets. a resize fills the next generation from the
+ * current one a bucket at a time, while both stay in use */
+typedef struct hash_gen_t
 {
     node_t **buckets;
     rwlock_t *locks;
     size_t *bucket_sizes; // number of entries in each bucket
-    size_t total_entries;
+    unsigned long *versions; // bumped by every write to the bucket
+    unsigned char *moved; // set once the bucket's entries live in next
     size_t hash_size;
+    unsigned long id;     // tells cached buckets of generations apart
+    struct hash_gen_t *next; // generation being filled by a resize
+} hash_gen_t;
+/*---------------------------------------------------------------------------*/
+/* operations in flight, counted by the parity of the epoch they started
+ * in; each stripe has a cache line of its own */
+typedef struct hash_active_t
+{
+    _Alignas(64) unsigned long count[2];
+} hash_active_t;
+/*---------------------------------------------------------------------------*/
+typedef struct hashtable_t
+{
+    hash_gen_t *gen;      // current generation, replaced by hash_resize()
+    unsigned long epoch;  // bumped when a generation is replaced
+    hash_active_t active[HASH_STRIPES];
+    pthread_rwlock_t resize_lock; // held by a resize, shared by scans
+    int delay;            // rwlock delay of new generations
+    int max_writers;      // writer ring size of new generations
+    size_t total_entries;
+    size_t compress_min; // values this long are compressed, 0 = never
+    hash_write_hook_t on_write; // NULL unless writes are being observed
+    void *on_write_arg;
 } hashtable_t;
 /*---------------------------------------------------------------------------*/
+/* a read-cached key; valid while its bucket version is unchanged */
+typedef struct hash_cache_entry_t
+{
+    char key[MAX_KEY_LEN + 1];
+    unsigned long gen;     // generation of index
+    size_t index;          // bucket of key
+    unsigned long version; // bucket version the value was copied at
+    char *value;           // private copy of the value
+    size_t value_cap;
+    int valid;
+} hash_cache_entry_t;
+/*---------------------------------------------------------------------------*/
+/* read cache owned by one thread; only its owner may search through it */
+typedef struct hash_cache_t
+{
+    hash_cache_entry_t entries[HASH_CACHE_SIZE];
+    unsigned long hits;   // updated atomically, may be read by any thread
+    unsigned long misses;
+    struct hash_cache_t *next;
+} hash_cache_t;
+/*---------------------------------------------------------------------------*/
 /**
  * calculates hash of key
  */
 int hash(const char *key, size_t hash_size);
 /*---------------------------------------------------------------------------*/
 /**
- * initializes a hash table
+ * calculates the 64-bit hash of the len bytes of key kept in every node.
  */
-hashtable_t *hash_init(size_t hash_size, int delay);
+uint64_t hash_key(const char *key, size_t len);
+/*---------------------------------------------------------------------------*/
+/**
+ * initializes a hash table written by at most max_writers threads at
+ * once, a resize included
+ */
+hashtable_t *hash_init(size_t hash_size, int delay, int max_writers);
 /*---------------------------------------------------------------------------*/
 /**
  * destroys a hash table
@@ -48,21 +159,67 @@ int hash_destroy(hashtable_t *table);
 /*---------------------------------------------------------------------------*/
 /**
  * inserts a key-value pair to the hash table.
- * returns -1 when any internal errors occur.
+ * returns -1 when any internal errors occur, or key is longer than
+ * MAX_KEY_LEN.
  * returns 1 when successfully inserted.
  * returns 0 when the key already exists. (collision)
  */
 int hash_insert(hashtable_t *table, const char *key, const char *value);
 /*---------------------------------------------------------------------------*/
+/**
+ * same as hash_insert, but stores val itself instead of a copy, unless
+ * it is compressed into a new value (see hash_set_compression()).
+ * the table takes its own reference; the caller keeps its reference.
+ */
+int hash_insert_val(hashtable_t *table, const char *key, hash_val_t *val);
+/*---------------------------------------------------------------------------*/
 /**
  * searches a key-value pair in the hash table,
  * and modify the given value pointer to point found value.
+ * returns HASH_FOUND_BULK instead for a compressed value, which has to be
+ * read with hash_search_val().
  * returns -1 when any internal errors occur.
  * returns 1 when successfully found.
  * returns 0 when there is no such key found.
  */
 int hash_search(hashtable_t *table, const char *key, const char **value);
 /*---------------------------------------------------------------------------*/
+/**
+ * searches a key and takes a reference to its value as stored, which
+ * may be compressed (see hash_val_inflate()). the caller must release it
+ * with hash_val_put().
+ * returns -1 when any internal errors occur.
+ * returns 1 when successfully found.
+ * returns 0 when there is no such key found.
+ */
+int hash_search_val(hashtable_t *table, const char *key, hash_val_t **val);
+/*---------------------------------------------------------------------------*/
+/**
+ * same as hash_search, but serves repeated reads of a key from cache
+ * without taking the bucket lock as long as the bucket version is
+ * unchanged. the returned value belongs to cache and stays valid until
+ * the next call with the same cache. bulk values are never copied into
+ * the cache; compressed ones are decompressed into it.
+ * returns -1 when any internal errors occur.
+ * returns HASH_FOUND_BULK when the value is a bulk value; read it with
+ * hash_search_val() instead.
+ * returns 1 when successfully found.
+ * returns 0 when there is no such key found.
+ */
+int hash_search_cached(hashtable_t *table, hash_cache_t *cache,
+                       const char *key, const char **value);
+/*---------------------------------------------------------------------------*/
+/**
+ * allocates an empty read cache.
+ * returns NULL when any internal errors occur.
+ */
+hash_cache_t *hash_cache_create(void);
+/*---------------------------------------------------------------------------*/
+/**
+ * frees a read cache and its cached values.
+ */
+void hash_cache_destroy(hash_cache_t *cache);
+/*---------------------------------------------------------------------------*/
 /**
  * updates a key-value pair in the hash table.
  * returns -1 when any internal errors occur.
@@ -71,6 +228,13 @@ int hash_search(hashtable_t *table, const char *key, const char **value);
  */
 int hash_update(hashtable_t *table, const char *key, const char *value);
 /*---------------------------------------------------------------------------*/
+/**
+ * same as hash_update, but stores val itself instead of a copy, unless
+ * it is compressed into a new value (see hash_set_compression()).
+ * the table takes its own reference; the caller keeps its reference.
+ */
+int hash_update_val(hashtable_t *table, const char *key, hash_val_t *val);
+/*---------------------------------------------------------------------------*/
 /**
  * deletes a key-value pair from the hash table.
  * returns -1 when any internal errors occur.
@@ -80,8 +244,112 @@ int hash_update(hashtable_t *table, const char *key, const char *value);
 int hash_delete(hashtable_t *table, const char *key);
 /*---------------------------------------------------------------------------*/
 /**
- * dump the hash table
+ * allocates an uninitialized value of len bytes holding one reference.
+ * returns NULL when any internal errors occur.
+ */
+hash_val_t *hash_val_alloc(size_t len);
+/*---------------------------------------------------------------------------*/
+/**
+ * takes another reference to val.
+ */
+void hash_val_get(hash_val_t *val);
+/*---------------------------------------------------------------------------*/
+/**
+ * drops a reference to val and frees it with the last one.
+ */
+void hash_val_put(hash_val_t *val);
+/*---------------------------------------------------------------------------*/
+/**
+ * returns a reference to the uncompressed form of val: val itself when it
+ * is not compressed, otherwise a new value. release it with hash_val_put().
+ * returns NULL when any internal errors occur.
+ */
+hash_val_t *hash_val_inflate(hash_val_t *val);
+/*---------------------------------------------------------------------------*/
+/**
+ * stores values of min_len bytes or more LZ4 compressed when that saves
+ * space, or disables compression when min_len is 0. values are
+ * decompressed again when read.
+ * must be called before the table is shared between threads.
+ */
+void hash_set_compression(hashtable_t *table, size_t min_len);
+/*---------------------------------------------------------------------------*/
+/**
+ * installs hook to observe every write, or removes it when hook is NULL.
+ * must be called before the table is shared between threads.
+ */
+void hash_set_write_hook(hashtable_t *table, hash_write_hook_t hook,
+                         void *arg);
+/*---------------------------------------------------------------------------*/
+/**
+ * returns the number of buckets, which stays the same until
+ * hash_scan_end() so that every bucket can be visited with
+ * hash_scan_bucket(). a resize started meanwhile waits for the scan.
+ */
+size_t hash_scan_begin(hashtable_t *table);
+/*---------------------------------------------------------------------------*/
+/**
+ * ends a scan started with hash_scan_begin().
+ */
+void hash_scan_end(hashtable_t *table);
+/*---------------------------------------------------------------------------*/
+/**
+ * returns the id of the generation being scanned. a scan that is ended
+ * and begun again may resume where it stopped only when the id is still
+ * the same; otherwise a resize has renumbered the buckets.
+ * must be called between hash_scan_begin() and hash_scan_end().
+ */
+unsigned long hash_scan_generation(hashtable_t *table);
+/*---------------------------------------------------------------------------*/
+/**
+ * calls fn for every entry of bucket index under its read lock.
+ * must be called between hash_scan_begin() and hash_scan_end().
+ * returns -1 when fn stopped the scan.
+ * returns 0 on success.
+ */
+int hash_scan_bucket(hashtable_t *table, size_t index, hash_scan_fn_t fn,
+                     void *arg);
+/*---------------------------------------------------------------------------*/
+/**
+ * returns the current number of buckets.
+ */
+size_t hash_bucket_count(hashtable_t *table);
+/*---------------------------------------------------------------------------*/
+/**
+ * rehashes the table into hash_size buckets while it stays in use. the
+ * entries move a bucket at a time into a new array, and an operation on
+ * a bucket that was already moved follows it there, so no operation
+ * waits for more than one bucket. the old array is freed once every
+ * operation that may still be reading it has returned. resizes run one
+ * at a time and wait for running scans.
+ * returns -1 when any internal errors occur.
+ * returns 0 on success.
+ */
+int hash_resize(hashtable_t *table, size_t hash_size);
+/*---------------------------------------------------------------------------*/
+/**
+ * deletes every entry, one bucket at a time. the write hook is not called.
+ */
+void hash_clear(hashtable_t *table);
+/*---------------------------------------------------------------------------*/
+/**
+ * dump the hash table to stdout
  */
 void hash_dump(hashtable_t *table);
 /*---------------------------------------------------------------------------*/
+/**
+ * writes every entry to fd in format, a bucket at a time: the entries of
+ * a bucket are referenced under its read lock and written after it is
+ * released, so the dump may run while the table is in use and each
+ * bucket is seen consistently. output goes out in HASH_DUMP_BUF_SIZE
+ * writes. values are written uncompressed.
+ * HASH_DUMP_BINARY is "SKVSDUMP" and a uint32_t version (1), then for each
+ * entry a uint32_t key length, a uint32_t value length, a uint8_t bulk
+ * flag, the key and the value, and finally a zero key length. integers
+ * are in host byte order.
+ * returns -1 when any internal errors occur.
+ * returns 0 on success.
+ */
+int hash_dump_fd(hashtable_t *table, int fd, int format);
+/*---------------------------------------------------------------------------*/
 #endif // _HASHTABLE_H
@@ -0,0 +1,232 @@
+/*---------------------------------------------------------------------------*/
+/* lz4.c                                                                     */
+/* Author: Kim Sungjin                                                       */
+/*---------------------------------------------------------------------------*/
+#include <stdint.h>
+#include <string.h>
+#include "lz4.h"
+/*---------------------------------------------------------------------------*/
+#define LZ4_MIN_MATCH 4
+#define LZ4_LAST_LITERALS 5 // a block always ends with this many literals
+#define LZ4_MF_LIMIT 12     // no match starts in the last 12 bytes
+#define LZ4_MAX_OFFSET 65535
+#define LZ4_HASH_LOG 12     // 4096 candidate positions, 16 KB of stack
+#define LZ4_SKIP_SHIFT 6    // probe step grows every 64 missed positions
+/*---------------------------------------------------------------------------*/
+static inline uint32_t lz4_read32(const unsigned char *p)
+{
+    uint32_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+/*---------------------------------------------------------------------------*/
+static inline unsigned int lz4_hash(uint32_t seq)
+{
+    return (seq * 2654435761U) >> (32 - LZ4_HASH_LOG);
+}
+/*---------------------------------------------------------------------------*/
+/* writes the part of a length that exceeds its 4-bit token field.
+ * returns NULL when it does not fit, the next output byte otherwise. */
+static unsigned char *lz4_put_len(unsigned char *op, unsigned char *oend,
+                                  size_t len)
+{
+    for (; len >= 255; len -= 255)
+    {
+        if (op == oend)
+        {
+            return NULL;
+        }
+        *op++ = 255;
+    }
+    if (op == oend)
+    {
+        return NULL;
+    }
+    *op++ = len;
+    return op;
+}
+/*---------------------------------------------------------------------------*/
+/* emits one sequence: lit literals at anchor, then a match of mlen bytes
+ * at offset back (no match when mlen is 0).
+ * returns NULL when it does not fit, the next output byte otherwise. */
+static unsigned char *lz4_put_seq(unsigned char *op, unsigned char *oend,
+                                  const unsigned char *anchor, size_t lit,
+                                  size_t offset, size_t mlen)
+{
+    unsigned char *token = op++;
+
+    if (token >= oend)
+    {
+        return NULL;
+    }
+    *token = (lit >= 15 ? 15 : lit) << 4;
+    if (lit >= 15 && (op = lz4_put_len(op, oend, lit - 15)) == NULL)
+    {
+        return NULL;
+    }
+    if ((size_t)(oend - op) < lit)
+    {
+        return NULL;
+    }
+    memcpy(op, anchor, lit);
+    op += lit;
+
+    if (mlen == 0)
+    {
+        return op;
+    }
+    if (oend - op < 2)
+    {
+        return NULL;
+    }
+    *op++ = offset & 0xff;
+    *op++ = offset >> 8;
+    mlen -= LZ4_MIN_MATCH;
+    *token |= mlen >= 15 ? 15 : mlen;
+    if (mlen >= 15)
+    {
+        op = lz4_put_len(op, oend, mlen - 15);
+    }
+    return op;
+}
+/*---------------------------------------------------------------------------*/
+size_t lz4_compress(const char *src, size_t len, char *dst, size_t cap)
+{
+    const unsigned char *base = (const unsigned char *)src;
+    const unsigned char *ip = base, *anchor = base, *ref;
+    const unsigned char *iend = base + len;
+    const unsigned char *mflimit, *matchlimit;
+    unsigned char *op = (unsigned char *)dst, *oend = op + cap;
+    uint32_t table[1 << LZ4_HASH_LOG];
+    uint32_t seq;
+    size_t mlen;
+    unsigned int h;
+
+    memset(table, 0, sizeof(table));
+    /* greedy parse; too short blocks are all literals */
+    mflimit = len > LZ4_MF_LIMIT ? iend - LZ4_MF_LIMIT : base;
+    matchlimit = len > LZ4_MF_LIMIT ? iend - LZ4_LAST_LITERALS : base;
+    while (ip < mflimit)
+    {
+        seq = lz4_read32(ip);
+        h = lz4_hash(seq);
+        ref = base + table[h];
+        table[h] = ip - base;
+        if (ref >= ip || ip - ref > LZ4_MAX_OFFSET || lz4_read32(ref) != seq)
+        {
+            /* skip faster through data that does not compress */
+            ip += 1 + ((ip - anchor) >> LZ4_SKIP_SHIFT);
+            continue;
+        }
+
+        /* extend the match both ways */
+        while (ip > anchor && ref > base && ip[-1] == ref[-1])
+        {
+            ip--;
+            ref--;
+        }
+        mlen = LZ4_MIN_MATCH;
+        while (ip + mlen < matchlimit && ip[mlen] == ref[mlen])
+        {
+            mlen++;
+        }
+
+        op = lz4_put_seq(op, oend, anchor, ip - anchor, ip - ref, mlen);
+        if (op == NULL)
+        {
+            return 0;
+        }
+        ip += mlen;
+        anchor = ip;
+        /* let the bytes just before the next position be found again */
+        table[lz4_hash(lz4_read32(ip - 2))] = ip - 2 - base;
+    }
+
+    op = lz4_put_seq(op, oend, anchor, iend - anchor, 0, 0);
+    return op ? op - (unsigned char *)dst : 0;
+}
+/*---------------------------------------------------------------------------*/
+/* reads the extra bytes of a length whose token field is 15.
+ * returns -1 when the block ends first, 0 on success. */
+static int lz4_get_len(const unsigned char **ip, const unsigned char *iend,
+                       size_t *len)
+{
+    unsigned char b;
+
+    do
+    {
+        if (*ip == iend)
+        {
+            return -1;
+        }
+        b = *(*ip)++;
+        *len += b;
+    } while (b == 255);
+    return 0;
+}
+/*---------------------------------------------------------------------------*/
+long lz4_decompress(const char *src, size_t len, char *dst, size_t cap)
+{
+    const unsigned char *ip = (const unsigned char *)src, *iend = ip + len;
+    unsigned char *op = (unsigned char *)dst, *oend = op + cap, *ref;
+    size_t lit, mlen, offset;
+    unsigned char token;
+
+    while (ip < iend)
+    {
+        token = *ip++;
+        lit = token >> 4;
+        if (lit == 15 && lz4_get_len(&ip, iend, &lit) < 0)
+        {
+            return -1;
+        }
+        if ((size_t)(iend - ip) < lit || (size_t)(oend - op) < lit)
+        {
+            return -1;
+        }
+        memcpy(op, ip, lit);
+        op += lit;
+        ip += lit;
+        if (ip == iend)
+        {
+            /* the last sequence has no match */
+            break;
+        }
+
+        if (iend - ip < 2)
+        {
+            return -1;
+        }
+        offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        mlen = token & 15;
+        if (mlen == 15 && lz4_get_len(&ip, iend, &mlen) < 0)
+        {
+            return -1;
+        }
+        mlen += LZ4_MIN_MATCH;
+        if (offset == 0 || offset > (size_t)(op - (unsigned char *)dst) ||
+            (size_t)(oend - op) < mlen)
+        {
+            return -1;
+        }
+
+        ref = op - offset;
+        if (offset >= mlen)
+        {
+            memcpy(op, ref, mlen);
+            op += mlen;
+        }
+        else
+        {
+            /* the match overlaps its own output, e.g. a run of one byte */
+            while (mlen--)
+            {
+                *op++ = *ref++;
+            }
+        }
+    }
+
+    return op - (unsigned char *)dst;
+}
@@ -0,0 +1,33 @@
+/*---------------------------------------------------------------------------*/
+/* lz4.h                                                                     */
+/* Author: Kim Sungjin                                                       */
+/*---------------------------------------------------------------------------*/
+#ifndef _LZ4_H
+#define _LZ4_H
+/*---------------------------------------------------------------------------*/
+#include <stddef.h>
+/*---------------------------------------------------------------------------*/
+/*
+ * a small codec for the LZ4 block format: a sequence is a token byte
+ * (literal length << 4 | match length - 4), extra length bytes, the
+ * literals, a 2-byte little-endian offset and extra match length bytes.
+ * the last sequence has literals only. blocks are interchangeable with
+ * LZ4_compress_default() / LZ4_decompress_safe() of liblz4.
+ */
+/*---------------------------------------------------------------------------*/
+/**
+ * compresses len bytes of src into dst of cap bytes.
+ * returns 0 when the result does not fit in cap bytes.
+ * returns the compressed length on success.
+ */
+size_t lz4_compress(const char *src, size_t len, char *dst, size_t cap);
+/*---------------------------------------------------------------------------*/
+/**
+ * decompresses the len bytes block at src into dst of cap bytes.
+ * never reads or writes out of bounds, whatever src holds.
+ * returns -1 when the block is malformed or does not fit in cap bytes.
+ * returns the decompressed length on success.
+ */
+long lz4_decompress(const char *src, size_t len, char *dst, size_t cap);
+/*---------------------------------------------------------------------------*/
+#endif // _LZ4_H
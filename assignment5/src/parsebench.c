@@ -0,0 +1,294 @@
+/*---------------------------------------------------------------------------*/
+/* parsebench.c                                                              */
+/* Author: Kim Sungjin                                                       */
+/*---------------------------------------------------------------------------*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <getopt.h>
+#include <time.h>
+#include "skvsparse.h"
+#include "common.h"
+/*---------------------------------------------------------------------------*/
+#define DEFAULT_REQUESTS 1000
+#define DEFAULT_ROUNDS 10000
+#define DEFAULT_VALUE_LEN 16
+#define DEFAULT_READ_RATIO 90
+/*---------------------------------------------------------------------------*/
+/* the strtok parser skvs_parse() replaced, kept as the baseline */
+static const char *g_legacy_cmds[CMD_COUNT] = {
+    "CREATE", "READ", "UPDATE", "DELETE", "STATS", "TRACE", "CONFIG"};
+/*---------------------------------------------------------------------------*/
+static enum CMD legacy_parse(char *buffer, size_t len, const char **key,
+                             const char **value)
+{
+    char *cmd, *crlf_ptr;
+    int i;
+
+    crlf_ptr = memchr(buffer, '\n', len);
+    if (crlf_ptr == NULL)
+    {
+        return len >= BUFFER_SIZE ? CMD_INVALID : CMD_INCOMPLETE;
+    }
+    *crlf_ptr = '\0';
+
+    cmd = strtok(buffer, " ");
+    if (cmd == NULL)
+    {
+        return CMD_INVALID;
+    }
+    for (i = 0; cmd[i]; i++)
+    {
+        cmd[i] = toupper(cmd[i]);
+    }
+    for (i = 0; i < CMD_COUNT; i++)
+    {
+        if (strcmp(cmd, g_legacy_cmds[i]) == 0)
+        {
+            *key = strtok(NULL, " ");
+            if (i == CMD_STATS)
+            {
+                return *key == NULL ? i : CMD_INVALID;
+            }
+            if (i == CMD_TRACE)
+            {
+                return *key != NULL && strcasecmp(*key, "DUMP") == 0 &&
+                               strtok(NULL, " ") == NULL
+                           ? i
+                           : CMD_INVALID;
+            }
+            if (*key == NULL || strlen(*key) > MAX_KEY_LEN)
+            {
+                return CMD_INVALID;
+            }
+            *value = strtok(NULL, " ");
+            if ((i == CMD_READ || i == CMD_DELETE) && *value != NULL)
+            {
+                return CMD_INVALID;
+            }
+            if ((i == CMD_CREATE || i == CMD_UPDATE || i == CMD_CONFIG) &&
+                *value == NULL)
+            {
+                return CMD_INVALID;
+            }
+            if (strtok(NULL, " ") != NULL)
+            {
+                return CMD_INVALID;
+            }
+            return i;
+        }
+    }
+    return CMD_INVALID;
+}
+/*---------------------------------------------------------------------------*/
+static double now_sec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+/*---------------------------------------------------------------------------*/
+/* fills buf with requests pipelined the way clientbench sends them.
+ * returns the number of bytes used. */
+static size_t make_requests(char *buf, int requests, int value_len,
+                            int read_ratio)
+{
+    size_t len = 0;
+    unsigned int seed = 1;
+    int i, key;
+
+    for (i = 0; i < requests; i++)
+    {
+        key = rand_r(&seed) % 1000;
+        if ((int)(rand_r(&seed) % 100) < read_ratio)
+        {
+            len += sprintf(buf + len, "READ key%d\n", key);
+        }
+        else
+        {
+            len += sprintf(buf + len, "UPDATE key%d %.*s\n", key, value_len,
+                           "0123456789abcdefghijklmnopqrstuvwxyz"
+                           "0123456789abcdefghijklmnopqrstuvwxyz"
+                           "0123456789abcdefghijklmnopqrstuvwxyz");
+        }
+    }
+    return len;
+}
+/*---------------------------------------------------------------------------*/
+/* checks that both parsers agree on the line of len bytes.
+ * returns -1 when they do not, 0 otherwise. */
+static int check_one(const char *line, size_t len)
+{
+    char copy[BUFFER_SIZE];
+    const char *key = NULL, *value = NULL;
+    struct skvs_req req;
+    enum CMD a, b;
+
+    memcpy(copy, line, len);
+    a = skvs_parse(copy, len, &req);
+    b = legacy_parse(copy, len, &key, &value);
+    if (a != b || req.line_len != len)
+    {
+        return -1;
+    }
+    if (a == CMD_INVALID || a == CMD_STATS || a == CMD_TRACE)
+    {
+        return 0;
+    }
+    if (req.key_len != strlen(key) || memcmp(req.key, key, req.key_len) ||
+        (value == NULL) != (req.value == NULL))
+    {
+        return -1;
+    }
+    if (value && (req.value_len != strlen(value) ||
+                  memcmp(req.value, value, req.value_len)))
+    {
+        return -1;
+    }
+    return 0;
+}
+/*---------------------------------------------------------------------------*/
+/* checks that both parsers agree on every request of buf and on a few
+ * malformed ones. returns -1 on the first disagreement, 0 otherwise. */
+static int check(const char *buf, size_t len)
+{
+    static const char *odd[] = {
+        "read   k1\n", "  CrEaTe k v\n", "READ\n", "READ k v\n",
+        "CREATE k\n", "CREATE k v w\n", "STATS\n", "stats x\n",
+        "trace dump\n", "TRACE DUMPS\n", "REA k\n", "READS k\n",
+        "\n", "   \n", "UPDATE k v   \n",
+        "READ 0123456789012345678901234567890123456789\n",
+        "READ 01234567890123456789012345678901\n", "config threads 4\n",
+        "CONFIG BUCKETS\n", "CONFIGS threads 4\n"};
+    size_t off, line, i;
+
+    for (off = 0; off < len; off += line)
+    {
+        line = (const char *)memchr(buf + off, '\n', len - off) - buf - off;
+        if (check_one(buf + off, ++line) < 0)
+        {
+            fprintf(stderr, "parsers disagree at offset %zu\n", off);
+            return -1;
+        }
+    }
+    for (i = 0; i < sizeof(odd) / sizeof(odd[0]); i++)
+    {
+        if (check_one(odd[i], strlen(odd[i])) < 0)
+        {
+            fprintf(stderr, "parsers disagree on \"%.*s\"\n",
+                    (int)strlen(odd[i]) - 1, odd[i]);
+            return -1;
+        }
+    }
+    return 0;
+}
+/*---------------------------------------------------------------------------*/
+int main(int argc, char *argv[])
+{
+    int requests = DEFAULT_REQUESTS, rounds = DEFAULT_ROUNDS;
+    int value_len = DEFAULT_VALUE_LEN, read_ratio = DEFAULT_READ_RATIO;
+    char *buf, *scratch;
+    const char *key, *value;
+    struct skvs_req req;
+    size_t len, off;
+    long parsed = 0, sum = 0;
+    double start, simd, legacy, restore;
+    int opt, r;
+
+    while ((opt = getopt(argc, argv, "n:R:v:r:h")) != -1)
+    {
+        switch (opt)
+        {
+        case 'n':
+            requests = atoi(optarg);
+            break;
+        case 'R':
+            rounds = atoi(optarg);
+            break;
+        case 'v':
+            value_len = atoi(optarg);
+            break;
+        case 'r':
+            read_ratio = atoi(optarg);
+            break;
+        case 'h':
+        default:
+            printf("Usage: %s [-n requests (%d)] [-R rounds (%d)] "
+                   "[-v value_len (%d, at most 108)] "
+                   "[-r read_percent (%d)]\n",
+                   argv[0], DEFAULT_REQUESTS, DEFAULT_ROUNDS,
+                   DEFAULT_VALUE_LEN, DEFAULT_READ_RATIO);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (requests <= 0 || rounds <= 0 || value_len <= 0 || value_len > 108)
+    {
+        fprintf(stderr, "Invalid benchmark parameters\n");
+        exit(EXIT_FAILURE);
+    }
+
+    buf = malloc((size_t)requests * 128);
+    scratch = malloc((size_t)requests * 128);
+    if (buf == NULL || scratch == NULL)
+    {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    len = make_requests(buf, requests, value_len, read_ratio);
+    if (check(buf, len) < 0)
+    {
+        exit(EXIT_FAILURE);
+    }
+
+    /* the server parses straight from its receive buffer */
+    start = now_sec();
+    for (r = 0; r < rounds; r++)
+    {
+        for (off = 0; off < len; off += req.line_len)
+        {
+            sum += skvs_parse(buf + off, len - off, &req) + req.key_len;
+            parsed++;
+        }
+    }
+    simd = now_sec() - start;
+
+    /* strtok writes into the buffer, so each round works on a fresh copy;
+     * the copy is timed apart and left out */
+    start = now_sec();
+    for (r = 0; r < rounds; r++)
+    {
+        memcpy(scratch, buf, len);
+        __asm__ __volatile__("" : : "r"(scratch) : "memory");
+    }
+    restore = now_sec() - start;
+    start = now_sec();
+    for (r = 0; r < rounds; r++)
+    {
+        memcpy(scratch, buf, len);
+        for (off = 0; off < len;)
+        {
+            key = value = NULL;
+            sum += legacy_parse(scratch + off, len - off, &key, &value);
+            off = (const char *)memchr(buf + off, '\n', len - off) - buf + 1;
+        }
+    }
+    legacy = now_sec() - start - restore;
+
+    printf("requests: %ld, %.1f bytes/request, checksum %ld\n", parsed,
+           (double)len / requests, sum);
+    printf("skvs_parse: %.2f ns/request (%s)\n", simd * 1e9 / parsed,
+#ifdef __SSE2__
+           "SSE2"
+#else
+           "scalar"
+#endif
+    );
+    printf("strtok baseline: %.2f ns/request\n", legacy * 1e9 / parsed);
+
+    free(buf);
+    free(scratch);
+    return 0;
+}
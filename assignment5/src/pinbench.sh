@@ -0,0 +1,65 @@
+#!/bin/bash
+
+# Compares server throughput with workers unpinned and pinned to CPUs.
+# Example: ./pinbench.sh -w 2-5 -m 1 -b 6-7 -t 4
+
+PORT=9090
+THREADS=4
+WORKER_CPUS=""
+MAIN_CPUS=""
+BENCH_CPUS=""
+REQUESTS=200000
+CONNS=8
+ROUNDS=3
+
+usage() {
+    echo "Usage: $0 -w worker_cpu_list [-m main_cpu_list]" \
+         "[-b bench_cpu_list] [-t threads ($THREADS)] [-p port ($PORT)]" \
+         "[-n requests ($REQUESTS)] [-c connections ($CONNS)]" \
+         "[-r rounds ($ROUNDS)]"
+    exit 1
+}
+
+while getopts "w:m:b:t:p:n:c:r:" opt; do
+    case $opt in
+        w) WORKER_CPUS=$OPTARG ;;
+        m) MAIN_CPUS=$OPTARG ;;
+        b) BENCH_CPUS=$OPTARG ;;
+        t) THREADS=$OPTARG ;;
+        p) PORT=$OPTARG ;;
+        n) REQUESTS=$OPTARG ;;
+        c) CONNS=$OPTARG ;;
+        r) ROUNDS=$OPTARG ;;
+        *) usage ;;
+    esac
+done
+[[ -z $WORKER_CPUS ]] && usage
+
+# keep the load generator off the worker CPUs when asked to
+BENCH="./clientbench"
+if [[ -n $BENCH_CPUS ]]; then
+    BENCH="taskset -c $BENCH_CPUS $BENCH"
+fi
+
+# runs the benchmark against a server started with the given options and
+# prints the throughput of each round
+run() {
+    local label=$1
+    shift
+    ./server -p "$PORT" -t "$THREADS" "$@" > /dev/null 2>&1 &
+    local pid=$!
+    sleep 0.5
+    for ((i = 1; i <= ROUNDS; i++)); do
+        $BENCH -p "$PORT" -c "$CONNS" -n "$REQUESTS" |
+            awk -v l="$label" -v r="$i" '/ops\/sec/ { print l, "round", r ":", $(NF-1), "ops/sec" }'
+    done
+    kill -INT $pid
+    wait $pid
+}
+
+run unpinned
+if [[ -n $MAIN_CPUS ]]; then
+    run pinned -c "$WORKER_CPUS" -C "$MAIN_CPUS"
+else
+    run pinned -c "$WORKER_CPUS"
+fi
@@ -4,11 +4,17 @@
 /* Modified by: Kim Sungjin                                                  */
 /*---------------------------------------------------------------------------*/
 #include "rwlock.h"
+#include "skvstrace.h"
 /*---------------------------------------------------------------------------*/
-int rwlock_init(rwlock_t *rw, int delay)
+int rwlock_init(rwlock_t *rw, int delay, int max_writers)
 {
     TRACE_PRINT();
     int ret, destroy_ret;
+    if (max_writers <= 0)
+    {
+        errno = EINVAL;
+        return -1;
+    }
     rw->read_count = 0;
     rw->write_count = 0;
     rw->writer_ring_head = 0;
@@ -18,7 +24,8 @@ int rwlock_init(rwlock_t *rw, int delay)
     {
         free(rw->writer_ring);
     }
-    rw->writer_ring = calloc(WRITER_RING_SIZE, sizeof(pthread_t));
+    rw->writer_ring_size = max_writers;
+    rw->writer_ring = calloc(max_writers, sizeof(pthread_t));
     if (!rw->writer_ring)
     {
         return -1;
@@ -82,6 +89,7 @@ int rwlock_read_lock(rwlock_t *rw)
     TRACE_PRINT();
 /*---------------------------------------------------------------------------*/
     /* edit here */
+    uint64_t traced = skvs_trace_begin(); // lock wait of a sampled request
     int ret = pthread_mutex_lock(&rw->lock);
     if (ret != 0) {
         errno = ret;
@@ -103,13 +111,18 @@ int rwlock_read_lock(rwlock_t *rw)
         errno = ret;
         return -1;
     }
+    skvs_trace_end(TRACE_STAGE_LOCK, traced);
 /*---------------------------------------------------------------------------*/
     return 0;
 }
 /*---------------------------------------------------------------------------*/
 int rwlock_read_unlock(rwlock_t *rw)
 {
-    sleep(rw->delay);
+    if (rw->delay)
+    {
+        /* even sleep(0) is a timer round trip of ~50 us (timer slack) */
+        sleep(rw->delay);
+    }
     TRACE_PRINT();
 /*---------------------------------------------------------------------------*/
     /* edit here */
@@ -121,7 +134,8 @@ int rwlock_read_unlock(rwlock_t *rw)
 
     rw->read_count--;
     if (rw->read_count == 0) {
-        ret = pthread_cond_signal(&rw->writers);
+        /* wake every writer: only the one at the ring tail may proceed */
+        ret = pthread_cond_broadcast(&rw->writers);
         if (ret != 0) {
             pthread_mutex_unlock(&rw->lock);
             errno = ret;
@@ -143,6 +157,7 @@ int rwlock_write_lock(rwlock_t *rw)
     TRACE_PRINT();
 /*---------------------------------------------------------------------------*/
     /* edit here */
+    uint64_t traced = skvs_trace_begin(); // lock wait of a sampled request
     int ret = pthread_mutex_lock(&rw->lock);
     if (ret != 0) {
         errno = ret;
@@ -150,17 +165,13 @@ int rwlock_write_lock(rwlock_t *rw)
     }
 
     rw->writer_ring[rw->writer_ring_head] = pthread_self();
-    rw->writer_ring_head = (rw->writer_ring_head + 1) % WRITER_RING_SIZE;
+    rw->writer_ring_head = (rw->writer_ring_head + 1) % rw->writer_ring_size;
 
-    while (rw->read_count > 0 || rw->write_count > 0) {
-        ret = pthread_cond_wait(&rw->writers, &rw->lock);
-        if (ret != 0) {
-            pthread_mutex_unlock(&rw->lock);
-            errno = ret;
-            return -1;
-        }
-    }
-    while (rw->writer_ring[rw->writer_ring_tail] != pthread_self()) {
+    /* wait for both an idle lock and our turn in the ring in one loop;
+     * readers may arrive while we wait for our turn */
+    while (rw->read_count > 0 || rw->write_count > 0 ||
+           !pthread_equal(rw->writer_ring[rw->writer_ring_tail],
+                          pthread_self())) {
         ret = pthread_cond_wait(&rw->writers, &rw->lock);
         if (ret != 0) {
             pthread_mutex_unlock(&rw->lock);
@@ -170,20 +181,25 @@ int rwlock_write_lock(rwlock_t *rw)
     }
     
     rw->write_count++;
-    rw->writer_ring_tail = (rw->writer_ring_tail + 1) % WRITER_RING_SIZE;
+    rw->writer_ring_tail = (rw->writer_ring_tail + 1) % rw->writer_ring_size;
 
     ret = pthread_mutex_unlock(&rw->lock);
     if (ret != 0) {
         errno = ret;
         return -1;
     }
+    skvs_trace_end(TRACE_STAGE_LOCK, traced);
 /*---------------------------------------------------------------------------*/
     return 0;
 }
 /*---------------------------------------------------------------------------*/
 int rwlock_write_unlock(rwlock_t *rw)
 {
-    sleep(rw->delay);
+    if (rw->delay)
+    {
+        /* even sleep(0) is a timer round trip of ~50 us (timer slack) */
+        sleep(rw->delay);
+    }
     TRACE_PRINT();
 /*---------------------------------------------------------------------------*/
     /* edit here */
@@ -205,7 +221,7 @@ int rwlock_write_unlock(rwlock_t *rw)
             }
         }
         else{
-            ret = pthread_cond_signal(&rw->writers);
+            ret = pthread_cond_broadcast(&rw->writers);
             if (ret != 0) {
                 pthread_mutex_unlock(&rw->lock);
                 errno = ret;
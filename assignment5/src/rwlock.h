@@ -11,7 +11,6 @@
 #include <string.h>
 #include <unistd.h>
 #include "common.h"
-#define WRITER_RING_SIZE NUM_THREADS
 /*---------------------------------------------------------------------------*/
 typedef struct
 {
@@ -23,6 +22,7 @@ typedef struct
 
     /* pending writer ring */
     pthread_t *writer_ring; // thread IDs array
+    int writer_ring_size;   // most writers that may wait at once
     int writer_ring_head;   // position to insert
     int writer_ring_tail;   // position to evict
 
@@ -31,11 +31,12 @@ typedef struct
 } rwlock_t;
 /*---------------------------------------------------------------------------*/
 /**
- * initializes rwlock.
+ * initializes rwlock for up to max_writers threads that may wait for
+ * the write lock at once; one more would overrun the writer ring.
  * returns -1 when any internal errors occur.
  * returns 0 on success.
  */
-int rwlock_init(rwlock_t *rw, int delay);
+int rwlock_init(rwlock_t *rw, int delay, int max_writers);
 /*---------------------------------------------------------------------------*/
 /**
  * acquires read lock.
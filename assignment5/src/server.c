@@ -16,7 +16,25 @@
 #include <sys/time.h>
 #include "common.h"
 #include "skvslib.h"
+#include "skvsrepl.h"
 #include <fcntl.h> // added
+#include <stddef.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
+#include <stdint.h>
+#include <time.h>
+#include <sched.h>
+#include <limits.h>
+/*---------------------------------------------------------------------------*/
+#define MAX_EVENTS 64
+#define OUTBUF_HIGH_WATER (64 * 1024) // stop reading a client above this
+#define OUTBUF_LOW_WATER (16 * 1024)  // and resume once output drains here
+#define STALL_TIMEOUT 10 // seconds a client may leave its output unread
+#define MAX_IOV 64       // output segments written per writev()
+#define DRAIN_TIMEOUT 5  // seconds open requests may take at shutdown
+#define MAX_CPUS 1024    // CPU numbers accepted in -c and -C lists
 /*---------------------------------------------------------------------------*/
 struct thread_args
 {
@@ -26,11 +44,822 @@ struct thread_args
 
 /*---------------------------------------------------------------------------*/
     /* free to use */
+    int unixfd;   // unix domain listener, -1 if disabled
+    int peer_uid; // uid allowed on unix listener, -1 for any
+    int cpu;      // CPU the worker is pinned to, -1 if not pinned
 
 /*---------------------------------------------------------------------------*/
 };
 /*---------------------------------------------------------------------------*/
+/* a piece of queued output: either response bytes copied into buf, or
+ * a reference to a stored value that is written straight from the table */
+struct oseg
+{
+    hash_val_t *val; // NULL for copied bytes
+    char *buf;
+    size_t len;
+    size_t cap;
+    size_t off;      // bytes already written
+    struct oseg *next;
+};
+/*---------------------------------------------------------------------------*/
+/* one client connection, owned by the worker that accepted it */
+struct conn
+{
+    int fd;
+    uint32_t events;          // events registered with epoll
+    char rbuf[BUFFER_SIZE + 1];
+    int rlen;                 // buffered request bytes
+    struct skvs_bulk bulk;    // bulk value being received
+    struct oseg *ohead;       // output not yet written, oldest first
+    struct oseg *otail;
+    size_t opending;          // bytes queued in all segments
+    time_t last_progress;     // when the output last moved
+    uint64_t budget;          // rate limit tokens, in ns of request cost
+    uint64_t budget_at;       // when budget was last refilled
+    struct conn *prev, *next;
+};
+/*---------------------------------------------------------------------------*/
+/* event loop state of one worker thread */
+struct worker
+{
+    int epfd;
+    int listenfd;
+    int unixfd;
+    int peer_uid;
+    int idx;
+    int inbox;          // read end of the pool slot's inbox pipe
+    struct skvs_ctx *ctx;
+    struct conn *conns; // every open connection, for stall checks
+};
+/*---------------------------------------------------------------------------*/
+/* a place in the worker pool; it outlives the threads that run in it */
+struct pool_slot
+{
+    pthread_t tid;
+    int started;          // tid is still to be joined
+    int running;          // taken by a worker that has not retired
+    int inbox[2];         // pipe written to wake the worker of the slot
+    struct conn *handoff; // connections handed over, not adopted yet
+    int nconns;           // connections held or on the way, updated
+                          // atomically
+};
+/*---------------------------------------------------------------------------*/
+/* the worker pool. "CONFIG THREADS" only sets target; main then starts
+ * the workers missing below it and wakes the ones above it, which hand
+ * their connections over to the others and exit. the workers that stay
+ * are woken too and even out their connections, so new workers take a
+ * share of the clients already connected. */
+struct pool
+{
+    pthread_mutex_t lock; // guards target and the running and handoff
+                          // fields of every slot
+    int target;           // workers wanted, at most size
+    int size;
+    struct pool_slot *slots;
+    pthread_t main;       // told about changes of target by SIGUSR2
+
+    /* what new workers are started with */
+    int listenfd;
+    int unixfd;
+    int peer_uid;
+    struct skvs_ctx *ctx;
+    const int *cpus;      // worker i runs on cpus[i % num_cpus]
+    int num_cpus;
+    cpu_set_t all_cpus;   // affinity of unpinned workers
+};
+/*---------------------------------------------------------------------------*/
 volatile static sig_atomic_t g_shutdown = 0;
+volatile static sig_atomic_t g_dump_requested = 0;
+volatile static sig_atomic_t g_pool_changed = 0;
+static struct pool g_pool;
+static int g_stall_timeout = STALL_TIMEOUT;
+static int g_drain_timeout = DRAIN_TIMEOUT;
+static int g_wake_pipe[2] = {-1, -1}; // readable once shutdown starts
+/* admission control; each connection has its own token bucket, so the
+ * check takes no lock and touches no shared line */
+static int g_max_conns = 0;      // open connections allowed, 0: any
+static int g_conns = 0;          // open connections, updated atomically
+static uint64_t g_rate_cost = 0; // ns of tokens per request, 0: no limit
+static uint64_t g_rate_cap = 0;  // ns of tokens a client may save up
+/*---------------------------------------------------------------------------*/
+/* checks the SO_PEERCRED credentials of a unix domain client.
+ * returns 1 when the peer may use the server, 0 otherwise. */
+static int peer_allowed(int clientfd, int peer_uid)
+{
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+
+    if (peer_uid < 0)
+    {
+        return 1;
+    }
+    if (getsockopt(clientfd, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0)
+    {
+        perror("getsockopt(SO_PEERCRED)");
+        return 0;
+    }
+
+    return cred.uid == 0 || cred.uid == (uid_t)peer_uid;
+}
+/*---------------------------------------------------------------------------*/
+static time_t mono_sec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+/*---------------------------------------------------------------------------*/
+static uint64_t mono_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+/*---------------------------------------------------------------------------*/
+static inline size_t conn_pending(const struct conn *c)
+{
+    return c->opending;
+}
+/*---------------------------------------------------------------------------*/
+static void oseg_free(struct oseg *seg)
+{
+    if (seg->val) {
+        hash_val_put(seg->val);
+    }
+    free(seg->buf);
+    free(seg);
+}
+/*---------------------------------------------------------------------------*/
+/* queues a new output segment.
+ * returns NULL on error, the segment on success. */
+static struct oseg *conn_push(struct conn *c, size_t cap)
+{
+    struct oseg *seg = calloc(1, sizeof(struct oseg));
+
+    if (seg == NULL) {
+        DEBUG_PRINT("Failed to allocate output segment");
+        return NULL;
+    }
+    if (cap > 0 && (seg->buf = malloc(cap)) == NULL) {
+        DEBUG_PRINT("Failed to allocate output buffer");
+        free(seg);
+        return NULL;
+    }
+    seg->cap = cap;
+
+    if (c->opending == 0) {
+        /* the stall clock starts when output starts waiting */
+        c->last_progress = mono_sec();
+    }
+    if (c->otail) {
+        c->otail->next = seg;
+    } else {
+        c->ohead = seg;
+    }
+    c->otail = seg;
+    return seg;
+}
+/*---------------------------------------------------------------------------*/
+/* registers a connection with the worker's epoll instance for the events
+ * it asks for, and adds it to the worker's connections.
+ * returns -1 on error, 0 on success. */
+static int conn_attach(struct worker *w, struct conn *c)
+{
+    struct epoll_event ev;
+
+    ev.events = c->events;
+    ev.data.ptr = c;
+    if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, c->fd, &ev) < 0) {
+        perror("epoll_ctl");
+        return -1;
+    }
+
+    c->prev = NULL;
+    c->next = w->conns;
+    if (w->conns) {
+        w->conns->prev = c;
+    }
+    w->conns = c;
+    return 0;
+}
+/*---------------------------------------------------------------------------*/
+/* registers a new client with the worker's epoll instance.
+ * returns -1 on error, 0 on success. */
+static int conn_open(struct worker *w, int clientfd)
+{
+    struct conn *c = calloc(1, sizeof(struct conn));
+
+    if (c == NULL) {
+        DEBUG_PRINT("Failed to allocate connection");
+        return -1;
+    }
+    c->fd = clientfd;
+    c->events = EPOLLIN;
+    c->budget = g_rate_cap;
+    c->budget_at = g_rate_cost ? mono_ns() : 0;
+
+    if (conn_attach(w, c) < 0) {
+        free(c);
+        return -1;
+    }
+    __atomic_add_fetch(&g_pool.slots[w->idx].nconns, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+/*---------------------------------------------------------------------------*/
+static void conn_unlink(struct worker *w, struct conn *c)
+{
+    if (c->prev) {
+        c->prev->next = c->next;
+    } else {
+        w->conns = c->next;
+    }
+    if (c->next) {
+        c->next->prev = c->prev;
+    }
+}
+/*---------------------------------------------------------------------------*/
+/* closes a connection that no worker holds */
+static void conn_free(struct conn *c)
+{
+    struct oseg *seg;
+
+    /* closing the socket also removes it from the epoll set */
+    close(c->fd);
+    while ((seg = c->ohead) != NULL) {
+        c->ohead = seg->next;
+        oseg_free(seg);
+    }
+    skvs_bulk_reset(&c->bulk);
+    free(c);
+}
+/*---------------------------------------------------------------------------*/
+/* frees a connection counted in slot and takes it off both counters */
+static void conn_drop(struct pool_slot *slot, struct conn *c)
+{
+    conn_free(c);
+    __atomic_sub_fetch(&slot->nconns, 1, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&g_conns, 1, __ATOMIC_RELAXED);
+}
+/*---------------------------------------------------------------------------*/
+static void conn_close(struct worker *w, struct conn *c)
+{
+    conn_unlink(w, c);
+    conn_drop(&g_pool.slots[w->idx], c);
+}
+/*---------------------------------------------------------------------------*/
+/* appends one response line to the output buffer.
+ * returns -1 on error, 0 on success. */
+static int conn_append(struct conn *c, const char *resp, size_t len)
+{
+    struct oseg *seg = c->otail;
+    size_t cap;
+    char *buf;
+
+    if (seg == NULL || seg->val) {
+        seg = conn_push(c, len + 1 > BUFFER_SIZE ? len + 1 : BUFFER_SIZE);
+        if (seg == NULL) {
+            return -1;
+        }
+    } else if (seg->len + len + 1 > seg->cap) {
+        cap = seg->cap;
+        while (cap < seg->len + len + 1) {
+            cap *= 2;
+        }
+        buf = realloc(seg->buf, cap);
+        if (buf == NULL) {
+            DEBUG_PRINT("Failed to grow output buffer");
+            return -1;
+        }
+        seg->buf = buf;
+        seg->cap = cap;
+    }
+
+    memcpy(seg->buf + seg->len, resp, len);
+    seg->buf[seg->len + len] = '\n';
+    seg->len += len + 1;
+    c->opending += len + 1;
+    return 0;
+}
+/*---------------------------------------------------------------------------*/
+/* queues a stored value and its closing line feed without copying the
+ * value. takes over the caller's reference to val.
+ * returns -1 on error, 0 on success. */
+static int conn_append_val(struct conn *c, hash_val_t *val)
+{
+    struct oseg *seg = conn_push(c, 0);
+
+    if (seg == NULL) {
+        hash_val_put(val);
+        return -1;
+    }
+    seg->val = val;
+    seg->len = val->len;
+    c->opending += val->len;
+
+    return conn_append(c, "", 0);
+}
+/*---------------------------------------------------------------------------*/
+/* writes as much pending output as the socket takes without blocking.
+ * returns -1 on error, 0 on success. */
+static int conn_flush(struct conn *c)
+{
+    struct iovec iov[MAX_IOV];
+    struct oseg *seg;
+    uint64_t traced;
+    ssize_t res;
+    size_t n;
+    int cnt;
+
+    while (c->opending > 0) {
+        cnt = 0;
+        for (seg = c->ohead; seg && cnt < MAX_IOV; seg = seg->next) {
+            iov[cnt].iov_base = (seg->val ? seg->val->data : seg->buf) +
+                                seg->off;
+            iov[cnt++].iov_len = seg->len - seg->off;
+        }
+
+        traced = skvs_trace_write_begin();
+        res = writev(c->fd, iov, cnt);
+        skvs_trace_write_end(traced);
+        if (res < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            perror("writev");
+            return -1;
+        }
+        c->opending -= res;
+        c->last_progress = mono_sec();
+
+        /* retire the segments that were written completely */
+        while ((seg = c->ohead) != NULL) {
+            n = seg->len - seg->off < (size_t)res ? seg->len - seg->off
+                                                  : (size_t)res;
+            seg->off += n;
+            res -= n;
+            if (seg->off < seg->len) {
+                break;
+            }
+            if (seg == c->otail && seg->val == NULL) {
+                /* keep the last buffer for the next responses */
+                seg->len = seg->off = 0;
+                break;
+            }
+            c->ohead = seg->next;
+            if (c->ohead == NULL) {
+                c->otail = NULL;
+            }
+            oseg_free(seg);
+        }
+    }
+
+    return 0;
+}
+/*---------------------------------------------------------------------------*/
+/* adds the tokens the connection earned since the last refill */
+static void conn_refill(struct conn *c)
+{
+    uint64_t now;
+
+    if (g_rate_cost == 0) {
+        return;
+    }
+    now = mono_ns();
+    c->budget += now - c->budget_at;
+    if (c->budget > g_rate_cap) {
+        c->budget = g_rate_cap;
+    }
+    c->budget_at = now;
+}
+/*---------------------------------------------------------------------------*/
+/* serves the complete requests in the input buffer until the output
+ * reaches the high watermark; the rest waits in the input buffer.
+ * requests over the connection's rate limit are answered with BUSY.
+ * returns -1 on error, 0 on success. */
+static int conn_process(struct skvs_ctx *ctx, struct conn *c)
+{
+    int start = 0;
+    const char *resp;
+    size_t room, used;
+    char *dst;
+
+    conn_refill(c);
+    while (start < c->rlen && conn_pending(c) < OUTBUF_HIGH_WATER) {
+        if (c->bulk.state == BULK_RECEIVING) {
+            /* the start of a bulk payload that arrived with its request */
+            dst = skvs_bulk_space(&c->bulk, &room);
+            if (room > (size_t)(c->rlen - start)) {
+                room = c->rlen - start;
+            }
+            if (dst) {
+                memcpy(dst, c->rbuf + start, room);
+            }
+            start += room;
+            resp = skvs_bulk_commit(ctx, &c->bulk, room);
+            if (resp != NULL && conn_append(c, resp, strlen(resp)) < 0) {
+                return -1;
+            }
+            continue;
+        }
+
+        if (c->budget >= g_rate_cost) {
+            resp = skvs_serve(ctx, c->rbuf + start, c->rlen - start,
+                              &c->bulk, &used);
+            c->budget -= used ? g_rate_cost : 0;
+        } else {
+            /* over the limit: skipped without touching the table */
+            resp = skvs_refuse(c->rbuf + start, c->rlen - start, &c->bulk,
+                               &used);
+        }
+        if (used == 0) {
+            /* the rest of the line has not arrived yet */
+            break;
+        }
+        start += used;
+        if (resp != NULL && conn_append(c, resp, strlen(resp)) < 0) {
+            return -1;
+        }
+        if (c->bulk.state == BULK_SENDING) {
+            /* the value is written from the table's own buffer */
+            if (conn_append_val(c, c->bulk.val) < 0) {
+                memset(&c->bulk, 0, sizeof(c->bulk));
+                return -1;
+            }
+            memset(&c->bulk, 0, sizeof(c->bulk));
+        }
+    }
+
+    /* keep the unserved requests for later */
+    c->rlen -= start;
+    memmove(c->rbuf, c->rbuf + start, c->rlen);
+    return 0;
+}
+/*---------------------------------------------------------------------------*/
+/* picks the epoll events for the connection: reading stops at the high
+ * watermark and resumes only once output drains to the low watermark.
+ * returns -1 on error, 0 on success. */
+static int conn_rearm(struct worker *w, struct conn *c)
+{
+    struct epoll_event ev;
+    uint32_t events = 0;
+    size_t pending = conn_pending(c);
+
+    if ((c->events & EPOLLIN) ? pending < OUTBUF_HIGH_WATER
+                              : pending <= OUTBUF_LOW_WATER) {
+        events |= EPOLLIN;
+    }
+    if (pending > 0) {
+        events |= EPOLLOUT;
+    }
+    if (events == c->events) {
+        return 0;
+    }
+
+    ev.events = events;
+    ev.data.ptr = c;
+    if (epoll_ctl(w->epfd, EPOLL_CTL_MOD, c->fd, &ev) < 0) {
+        perror("epoll_ctl");
+        return -1;
+    }
+    c->events = events;
+    return 0;
+}
+/*---------------------------------------------------------------------------*/
+/* handles readiness of one connection.
+ * returns -1 when the connection should be closed, 0 otherwise. */
+static int conn_handle(struct worker *w, struct conn *c, uint32_t revents)
+{
+    const char *resp;
+    char *dst;
+    size_t room;
+    ssize_t res;
+    int eof = 0;
+
+    if (revents & EPOLLERR) {
+        return -1;
+    }
+    if ((revents & EPOLLOUT) && conn_flush(c) < 0) {
+        return -1;
+    }
+
+    if (revents & (EPOLLIN | EPOLLHUP)) {
+        if (!(c->events & EPOLLIN)) {
+            /* hung up while reading is paused */
+            return -1;
+        }
+        dst = NULL;
+        if (c->bulk.state == BULK_RECEIVING && c->rlen == 0) {
+            /* read the payload straight into the value buffer */
+            dst = skvs_bulk_space(&c->bulk, &room);
+        }
+        if (dst) {
+            res = read(c->fd, dst, room);
+            if (res > 0) {
+                resp = skvs_bulk_commit(w->ctx, &c->bulk, res);
+                if (resp != NULL && conn_append(c, resp, strlen(resp)) < 0) {
+                    return -1;
+                }
+                /* consumed; nothing was added to rbuf */
+                res = -1;
+                errno = EAGAIN;
+            }
+        } else if (c->rlen == BUFFER_SIZE) {
+            /* unserved requests fill the buffer; read them later */
+            res = -1;
+            errno = EAGAIN;
+        } else {
+            res = read(c->fd, c->rbuf + c->rlen, BUFFER_SIZE - c->rlen);
+        }
+        if (res < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                perror("read");
+                return -1;
+            }
+        } else if (res == 0) {
+            printf("Connection closed by client\n");
+            eof = 1;
+        } else {
+            c->rlen += res;
+        }
+    }
+
+    /* also picks up requests left over from a paused read */
+    if (conn_process(w->ctx, c) < 0 || conn_flush(c) < 0 || eof) {
+        return -1;
+    }
+    return conn_rearm(w, c);
+}
+/*---------------------------------------------------------------------------*/
+/* drops connections whose output has not moved for the stall timeout,
+ * so one client that stops reading cannot pin memory forever */
+static void drop_stalled(struct worker *w, time_t now)
+{
+    struct conn *c, *next;
+
+    for (c = w->conns; c; c = next) {
+        next = c->next;
+        if (conn_pending(c) > 0 &&
+            now - c->last_progress >= g_stall_timeout) {
+            printf("Dropping stalled connection (%zu bytes unsent)\n",
+                   conn_pending(c));
+            conn_close(w, c);
+        }
+    }
+}
+/*---------------------------------------------------------------------------*/
+static inline int conn_idle(const struct conn *c)
+{
+    return c->rlen == 0 && c->bulk.state == BULK_NONE && conn_pending(c) == 0;
+}
+/*---------------------------------------------------------------------------*/
+/* accepts one client on a listener shared by all workers.
+ * returns -1 when none was waiting, 0 otherwise. */
+static int accept_client(struct worker *w, int lfd, int is_unix)
+{
+    int clientfd = accept4(lfd, NULL, NULL, SOCK_NONBLOCK);
+    int n;
+
+    if (clientfd < 0) {
+        /* another worker took it */
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            perror("accept");
+        }
+        return -1;
+    }
+    if (is_unix && !peer_allowed(clientfd, w->peer_uid)) {
+        DEBUG_PRINT("Rejected unix domain peer");
+        close(clientfd);
+        return 0;
+    }
+    n = __atomic_add_fetch(&g_conns, 1, __ATOMIC_RELAXED);
+    if (g_max_conns > 0 && n > g_max_conns) {
+        /* full: say so in one non-blocking send and hang up */
+        if (send(clientfd, "BUSY\n", 5, MSG_NOSIGNAL | MSG_DONTWAIT) < 0) {
+            /* the client is gone already */
+        }
+        DEBUG_PRINT("Refused a client over the connection limit");
+    } else if (conn_open(w, clientfd) == 0) {
+        return 0;
+    }
+    __atomic_sub_fetch(&g_conns, 1, __ATOMIC_RELAXED);
+    close(clientfd);
+    return 0;
+}
+/*---------------------------------------------------------------------------*/
+/* returns the slot of a worker that stays in the pool for the n-th
+ * handed over connection, or NULL when there is none.
+ * must be called with the pool lock held. */
+static struct pool_slot *pool_pick(struct pool *p, int n)
+{
+    struct pool_slot *slot;
+    int i;
+
+    for (i = 0; i < p->target; i++) {
+        slot = &p->slots[(n + i) % p->target];
+        if (slot->running) {
+            return slot;
+        }
+    }
+    return NULL;
+}
+/*---------------------------------------------------------------------------*/
+/* moves a connection that worker w no longer watches to dst, which adopts
+ * it when woken. must be called with the pool lock held. */
+static void pool_handoff(struct worker *w, struct pool_slot *dst,
+                         struct conn *c)
+{
+    __atomic_sub_fetch(&g_pool.slots[w->idx].nconns, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&dst->nconns, 1, __ATOMIC_RELAXED);
+    c->next = dst->handoff;
+    dst->handoff = c;
+    if (write(dst->inbox[1], "", 1) < 0) {
+        /* a full pipe is readable already */
+    }
+}
+/*---------------------------------------------------------------------------*/
+/* hands every connection of a worker leaving the pool, and those that
+ * were on their way to it, over to the workers that stay. a connection
+ * moves as it is, with its buffered requests, bulk transfer and output;
+ * only the epoll instance watching it changes. */
+static void worker_retire(struct worker *w, struct conn *list)
+{
+    struct pool_slot *dst;
+    struct conn *c, *next;
+    int n;
+
+    /* take no new clients, but the ones already waiting: this worker
+     * may be the only one that was woken for them */
+    epoll_ctl(w->epfd, EPOLL_CTL_DEL, w->listenfd, NULL);
+    while (accept_client(w, w->listenfd, 0) == 0) {
+    }
+    if (w->unixfd >= 0) {
+        epoll_ctl(w->epfd, EPOLL_CTL_DEL, w->unixfd, NULL);
+        while (accept_client(w, w->unixfd, 1) == 0) {
+        }
+    }
+    while ((c = w->conns) != NULL) {
+        conn_unlink(w, c);
+        epoll_ctl(w->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+        c->next = list;
+        list = c;
+    }
+
+    pthread_mutex_lock(&g_pool.lock);
+    for (n = 0, c = list; c; n++, c = next) {
+        next = c->next;
+        dst = pool_pick(&g_pool, n);
+        if (dst == NULL) {
+            conn_drop(&g_pool.slots[w->idx], c);
+            continue;
+        }
+        pool_handoff(w, dst, c);
+    }
+    pthread_mutex_unlock(&g_pool.lock);
+
+    printf("%dth worker retired, handed over %d connections\n", w->idx, n);
+}
+/*---------------------------------------------------------------------------*/
+/* hands connections over to the least loaded workers of the pool until
+ * this one holds no more than its share. connections on the way count
+ * for their receiver, so workers woken one after another agree. */
+static void worker_shed(struct worker *w)
+{
+    struct pool_slot *self = &g_pool.slots[w->idx], *slot, *dst;
+    struct conn *c;
+    int i, workers, total, share, n, least;
+
+    pthread_mutex_lock(&g_pool.lock);
+    workers = total = 0;
+    for (i = 0; i < g_pool.target; i++) {
+        slot = &g_pool.slots[i];
+        if (slot->running) {
+            workers++;
+            total += __atomic_load_n(&slot->nconns, __ATOMIC_RELAXED);
+        }
+    }
+    share = workers ? (total + workers - 1) / workers : 0;
+
+    while (w->conns &&
+           __atomic_load_n(&self->nconns, __ATOMIC_RELAXED) > share) {
+        dst = NULL;
+        least = share;
+        for (i = 0; i < g_pool.target; i++) {
+            slot = &g_pool.slots[i];
+            n = __atomic_load_n(&slot->nconns, __ATOMIC_RELAXED);
+            if (slot->running && n < least) {
+                dst = slot;
+                least = n;
+            }
+        }
+        if (dst == NULL) {
+            break;
+        }
+        c = w->conns;
+        conn_unlink(w, c);
+        epoll_ctl(w->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+        pool_handoff(w, dst, c);
+    }
+    pthread_mutex_unlock(&g_pool.lock);
+}
+/*---------------------------------------------------------------------------*/
+/* reacts to a wakeup through the worker's inbox: adopts the connections
+ * handed over to it, or retires the worker when the pool shrank below
+ * it. a worker that is draining for shutdown only adopts.
+ * returns 1 when the worker retired and has to exit, 0 otherwise. */
+static int worker_inbox(struct worker *w)
+{
+    struct pool_slot *slot = &g_pool.slots[w->idx];
+    struct conn *list, *next;
+    char buf[64];
+
+    while (read(w->inbox, buf, sizeof(buf)) > 0) {
+        /* the bytes only wake the worker */
+    }
+
+    pthread_mutex_lock(&g_pool.lock);
+    list = slot->handoff;
+    slot->handoff = NULL;
+    if (w->idx >= g_pool.target && !g_shutdown) {
+        /* nothing is handed to it from now on */
+        slot->running = 0;
+        pthread_mutex_unlock(&g_pool.lock);
+        worker_retire(w, list);
+        return 1;
+    }
+    pthread_mutex_unlock(&g_pool.lock);
+
+    for (; list; list = next) {
+        next = list->next;
+        if (conn_attach(w, list) < 0) {
+            conn_drop(slot, list);
+        }
+    }
+    if (!g_shutdown) {
+        worker_shed(w);
+    }
+    return 0;
+}
+/*---------------------------------------------------------------------------*/
+/* takes no new connections and lets the open ones finish the requests
+ * they already sent, closing each once nothing is in flight. whatever
+ * is still busy at the drain deadline is cut off. */
+static void drain_conns(struct worker *w)
+{
+    struct epoll_event events[MAX_EVENTS];
+    struct conn *c, *next;
+    time_t deadline = mono_sec() + g_drain_timeout;
+    int i, n, left;
+
+    epoll_ctl(w->epfd, EPOLL_CTL_DEL, w->listenfd, NULL);
+    if (w->unixfd >= 0) {
+        epoll_ctl(w->epfd, EPOLL_CTL_DEL, w->unixfd, NULL);
+    }
+    /* stays readable, so it would wake every wait below */
+    epoll_ctl(w->epfd, EPOLL_CTL_DEL, g_wake_pipe[0], NULL);
+
+    while (1) {
+        for (c = w->conns; c; c = next) {
+            next = c->next;
+            if (conn_idle(c)) {
+                conn_close(w, c);
+            }
+        }
+        left = deadline - mono_sec();
+        if (w->conns == NULL || left <= 0) {
+            break;
+        }
+
+        n = epoll_wait(w->epfd, events, MAX_EVENTS, left * 1000);
+        if (n < 0 && errno != EINTR) {
+            perror("epoll_wait");
+            break;
+        }
+        for (i = 0; i < n; i++) {
+            if (events[i].data.ptr == &w->inbox) {
+                /* a retiring worker handed over its connections */
+                worker_inbox(w);
+                continue;
+            }
+            c = events[i].data.ptr;
+            if (conn_handle(w, c, events[i].events) < 0) {
+                conn_close(w, c);
+            }
+        }
+    }
+
+    for (n = 0; w->conns; n++) {
+        conn_close(w, w->conns);
+    }
+    if (n > 0) {
+        printf("Closed %d busy connections at the drain deadline\n", n);
+    }
+}
 /*---------------------------------------------------------------------------*/
 void *handle_client(void *arg)
 {
@@ -39,83 +868,415 @@ void *handle_client(void *arg)
     struct skvs_ctx *ctx = args->ctx;
     int idx = args->idx;
     int listenfd = args->listenfd;
+    int cpu = args->cpu;
 /*---------------------------------------------------------------------------*/
     /* free to declare any variables */
-    int clientfd, res, len, off;
-    char buf[BUFFER_SIZE + 1];
+    struct worker w;
+    struct epoll_event ev, events[MAX_EVENTS];
+    struct conn *c;
+    time_t now, last_sweep = 0;
+    int i, n, retired = 0;
+
+    memset(&w, 0, sizeof(w));
+    w.ctx = ctx;
+    w.listenfd = listenfd;
+    w.unixfd = args->unixfd;
+    w.peer_uid = args->peer_uid;
+    w.idx = idx;
+    w.inbox = g_pool.slots[idx].inbox[0];
 
 /*---------------------------------------------------------------------------*/
 
     free(args);
-    printf("%dth worker ready\n", idx);
+
+    w.epfd = epoll_create1(0);
+    if (w.epfd < 0) {
+        perror("epoll_create1");
+        return NULL;
+    }
+    /* every worker watches the shared listeners; EPOLLEXCLUSIVE wakes only
+     * one of them per incoming connection */
+    ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+    ev.data.ptr = &w.listenfd;
+    if (epoll_ctl(w.epfd, EPOLL_CTL_ADD, listenfd, &ev) < 0) {
+        perror("epoll_ctl");
+        close(w.epfd);
+        return NULL;
+    }
+    if (w.unixfd >= 0) {
+        ev.data.ptr = &w.unixfd;
+        if (epoll_ctl(w.epfd, EPOLL_CTL_ADD, w.unixfd, &ev) < 0) {
+            perror("epoll_ctl");
+            close(w.epfd);
+            return NULL;
+        }
+    }
+    /* wakes every worker as soon as shutdown starts */
+    ev.events = EPOLLIN;
+    ev.data.ptr = &g_wake_pipe[0];
+    if (epoll_ctl(w.epfd, EPOLL_CTL_ADD, g_wake_pipe[0], &ev) < 0) {
+        perror("epoll_ctl");
+        close(w.epfd);
+        return NULL;
+    }
+    /* wakes this worker to adopt connections or to retire; handed over
+     * connections may be waiting already */
+    ev.data.ptr = &w.inbox;
+    if (epoll_ctl(w.epfd, EPOLL_CTL_ADD, w.inbox, &ev) < 0) {
+        perror("epoll_ctl");
+        close(w.epfd);
+        return NULL;
+    }
+
+    if (cpu >= 0) {
+        printf("%dth worker ready on CPU %d\n", idx, cpu);
+    } else {
+        printf("%dth worker ready\n", idx);
+    }
 
 /*---------------------------------------------------------------------------*/
     /* edit here */
-    while (!g_shutdown) {
-        clientfd = accept(listenfd, NULL, NULL);
-
-        if (clientfd < 0) {
-            if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                usleep(1000);
+    /* each worker multiplexes its own clients, so one client that reads
+     * slowly only stalls itself */
+    while (!g_shutdown && !retired) {
+        n = epoll_wait(w.epfd, events, MAX_EVENTS, TIMEOUT * 1000);
+        if (n < 0) {
+            if (errno == EINTR) {
                 continue;
-            } else if (errno == EINTR) {
-                continue;
-            } else {
-                perror("accept");
-                break;
             }
+            perror("epoll_wait");
+            break;
         }
-        int flags = fcntl(clientfd, F_GETFL, 0);
-        fcntl(clientfd, F_SETFL, flags | O_NONBLOCK);
-
-        while (!g_shutdown) {
-            res = read(clientfd, buf, sizeof(buf) - 1);
 
-            if (res < 0) {
-                if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                    usleep(1000);
-                    continue;
-                } else if (errno == EINTR) {
-                    continue;
-                } else {
-                    perror("read");
-                    break;
+        for (i = 0; i < n && !g_shutdown && !retired; i++) {
+            if (events[i].data.ptr == &w.listenfd) {
+                accept_client(&w, listenfd, 0);
+            } else if (events[i].data.ptr == &w.unixfd) {
+                accept_client(&w, w.unixfd, 1);
+            } else if (events[i].data.ptr == &g_wake_pipe[0]) {
+                /* g_shutdown is set; the loop ends */
+            } else if (events[i].data.ptr == &w.inbox) {
+                retired = worker_inbox(&w);
+            } else {
+                c = events[i].data.ptr;
+                if (conn_handle(&w, c, events[i].events) < 0) {
+                    conn_close(&w, c);
                 }
-            } else if (res == 0) {
-                printf("Connection closed by client\n");
-                break;
             }
+        }
 
-            const char *resp = skvs_serve(ctx, buf, res);
-            char *result = strdup(resp);
-            strcat(result, "\n");
-
-            len = strlen(result);
-            off = 0;
-
-            while (off < len) {
-                res = write(clientfd, result + off, len - off);
-                if (res <= 0) {
-                    perror("write");
-                    break;
-                }
-                off += res;
-            }
+        now = mono_sec();
+        if (now != last_sweep) {
+            drop_stalled(&w, now);
+            last_sweep = now;
         }
-        close(clientfd);
+    }
 
+    if (!retired) {
+        drain_conns(&w);
     }
+    close(w.epfd);
 /*---------------------------------------------------------------------------*/
 
     return NULL;
 }
 /*---------------------------------------------------------------------------*/
-/* Signal handler for SIGINT */
+/* Signal handler for SIGINT and SIGTERM */
 void handle_sigint(int sig)
 {
     TRACE_PRINT();
-    printf("\nReceived SIGINT, initiating shutdown...\n");
-    g_shutdown = 1;
+    g_shutdown = sig;
+    /* main reports the shutdown; stdio is not async-signal-safe */
+    if (write(g_wake_pipe[1], "", 1) < 0) {
+        /* a full pipe is readable already */
+    }
+}
+/*---------------------------------------------------------------------------*/
+/* Signal handler for SIGUSR1: dump the table in the background */
+static void handle_sigusr1(int sig)
+{
+    g_dump_requested = 1;
+}
+/*---------------------------------------------------------------------------*/
+/* parses a CPU list such as "0-3,8,10-11" into cpus, in the given order,
+ * so that the CPUs serving NIC interrupts can be left out.
+ * returns -1 when the list is malformed, the number of CPUs otherwise. */
+static int parse_cpu_list(const char *list, int *cpus, int max)
+{
+    const char *p = list;
+    char *end;
+    long first, last;
+    int n = 0;
+
+    while (*p) {
+        first = strtol(p, &end, 10);
+        if (end == p || first < 0 || first >= MAX_CPUS) {
+            return -1;
+        }
+        last = first;
+        if (*end == '-') {
+            p = end + 1;
+            last = strtol(p, &end, 10);
+            if (end == p || last < first || last >= MAX_CPUS) {
+                return -1;
+            }
+        }
+        for (; first <= last; first++) {
+            if (n == max) {
+                return -1;
+            }
+            cpus[n++] = first;
+        }
+        if (*end == ',') {
+            end++;
+        } else if (*end != '\0') {
+            return -1;
+        }
+        p = end;
+    }
+
+    return n;
+}
+/*---------------------------------------------------------------------------*/
+/* restricts the calling thread, and the threads it creates later, to the
+ * CPUs in the list. returns -1 on error, 0 on success. */
+static int pin_self(const int *cpus, int n)
+{
+    cpu_set_t set;
+    int i, err;
+
+    CPU_ZERO(&set);
+    for (i = 0; i < n; i++) {
+        CPU_SET(cpus[i], &set);
+    }
+    err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (err != 0) {
+        errno = err;
+        perror("pthread_setaffinity_np");
+        return -1;
+    }
+
+    return 0;
+}
+/*---------------------------------------------------------------------------*/
+/* Signal handler for SIGUSR2: the pool target changed */
+static void handle_sigusr2(int sig)
+{
+    g_pool_changed = 1;
+}
+/*---------------------------------------------------------------------------*/
+/* "CONFIG THREADS" hook, called by a worker: records the new size and
+ * leaves starting and retiring workers to main.
+ * returns -1 when n is out of range, 0 on success. */
+static int pool_set_target(void *arg, int n)
+{
+    struct pool *p = arg;
+
+    if (n < 1 || n > p->size) {
+        return -1;
+    }
+    pthread_mutex_lock(&p->lock);
+    p->target = n;
+    pthread_mutex_unlock(&p->lock);
+    __atomic_store_n(&p->ctx->threads, n, __ATOMIC_RELAXED);
+    pthread_kill(p->main, SIGUSR2);
+    return 0;
+}
+/*---------------------------------------------------------------------------*/
+/* starts a worker in slot i.
+ * returns -1 on error, 0 on success. */
+static int pool_start(struct pool *p, int i)
+{
+    struct thread_args *args = malloc(sizeof(struct thread_args));
+    pthread_attr_t attr;
+    cpu_set_t set;
+    int err;
+
+    if (args == NULL) {
+        perror("malloc");
+        return -1;
+    }
+    args->listenfd = p->listenfd;
+    args->idx = i;
+    args->ctx = p->ctx;
+    args->unixfd = p->unixfd;
+    args->peer_uid = p->peer_uid;
+    args->cpu = -1;
+
+    /* a worker starts on its CPU, so the memory it touches first (its
+     * stack, connections, buffers, read cache and trace ring) is
+     * placed on the local node; unpinned workers may use every CPU,
+     * not just the ones main was restricted to */
+    set = p->all_cpus;
+    if (p->num_cpus > 0) {
+        args->cpu = p->cpus[i % p->num_cpus];
+        CPU_ZERO(&set);
+        CPU_SET(args->cpu, &set);
+    }
+    pthread_attr_init(&attr);
+    pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+    err = pthread_create(&p->slots[i].tid, &attr, handle_client, args);
+    pthread_attr_destroy(&attr);
+    if (err != 0) {
+        errno = err;
+        perror("pthread_create");
+        free(args);
+        return -1;
+    }
+    p->slots[i].started = 1;
+    return 0;
+}
+/*---------------------------------------------------------------------------*/
+/* brings the pool to its target: starts a worker in every free slot
+ * below it and wakes every worker above it to retire. only main calls
+ * it, so only main starts and joins workers.
+ * returns -1 when a worker could not be started, 0 otherwise. */
+static int pool_apply(struct pool *p)
+{
+    struct pool_slot *slot;
+    int i, start, ret = 0;
+
+    for (i = 0; i < p->size; i++) {
+        slot = &p->slots[i];
+        pthread_mutex_lock(&p->lock);
+        start = i < p->target && !slot->running;
+        if (start) {
+            /* connections may be handed to it from now on */
+            slot->running = 1;
+        } else if (i >= p->target && slot->running &&
+                   write(slot->inbox[1], "", 1) < 0) {
+            /* a full pipe is readable already */
+        }
+        pthread_mutex_unlock(&p->lock);
+        if (!start) {
+            continue;
+        }
+
+        if (slot->started) {
+            /* the worker that retired from it is gone or on its way */
+            pthread_join(slot->tid, NULL);
+            slot->started = 0;
+        }
+        if (pool_start(p, i) < 0) {
+            pthread_mutex_lock(&p->lock);
+            slot->running = 0;
+            pthread_mutex_unlock(&p->lock);
+            ret = -1;
+        }
+    }
+
+    /* the workers that stay even out their connections */
+    pthread_mutex_lock(&p->lock);
+    for (i = 0; i < p->target; i++) {
+        if (p->slots[i].running && write(p->slots[i].inbox[1], "", 1) < 0) {
+            /* a full pipe is readable already */
+        }
+    }
+    pthread_mutex_unlock(&p->lock);
+
+    return ret;
+}
+/*---------------------------------------------------------------------------*/
+/* sets up the slots of a pool of num_threads workers that may grow to
+ * size. returns -1 on error, 0 on success. */
+static int pool_init(struct pool *p, int num_threads, int size)
+{
+    int i;
+
+    p->slots = calloc(size, sizeof(struct pool_slot));
+    if (p->slots == NULL) {
+        perror("calloc");
+        return -1;
+    }
+    for (i = 0; i < size; i++) {
+        if (pipe2(p->slots[i].inbox, O_CLOEXEC | O_NONBLOCK) < 0) {
+            perror("pipe2()");
+            while (i-- > 0) {
+                close(p->slots[i].inbox[0]);
+                close(p->slots[i].inbox[1]);
+            }
+            free(p->slots);
+            return -1;
+        }
+    }
+    pthread_mutex_init(&p->lock, NULL);
+    p->size = size;
+    p->target = num_threads;
+    p->main = pthread_self();
+    return 0;
+}
+/*---------------------------------------------------------------------------*/
+/* joins every worker and closes what is left of the pool, including
+ * connections handed over too late to be adopted */
+static void pool_destroy(struct pool *p)
+{
+    struct conn *c;
+    int i;
+
+    for (i = 0; i < p->size; i++) {
+        if (p->slots[i].started) {
+            pthread_join(p->slots[i].tid, NULL);
+        }
+    }
+    for (i = 0; i < p->size; i++) {
+        while ((c = p->slots[i].handoff) != NULL) {
+            p->slots[i].handoff = c->next;
+            conn_drop(&p->slots[i], c);
+        }
+        close(p->slots[i].inbox[0]);
+        close(p->slots[i].inbox[1]);
+    }
+    pthread_mutex_destroy(&p->lock);
+    free(p->slots);
+}
+/*---------------------------------------------------------------------------*/
+/* opens a listening unix domain socket. a path starting with '@' is bound
+ * in the abstract namespace, which needs no file and vanishes with the
+ * socket. returns -1 on error, the socket on success. */
+static int open_unix_listener(const char *path, int backlog)
+{
+    struct sockaddr_un uaddr;
+    socklen_t addrlen;
+    size_t len = strlen(path);
+    int us;
+
+    if (len == 0 || len >= sizeof(uaddr.sun_path)) {
+        fprintf(stderr, "Invalid unix socket path: %s\n", path);
+        return -1;
+    }
+
+    if ((us = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0)) < 0) {
+        perror("socket(AF_UNIX)");
+        return -1;
+    }
+
+    memset(&uaddr, 0, sizeof(uaddr));
+    uaddr.sun_family = AF_UNIX;
+    memcpy(uaddr.sun_path, path, len);
+    addrlen = offsetof(struct sockaddr_un, sun_path) + len;
+    if (path[0] == '@') {
+        uaddr.sun_path[0] = '\0';
+    } else {
+        /* remove a stale socket file from a previous run */
+        if (skvs_unlink_stale(path) < 0) {
+            close(us);
+            return -1;
+        }
+        addrlen++;
+    }
+
+    if (bind(us, (struct sockaddr *)&uaddr, addrlen) < 0) {
+        perror("bind(AF_UNIX)");
+        close(us);
+        return -1;
+    }
+    if (listen(us, backlog) < 0) {
+        perror("listen(AF_UNIX)");
+        close(us);
+        return -1;
+    }
+
+    return us;
 }
 /*---------------------------------------------------------------------------*/
 int main(int argc, char *argv[])
@@ -127,13 +1288,27 @@ int main(int argc, char *argv[])
     int delay = RWLOCK_DELAY;
 /*---------------------------------------------------------------------------*/
     /* free to declare any variables */
-    int s;
-
+    int s, us = -1;
+    char *unix_path = NULL;
+    int peer_uid = -1;
+    char *repl_addr = NULL, *primary_addr = NULL;
+    struct skvs_repl *repl = NULL, *follower = NULL;
+    size_t compress_min = 0;
+    char *dump_path = NULL;
+    int dump_format = HASH_DUMP_TEXT;
+    unsigned int trace_every = 0;
+    sigset_t blocked, waitmask;
+    char *worker_cpu_list = NULL, *main_cpu_list = NULL;
+    int worker_cpus[MAX_CPUS], main_cpus[MAX_CPUS];
+    int num_worker_cpus = 0, num_main_cpus = 0;
+    cpu_set_t all_cpus;
+    long rate = 0, burst = 0;
+    int pool_size;
     
 /*---------------------------------------------------------------------------*/
 
     /* parse command line options */
-    while ((opt = getopt(argc, argv, "p:t:s:d:h")) != -1)
+    while ((opt = getopt(argc, argv, "p:t:s:d:u:a:T:R:F:z:D:o:bS:c:C:l:B:m:h")) != -1)
     {
         switch (opt)
         {
@@ -142,6 +1317,11 @@ int main(int argc, char *argv[])
             break;
         case 't':
             num_threads = atoi(optarg);
+            if (num_threads <= 0)
+            {
+                fprintf(stderr, "Invalid number of threads\n");
+                exit(EXIT_FAILURE);
+            }
             break;
         case 's':
             hash_size = atoi(optarg);
@@ -154,24 +1334,159 @@ int main(int argc, char *argv[])
         case 'd':
             delay = atoi(optarg);
             break;
+        case 'u':
+            unix_path = optarg;
+            break;
+        case 'a':
+            peer_uid = atoi(optarg);
+            break;
+        case 'R':
+            repl_addr = optarg;
+            break;
+        case 'F':
+            primary_addr = optarg;
+            break;
+        case 'z':
+            compress_min = strtoul(optarg, NULL, 10);
+            break;
+        case 'D':
+            g_drain_timeout = atoi(optarg);
+            break;
+        case 'o':
+            dump_path = optarg;
+            break;
+        case 'b':
+            dump_format = HASH_DUMP_BINARY;
+            break;
+        case 'S':
+            trace_every = strtoul(optarg, NULL, 10);
+            break;
+        case 'c':
+            worker_cpu_list = optarg;
+            break;
+        case 'C':
+            main_cpu_list = optarg;
+            break;
+        case 'l':
+            rate = atol(optarg);
+            if (rate < 0 || rate > 1000000000)
+            {
+                fprintf(stderr, "Invalid request rate limit\n");
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'B':
+            burst = atol(optarg);
+            if (burst <= 0 || burst > INT_MAX)
+            {
+                fprintf(stderr, "Invalid burst size\n");
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'm':
+            g_max_conns = atoi(optarg);
+            if (g_max_conns < 0)
+            {
+                fprintf(stderr, "Invalid connection limit\n");
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'T':
+            g_stall_timeout = atoi(optarg);
+            if (g_stall_timeout <= 0)
+            {
+                fprintf(stderr, "Invalid stall timeout\n");
+                exit(EXIT_FAILURE);
+            }
+            break;
         case 'h':
         default:
             printf("Usage: %s [-p port (%d)] "
                    "[-t num_threads (%d)] "
                    "[-d rwlock_delay (%d)] "
-                   "[-s hash_size (%d)]\n",
+                   "[-s hash_size (%d)] "
+                   "[-u unix_socket_path (@name: abstract)] "
+                   "[-a allowed_peer_uid] "
+                   "[-T stall_timeout_sec (%d)] "
+                   "[-R replication_listen_addr] "
+                   "[-F primary_replication_addr] "
+                   "[-z compress_min_bytes (0: off)] "
+                   "[-D drain_timeout_sec (%d)] "
+                   "[-o dump_path (stdout)] [-b (binary dump)] "
+                   "[-S trace_one_request_in (0: off)] "
+                   "[-c worker_cpu_list (e.g. 2-7,10)] "
+                   "[-C main_cpu_list] "
+                   "[-l requests_per_sec_per_client (0: off)] "
+                   "[-B burst_requests (1 sec worth)] "
+                   "[-m max_connections (0: any)]\n",
                    argv[0],
                    DEFAULT_PORT,
                    NUM_THREADS,
                    RWLOCK_DELAY,
-                   DEFAULT_HASH_SIZE);
+                   DEFAULT_HASH_SIZE,
+                   STALL_TIMEOUT,
+                   DRAIN_TIMEOUT);
             exit(EXIT_FAILURE);
         }
     }
 
 /*---------------------------------------------------------------------------*/
     /* edit here */
+    if (rate > 0) {
+        /* a token is 1/rate seconds; a client may save up burst of them */
+        g_rate_cost = 1000000000 / rate;
+        g_rate_cap = g_rate_cost * (burst > 0 ? burst : rate);
+    }
+    if (worker_cpu_list) {
+        num_worker_cpus = parse_cpu_list(worker_cpu_list, worker_cpus,
+                                         MAX_CPUS);
+        if (num_worker_cpus <= 0) {
+            fprintf(stderr, "Invalid worker CPU list: %s\n",
+                    worker_cpu_list);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (main_cpu_list) {
+        num_main_cpus = parse_cpu_list(main_cpu_list, main_cpus, MAX_CPUS);
+        if (num_main_cpus <= 0) {
+            fprintf(stderr, "Invalid main CPU list: %s\n", main_cpu_list);
+            exit(EXIT_FAILURE);
+        }
+    }
+    /* main, and the replication and dump threads it starts, keep off the
+     * worker CPUs; workers get their own affinity below */
+    sched_getaffinity(0, sizeof(all_cpus), &all_cpus);
+    for (int i = 0; i < num_worker_cpus + num_main_cpus; i++) {
+        int cpu = i < num_worker_cpus ? worker_cpus[i]
+                                      : main_cpus[i - num_worker_cpus];
+        if (!CPU_ISSET(cpu, &all_cpus)) {
+            fprintf(stderr, "CPU %d is not available\n", cpu);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (num_main_cpus > 0 && pin_self(main_cpus, num_main_cpus) < 0) {
+        exit(EXIT_FAILURE);
+    }
+
+    if (pipe2(g_wake_pipe, O_CLOEXEC | O_NONBLOCK) < 0) {
+        perror("pipe2()");
+        return -1;
+    }
+    /* only main takes the signals, and only inside sigsuspend(), so none
+     * is lost between checking the flags and waiting; every thread
+     * started from here on inherits the mask */
+    sigemptyset(&blocked);
+    sigaddset(&blocked, SIGINT);
+    sigaddset(&blocked, SIGTERM);
+    sigaddset(&blocked, SIGUSR1);
+    sigaddset(&blocked, SIGUSR2);
+    pthread_sigmask(SIG_BLOCK, &blocked, &waitmask);
     signal(SIGINT, handle_sigint);
+    signal(SIGTERM, handle_sigint);
+    signal(SIGUSR1, handle_sigusr1);
+    signal(SIGUSR2, handle_sigusr2);
+    /* a client that vanishes mid-write must not kill the server */
+    signal(SIGPIPE, SIG_IGN);
 
     struct sockaddr_in saddr;
 
@@ -204,34 +1519,108 @@ int main(int argc, char *argv[])
     }
     printf("Server listening on %s:%d\n", ip, port);
 
-    struct skvs_ctx *ctx = skvs_init(hash_size, delay);
+    if (unix_path) {
+        us = open_unix_listener(unix_path, num_threads);
+        if (us < 0) {
+            close(s);
+            return -1;
+        }
+        printf("Server listening on unix:%s\n", unix_path);
+    }
+
+    /* the pool may grow to NUM_THREADS workers, or to -t if larger */
+    pool_size = num_threads > NUM_THREADS ? num_threads : NUM_THREADS;
+    struct skvs_ctx *ctx = skvs_init(hash_size, delay, pool_size);
     if (!ctx) {
         perror("SKVS initialization failed");
         close(s);
         exit(EXIT_FAILURE);
     }
+    hash_set_compression(ctx->table, compress_min);
+    ctx->trace_every = trace_every;
 
-    pthread_t threads[num_threads];
-    for (int i = 0; i < num_threads; i++) {
-        struct thread_args *args = malloc(sizeof(struct thread_args));
-        args->listenfd = s;
-        args->idx = i;
-        args->ctx = ctx;
+    /* replication addresses are [host:]port or a unix socket path */
+    if (repl_addr) {
+        repl = skvs_repl_primary(ctx, repl_addr);
+        if (!repl) {
+            fprintf(stderr, "Failed to serve followers on %s\n", repl_addr);
+            skvs_destroy(ctx, 0);
+            close(s);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (primary_addr) {
+        follower = skvs_repl_follow(ctx, primary_addr);
+        if (!follower) {
+            fprintf(stderr, "Failed to follow %s\n", primary_addr);
+            skvs_repl_stop(repl);
+            skvs_destroy(ctx, 0);
+            close(s);
+            exit(EXIT_FAILURE);
+        }
+    }
 
-        pthread_create(&threads[i], NULL, handle_client, args);
+    if (pool_init(&g_pool, num_threads, pool_size) < 0) {
+        exit(EXIT_FAILURE);
+    }
+    g_pool.listenfd = s;
+    g_pool.unixfd = us;
+    g_pool.peer_uid = peer_uid;
+    g_pool.ctx = ctx;
+    g_pool.cpus = worker_cpus;
+    g_pool.num_cpus = num_worker_cpus;
+    g_pool.all_cpus = all_cpus;
+    ctx->threads = num_threads;
+    ctx->set_threads = pool_set_target;
+    ctx->set_threads_arg = &g_pool;
+    if (pool_apply(&g_pool) < 0) {
+        exit(EXIT_FAILURE);
     }
 
     while (!g_shutdown) {
-        sleep(1);
+        sigsuspend(&waitmask);
+        if (g_pool_changed && !g_shutdown) {
+            g_pool_changed = 0;
+            if (pool_apply(&g_pool) < 0) {
+                fprintf(stderr, "Failed to grow the worker pool\n");
+            }
+        }
+        if (g_dump_requested) {
+            g_dump_requested = 0;
+            if (!dump_path) {
+                fprintf(stderr, "No dump path given (-o)\n");
+            } else if (skvs_dump_start(ctx, dump_path, dump_format) < 0) {
+                fprintf(stderr, "A dump is already running\n");
+            } else {
+                printf("Dumping to %s in the background\n", dump_path);
+            }
+        }
     }
 
+    printf("\nReceived %s, initiating shutdown...\n",
+           g_shutdown == SIGTERM ? "SIGTERM" : "SIGINT");
     printf("Shutting down server...\n");
 
-    for (int i = 0; i < num_threads; i++) {
-        pthread_join(threads[i], NULL);
+    /* workers return once drained, within the drain timeout */
+    pool_destroy(&g_pool);
+    skvs_repl_stop(follower);
+    skvs_repl_stop(repl);
+    if (skvs_dump_wait(ctx) < 0) {
+        fprintf(stderr, "Background dump failed\n");
     }
-    skvs_destroy(ctx, 1);
+    if (dump_path && skvs_dump(ctx, dump_path, dump_format) < 0) {
+        fprintf(stderr, "Failed to dump to %s\n", dump_path);
+    }
+    skvs_destroy(ctx, dump_path == NULL);
     close(s);
+    if (us >= 0) {
+        close(us);
+        if (unix_path[0] != '@') {
+            unlink(unix_path);
+        }
+    }
+    close(g_wake_pipe[0]);
+    close(g_wake_pipe[1]);
 /*---------------------------------------------------------------------------*/
 
     return 0;
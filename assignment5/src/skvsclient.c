@@ -0,0 +1,821 @@
+/*---------------------------------------------------------------------------*/
+/* skvsclient.c                                                              */
+/* Author: Kim Sungjin                                                       */
+/*---------------------------------------------------------------------------*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <stddef.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "skvsclient.h"
+/*---------------------------------------------------------------------------*/
+/* poll slice used by skvs_client_call() so that requests submitted by other
+ * threads while one thread sleeps in poll() are picked up quickly */
+#define CALL_POLL_MS 10
+/*---------------------------------------------------------------------------*/
+/* one outstanding request; responses come back in request order on each
+ * connection, so the FIFO position is enough to correlate them */
+struct skvs_pending
+{
+    long id;
+    skvs_client_cb cb;
+    void *arg;
+    struct skvs_pending *next;
+};
+/*---------------------------------------------------------------------------*/
+struct skvs_conn
+{
+    int fd;
+
+    /* requests queued but not yet written */
+    char *wbuf;
+    size_t wlen;
+    size_t woff;
+    size_t wcap;
+
+    /* partial response; grows to hold a whole bulk value */
+    char *rbuf;
+    size_t rlen;
+    size_t rcap;
+
+    /* requests waiting for their responses, oldest first */
+    struct skvs_pending *head;
+    struct skvs_pending *tail;
+    size_t inflight;
+};
+/*---------------------------------------------------------------------------*/
+struct skvs_client
+{
+    pthread_mutex_t lock;
+    pthread_cond_t done;      // broadcast after every poll round
+    int polling;              // a thread is blocked in poll()
+
+    int pool_size;
+    int next_conn;            // round robin start for load balancing
+    long next_id;
+    struct skvs_conn *conns;
+    struct pollfd *pfds;
+    struct skvs_pending *free_reqs;
+
+    struct skvs_client_stats stats;
+};
+/*---------------------------------------------------------------------------*/
+static inline uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+/*---------------------------------------------------------------------------*/
+static int conn_open(struct skvs_conn *conn, const struct sockaddr *addr,
+                     socklen_t addrlen)
+{
+    TRACE_PRINT();
+    int s;
+
+    s = socket(addr->sa_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (s < 0)
+    {
+        DEBUG_PRINT("socket() failed");
+        return -1;
+    }
+    /* a unix domain connect never returns EINPROGRESS but may return
+     * EAGAIN when the listen backlog is full */
+    if (connect(s, addr, addrlen) < 0 && errno != EINPROGRESS)
+    {
+        DEBUG_PRINT("connect() failed");
+        close(s);
+        return -1;
+    }
+
+    conn->fd = s;
+    return 0;
+}
+/*---------------------------------------------------------------------------*/
+/* fails every request of a broken connection and closes it */
+static void conn_fail(struct skvs_client *cli, struct skvs_conn *conn,
+                      int status)
+{
+    TRACE_PRINT();
+    struct skvs_pending *req;
+
+    if (conn->fd >= 0)
+    {
+        close(conn->fd);
+        conn->fd = -1;
+    }
+    while ((req = conn->head) != NULL)
+    {
+        conn->head = req->next;
+        if (req->cb)
+        {
+            req->cb(req->arg, req->id, status, NULL, 0);
+        }
+        cli->stats.failed++;
+        req->next = cli->free_reqs;
+        cli->free_reqs = req;
+    }
+    conn->tail = NULL;
+    conn->inflight = 0;
+    conn->wlen = conn->woff = conn->rlen = 0;
+}
+/*---------------------------------------------------------------------------*/
+/* writes as much of the queued batch as the socket accepts */
+static void conn_flush(struct skvs_client *cli, struct skvs_conn *conn)
+{
+    ssize_t res;
+
+    if (conn->fd < 0 || conn->woff == conn->wlen)
+    {
+        return;
+    }
+    cli->stats.flushes++;
+    while (conn->woff < conn->wlen)
+    {
+        res = write(conn->fd, conn->wbuf + conn->woff,
+                    conn->wlen - conn->woff);
+        cli->stats.write_calls++;
+        if (res < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+            {
+                DEBUG_PRINT("write() failed");
+                conn_fail(cli, conn, SKVS_ERR_CONN);
+            }
+            return;
+        }
+        conn->woff += res;
+        cli->stats.bytes_out += res;
+    }
+    conn->wlen = conn->woff = 0;
+}
+/*---------------------------------------------------------------------------*/
+/* checks whether the response line ending at eol is a "$<len>" bulk
+ * header. returns 1 and sets *len when it is, 0 otherwise. */
+static int bulk_header(const char *line, const char *eol, size_t *len)
+{
+    const char *p;
+
+    if (line[0] != '$' || line + 1 == eol)
+    {
+        return 0;
+    }
+    *len = 0;
+    for (p = line + 1; p < eol; p++)
+    {
+        if (*p < '0' || *p > '9' || *len > MAX_BULK_LEN)
+        {
+            return 0;
+        }
+        *len = *len * 10 + (*p - '0');
+    }
+    return *len <= MAX_BULK_LEN;
+}
+/*---------------------------------------------------------------------------*/
+/* reads available responses and completes their requests.
+ * returns the number of completed requests. */
+static int conn_read(struct skvs_client *cli, struct skvs_conn *conn)
+{
+    struct skvs_pending *req;
+    char *line, *eol, *rbuf;
+    const char *resp;
+    size_t left, used, resp_len, vlen;
+    ssize_t res;
+    int completed = 0;
+
+    while (conn->fd >= 0)
+    {
+        res = read(conn->fd, conn->rbuf + conn->rlen,
+                   conn->rcap - conn->rlen);
+        cli->stats.read_calls++;
+        if (res < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+            {
+                DEBUG_PRINT("read() failed");
+                conn_fail(cli, conn, SKVS_ERR_CONN);
+            }
+            break;
+        }
+        if (res == 0)
+        {
+            DEBUG_PRINT("Connection closed by server");
+            conn_fail(cli, conn, SKVS_ERR_CONN);
+            break;
+        }
+        conn->rlen += res;
+        cli->stats.bytes_in += res;
+
+        /* complete one request per response line, or per bulk value */
+        line = conn->rbuf;
+        left = conn->rlen;
+        while ((eol = memchr(line, '\n', left)) != NULL)
+        {
+            resp = line;
+            resp_len = eol - line;
+            used = resp_len + 1;
+            if (bulk_header(line, eol, &vlen))
+            {
+                used += vlen + 1;
+                if (used > left)
+                {
+                    /* wait for the rest of the value */
+                    if (used > conn->rcap)
+                    {
+                        memmove(conn->rbuf, line, left);
+                        line = conn->rbuf;
+                        rbuf = realloc(conn->rbuf, used);
+                        if (rbuf == NULL)
+                        {
+                            conn_fail(cli, conn, SKVS_ERR_PROTO);
+                            return completed;
+                        }
+                        line = conn->rbuf = rbuf;
+                        conn->rcap = used;
+                    }
+                    break;
+                }
+                resp = eol + 1;
+                resp_len = vlen;
+            }
+
+            req = conn->head;
+            if (req == NULL)
+            {
+                DEBUG_PRINT("Unsolicited response");
+                conn_fail(cli, conn, SKVS_ERR_PROTO);
+                return completed;
+            }
+            conn->head = req->next;
+            if (conn->head == NULL)
+            {
+                conn->tail = NULL;
+            }
+            conn->inflight--;
+
+            if (req->cb)
+            {
+                req->cb(req->arg, req->id, SKVS_OK, resp, resp_len);
+            }
+            cli->stats.completed++;
+            completed++;
+            req->next = cli->free_reqs;
+            cli->free_reqs = req;
+
+            left -= used;
+            line += used;
+        }
+        if (left == conn->rcap)
+        {
+            conn_fail(cli, conn, SKVS_ERR_PROTO);
+            break;
+        }
+        memmove(conn->rbuf, line, left);
+        conn->rlen = left;
+    }
+
+    return completed;
+}
+/*---------------------------------------------------------------------------*/
+static struct skvs_client *
+client_create(const struct sockaddr *addr, socklen_t addrlen, int pool_size)
+{
+    struct skvs_client *cli;
+    int i;
+
+    if (pool_size <= 0)
+    {
+        pool_size = SKVS_CLIENT_POOL_SIZE;
+    }
+
+    cli = calloc(1, sizeof(struct skvs_client));
+    if (cli == NULL)
+    {
+        return NULL;
+    }
+    cli->conns = calloc(pool_size, sizeof(struct skvs_conn));
+    cli->pfds = calloc(pool_size, sizeof(struct pollfd));
+    if (cli->conns == NULL || cli->pfds == NULL)
+    {
+        free(cli->conns);
+        free(cli->pfds);
+        free(cli);
+        return NULL;
+    }
+    cli->pool_size = pool_size;
+    cli->next_id = 1;
+    pthread_mutex_init(&cli->lock, NULL);
+    pthread_cond_init(&cli->done, NULL);
+
+    for (i = 0; i < pool_size; i++)
+    {
+        cli->conns[i].fd = -1;
+    }
+    for (i = 0; i < pool_size; i++)
+    {
+        cli->conns[i].rcap = BUFFER_SIZE;
+        cli->conns[i].rbuf = malloc(cli->conns[i].rcap);
+        if (cli->conns[i].rbuf == NULL)
+        {
+            skvs_client_destroy(cli);
+            return NULL;
+        }
+    }
+    for (i = 0; i < pool_size; i++)
+    {
+        if (conn_open(&cli->conns[i], addr, addrlen) < 0)
+        {
+            skvs_client_destroy(cli);
+            return NULL;
+        }
+    }
+
+    return cli;
+}
+/*---------------------------------------------------------------------------*/
+struct skvs_client *
+skvs_client_create(const char *host, int port, int pool_size)
+{
+    TRACE_PRINT();
+    struct skvs_client *cli;
+    struct addrinfo hints, *ai;
+    char port_str[6];
+    int res;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    snprintf(port_str, sizeof(port_str), "%d", port);
+    res = getaddrinfo(host, port_str, &hints, &ai);
+    if (res != 0)
+    {
+        DEBUG_PRINT("getaddrinfo failed: %s", gai_strerror(res));
+        return NULL;
+    }
+
+    cli = client_create(ai->ai_addr, ai->ai_addrlen, pool_size);
+    freeaddrinfo(ai);
+
+    return cli;
+}
+/*---------------------------------------------------------------------------*/
+struct skvs_client *
+skvs_client_create_unix(const char *path, int pool_size)
+{
+    TRACE_PRINT();
+    struct sockaddr_un uaddr;
+    socklen_t addrlen;
+    size_t len = strlen(path);
+
+    if (len == 0 || len >= sizeof(uaddr.sun_path))
+    {
+        DEBUG_PRINT("Invalid unix socket path");
+        return NULL;
+    }
+
+    memset(&uaddr, 0, sizeof(uaddr));
+    uaddr.sun_family = AF_UNIX;
+    memcpy(uaddr.sun_path, path, len);
+    addrlen = offsetof(struct sockaddr_un, sun_path) + len;
+    if (path[0] == '@')
+    {
+        /* abstract namespace */
+        uaddr.sun_path[0] = '\0';
+    }
+    else
+    {
+        addrlen++;
+    }
+
+    return client_create((struct sockaddr *)&uaddr, addrlen, pool_size);
+}
+/*---------------------------------------------------------------------------*/
+void skvs_client_destroy(struct skvs_client *cli)
+{
+    TRACE_PRINT();
+    struct skvs_pending *req;
+    int i;
+
+    if (cli == NULL)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&cli->lock);
+    for (i = 0; i < cli->pool_size; i++)
+    {
+        conn_fail(cli, &cli->conns[i], SKVS_ERR_CONN);
+        free(cli->conns[i].wbuf);
+        free(cli->conns[i].rbuf);
+    }
+    while ((req = cli->free_reqs) != NULL)
+    {
+        cli->free_reqs = req->next;
+        free(req);
+    }
+    pthread_mutex_unlock(&cli->lock);
+
+    pthread_mutex_destroy(&cli->lock);
+    pthread_cond_destroy(&cli->done);
+    free(cli->conns);
+    free(cli->pfds);
+    free(cli);
+}
+/*---------------------------------------------------------------------------*/
+static long client_submit_locked(struct skvs_client *cli, const char *req,
+                                 size_t len, const void *value,
+                                 size_t value_len, skvs_client_cb cb,
+                                 void *arg, struct skvs_conn **connp)
+{
+    struct skvs_conn *conn = NULL, *c;
+    struct skvs_pending *r;
+    char hdr[32];
+    size_t need, hdr_len = 0;
+    char *wbuf;
+    int i;
+
+    if (value)
+    {
+        if (value_len > MAX_BULK_LEN)
+        {
+            return -1;
+        }
+        hdr_len = snprintf(hdr, sizeof(hdr), " $%zu\n", value_len);
+    }
+    if (len + hdr_len + 1 > BUFFER_SIZE)
+    {
+        return -1;
+    }
+
+    /* pick the live connection with the fewest requests in flight */
+    for (i = 0; i < cli->pool_size; i++)
+    {
+        c = &cli->conns[(cli->next_conn + i) % cli->pool_size];
+        if (c->fd >= 0 && (conn == NULL || c->inflight < conn->inflight))
+        {
+            conn = c;
+        }
+    }
+    if (conn == NULL)
+    {
+        return -1;
+    }
+    cli->next_conn = (cli->next_conn + 1) % cli->pool_size;
+
+    /* append the request to the connection batch */
+    need = conn->wlen + len + 1;
+    if (value)
+    {
+        need += hdr_len + value_len;
+    }
+    if (need > conn->wcap)
+    {
+        wbuf = realloc(conn->wbuf, need > 2 * conn->wcap ? need
+                                                        : 2 * conn->wcap);
+        if (wbuf == NULL)
+        {
+            return -1;
+        }
+        conn->wbuf = wbuf;
+        conn->wcap = need > 2 * conn->wcap ? need : 2 * conn->wcap;
+    }
+
+    r = cli->free_reqs;
+    if (r != NULL)
+    {
+        cli->free_reqs = r->next;
+    }
+    else if ((r = malloc(sizeof(struct skvs_pending))) == NULL)
+    {
+        return -1;
+    }
+    r->id = cli->next_id++;
+    r->cb = cb;
+    r->arg = arg;
+    r->next = NULL;
+    if (conn->tail)
+    {
+        conn->tail->next = r;
+    }
+    else
+    {
+        conn->head = r;
+    }
+    conn->tail = r;
+    conn->inflight++;
+
+    memcpy(conn->wbuf + conn->wlen, req, len);
+    conn->wlen += len;
+    if (value)
+    {
+        /* "<req> $<len>\n<value>\n" */
+        memcpy(conn->wbuf + conn->wlen, hdr, hdr_len);
+        memcpy(conn->wbuf + conn->wlen + hdr_len, value, value_len);
+        conn->wlen += hdr_len + value_len;
+    }
+    conn->wbuf[conn->wlen++] = '\n';
+    cli->stats.submitted++;
+
+    /* do not let a single batch grow past what the server reads at once */
+    if (conn->wlen - conn->woff >= BUFFER_SIZE)
+    {
+        conn_flush(cli, conn);
+    }
+
+    if (connp)
+    {
+        *connp = conn;
+    }
+    return r->id;
+}
+/*---------------------------------------------------------------------------*/
+long skvs_client_submit(struct skvs_client *cli, const char *req, size_t len,
+                        skvs_client_cb cb, void *arg)
+{
+    TRACE_PRINT();
+    uint64_t start = now_ns();
+    long id;
+
+    pthread_mutex_lock(&cli->lock);
+    id = client_submit_locked(cli, req, len, NULL, 0, cb, arg, NULL);
+    cli->stats.lib_ns += now_ns() - start;
+    pthread_mutex_unlock(&cli->lock);
+
+    return id;
+}
+/*---------------------------------------------------------------------------*/
+long skvs_client_submit_bulk(struct skvs_client *cli, const char *req,
+                             size_t len, const void *value, size_t value_len,
+                             skvs_client_cb cb, void *arg)
+{
+    TRACE_PRINT();
+    uint64_t start = now_ns();
+    long id;
+
+    pthread_mutex_lock(&cli->lock);
+    id = client_submit_locked(cli, req, len, value, value_len, cb, arg, NULL);
+    cli->stats.lib_ns += now_ns() - start;
+    pthread_mutex_unlock(&cli->lock);
+
+    return id;
+}
+/*---------------------------------------------------------------------------*/
+static int client_flush_locked(struct skvs_client *cli)
+{
+    int i, live = 0;
+
+    for (i = 0; i < cli->pool_size; i++)
+    {
+        conn_flush(cli, &cli->conns[i]);
+        if (cli->conns[i].fd >= 0)
+        {
+            live++;
+        }
+    }
+
+    return live ? 0 : -1;
+}
+/*---------------------------------------------------------------------------*/
+int skvs_client_flush(struct skvs_client *cli)
+{
+    TRACE_PRINT();
+    uint64_t start = now_ns();
+    int ret;
+
+    pthread_mutex_lock(&cli->lock);
+    ret = client_flush_locked(cli);
+    cli->stats.lib_ns += now_ns() - start;
+    pthread_mutex_unlock(&cli->lock);
+
+    return ret;
+}
+/*---------------------------------------------------------------------------*/
+/* one round of flush, poll() and read. the lock is dropped while blocked
+ * in poll() so that other threads can keep submitting requests.
+ * the time blocked is added to *waited. */
+static int client_poll_locked(struct skvs_client *cli, int timeout_ms,
+                              uint64_t *waited)
+{
+    struct skvs_conn *conn;
+    uint64_t start, wait;
+    int i, n, res, completed = 0;
+
+    if (client_flush_locked(cli) < 0)
+    {
+        return -1;
+    }
+
+    n = 0;
+    for (i = 0; i < cli->pool_size; i++)
+    {
+        conn = &cli->conns[i];
+        cli->pfds[i].fd = conn->fd;
+        cli->pfds[i].events = POLLIN;
+        cli->pfds[i].revents = 0;
+        if (conn->woff < conn->wlen)
+        {
+            cli->pfds[i].events |= POLLOUT;
+        }
+        if (conn->fd >= 0 && conn->inflight > 0)
+        {
+            n++;
+        }
+    }
+    if (n == 0)
+    {
+        /* nothing to wait for */
+        return 0;
+    }
+
+    cli->polling = 1;
+    pthread_mutex_unlock(&cli->lock);
+    start = now_ns();
+    res = poll(cli->pfds, cli->pool_size, timeout_ms);
+    pthread_mutex_lock(&cli->lock);
+    wait = now_ns() - start;
+    cli->stats.wait_ns += wait;
+    *waited += wait;
+    cli->polling = 0;
+
+    if (res < 0 && errno != EINTR)
+    {
+        DEBUG_PRINT("poll() failed");
+        pthread_cond_broadcast(&cli->done);
+        return -1;
+    }
+
+    for (i = 0; res > 0 && i < cli->pool_size; i++)
+    {
+        conn = &cli->conns[i];
+        if (cli->pfds[i].fd != conn->fd || conn->fd < 0)
+        {
+            continue;
+        }
+        if (cli->pfds[i].revents & POLLOUT)
+        {
+            conn_flush(cli, conn);
+        }
+        if (cli->pfds[i].revents & (POLLIN | POLLERR | POLLHUP))
+        {
+            completed += conn_read(cli, conn);
+        }
+    }
+    pthread_cond_broadcast(&cli->done);
+
+    return completed;
+}
+/*---------------------------------------------------------------------------*/
+int skvs_client_poll(struct skvs_client *cli, int timeout_ms)
+{
+    TRACE_PRINT();
+    uint64_t start = now_ns(), waited = 0, t;
+    int ret;
+
+    pthread_mutex_lock(&cli->lock);
+    /* only one thread may sit in poll() on the shared pollfd array */
+    while (cli->polling)
+    {
+        t = now_ns();
+        pthread_cond_wait(&cli->done, &cli->lock);
+        t = now_ns() - t;
+        cli->stats.wait_ns += t;
+        waited += t;
+    }
+    ret = client_poll_locked(cli, timeout_ms, &waited);
+    cli->stats.lib_ns += now_ns() - start - waited;
+    pthread_mutex_unlock(&cli->lock);
+
+    return ret;
+}
+/*---------------------------------------------------------------------------*/
+struct call_wait
+{
+    int done;
+    int status;
+    char *resp;
+    size_t resp_size;
+    size_t len;
+};
+/*---------------------------------------------------------------------------*/
+static void call_done(void *arg, long id, int status,
+                      const char *resp, size_t len)
+{
+    struct call_wait *w = arg;
+
+    w->done = 1;
+    w->status = status;
+    if (status != SKVS_OK)
+    {
+        return;
+    }
+    /* like snprintf(): keep what fits, report the whole length */
+    w->len = len;
+    if (len >= w->resp_size)
+    {
+        len = w->resp_size - 1;
+    }
+    memcpy(w->resp, resp, len);
+    w->resp[len] = '\0';
+}
+/*---------------------------------------------------------------------------*/
+/* keeps a pending request in its connection queue, so that responses
+ * still line up, but drops its callback */
+static void call_detach(struct skvs_conn *conn, long id)
+{
+    struct skvs_pending *req;
+
+    for (req = conn->head; req != NULL; req = req->next)
+    {
+        if (req->id == id)
+        {
+            req->cb = NULL;
+            req->arg = NULL;
+            return;
+        }
+    }
+}
+/*---------------------------------------------------------------------------*/
+int skvs_client_call(struct skvs_client *cli, const char *req,
+                     char *resp, size_t resp_size)
+{
+    TRACE_PRINT();
+    struct call_wait w = {0, SKVS_OK, resp, resp_size, 0};
+    struct skvs_conn *conn;
+    uint64_t start = now_ns(), waited = 0, t;
+    long id;
+
+    if (resp == NULL || resp_size == 0)
+    {
+        return -1;
+    }
+
+    pthread_mutex_lock(&cli->lock);
+    id = client_submit_locked(cli, req, strlen(req), NULL, 0, call_done, &w,
+                              &conn);
+    if (id < 0)
+    {
+        pthread_mutex_unlock(&cli->lock);
+        return -1;
+    }
+
+    /* another thread owns poll(); push our request out ourselves and let
+     * that thread pick up the response */
+    if (cli->polling)
+    {
+        conn_flush(cli, conn);
+    }
+
+    while (!w.done)
+    {
+        if (cli->polling)
+        {
+            t = now_ns();
+            pthread_cond_wait(&cli->done, &cli->lock);
+            t = now_ns() - t;
+            cli->stats.wait_ns += t;
+            waited += t;
+            continue;
+        }
+        if (client_poll_locked(cli, CALL_POLL_MS, &waited) < 0)
+        {
+            /* w lives on our stack; the response must not reach it */
+            call_detach(conn, id);
+            break;
+        }
+    }
+    cli->stats.lib_ns += now_ns() - start - waited;
+    pthread_mutex_unlock(&cli->lock);
+
+    if (!w.done || w.status != SKVS_OK)
+    {
+        return -1;
+    }
+    return (int)w.len;
+}
+/*---------------------------------------------------------------------------*/
+void skvs_client_get_stats(struct skvs_client *cli,
+                           struct skvs_client_stats *stats)
+{
+    TRACE_PRINT();
+    pthread_mutex_lock(&cli->lock);
+    *stats = cli->stats;
+    pthread_mutex_unlock(&cli->lock);
+}
@@ -0,0 +1,125 @@
+/*---------------------------------------------------------------------------*/
+/* skvsclient.h                                                              */
+/* Author: Kim Sungjin                                                       */
+/*---------------------------------------------------------------------------*/
+#ifndef _SKVSCLIENT_H
+#define _SKVSCLIENT_H
+/*---------------------------------------------------------------------------*/
+#include <stddef.h>
+#include <stdint.h>
+#include "common.h"
+/*---------------------------------------------------------------------------*/
+#define SKVS_CLIENT_POOL_SIZE 4
+/*---------------------------------------------------------------------------*/
+/* completion status passed to a request callback */
+enum SKVS_STATUS
+{
+    SKVS_OK = 0,
+    SKVS_ERR_CONN = -1, // connection failed before a response arrived
+    SKVS_ERR_PROTO = -2 // response did not fit in BUFFER_SIZE
+};
+/*---------------------------------------------------------------------------*/
+/**
+ * called once per request when its response arrives or it fails.
+ * resp is not null-terminated and has no line feed;
+ * it is only valid during the call.
+ * for a "$<len>" bulk response, resp is the value itself and may contain
+ * any byte.
+ */
+typedef void (*skvs_client_cb)(void *arg, long id, int status,
+                               const char *resp, size_t len);
+/*---------------------------------------------------------------------------*/
+/* counters for measuring the client overhead apart from the server */
+struct skvs_client_stats
+{
+    uint64_t submitted;   // requests queued by skvs_client_submit()
+    uint64_t completed;   // responses matched to their requests
+    uint64_t failed;      // requests completed with an error status
+    uint64_t flushes;     // batches pushed to the sockets
+    uint64_t write_calls; // write() system calls
+    uint64_t read_calls;  // read() system calls
+    uint64_t bytes_out;
+    uint64_t bytes_in;
+    uint64_t lib_ns;      // time spent inside the library
+    uint64_t wait_ns;     // time spent blocked waiting for responses
+};
+/*---------------------------------------------------------------------------*/
+struct skvs_client;
+/*---------------------------------------------------------------------------*/
+/**
+ * opens a pool of pool_size non-blocking connections to host:port.
+ * returns NULL when any internal errors occur.
+ * returns the client pointer on success.
+ */
+struct skvs_client *skvs_client_create(const char *host, int port,
+                                       int pool_size);
+/*---------------------------------------------------------------------------*/
+/**
+ * same as skvs_client_create() but connects to a server's unix domain
+ * socket. a path starting with '@' names an abstract socket.
+ */
+struct skvs_client *skvs_client_create_unix(const char *path, int pool_size);
+/*---------------------------------------------------------------------------*/
+/**
+ * closes every connection and fails all outstanding requests.
+ */
+void skvs_client_destroy(struct skvs_client *cli);
+/*---------------------------------------------------------------------------*/
+/**
+ * queues one request (e.g. "READ hello", without line feed) on the least
+ * loaded connection. nothing is sent until the next flush or poll, so
+ * requests submitted back to back are pipelined in one write.
+ * cb may be NULL. callbacks run with the client locked and must not call
+ * back into the client.
+ * returns -1 when any internal errors occur.
+ * returns the request id (> 0) on success.
+ */
+long skvs_client_submit(struct skvs_client *cli, const char *req, size_t len,
+                        skvs_client_cb cb, void *arg);
+/*---------------------------------------------------------------------------*/
+/**
+ * same as skvs_client_submit() but sends value_len bytes of value as a
+ * bulk value of up to MAX_BULK_LEN bytes. req names the command and key
+ * only, e.g. "UPDATE photo"; the "$<len>" part is added here.
+ * returns -1 when any internal errors occur.
+ * returns the request id (> 0) on success.
+ */
+long skvs_client_submit_bulk(struct skvs_client *cli, const char *req,
+                             size_t len, const void *value, size_t value_len,
+                             skvs_client_cb cb, void *arg);
+/*---------------------------------------------------------------------------*/
+/**
+ * sends every queued request without waiting for responses.
+ * returns -1 when all connections are broken.
+ * returns 0 on success.
+ */
+int skvs_client_flush(struct skvs_client *cli);
+/*---------------------------------------------------------------------------*/
+/**
+ * flushes queued requests and waits up to timeout_ms (-1 for forever)
+ * for responses, invoking their callbacks.
+ * returns -1 when all connections are broken.
+ * returns the number of completed requests on success.
+ */
+int skvs_client_poll(struct skvs_client *cli, int timeout_ms);
+/*---------------------------------------------------------------------------*/
+/**
+ * sends one request and waits for its response. safe to call from many
+ * threads at once; concurrent calls share the pooled connections.
+ * the response is copied to resp and null-terminated. as with
+ * snprintf(), at most resp_size - 1 bytes are copied and the whole
+ * response length is returned, so a return value of resp_size or more
+ * means that resp holds only the start of the response.
+ * returns -1 when any internal errors occur.
+ * returns the response length on success.
+ */
+int skvs_client_call(struct skvs_client *cli, const char *req,
+                     char *resp, size_t resp_size);
+/*---------------------------------------------------------------------------*/
+/**
+ * copies the client counters to stats.
+ */
+void skvs_client_get_stats(struct skvs_client *cli,
+                           struct skvs_client_stats *stats);
+/*---------------------------------------------------------------------------*/
+#endif // _SKVSCLIENT_H
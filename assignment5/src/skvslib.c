@@ -2,6 +2,18 @@
 /* skvslib.c                                                                 */
 /* Author: Junghan Yoon, KyoungSoo Park                                      */
 /*---------------------------------------------------------------------------*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <stdint.h>
+#include <strings.h>
+#include <stddef.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sched.h>
 #include "skvslib.h"
 /*---------------------------------------------------------------------------*/
 /* response messages and commands */
@@ -12,124 +24,374 @@ const char *g_msgs[MSG_COUNT] = {
     "NOT FOUND",
     "UPDATE OK",
     "DELETE OK",
-    "INTERNAL ERR"};
-const char *g_cmds[CMD_COUNT] = {
-    "CREATE",
-    "READ",
-    "UPDATE",
-    "DELETE"};
+    "INTERNAL ERR",
+    "READ ONLY",
+    "CONFIG OK",
+    "BUSY"};
 // const char *g_crlf = "\r\n";
 const char *g_crlf = "\n";
 /*---------------------------------------------------------------------------*/
-static inline enum CMD
-skvs_parse(char *buffer, size_t len, const char **key, const char **value)
+/* read cache of the calling worker thread, created on its first READ */
+static __thread hash_cache_t *t_cache;
+static __thread unsigned long t_cache_ctx;
+static unsigned long g_ctx_id;
+/* trace ring of the calling worker thread, created on its first request */
+static __thread struct skvs_trace *t_trace;
+static __thread unsigned long t_trace_ctx;
+/* CPUs of the thread that called skvs_init(), where resizes run */
+static cpu_set_t g_init_cpus;
+/* STATS response of the calling thread */
+static __thread char t_stats[BUFFER_SIZE];
+/* "$<len>" header of a bulk READ response of the calling thread */
+static __thread char t_bulk_hdr[32];
+/*---------------------------------------------------------------------------*/
+/* returns the read cache of the calling thread for ctx, creating and
+ * registering it on first use. returns NULL when out of memory. */
+static hash_cache_t *
+skvs_get_cache(struct skvs_ctx *ctx)
 {
-    TRACE_PRINT();
-    char *cmd;
-    int i;
+    if (t_cache && t_cache_ctx == ctx->id)
+    {
+        return t_cache;
+    }
 
-    if (len > BUFFER_SIZE)
+    t_cache = hash_cache_create();
+    if (t_cache == NULL)
     {
-        /* too large message */
-        return CMD_INVALID;
+        DEBUG_PRINT("Failed to allocate read cache");
+        return NULL;
     }
-    if (len == BUFFER_SIZE)
+    t_cache_ctx = ctx->id;
+
+    pthread_mutex_lock(&ctx->cache_lock);
+    t_cache->next = ctx->caches;
+    ctx->caches = t_cache;
+    pthread_mutex_unlock(&ctx->cache_lock);
+
+    return t_cache;
+}
+/*---------------------------------------------------------------------------*/
+/* returns the trace ring of the calling thread for ctx, creating and
+ * registering it on first use. returns NULL when out of memory. */
+static struct skvs_trace *
+skvs_get_trace(struct skvs_ctx *ctx)
+{
+    if (t_trace && t_trace_ctx == ctx->id)
     {
-        if (memcmp(&buffer[BUFFER_SIZE - 1], g_crlf, strlen(g_crlf)))
-        {
-            /* too large message */
-            return CMD_INVALID;
-        }
+        return t_trace;
+    }
 
-        /* remove line feed */
-        buffer[BUFFER_SIZE - 1] = '\0';
+    t_trace = skvs_trace_create();
+    if (t_trace == NULL)
+    {
+        return NULL;
     }
-    else
+    t_trace_ctx = ctx->id;
+
+    pthread_mutex_lock(&ctx->trace_lock);
+    t_trace->next = ctx->traces;
+    ctx->traces = t_trace;
+    pthread_mutex_unlock(&ctx->trace_lock);
+
+    return t_trace;
+}
+/*---------------------------------------------------------------------------*/
+/* answers TRACE DUMP with the trace rings of all threads as Chrome trace
+ * JSON, sent like a bulk READ since it is far larger than a line.
+ * returns the header line, or NULL when any internal errors occur. */
+static const char *
+skvs_trace_dump(struct skvs_ctx *ctx, struct skvs_bulk *bulk)
+{
+    hash_val_t *val;
+    char *json = NULL;
+    size_t len = 0;
+    FILE *out;
+    int ret;
+
+    out = open_memstream(&json, &len);
+    if (out == NULL)
+    {
+        return NULL;
+    }
+    pthread_mutex_lock(&ctx->trace_lock);
+    ret = skvs_trace_export(ctx->traces, out);
+    pthread_mutex_unlock(&ctx->trace_lock);
+    if (fclose(out) != 0 || ret < 0 || len > MAX_BULK_LEN ||
+        (val = hash_val_alloc(len)) == NULL)
+    {
+        free(json);
+        return NULL;
+    }
+    memcpy(val->data, json, len);
+    val->bulk = 1;
+    free(json);
+
+    bulk->state = BULK_SENDING;
+    bulk->val = val;
+    snprintf(t_bulk_hdr, sizeof(t_bulk_hdr), "$%zu", len);
+    return t_bulk_hdr;
+}
+/*---------------------------------------------------------------------------*/
+/* formats the read cache counters summed over all threads */
+static const char *
+skvs_stats(struct skvs_ctx *ctx)
+{
+    hash_cache_t *cache;
+    unsigned long hits = 0, misses = 0;
+
+    pthread_mutex_lock(&ctx->cache_lock);
+    for (cache = ctx->caches; cache; cache = cache->next)
     {
-        /* make it null-terminated */
-        buffer[len] = '\0';
+        hits += __atomic_load_n(&cache->hits, __ATOMIC_RELAXED);
+        misses += __atomic_load_n(&cache->misses, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&ctx->cache_lock);
+
+    snprintf(t_stats, sizeof(t_stats),
+             "cache_hits=%lu cache_misses=%lu cache_hit_rate=%.2f%% "
+             "buckets=%zu threads=%d",
+             hits, misses,
+             hits + misses ? 100.0 * hits / (hits + misses) : 0.0,
+             hash_bucket_count(ctx->table),
+             __atomic_load_n(&ctx->threads, __ATOMIC_RELAXED));
+    return t_stats;
+}
+/*---------------------------------------------------------------------------*/
+/* parses a "$<len>" bulk value token of value_len bytes.
+ * returns 1 and sets *len when value is one, 0 otherwise. */
+static int
+skvs_bulk_len(const char *value, size_t value_len, size_t *len)
+{
+    size_t i;
 
-        char *crlf_ptr = strstr(buffer, g_crlf);
-        if (crlf_ptr == NULL)
+    if (value_len < 2 || value[0] != '$')
+    {
+        return 0;
+    }
+    *len = 0;
+    for (i = 1; i < value_len; i++)
+    {
+        if (!isdigit((unsigned char)value[i]) || *len > SIZE_MAX / 10 - 1)
         {
-            return CMD_INCOMPLETE;
+            return 0;
         }
-
-        /* remove line feed */
-        *crlf_ptr = '\0';
+        *len = *len * 10 + (value[i] - '0');
     }
+    return 1;
+}
+/*---------------------------------------------------------------------------*/
+/* parses a decimal count token of len bytes.
+ * returns 1 and sets *n when it is one of at most max, 0 otherwise. */
+static int
+skvs_count(const char *token, size_t len, size_t max, size_t *n)
+{
+    size_t i;
 
-    cmd = strtok(buffer, " ");
-    if (cmd == NULL)
+    *n = 0;
+    for (i = 0; i < len; i++)
     {
-        /* no command found */
-        return CMD_INVALID;
+        if (!isdigit((unsigned char)token[i]) || *n > max)
+        {
+            return 0;
+        }
+        *n = *n * 10 + (token[i] - '0');
     }
+    return len > 0 && *n <= max;
+}
+/*---------------------------------------------------------------------------*/
+/* answers "CONFIG THREADS <n>" and "CONFIG BUCKETS <n>" */
+static const char *
+skvs_config(struct skvs_ctx *ctx, const char *name, const char *value,
+            size_t value_len)
+{
+    size_t n;
 
-    /* convert command to uppercase for case-insensitive comparison */
-    for (i = 0; cmd[i]; i++)
+    if (strcasecmp(name, "THREADS") == 0 && ctx->set_threads &&
+        skvs_count(value, value_len, INT_MAX, &n) && n > 0)
+    {
+        return ctx->set_threads(ctx->set_threads_arg, (int)n) < 0
+                   ? g_msgs[MSG_INVALID]
+                   : g_msgs[MSG_CONFIG_OK];
+    }
+    if (strcasecmp(name, "BUCKETS") == 0 &&
+        skvs_count(value, value_len, MAX_HASH_SIZE, &n) && n > 0)
     {
-        cmd[i] = toupper(cmd[i]);
+        return skvs_resize_start(ctx, n) < 0 ? g_msgs[MSG_BUSY]
+                                             : g_msgs[MSG_CONFIG_OK];
     }
+    return g_msgs[MSG_INVALID];
+}
+/*---------------------------------------------------------------------------*/
+/* copies a plain value of len bytes into a new value buffer.
+ * returns NULL when out of memory. */
+static hash_val_t *
+skvs_val_dup(const char *value, size_t len)
+{
+    hash_val_t *val = hash_val_alloc(len);
 
-    for (i = 0; i < CMD_COUNT; i++)
+    if (val)
     {
-        if (strcmp(cmd, g_cmds[i]) == 0)
-        {
-            *key = strtok(NULL, " ");
-            if (*key == NULL)
-            {
-                /* no key found */
-                return CMD_INVALID;
-            }
-            if (strlen(*key) > MAX_KEY_LEN)
-            {
-                /* too large key */
-                return CMD_INVALID;
-            }
+        memcpy(val->data, value, len);
+    }
+    return val;
+}
+/*---------------------------------------------------------------------------*/
+/* starts receiving the payload of a bulk CREATE or UPDATE. a refused
+ * upload is still received, and dropped, to keep the stream in sync. */
+static void
+skvs_bulk_begin(struct skvs_ctx *ctx, struct skvs_bulk *bulk, enum CMD cmd,
+                const char *key, size_t len)
+{
+    memset(bulk, 0, sizeof(*bulk));
+    bulk->state = BULK_RECEIVING;
+    bulk->cmd = cmd;
+    bulk->len = len;
+    strcpy(bulk->key, key);
 
-            *value = strtok(NULL, " ");
+    if (ctx->read_only)
+    {
+        bulk->resp = g_msgs[MSG_READ_ONLY];
+    }
+    else if (len > MAX_BULK_LEN)
+    {
+        bulk->resp = g_msgs[MSG_INVALID];
+    }
+    else if ((bulk->val = hash_val_alloc(len)) == NULL)
+    {
+        bulk->resp = g_msgs[MSG_INTERNAL_ERR];
+    }
+    else
+    {
+        bulk->val->bulk = 1;
+    }
+}
+/*---------------------------------------------------------------------------*/
+char *
+skvs_bulk_space(struct skvs_bulk *bulk, size_t *room)
+{
+    *room = bulk->len + 1 - bulk->done;
+    /* the value buffer has room for the closing line feed at data[len] */
+    return bulk->val ? bulk->val->data + bulk->done : NULL;
+}
+/*---------------------------------------------------------------------------*/
+const char *
+skvs_bulk_commit(struct skvs_ctx *ctx, struct skvs_bulk *bulk, size_t n)
+{
+    TRACE_PRINT();
+    const char *resp;
+    int ret;
 
-            /* handle specific cases for READ and DELETE */
-            if ((i == CMD_READ || i == CMD_DELETE) && *value != NULL)
-            {
-                /* READ or DELETE should not have a value */
-                return CMD_INVALID;
-            }
+    bulk->done += n;
+    if (bulk->done < bulk->len + 1)
+    {
+        return NULL;
+    }
 
-            /* handle specific cases for CREATE and UPDATE */
-            if ((i == CMD_CREATE || i == CMD_UPDATE) && *value == NULL)
-            {
-                /* CREATE or UPDATE must have a value */
-                return CMD_INVALID;
-            }
+    if (bulk->val == NULL)
+    {
+        resp = bulk->resp;
+    }
+    else if (bulk->val->data[bulk->len] != '\n')
+    {
+        /* the payload did not end where its length said */
+        resp = g_msgs[MSG_INVALID];
+    }
+    else
+    {
+        bulk->val->data[bulk->len] = '\0';
+        if (bulk->cmd == CMD_CREATE)
+        {
+            ret = hash_insert_val(ctx->table, bulk->key, bulk->val);
+            resp = ret > 0    ? g_msgs[MSG_CREATE_OK]
+                   : ret == 0 ? g_msgs[MSG_COLLISION]
+                              : g_msgs[MSG_INTERNAL_ERR];
+        }
+        else
+        {
+            ret = hash_update_val(ctx->table, bulk->key, bulk->val);
+            resp = ret > 0    ? g_msgs[MSG_UPDATE_OK]
+                   : ret == 0 ? g_msgs[MSG_NOT_FOUND]
+                              : g_msgs[MSG_INTERNAL_ERR];
+        }
+    }
 
-            /* check for extra tokens after value */
-            if (strtok(NULL, " ") != NULL)
-            {
-                /* extra tokens found */
-                return CMD_INVALID;
-            }
+    skvs_bulk_reset(bulk);
+    return resp;
+}
+/*---------------------------------------------------------------------------*/
+void
+skvs_bulk_reset(struct skvs_bulk *bulk)
+{
+    if (bulk->val)
+    {
+        hash_val_put(bulk->val);
+    }
+    memset(bulk, 0, sizeof(*bulk));
+}
+/*---------------------------------------------------------------------------*/
+/* answers a READ of a bulk value with a reference to it instead of a copy.
+ * returns the header line, or NULL when the value turned out to be a plain
+ * one and is sent as the response line itself. */
+static const char *
+skvs_read_val(struct skvs_ctx *ctx, const char *key, struct skvs_bulk *bulk,
+              int *ret)
+{
+    hash_val_t *val, *raw;
 
-            /* return the corresponding command enum */
-            return i;
+    *ret = hash_search_val(ctx->table, key, &val);
+    if (*ret <= 0)
+    {
+        return NULL;
+    }
+    if (val->raw_len)
+    {
+        /* decompressed per READ; the table keeps the compressed form */
+        raw = hash_val_inflate(val);
+        hash_val_put(val);
+        if (raw == NULL)
+        {
+            *ret = -1;
+            return NULL;
         }
+        val = raw;
     }
 
-    /* command not recognized */
-    return CMD_INVALID;
+    bulk->state = BULK_SENDING;
+    bulk->val = val;
+    if (!val->bulk)
+    {
+        return NULL;
+    }
+    snprintf(t_bulk_hdr, sizeof(t_bulk_hdr), "$%zu", val->len);
+    return t_bulk_hdr;
 }
 /*---------------------------------------------------------------------------*/
 struct skvs_ctx *
-skvs_init(size_t hash_size, int delay)
+skvs_init(size_t hash_size, int delay, int max_workers)
 {
     TRACE_PRINT();
     struct skvs_ctx *ctx = calloc(1, sizeof(struct skvs_ctx));
-    /* initialize the global hash table */
-    ctx->table = hash_init(hash_size, delay);
+    if (ctx == NULL)
+    {
+        DEBUG_PRINT("Failed to allocate SKVS context");
+        return NULL;
+    }
+    pthread_mutex_init(&ctx->cache_lock, NULL);
+    pthread_mutex_init(&ctx->trace_lock, NULL);
+    pthread_mutex_init(&ctx->resize_lock, NULL);
+    ctx->id = __atomic_add_fetch(&g_ctx_id, 1, __ATOMIC_RELAXED);
+    /* resizes are started by workers, which may be pinned */
+    pthread_getaffinity_np(pthread_self(), sizeof(g_init_cpus), &g_init_cpus);
+    /* initialize the global hash table; besides the workers, the resize
+     * thread and a follower's replication thread take write locks */
+    ctx->table = hash_init(hash_size, delay, max_workers + 2);
     if (ctx->table == NULL)
     {
         DEBUG_PRINT("Failed to initialize global hash table");
+        pthread_mutex_destroy(&ctx->cache_lock);
+        pthread_mutex_destroy(&ctx->trace_lock);
+        pthread_mutex_destroy(&ctx->resize_lock);
+        free(ctx);
         return NULL;
     }
 
@@ -139,6 +401,13 @@ skvs_init(size_t hash_size, int delay)
 int skvs_destroy(struct skvs_ctx *ctx, int dump)
 {
     TRACE_PRINT();
+    hash_cache_t *cache;
+    struct skvs_trace *trace;
+
+    /* a background dump still holds references into the table */
+    skvs_dump_wait(ctx);
+    skvs_resize_wait(ctx);
+    pthread_mutex_destroy(&ctx->resize_lock);
     if (dump)
     {
         hash_dump(ctx->table);
@@ -147,29 +416,245 @@ int skvs_destroy(struct skvs_ctx *ctx, int dump)
     {
         return -1;
     }
+    while ((cache = ctx->caches) != NULL)
+    {
+        ctx->caches = cache->next;
+        hash_cache_destroy(cache);
+    }
+    pthread_mutex_destroy(&ctx->cache_lock);
+    while ((trace = ctx->traces) != NULL)
+    {
+        ctx->traces = trace->next;
+        free(trace);
+    }
+    pthread_mutex_destroy(&ctx->trace_lock);
+    free(ctx);
 
     return 0;
 }
 /*---------------------------------------------------------------------------*/
-const char *
-skvs_serve(struct skvs_ctx *ctx, char *rbuf, size_t rlen)
+int skvs_dump(struct skvs_ctx *ctx, const char *path, int format)
+{
+    TRACE_PRINT();
+    char tmp[PATH_MAX];
+    int fd, ret;
+
+    if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int)sizeof(tmp))
+    {
+        DEBUG_PRINT("Dump path too long");
+        return -1;
+    }
+    fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+    {
+        perror("open");
+        return -1;
+    }
+
+    ret = hash_dump_fd(ctx->table, fd, format);
+    if (close(fd) < 0)
+    {
+        perror("close");
+        ret = -1;
+    }
+    if (ret == 0 && rename(tmp, path) < 0)
+    {
+        perror("rename");
+        ret = -1;
+    }
+    if (ret < 0)
+    {
+        unlink(tmp);
+    }
+
+    return ret;
+}
+/*---------------------------------------------------------------------------*/
+static void *
+skvs_dump_main(void *arg)
+{
+    struct skvs_ctx *ctx = arg;
+
+    ctx->dump_result = skvs_dump(ctx, ctx->dump_path, ctx->dump_format);
+    __atomic_store_n(&ctx->dump_done, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+/*---------------------------------------------------------------------------*/
+int skvs_dump_start(struct skvs_ctx *ctx, const char *path, int format)
+{
+    TRACE_PRINT();
+
+    if (ctx->dump_running)
+    {
+        if (!__atomic_load_n(&ctx->dump_done, __ATOMIC_ACQUIRE))
+        {
+            return -1;
+        }
+        skvs_dump_wait(ctx);
+    }
+
+    ctx->dump_path = strdup(path);
+    if (ctx->dump_path == NULL)
+    {
+        return -1;
+    }
+    ctx->dump_format = format;
+    ctx->dump_done = 0;
+    if (pthread_create(&ctx->dump_thread, NULL, skvs_dump_main, ctx) != 0)
+    {
+        DEBUG_PRINT("Failed to start dump thread");
+        free(ctx->dump_path);
+        ctx->dump_path = NULL;
+        return -1;
+    }
+    ctx->dump_running = 1;
+
+    return 0;
+}
+/*---------------------------------------------------------------------------*/
+int skvs_dump_wait(struct skvs_ctx *ctx)
+{
+    TRACE_PRINT();
+
+    if (!ctx->dump_running)
+    {
+        return 0;
+    }
+    pthread_join(ctx->dump_thread, NULL);
+    ctx->dump_running = 0;
+    free(ctx->dump_path);
+    ctx->dump_path = NULL;
+
+    return ctx->dump_result;
+}
+/*---------------------------------------------------------------------------*/
+static void *
+skvs_resize_main(void *arg)
+{
+    struct skvs_ctx *ctx = arg;
+
+    if (hash_resize(ctx->table, ctx->resize_to) < 0)
+    {
+        fprintf(stderr, "Failed to resize the table to %zu buckets\n",
+                ctx->resize_to);
+    }
+    else
+    {
+        printf("Table resized to %zu buckets\n", ctx->resize_to);
+    }
+    __atomic_store_n(&ctx->resize_done, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+/*---------------------------------------------------------------------------*/
+int skvs_resize_start(struct skvs_ctx *ctx, size_t hash_size)
+{
+    TRACE_PRINT();
+    pthread_attr_t attr;
+    int ret = 0, err;
+
+    /* unlike dumps, resizes are started by workers */
+    pthread_mutex_lock(&ctx->resize_lock);
+    if (ctx->resize_running)
+    {
+        if (!__atomic_load_n(&ctx->resize_done, __ATOMIC_ACQUIRE))
+        {
+            pthread_mutex_unlock(&ctx->resize_lock);
+            return -1;
+        }
+        pthread_join(ctx->resize_thread, NULL);
+        ctx->resize_running = 0;
+    }
+
+    ctx->resize_to = hash_size;
+    ctx->resize_done = 0;
+    /* run on the CPUs of skvs_init()'s caller, not on the worker's */
+    pthread_attr_init(&attr);
+    pthread_attr_setaffinity_np(&attr, sizeof(g_init_cpus), &g_init_cpus);
+    err = pthread_create(&ctx->resize_thread, &attr, skvs_resize_main, ctx);
+    pthread_attr_destroy(&attr);
+    if (err != 0)
+    {
+        DEBUG_PRINT("Failed to start resize thread");
+        ret = -1;
+    }
+    else
+    {
+        ctx->resize_running = 1;
+    }
+    pthread_mutex_unlock(&ctx->resize_lock);
+
+    return ret;
+}
+/*---------------------------------------------------------------------------*/
+void skvs_resize_wait(struct skvs_ctx *ctx)
 {
     TRACE_PRINT();
-    const char *resp, *key = NULL, *value = NULL;
+
+    pthread_mutex_lock(&ctx->resize_lock);
+    if (ctx->resize_running)
+    {
+        pthread_join(ctx->resize_thread, NULL);
+        ctx->resize_running = 0;
+    }
+    pthread_mutex_unlock(&ctx->resize_lock);
+}
+/*---------------------------------------------------------------------------*/
+static const char *
+skvs_serve_one(struct skvs_ctx *ctx, const char *rbuf, size_t rlen,
+               struct skvs_bulk *bulk, size_t *used)
+{
+    const char *resp, *value;
+    char key[MAX_KEY_LEN + 1];
+    struct skvs_req req;
+    hash_cache_t *cache;
+    hash_val_t *val;
     enum CMD cmd;
+    uint64_t traced;
+    size_t len;
     int ret;
 
     /* parse the command */
-    cmd = skvs_parse(rbuf, rlen, &key, &value);
+    traced = skvs_trace_begin();
+    cmd = skvs_parse(rbuf, rlen, &req);
+    skvs_trace_end(TRACE_STAGE_PARSE, traced);
+    *used = req.line_len;
+
+    /* the table takes NUL-terminated keys; the request line is left as is */
+    if (req.key)
+    {
+        memcpy(key, req.key, req.key_len);
+        key[req.key_len] = '\0';
+    }
+
+    if ((cmd == CMD_CREATE || cmd == CMD_UPDATE) &&
+        skvs_bulk_len(req.value, req.value_len, &len))
+    {
+        /* the value follows the request line */
+        skvs_bulk_begin(ctx, bulk, cmd, key, len);
+        return NULL;
+    }
+
+    /* a replica's table follows the primary; clients may only read */
+    if (ctx->read_only &&
+        (cmd == CMD_CREATE || cmd == CMD_UPDATE || cmd == CMD_DELETE))
+    {
+        return g_msgs[MSG_READ_ONLY];
+    }
 
     /* handle request */
+    traced = skvs_trace_begin();
     switch (cmd)
     {
     case CMD_INCOMPLETE:
         resp = NULL;
         break;
     case CMD_CREATE:
-        ret = hash_insert(ctx->table, key, value);
+        val = skvs_val_dup(req.value, req.value_len);
+        ret = val ? hash_insert_val(ctx->table, key, val) : -1;
+        if (val)
+        {
+            hash_val_put(val);
+        }
         if (ret > 0)
         {
             resp = g_msgs[MSG_CREATE_OK];
@@ -184,7 +669,24 @@ skvs_serve(struct skvs_ctx *ctx, char *rbuf, size_t rlen)
         }
         break;
     case CMD_READ:
-        ret = hash_search(ctx->table, key, &value);
+        cache = skvs_get_cache(ctx);
+        if (cache)
+        {
+            ret = hash_search_cached(ctx->table, cache, key, &value);
+        }
+        else
+        {
+            ret = HASH_FOUND_BULK;
+        }
+        if (ret == HASH_FOUND_BULK)
+        {
+            /* send the stored value itself, without copying it */
+            resp = skvs_read_val(ctx, key, bulk, &ret);
+            if (ret > 0)
+            {
+                break;
+            }
+        }
         if (ret > 0)
         {
             resp = (const char *)value;
@@ -199,7 +701,12 @@ skvs_serve(struct skvs_ctx *ctx, char *rbuf, size_t rlen)
         }
         break;
     case CMD_UPDATE:
-        ret = hash_update(ctx->table, key, value);
+        val = skvs_val_dup(req.value, req.value_len);
+        ret = val ? hash_update_val(ctx->table, key, val) : -1;
+        if (val)
+        {
+            hash_val_put(val);
+        }
         if (ret > 0)
         {
             resp = g_msgs[MSG_UPDATE_OK];
@@ -228,11 +735,120 @@ skvs_serve(struct skvs_ctx *ctx, char *rbuf, size_t rlen)
             resp = g_msgs[MSG_INTERNAL_ERR];
         }
         break;
+    case CMD_STATS:
+        resp = skvs_stats(ctx);
+        break;
+    case CMD_TRACE:
+        resp = skvs_trace_dump(ctx, bulk);
+        if (resp == NULL)
+        {
+            resp = g_msgs[MSG_INTERNAL_ERR];
+        }
+        break;
+    case CMD_CONFIG:
+        resp = skvs_config(ctx, key, req.value, req.value_len);
+        break;
     case CMD_INVALID:
     default:
         resp = g_msgs[MSG_INVALID];
         break;
     }
 
+    skvs_trace_end(TRACE_STAGE_TABLE, traced);
     return resp;
-}
\ No newline at end of file
+}
+/*---------------------------------------------------------------------------*/
+const char *
+skvs_refuse(const char *rbuf, size_t rlen, struct skvs_bulk *bulk,
+            size_t *used)
+{
+    TRACE_PRINT();
+    struct skvs_req req;
+    enum CMD cmd;
+    size_t len;
+
+    cmd = skvs_parse(rbuf, rlen, &req);
+    *used = req.line_len;
+    if (cmd == CMD_INCOMPLETE)
+    {
+        return NULL;
+    }
+    if ((cmd == CMD_CREATE || cmd == CMD_UPDATE) &&
+        skvs_bulk_len(req.value, req.value_len, &len))
+    {
+        /* the payload is still received, and dropped */
+        memset(bulk, 0, sizeof(*bulk));
+        bulk->state = BULK_RECEIVING;
+        bulk->cmd = cmd;
+        bulk->len = len;
+        bulk->resp = g_msgs[MSG_BUSY];
+        return NULL;
+    }
+    return g_msgs[MSG_BUSY];
+}
+/*---------------------------------------------------------------------------*/
+const char *
+skvs_serve(struct skvs_ctx *ctx, const char *rbuf, size_t rlen,
+           struct skvs_bulk *bulk, size_t *used)
+{
+    TRACE_PRINT();
+    struct skvs_trace *trace = NULL;
+    const char *resp;
+    uint64_t traced;
+
+    if (ctx->trace_every)
+    {
+        trace = skvs_get_trace(ctx);
+    }
+    traced = skvs_trace_request_begin(trace, ctx->trace_every);
+    resp = skvs_serve_one(ctx, rbuf, rlen, bulk, used);
+    skvs_trace_request_end(traced);
+
+    return resp;
+}
+/*---------------------------------------------------------------------------*/
+int
+skvs_unlink_stale(const char *path)
+{
+    TRACE_PRINT();
+    struct sockaddr_un uaddr;
+    struct stat st;
+    size_t len = strlen(path);
+    int s, res;
+
+    if (lstat(path, &st) < 0)
+    {
+        return errno == ENOENT ? 0 : -1;
+    }
+    if (!S_ISSOCK(st.st_mode) || len >= sizeof(uaddr.sun_path))
+    {
+        fprintf(stderr, "%s exists and is not a socket\n", path);
+        return -1;
+    }
+
+    /* a socket someone still listens on belongs to a live server */
+    if ((s = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+    {
+        perror("socket(AF_UNIX)");
+        return -1;
+    }
+    memset(&uaddr, 0, sizeof(uaddr));
+    uaddr.sun_family = AF_UNIX;
+    memcpy(uaddr.sun_path, path, len);
+    res = connect(s, (struct sockaddr *)&uaddr,
+                  offsetof(struct sockaddr_un, sun_path) + len + 1);
+    if (res == 0 || errno != ECONNREFUSED)
+    {
+        fprintf(stderr, "%s is in use\n", path);
+        close(s);
+        return -1;
+    }
+    close(s);
+
+    if (unlink(path) < 0 && errno != ENOENT)
+    {
+        perror("unlink");
+        return -1;
+    }
+    return 0;
+}
@@ -8,7 +8,10 @@
 #include <string.h>
 #include <errno.h>
 #include <ctype.h>
+#include <pthread.h>
 #include "hashtable.h"
+#include "skvstrace.h"
+#include "skvsparse.h"
 #include "common.h"
 /*---------------------------------------------------------------------------*/
 /* response message indices */
@@ -21,32 +24,95 @@ enum MSG
     MSG_UPDATE_OK,
     MSG_DELETE_OK,
     MSG_INTERNAL_ERR,
+    MSG_READ_ONLY,
+    MSG_CONFIG_OK,
+    MSG_BUSY,
     MSG_COUNT
 };
-/* command indices */
-enum CMD
+/*---------------------------------------------------------------------------*/
+/*
+ * bulk values: "CREATE <key> $<len>" or "UPDATE <key> $<len>" is followed
+ * by exactly len raw bytes and a line feed, so values may be up to
+ * MAX_BULK_LEN bytes and contain any byte. a value stored that way is
+ * returned by READ as "$<len>", a line feed, the len bytes and a line
+ * feed. values set with a plain request line are read back as before.
+ */
+/*---------------------------------------------------------------------------*/
+enum BULK
+{
+    BULK_NONE,      // no bulk transfer in progress
+    BULK_RECEIVING, // reading the payload of an upload
+    BULK_SENDING    // a READ answered with a stored value
+};
+/*---------------------------------------------------------------------------*/
+/* bulk transfer state of one connection; zero means BULK_NONE */
+struct skvs_bulk
 {
-    CMD_INCOMPLETE = -2,
-    CMD_INVALID,
-    CMD_CREATE,
-    CMD_READ,
-    CMD_UPDATE,
-    CMD_DELETE,
-    CMD_COUNT
+    enum BULK state;
+    enum CMD cmd;              // CMD_CREATE or CMD_UPDATE while receiving
+    char key[MAX_KEY_LEN + 1];
+    hash_val_t *val;           // upload target, or the value to send;
+                               // NULL while skipping a refused upload
+    size_t len;                // payload length without the line feed
+    size_t done;               // payload bytes received, with the line feed
+    const char *resp;          // response to a refused upload
 };
 /*---------------------------------------------------------------------------*/
 /* SKVS context */
 struct skvs_ctx {
     int sock;
     hashtable_t *table;
+
+    /* per-thread read caches, kept for STATS and freed on destroy */
+    pthread_mutex_t cache_lock;
+    hash_cache_t *caches;
+    unsigned long id; // tells thread-local caches of different contexts apart
+
+    int read_only; // set on replicas, which only take writes from the primary
+
+    /* per-thread trace rings, exported by "TRACE DUMP" */
+    unsigned int trace_every; // sample one request in every n, 0: off
+    pthread_mutex_t trace_lock;
+    struct skvs_trace *traces;
+
+    /* background dump, see skvs_dump_start() */
+    pthread_t dump_thread;
+    int dump_running;  // dump_thread is still to be joined
+    int dump_done;     // set by dump_thread when it finishes
+    int dump_result;
+    char *dump_path;
+    int dump_format;
+
+    /* background resize, see skvs_resize_start() */
+    pthread_mutex_t resize_lock;
+    pthread_t resize_thread;
+    int resize_running; // resize_thread is still to be joined
+    int resize_done;    // set by resize_thread when it finishes
+    size_t resize_to;
+
+    /* worker pool control for "CONFIG THREADS", installed by the server.
+     * set_threads returns -1 when n is out of range. */
+    int (*set_threads)(void *arg, int n);
+    void *set_threads_arg;
+    int threads; // size the pool is heading for, updated atomically
 };
+/*
+ * admin commands: "CONFIG THREADS <n>" resizes the worker pool and
+ * "CONFIG BUCKETS <n>" rehashes the table into n buckets, both while
+ * requests keep being served. "CONFIG OK" means the change was started;
+ * a second resize while one is running gets "BUSY". STATS reports the
+ * current sizes.
+ */
 /*---------------------------------------------------------------------------*/
 /**
  * initiates SKVS context including a thread-safe global hash table.
+ * max_workers is the most threads that serve requests at once; the
+ * table also makes room for the resize thread and a replication
+ * follower. the resize thread runs on the CPUs of the calling thread.
  * returns NULL when any internal errors occur.
  * returns the SKVS context pointer on success.
  */
-struct skvs_ctx *skvs_init(size_t hash_size, int delay);
+struct skvs_ctx *skvs_init(size_t hash_size, int delay, int max_workers);
 /*---------------------------------------------------------------------------*/
 /**
  * destroys SKVS context and the hash table.
@@ -58,13 +124,100 @@ int skvs_destroy(struct skvs_ctx *ctx, int dump);
 /*---------------------------------------------------------------------------*/
 /**
  * returns the complete SKVS commands for the given request on success
- * returns NULL when the request is incomplete.
+ * returns NULL when the request is incomplete; *used is then 0.
+ * only the first line of rbuf is served and *used is set to its length,
+ * so a caller holding several pipelined requests should call it again
+ * at rbuf + *used. rbuf is never modified.
+ *
+ * when the request starts a bulk upload, NULL is returned and bulk enters
+ * BULK_RECEIVING; feed the payload through skvs_bulk_space() and
+ * skvs_bulk_commit() before serving the next line.
+ * when a READ is answered with a stored value, bulk enters BULK_SENDING
+ * and holds a reference to it in bulk->val: send the returned line (if
+ * not NULL), then the value bytes and a line feed, then release the
+ * value with hash_val_put() and reset bulk to zero.
  * 
  * !Caveat!
  * The return value has no line feed.
  * You should copy the return value to application buffer,
  * and add a line feed at the end.
  */
-const char *skvs_serve(struct skvs_ctx *ctx, char *rbuf, size_t rlen);
+const char *skvs_serve(struct skvs_ctx *ctx, const char *rbuf, size_t rlen,
+                       struct skvs_bulk *bulk, size_t *used);
+/*---------------------------------------------------------------------------*/
+/**
+ * skips the first request of rbuf without serving it, for a client over
+ * its rate limit. returns "BUSY" and sets *used like skvs_serve(); a bulk
+ * upload enters BULK_RECEIVING instead and gets "BUSY" once its payload
+ * has been dropped. costs one parse and no table access.
+ */
+const char *skvs_refuse(const char *rbuf, size_t rlen, struct skvs_bulk *bulk,
+                        size_t *used);
+/*---------------------------------------------------------------------------*/
+/**
+ * returns where the next payload bytes of a bulk upload belong and sets
+ * *room to how many are still expected. returns NULL when the upload was
+ * refused; the caller then reads up to *room bytes anywhere and drops
+ * them. receiving straight into the returned buffer avoids any copy.
+ */
+char *skvs_bulk_space(struct skvs_bulk *bulk, size_t *room);
+/*---------------------------------------------------------------------------*/
+/**
+ * accounts for n payload bytes placed at skvs_bulk_space().
+ * returns NULL while the upload is incomplete.
+ * returns the response once it completes; bulk is then reset.
+ */
+const char *skvs_bulk_commit(struct skvs_ctx *ctx, struct skvs_bulk *bulk,
+                             size_t n);
+/*---------------------------------------------------------------------------*/
+/**
+ * releases the value held by an unfinished transfer and resets bulk.
+ */
+void skvs_bulk_reset(struct skvs_bulk *bulk);
+/*---------------------------------------------------------------------------*/
+/**
+ * dumps the table to the file at path with hash_dump_fd(), so requests
+ * can be served meanwhile. the dump is written to "<path>.tmp" and renamed
+ * to path once complete, so path never holds a partial dump.
+ * returns -1 when any internal errors occur.
+ * returns 0 on success.
+ */
+int skvs_dump(struct skvs_ctx *ctx, const char *path, int format);
+/*---------------------------------------------------------------------------*/
+/**
+ * runs skvs_dump() in a background thread. only one runs at a time.
+ * returns -1 when one is still running or any internal errors occur.
+ * returns 0 on success.
+ */
+int skvs_dump_start(struct skvs_ctx *ctx, const char *path, int format);
+/*---------------------------------------------------------------------------*/
+/**
+ * waits for the background dump, if any, to finish.
+ * returns -1 when it failed.
+ * returns 0 on success or when there was none.
+ */
+int skvs_dump_wait(struct skvs_ctx *ctx);
+/*---------------------------------------------------------------------------*/
+/**
+ * rehashes the table into hash_size buckets with hash_resize() in a
+ * background thread. only one runs at a time; any thread may start it.
+ * returns -1 when one is still running or any internal errors occur.
+ * returns 0 on success.
+ */
+int skvs_resize_start(struct skvs_ctx *ctx, size_t hash_size);
+/*---------------------------------------------------------------------------*/
+/**
+ * waits for the background resize, if any, to finish.
+ */
+void skvs_resize_wait(struct skvs_ctx *ctx);
+/*---------------------------------------------------------------------------*/
+/**
+ * removes a unix domain socket file left at path by a previous run, so
+ * that it can be bound again. a path that is not a socket, or a socket
+ * that still accepts connections, is left alone.
+ * returns -1 when path exists and must not be removed.
+ * returns 0 when path is free to bind.
+ */
+int skvs_unlink_stale(const char *path);
 /*---------------------------------------------------------------------------*/
 #endif // _SKVSLIB_H
\ No newline at end of file
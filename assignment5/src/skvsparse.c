@@ -0,0 +1,300 @@
+/*---------------------------------------------------------------------------*/
+/* skvsparse.c                                                               */
+/* Author: Kim Sungjin                                                       */
+/*---------------------------------------------------------------------------*/
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "skvsparse.h"
+#include "common.h"
+/*---------------------------------------------------------------------------*/
+#define PARSE_MAX_TOKENS 3 // command, key and value
+/* four characters as one big-endian word, so case labels read as text */
+#define OP4(a, b, c, d) \
+    ((uint32_t)(a) << 24 | (uint32_t)(b) << 16 | (uint32_t)(c) << 8 | (d))
+/*---------------------------------------------------------------------------*/
+/* returns the 4 bytes at p as a big-endian word with ASCII letters
+ * upper-cased. clearing bit 5 maps no byte but a letter onto a letter. */
+static inline uint32_t parse_fold4(const char *p)
+{
+    const unsigned char *u = (const unsigned char *)p;
+
+    return OP4(u[0], u[1], u[2], u[3]) & 0xDFDFDFDF;
+}
+/*---------------------------------------------------------------------------*/
+/* slot of a command in g_parse_cmds by the first 4 letters of its name;
+ * the multiplier keeps the seven commands apart in 8 slots */
+#define PARSE_SLOT(head) ((uint32_t)((head) * 116U) >> 29)
+/*---------------------------------------------------------------------------*/
+struct parse_cmd_slot
+{
+    uint32_t head; // first 4 letters of the name
+    uint32_t tail; // last 4 letters of the name
+    size_t len;    // 0 for an empty slot
+    enum CMD cmd;
+};
+/*---------------------------------------------------------------------------*/
+#define PARSE_CMD(a, b, c, d, tail, len, cmd) \
+    [PARSE_SLOT(OP4(a, b, c, d))] = {OP4(a, b, c, d), tail, len, cmd}
+static const struct parse_cmd_slot g_parse_cmds[8] = {
+    PARSE_CMD('C', 'R', 'E', 'A', OP4('E', 'A', 'T', 'E'), 6, CMD_CREATE),
+    PARSE_CMD('R', 'E', 'A', 'D', OP4('R', 'E', 'A', 'D'), 4, CMD_READ),
+    PARSE_CMD('U', 'P', 'D', 'A', OP4('D', 'A', 'T', 'E'), 6, CMD_UPDATE),
+    PARSE_CMD('D', 'E', 'L', 'E', OP4('L', 'E', 'T', 'E'), 6, CMD_DELETE),
+    PARSE_CMD('S', 'T', 'A', 'T', OP4('T', 'A', 'T', 'S'), 5, CMD_STATS),
+    PARSE_CMD('T', 'R', 'A', 'C', OP4('R', 'A', 'C', 'E'), 5, CMD_TRACE),
+    PARSE_CMD('C', 'O', 'N', 'F', OP4('N', 'F', 'I', 'G'), 6, CMD_CONFIG)};
+/*---------------------------------------------------------------------------*/
+/* matches a command token with a perfect hash on its first 4 letters and
+ * two overlapping 4-byte compares, which cover names of 4 to 8 letters */
+static inline enum CMD parse_cmd(const char *tok, size_t len)
+{
+    const struct parse_cmd_slot *slot;
+    uint32_t head;
+
+    if (len < 4)
+    {
+        return CMD_INVALID;
+    }
+    head = parse_fold4(tok);
+    slot = &g_parse_cmds[PARSE_SLOT(head)];
+    if (slot->len != len || slot->head != head ||
+        slot->tail != parse_fold4(tok + len - 4))
+    {
+        return CMD_INVALID;
+    }
+    return slot->cmd;
+}
+/*---------------------------------------------------------------------------*/
+/* outcomes of splitting a line other than its number of tokens */
+#define PARSE_BAD -1        // refused: a NUL byte or a token too many
+#define PARSE_INCOMPLETE -2 // no line feed yet
+#define PARSE_SLOW -3       // the fast path cannot tell
+/*---------------------------------------------------------------------------*/
+#ifdef __SSE2__
+/* returns a bit per byte of the 16 at p equal to c */
+static inline uint64_t parse_eq16(__m128i v, char c)
+{
+    return (unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8(c)));
+}
+/*---------------------------------------------------------------------------*/
+/* splits a line that ends within the first 64 bytes of buf, from bit
+ * masks of its spaces and line ends built 16 bytes at a time; this is
+ * the common case and needs no loop over the bytes. shorter buffers are
+ * padded in a copy.
+ * returns the number of tokens, PARSE_BAD or PARSE_SLOW. */
+static inline int parse_split_fast(const char *buf, size_t len,
+                                   const char **tok, size_t *tok_len,
+                                   size_t *line_len)
+{
+    char pad[64];
+    const char *p = buf;
+    uint64_t sp = 0, lf = 0, nul = 0, word, starts, ends;
+    __m128i v;
+    int i, n, s, e;
+
+    if (len < 64)
+    {
+        memcpy(pad, buf, len);
+        memset(pad + len, 'x', sizeof(pad) - len);
+        p = pad;
+    }
+    for (i = 0; i < 64 && lf == 0 && nul == 0; i += 16)
+    {
+        v = _mm_loadu_si128((const __m128i *)(p + i));
+        sp |= parse_eq16(v, ' ') << i;
+        lf |= parse_eq16(v, '\n') << i;
+        nul |= parse_eq16(v, '\0') << i;
+    }
+    e = __builtin_ctzll(lf | nul | (uint64_t)1 << 63);
+    if (!(lf >> e & 1))
+    {
+        /* no line end in reach, or a NUL before it */
+        return PARSE_SLOW;
+    }
+    *line_len = e + 1;
+
+/* a token starts at a byte of it whose predecessor is not one, and
+     * ends at the first byte after it that is not one */
+    word = ~sp & (((uint64_t)1 << e) - 1);
+    starts = word & ~(word << 1);
+    ends = ~word & (word << 1);
+    for (n = 0; starts; n++)
+    {
+        if (n == PARSE_MAX_TOKENS)
+        {
+            return PARSE_BAD;
+        }
+        s = __builtin_ctzll(starts);
+        e = __builtin_ctzll(ends);
+        tok[n] = buf + s;
+        tok_len[n] = e - s;
+        starts &= starts - 1;
+        ends &= ends - 1;
+    }
+    return n;
+}
+/*---------------------------------------------------------------------------*/
+/* returns a bit per byte of the 16 at p that is a space, line feed or NUL */
+static inline unsigned int parse_mask16(const char *p)
+{
+    __m128i v = _mm_loadu_si128((const __m128i *)p);
+
+    return parse_eq16(v, ' ') | parse_eq16(v, '\n') | parse_eq16(v, '\0');
+}
+#endif
+/*---------------------------------------------------------------------------*/
+/* returns the offset of the first space, line feed or NUL at or after i,
+ * or len when there is none */
+static inline size_t parse_delim(const char *buf, size_t i, size_t len)
+{
+#ifdef __SSE2__
+    unsigned int mask;
+
+    for (; i + 16 <= len; i += 16)
+    {
+        mask = parse_mask16(buf + i);
+        if (mask)
+        {
+            return i + __builtin_ctz(mask);
+        }
+    }
+    if (i < len && len >= 16)
+    {
+        /* the last block overlaps the one before; skip what it rereads */
+        mask = parse_mask16(buf + len - 16) >> (i - (len - 16));
+        return mask ? i + __builtin_ctz(mask) : len;
+    }
+#endif
+    /* lines shorter than a block, or no SSE2 */
+    for (; i < len; i++)
+    {
+        if (buf[i] == ' ' || buf[i] == '\n' || buf[i] == '\0')
+        {
+            return i;
+        }
+    }
+    return len;
+}
+/*---------------------------------------------------------------------------*/
+/* splits any line, a token at a time.
+ * returns the number of tokens, PARSE_BAD or PARSE_INCOMPLETE. */
+static int parse_split(const char *buf, size_t len, const char **tok,
+                       size_t *tok_len, size_t *line_len)
+{
+    size_t i = 0, end;
+    const char *eol;
+    int n = 0, bad = 0;
+
+    for (;;)
+    {
+        while (i < len && buf[i] == ' ')
+        {
+            i++;
+        }
+        end = parse_delim(buf, i, len);
+        if (end > i)
+        {
+            if (n == PARSE_MAX_TOKENS)
+            {
+                bad = 1;
+                break;
+            }
+            tok[n] = buf + i;
+            tok_len[n++] = end - i;
+        }
+        if (end == len || buf[end] != ' ')
+        {
+            break;
+        }
+        i = end + 1;
+    }
+    if (bad || (end < len && buf[end] == '\0'))
+    {
+        /* the request is refused; only its end is of interest */
+        eol = memchr(buf + i, '\n', len - i);
+        end = eol ? (size_t)(eol - buf) : len;
+        bad = 1;
+    }
+
+    if (end == len)
+    {
+        if (len < BUFFER_SIZE)
+        {
+            return PARSE_INCOMPLETE;
+        }
+        /* a line longer than the buffer can never complete */
+        *line_len = len;
+        return PARSE_BAD;
+    }
+    *line_len = end + 1;
+    return bad || end >= BUFFER_SIZE ? PARSE_BAD : n;
+}
+/*---------------------------------------------------------------------------*/
+enum CMD skvs_parse(const char *buf, size_t len, struct skvs_req *req)
+{
+    TRACE_PRINT();
+    const char *tok[PARSE_MAX_TOKENS];
+    size_t tok_len[PARSE_MAX_TOKENS];
+    enum CMD cmd;
+    int n = PARSE_SLOW;
+
+    req->key = req->value = NULL;
+    req->key_len = req->value_len = req->line_len = 0;
+#ifdef __SSE2__
+    n = parse_split_fast(buf, len, tok, tok_len, &req->line_len);
+#endif
+    if (n == PARSE_SLOW)
+    {
+        n = parse_split(buf, len, tok, tok_len, &req->line_len);
+    }
+    if (n == PARSE_INCOMPLETE)
+    {
+        return CMD_INCOMPLETE;
+    }
+    if (n <= 0)
+    {
+        return CMD_INVALID;
+    }
+
+    cmd = parse_cmd(tok[0], tok_len[0]);
+    switch (cmd)
+    {
+    case CMD_INVALID:
+        return CMD_INVALID;
+    case CMD_STATS:
+        /* STATS takes no argument */
+        return n == 1 ? cmd : CMD_INVALID;
+    case CMD_TRACE:
+        /* TRACE DUMP is the only form */
+        return n == 2 && tok_len[1] == 4 &&
+                       parse_fold4(tok[1]) == OP4('D', 'U', 'M', 'P')
+                   ? cmd
+                   : CMD_INVALID;
+    default:
+        break;
+    }
+
+    if (n < 2 || tok_len[1] > MAX_KEY_LEN)
+    {
+        /* no key, or too large key */
+        return CMD_INVALID;
+    }
+    req->key = tok[1];
+    req->key_len = tok_len[1];
+    if (n == 3)
+    {
+        req->value = tok[2];
+        req->value_len = tok_len[2];
+    }
+
+    /* READ and DELETE take no value, CREATE, UPDATE and CONFIG need one */
+    if ((cmd == CMD_READ || cmd == CMD_DELETE) != (n == 2))
+    {
+        return CMD_INVALID;
+    }
+    return cmd;
+}
@@ -0,0 +1,53 @@
+/*---------------------------------------------------------------------------*/
+/* skvsparse.h                                                               */
+/* Author: Kim Sungjin                                                       */
+/*---------------------------------------------------------------------------*/
+#ifndef _SKVSPARSE_H
+#define _SKVSPARSE_H
+/*---------------------------------------------------------------------------*/
+#include <stddef.h>
+/*---------------------------------------------------------------------------*/
+/* command indices */
+enum CMD
+{
+    CMD_INCOMPLETE = -2,
+    CMD_INVALID,
+    CMD_CREATE,
+    CMD_READ,
+    CMD_UPDATE,
+    CMD_DELETE,
+    CMD_STATS,
+    CMD_TRACE,
+    CMD_CONFIG,
+    CMD_COUNT
+};
+/*---------------------------------------------------------------------------*/
+/*
+ * a request line is "<cmd> [key [value]]" and a line feed, its tokens
+ * separated by runs of spaces and the command matched regardless of case.
+ * the line is read once, 16 bytes at a time with SSE2 where available
+ * (lines of up to 63 bytes are split from one 64-bit delimiter mask),
+ * and never written to: key and value point into it and are not
+ * NUL-terminated.
+ */
+/*---------------------------------------------------------------------------*/
+struct skvs_req
+{
+    const char *key;   // NULL when the request has none
+    size_t key_len;
+    const char *value; // NULL when the request has none
+    size_t value_len;
+    size_t line_len;   // bytes of the request, line feed included
+};
+/*---------------------------------------------------------------------------*/
+/**
+ * parses the request line at the start of the len bytes at buf.
+ * returns CMD_INCOMPLETE when its line feed has not arrived yet.
+ * returns CMD_INVALID when it is malformed or longer than BUFFER_SIZE.
+ * returns the command otherwise.
+ * unless CMD_INCOMPLETE is returned, req->line_len tells where the next
+ * request starts.
+ */
+enum CMD skvs_parse(const char *buf, size_t len, struct skvs_req *req);
+/*---------------------------------------------------------------------------*/
+#endif // _SKVSPARSE_H
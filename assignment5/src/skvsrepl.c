@@ -0,0 +1,841 @@
+/*---------------------------------------------------------------------------*/
+/* skvsrepl.c                                                                */
+/* Author: Kim Sungjin                                                       */
+/*---------------------------------------------------------------------------*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <poll.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <stddef.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/uio.h>
+#include "skvsrepl.h"
+/*---------------------------------------------------------------------------*/
+#define REPL_POLL_MS 1000 // how often blocked threads check for stop
+/*---------------------------------------------------------------------------*/
+/* mutation log: a byte ring holding the newest REPL_LOG_SIZE bytes of
+ * records. positions count every byte ever appended, so a reader whose
+ * position fell more than REPL_LOG_SIZE behind the tail has lost data. */
+struct repl_log
+{
+    pthread_mutex_t lock;
+    pthread_cond_t appended;
+    char *buf;
+    uint64_t tail; // position of the next record
+};
+/*---------------------------------------------------------------------------*/
+/* primary side of one follower connection */
+struct repl_sender
+{
+    struct skvs_repl *repl;
+    int fd;
+    pthread_t tid;
+    int done; // set by the sender thread when it exits
+    struct repl_sender *next;
+};
+/*---------------------------------------------------------------------------*/
+struct skvs_repl
+{
+    struct skvs_ctx *ctx;
+    int is_primary;
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+    char unix_path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+    int lfd;   // follower listener (primary only)
+    int stop;  // accessed atomically
+    pthread_t tid;
+
+    struct repl_log log;
+    struct repl_sender *senders;
+};
+/*---------------------------------------------------------------------------*/
+/* snapshot buffer of a sender; filled under a bucket read lock and
+ * written out after the lock is released */
+struct repl_snap
+{
+    char *buf;
+    size_t len;
+    size_t cap;
+};
+/*---------------------------------------------------------------------------*/
+/* header of a PUT or ZIP record */
+struct repl_put
+{
+    char key[MAX_KEY_LEN + 1];
+    size_t len;     // value bytes following the header line
+    size_t raw_len; // length before compression, 0 for PUT
+    int bulk;
+};
+/*---------------------------------------------------------------------------*/
+static inline int repl_stopped(struct skvs_repl *repl)
+{
+    return __atomic_load_n(&repl->stop, __ATOMIC_ACQUIRE);
+}
+/*---------------------------------------------------------------------------*/
+/* fills repl->addr from a replication address. for a listening unix
+ * socket a stale socket file is removed, see skvs_unlink_stale().
+ * returns -1 on error, 0 on success. */
+static int repl_resolve(struct skvs_repl *repl, const char *addr, int listen)
+{
+    struct sockaddr_un *ua = (struct sockaddr_un *)&repl->addr;
+    struct sockaddr_in *ia = (struct sockaddr_in *)&repl->addr;
+    char host[64];
+    const char *colon;
+    size_t len = strlen(addr);
+
+    memset(&repl->addr, 0, sizeof(repl->addr));
+    if (addr[0] == '@' || strchr(addr, '/'))
+    {
+        if (len == 0 || len >= sizeof(ua->sun_path))
+        {
+            fprintf(stderr, "Invalid unix socket path: %s\n", addr);
+            return -1;
+        }
+        ua->sun_family = AF_UNIX;
+        memcpy(ua->sun_path, addr, len);
+        repl->addrlen = offsetof(struct sockaddr_un, sun_path) + len;
+        if (addr[0] == '@')
+        {
+            ua->sun_path[0] = '\0';
+        }
+        else
+        {
+            repl->addrlen++;
+            strcpy(repl->unix_path, addr);
+            if (listen && skvs_unlink_stale(addr) < 0)
+            {
+                return -1;
+            }
+        }
+        return 0;
+    }
+
+    colon = strrchr(addr, ':');
+    if (colon)
+    {
+        if ((size_t)(colon - addr) >= sizeof(host))
+        {
+            fprintf(stderr, "Invalid host: %s\n", addr);
+            return -1;
+        }
+        memcpy(host, addr, colon - addr);
+        host[colon - addr] = '\0';
+    }
+    else
+    {
+        strcpy(host, listen ? DEFAULT_ANY_IP : DEFAULT_LOOPBACK_IP);
+    }
+    ia->sin_family = AF_INET;
+    ia->sin_addr.s_addr = inet_addr(host);
+    ia->sin_port = htons(atoi(colon ? colon + 1 : addr));
+    repl->addrlen = sizeof(*ia);
+    return 0;
+}
+/*---------------------------------------------------------------------------*/
+/* writes all len bytes to the non-blocking socket fd. a follower that
+ * takes nothing for REPL_STALL_SEC is given up on; it reconnects and
+ * resynchronizes from a fresh snapshot.
+ * returns -1 on error, stall or stop, 0 on success. */
+static int repl_write_all(struct skvs_repl *repl, int fd, const char *buf,
+                          size_t len)
+{
+    struct pollfd pfd;
+    ssize_t res;
+    int idle_ms = 0;
+
+    while (len > 0)
+    {
+        res = write(fd, buf, len);
+        if (res < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+            {
+                DEBUG_PRINT("write() to follower failed");
+                return -1;
+            }
+            if (idle_ms >= REPL_STALL_SEC * 1000)
+            {
+                printf("Follower stopped reading, dropping it\n");
+                return -1;
+            }
+            pfd.fd = fd;
+            pfd.events = POLLOUT;
+            res = poll(&pfd, 1, REPL_POLL_MS);
+            if (res < 0 && errno != EINTR)
+            {
+                return -1;
+            }
+            if (res == 0)
+            {
+                idle_ms += REPL_POLL_MS;
+            }
+            if (repl_stopped(repl))
+            {
+                return -1;
+            }
+            continue;
+        }
+        buf += res;
+        len -= res;
+        idle_ms = 0;
+    }
+
+    return 0;
+}
+/*---------------------------------------------------------------------------*/
+static void repl_log_append(struct repl_log *log, const struct iovec *iov,
+                            int cnt)
+{
+    const char *rec;
+    size_t len, off, first;
+    int i;
+
+    pthread_mutex_lock(&log->lock);
+    for (i = 0; i < cnt; i++)
+    {
+        rec = iov[i].iov_base;
+        len = iov[i].iov_len;
+        off = log->tail % REPL_LOG_SIZE;
+        first = len < REPL_LOG_SIZE - off ? len : REPL_LOG_SIZE - off;
+        memcpy(log->buf + off, rec, first);
+        memcpy(log->buf, rec + first, len - first);
+        log->tail += len;
+    }
+    pthread_cond_broadcast(&log->appended);
+    pthread_mutex_unlock(&log->lock);
+}
+/*---------------------------------------------------------------------------*/
+/* copies up to max log bytes from *pos, waiting for new records.
+ * returns -1 when *pos was overwritten, 0 on stop or timeout,
+ * the number of bytes copied otherwise. */
+static long repl_log_read(struct skvs_repl *repl, uint64_t *pos, char *buf,
+                          size_t max)
+{
+    struct repl_log *log = &repl->log;
+    struct timespec deadline;
+    size_t n, off, first;
+
+    pthread_mutex_lock(&log->lock);
+    if (log->tail == *pos)
+    {
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += REPL_POLL_MS / 1000;
+        pthread_cond_timedwait(&log->appended, &log->lock, &deadline);
+    }
+    if (log->tail - *pos > REPL_LOG_SIZE)
+    {
+        pthread_mutex_unlock(&log->lock);
+        return -1;
+    }
+
+    n = log->tail - *pos < max ? log->tail - *pos : max;
+    off = *pos % REPL_LOG_SIZE;
+    first = n < REPL_LOG_SIZE - off ? n : REPL_LOG_SIZE - off;
+    memcpy(buf, log->buf + off, first);
+    memcpy(buf + first, log->buf, n - first);
+    *pos += n;
+    pthread_mutex_unlock(&log->lock);
+
+    return n;
+}
+/*---------------------------------------------------------------------------*/
+/* describes the record for a write as header, value bytes and trailer.
+ * returns the number of iovecs used. */
+static int repl_record(char *hdr, size_t hdr_size, int op, const char *key,
+                       const hash_val_t *val, struct iovec *iov)
+{
+    if (op == HASH_WRITE_DEL)
+    {
+        iov[0].iov_len = snprintf(hdr, hdr_size, "DEL %s\n", key);
+        iov[0].iov_base = hdr;
+        return 1;
+    }
+
+    /* bulk and compressed values may hold any byte, so they are
+     * length-prefixed; compressed ones are shipped as they are stored */
+    if (val->raw_len)
+    {
+        iov[0].iov_len = snprintf(hdr, hdr_size, "ZIP %s %zu %zu %d\n", key,
+                                  val->len, val->raw_len, val->bulk);
+    }
+    else if (val->bulk)
+    {
+        iov[0].iov_len = snprintf(hdr, hdr_size, "PUT %s %zu\n", key,
+                                  val->len);
+    }
+    else
+    {
+        iov[0].iov_len = snprintf(hdr, hdr_size, "SET %s ", key);
+    }
+    iov[0].iov_base = hdr;
+    iov[1].iov_base = (char *)val->data;
+    iov[1].iov_len = val->len;
+    iov[2].iov_base = "\n";
+    iov[2].iov_len = 1;
+    return 3;
+}
+/*---------------------------------------------------------------------------*/
+/* write hook of the primary table; runs under the bucket write lock */
+static void repl_on_write(void *arg, int op, const char *key,
+                          const hash_val_t *val)
+{
+    struct skvs_repl *repl = arg;
+    char hdr[MAX_KEY_LEN + 32];
+    struct iovec iov[3];
+    int cnt;
+
+    cnt = repl_record(hdr, sizeof(hdr), op, key, val, iov);
+    repl_log_append(&repl->log, iov, cnt);
+}
+/*---------------------------------------------------------------------------*/
+static int repl_snap_entry(void *arg, const char *key,
+                           const hash_val_t *val)
+{
+    struct repl_snap *snap = arg;
+    char hdr[MAX_KEY_LEN + 32];
+    struct iovec iov[3];
+    size_t need = 0;
+    char *buf;
+    int i, cnt;
+
+    cnt = repl_record(hdr, sizeof(hdr), HASH_WRITE_SET, key, val, iov);
+    for (i = 0; i < cnt; i++)
+    {
+        need += iov[i].iov_len;
+    }
+    if (snap->len + need > snap->cap)
+    {
+        snap->cap = (snap->len + need) * 2;
+        buf = realloc(snap->buf, snap->cap);
+        if (buf == NULL)
+        {
+            DEBUG_PRINT("Failed to grow snapshot buffer");
+            return -1;
+        }
+        snap->buf = buf;
+    }
+    for (i = 0; i < cnt; i++)
+    {
+        memcpy(snap->buf + snap->len, iov[i].iov_base, iov[i].iov_len);
+        snap->len += iov[i].iov_len;
+    }
+    return 0;
+}
+/*---------------------------------------------------------------------------*/
+/* sends the snapshot of every bucket, then streams the log to a follower */
+static void *repl_send(void *arg)
+{
+    struct repl_sender *s = arg;
+    struct skvs_repl *repl = s->repl;
+    hashtable_t *table = repl->ctx->table;
+    struct repl_snap snap = {NULL, 0, 0};
+    uint64_t pos;
+    size_t hash_size, i = 0;
+    unsigned long gen;
+    long n;
+    int failed = 0;
+
+    /* writes logged after this position may also be in the snapshot;
+     * replaying them is harmless because records are idempotent */
+    pthread_mutex_lock(&repl->log.lock);
+    pos = repl->log.tail;
+    pthread_mutex_unlock(&repl->log.lock);
+
+    /* buckets are copied a batch at a time under the scan lock, which is
+     * dropped while the batch is written, so a slow follower never holds
+     * up a resize. a resize in between renumbers the buckets, so the
+     * snapshot starts over; entries sent twice are harmless. */
+    hash_size = hash_scan_begin(table);
+    gen = hash_scan_generation(table);
+    while (i < hash_size && !repl_stopped(repl))
+    {
+        if (hash_scan_bucket(table, i++, repl_snap_entry, &snap) < 0)
+        {
+            failed = 1;
+            break;
+        }
+        if (snap.len < REPL_BATCH_SIZE && i < hash_size)
+        {
+            continue;
+        }
+        hash_scan_end(table);
+        if (repl_write_all(repl, s->fd, snap.buf, snap.len) < 0)
+        {
+            goto out;
+        }
+        snap.len = 0;
+        hash_size = hash_scan_begin(table);
+        if (hash_scan_generation(table) != gen)
+        {
+            gen = hash_scan_generation(table);
+            i = 0;
+        }
+    }
+    hash_scan_end(table);
+    if (failed || i < hash_size ||
+        repl_write_all(repl, s->fd, "SYNCED\n", 7) < 0)
+    {
+        goto out;
+    }
+
+    /* reuse the snapshot buffer for log batches */
+    if (snap.cap < REPL_BATCH_SIZE)
+    {
+        free(snap.buf);
+        snap.cap = REPL_BATCH_SIZE;
+        snap.buf = malloc(snap.cap);
+        if (snap.buf == NULL)
+        {
+            goto out;
+        }
+    }
+    while (!repl_stopped(repl))
+    {
+        n = repl_log_read(repl, &pos, snap.buf, REPL_BATCH_SIZE);
+        if (n < 0)
+        {
+            printf("Follower fell behind the replication log, "
+                   "dropping it\n");
+            break;
+        }
+        if (n > 0 && repl_write_all(repl, s->fd, snap.buf, n) < 0)
+        {
+            break;
+        }
+    }
+
+out:
+    printf("Follower disconnected\n");
+    free(snap.buf);
+    close(s->fd);
+    __atomic_store_n(&s->done, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+/*---------------------------------------------------------------------------*/
+/* joins sender threads that have exited, or all of them when all is set */
+static void repl_reap(struct skvs_repl *repl, int all)
+{
+    struct repl_sender **link = &repl->senders, *s;
+
+    while ((s = *link) != NULL)
+    {
+        if (all || __atomic_load_n(&s->done, __ATOMIC_ACQUIRE))
+        {
+            pthread_join(s->tid, NULL);
+            *link = s->next;
+            free(s);
+        }
+        else
+        {
+            link = &s->next;
+        }
+    }
+}
+/*---------------------------------------------------------------------------*/
+/* accepts followers and starts a sender thread for each */
+static void *repl_accept(void *arg)
+{
+    struct skvs_repl *repl = arg;
+    struct repl_sender *s;
+    struct pollfd pfd;
+    int fd;
+
+    pfd.fd = repl->lfd;
+    pfd.events = POLLIN;
+    while (!repl_stopped(repl))
+    {
+        repl_reap(repl, 0);
+        if (poll(&pfd, 1, REPL_POLL_MS) <= 0)
+        {
+            continue;
+        }
+
+        fd = accept4(repl->lfd, NULL, NULL, SOCK_NONBLOCK);
+        if (fd < 0)
+        {
+            continue;
+        }
+        s = calloc(1, sizeof(struct repl_sender));
+        if (s == NULL)
+        {
+            DEBUG_PRINT("Failed to allocate follower");
+            close(fd);
+            continue;
+        }
+        s->repl = repl;
+        s->fd = fd;
+        if (pthread_create(&s->tid, NULL, repl_send, s) != 0)
+        {
+            DEBUG_PRINT("Failed to start follower sender");
+            close(fd);
+            free(s);
+            continue;
+        }
+        s->next = repl->senders;
+        repl->senders = s;
+        printf("Follower connected\n");
+    }
+
+    repl_reap(repl, 1);
+    return NULL;
+}
+/*---------------------------------------------------------------------------*/
+/* applies one record of the stream.
+ * returns -1 on a malformed record, 0 on success. */
+static int repl_apply(struct skvs_ctx *ctx, char *line)
+{
+    char *key, *value;
+
+    if (strcmp(line, "SYNCED") == 0)
+    {
+        printf("Replica synchronized with primary\n");
+        return 0;
+    }
+    if (strncmp(line, "DEL ", 4) == 0)
+    {
+        return hash_delete(ctx->table, line + 4) < 0 ? -1 : 0;
+    }
+    if (strncmp(line, "SET ", 4) == 0)
+    {
+        key = line + 4;
+        value = strchr(key, ' ');
+        if (value == NULL)
+        {
+            return -1;
+        }
+        *value++ = '\0';
+        /* upsert: the snapshot and the log may both carry the key */
+        if (hash_insert(ctx->table, key, value) == 0 &&
+            hash_update(ctx->table, key, value) < 0)
+        {
+            return -1;
+        }
+        return 0;
+    }
+
+    DEBUG_PRINT("Malformed replication record");
+    return -1;
+}
+/*---------------------------------------------------------------------------*/
+/* applies a PUT or ZIP record whose value is the len bytes at data */
+static int repl_apply_bulk(struct skvs_ctx *ctx, const char *key,
+                           const char *data, const struct repl_put *put)
+{
+    hash_val_t *val = hash_val_alloc(put->len);
+    int ret;
+
+    if (val == NULL)
+    {
+        return -1;
+    }
+    memcpy(val->data, data, put->len);
+    val->raw_len = put->raw_len;
+    val->bulk = put->bulk;
+    ret = hash_insert_val(ctx->table, key, val);
+    if (ret == 0)
+    {
+        ret = hash_update_val(ctx->table, key, val);
+    }
+    hash_val_put(val);
+
+    return ret < 0 ? -1 : 0;
+}
+/*---------------------------------------------------------------------------*/
+/* parses a "PUT <key> <len>" or "ZIP <key> <len> <raw_len> <bulk>"
+ * line, copying the key out.
+ * returns 1 when line is one, 0 otherwise. */
+static int repl_parse_put(const char *line, struct repl_put *put)
+{
+    const char *sp;
+    char *end;
+    int zip = strncmp(line, "ZIP ", 4) == 0;
+
+    if ((!zip && strncmp(line, "PUT ", 4) != 0) ||
+        (sp = strchr(line + 4, ' ')) == NULL || sp - (line + 4) > MAX_KEY_LEN)
+    {
+        return 0;
+    }
+    put->len = strtoull(sp + 1, &end, 10);
+    put->raw_len = 0;
+    put->bulk = 1;
+    if (zip)
+    {
+        put->raw_len = strtoull(end, &end, 10);
+        put->bulk = strtol(end, &end, 10);
+        if (put->raw_len == 0 || put->raw_len > MAX_BULK_LEN)
+        {
+            return 0;
+        }
+    }
+    if (*end != '\0' || put->len > MAX_BULK_LEN)
+    {
+        return 0;
+    }
+    memcpy(put->key, line + 4, sp - (line + 4));
+    put->key[sp - (line + 4)] = '\0';
+    return 1;
+}
+/*---------------------------------------------------------------------------*/
+/* applies the stream of one primary connection until it breaks */
+static void repl_receive(struct skvs_repl *repl, int fd)
+{
+    size_t cap = REPL_BATCH_SIZE, len = 0, start, need;
+    char *buf = malloc(cap), *grown, *eol;
+    struct repl_put put;
+    struct pollfd pfd;
+    ssize_t res;
+
+    if (buf == NULL)
+    {
+        return;
+    }
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    while (!repl_stopped(repl))
+    {
+        if (poll(&pfd, 1, REPL_POLL_MS) <= 0)
+        {
+            continue;
+        }
+        res = read(fd, buf + len, cap - len);
+        if (res < 0 && (errno == EINTR || errno == EAGAIN))
+        {
+            continue;
+        }
+        if (res <= 0)
+        {
+            break;
+        }
+        len += res;
+
+        start = 0;
+        while ((eol = memchr(buf + start, '\n', len - start)) != NULL)
+        {
+            need = eol - buf + 1;
+            if (strncmp(buf + start, "PUT ", 4) == 0 ||
+                strncmp(buf + start, "ZIP ", 4) == 0)
+            {
+                /* a bulk value follows the line; wait until it is all
+                 * here, growing the buffer when it cannot fit */
+                *eol = '\0';
+                if (!repl_parse_put(buf + start, &put))
+                {
+                    DEBUG_PRINT("Malformed replication record");
+                    goto out;
+                }
+                *eol = '\n';
+                need += put.len + 1;
+                if (need > len)
+                {
+                    if (need - start > cap)
+                    {
+                        grown = realloc(buf, need - start);
+                        if (grown == NULL)
+                        {
+                            goto out;
+                        }
+                        buf = grown;
+                        cap = need - start;
+                    }
+                    break;
+                }
+                if (buf[need - 1] != '\n' ||
+                    repl_apply_bulk(repl->ctx, put.key, eol + 1, &put) < 0)
+                {
+                    goto out;
+                }
+            }
+            else
+            {
+                *eol = '\0';
+                if (repl_apply(repl->ctx, buf + start) < 0)
+                {
+                    goto out;
+                }
+            }
+            start = need;
+        }
+        if (start == 0 && len == cap)
+        {
+            DEBUG_PRINT("Replication record too large");
+            break;
+        }
+        len -= start;
+        memmove(buf, buf + start, len);
+    }
+
+out:
+    free(buf);
+}
+/*---------------------------------------------------------------------------*/
+/* connects to the primary and follows it, reconnecting when it is lost */
+static void *repl_follow(void *arg)
+{
+    struct skvs_repl *repl = arg;
+    int fd, i;
+
+    while (!repl_stopped(repl))
+    {
+        fd = socket(repl->addr.ss_family, SOCK_STREAM, 0);
+        if (fd >= 0 &&
+            connect(fd, (struct sockaddr *)&repl->addr, repl->addrlen) == 0)
+        {
+            printf("Connected to primary, resynchronizing\n");
+            /* keys deleted while we were away are not in the snapshot */
+            hash_clear(repl->ctx->table);
+            repl_receive(repl, fd);
+            if (!repl_stopped(repl))
+            {
+                printf("Lost connection to primary\n");
+            }
+        }
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+
+        for (i = 0; i < REPL_RETRY_SEC && !repl_stopped(repl); i++)
+        {
+            sleep(1);
+        }
+    }
+
+    return NULL;
+}
+/*---------------------------------------------------------------------------*/
+struct skvs_repl *skvs_repl_primary(struct skvs_ctx *ctx, const char *addr)
+{
+    TRACE_PRINT();
+    struct skvs_repl *repl = calloc(1, sizeof(struct skvs_repl));
+    int optval = 1;
+
+    if (repl == NULL)
+    {
+        DEBUG_PRINT("Failed to allocate replication state");
+        return NULL;
+    }
+    repl->ctx = ctx;
+    repl->is_primary = 1;
+    repl->lfd = -1;
+    if (repl_resolve(repl, addr, 1) < 0)
+    {
+        free(repl);
+        return NULL;
+    }
+
+    repl->log.buf = malloc(REPL_LOG_SIZE);
+    if (repl->log.buf == NULL)
+    {
+        DEBUG_PRINT("Failed to allocate replication log");
+        free(repl);
+        return NULL;
+    }
+    pthread_mutex_init(&repl->log.lock, NULL);
+    pthread_cond_init(&repl->log.appended, NULL);
+
+    repl->lfd = socket(repl->addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (repl->lfd < 0)
+    {
+        perror("socket(replication)");
+        goto fail;
+    }
+    if (repl->addr.ss_family == AF_INET)
+    {
+        setsockopt(repl->lfd, SOL_SOCKET, SO_REUSEADDR, &optval,
+                   sizeof(optval));
+    }
+    if (bind(repl->lfd, (struct sockaddr *)&repl->addr, repl->addrlen) < 0 ||
+        listen(repl->lfd, NUM_BACKLOG) < 0)
+    {
+        perror("bind/listen(replication)");
+        goto fail;
+    }
+
+    hash_set_write_hook(ctx->table, repl_on_write, repl);
+    if (pthread_create(&repl->tid, NULL, repl_accept, repl) != 0)
+    {
+        hash_set_write_hook(ctx->table, NULL, NULL);
+        goto fail;
+    }
+
+    printf("Serving followers on %s\n", addr);
+    return repl;
+
+fail:
+    if (repl->lfd >= 0)
+    {
+        close(repl->lfd);
+    }
+    pthread_cond_destroy(&repl->log.appended);
+    pthread_mutex_destroy(&repl->log.lock);
+    free(repl->log.buf);
+    free(repl);
+    return NULL;
+}
+/*---------------------------------------------------------------------------*/
+struct skvs_repl *skvs_repl_follow(struct skvs_ctx *ctx, const char *addr)
+{
+    TRACE_PRINT();
+    struct skvs_repl *repl = calloc(1, sizeof(struct skvs_repl));
+
+    if (repl == NULL)
+    {
+        DEBUG_PRINT("Failed to allocate replication state");
+        return NULL;
+    }
+    repl->ctx = ctx;
+    repl->lfd = -1;
+    if (repl_resolve(repl, addr, 0) < 0)
+    {
+        free(repl);
+        return NULL;
+    }
+
+    ctx->read_only = 1;
+    if (pthread_create(&repl->tid, NULL, repl_follow, repl) != 0)
+    {
+        ctx->read_only = 0;
+        free(repl);
+        return NULL;
+    }
+
+    printf("Following primary at %s\n", addr);
+    return repl;
+}
+/*---------------------------------------------------------------------------*/
+void skvs_repl_stop(struct skvs_repl *repl)
+{
+    TRACE_PRINT();
+
+    if (repl == NULL)
+    {
+        return;
+    }
+    __atomic_store_n(&repl->stop, 1, __ATOMIC_RELEASE);
+    pthread_join(repl->tid, NULL);
+
+    if (repl->is_primary)
+    {
+        hash_set_write_hook(repl->ctx->table, NULL, NULL);
+        close(repl->lfd);
+        if (repl->unix_path[0])
+        {
+            unlink(repl->unix_path);
+        }
+        pthread_cond_destroy(&repl->log.appended);
+        pthread_mutex_destroy(&repl->log.lock);
+        free(repl->log.buf);
+    }
+    free(repl);
+}
@@ -0,0 +1,58 @@
+/*---------------------------------------------------------------------------*/
+/* skvsrepl.h                                                                */
+/* Author: Kim Sungjin                                                       */
+/*---------------------------------------------------------------------------*/
+#ifndef _SKVSREPL_H
+#define _SKVSREPL_H
+/*---------------------------------------------------------------------------*/
+#include "skvslib.h"
+/*---------------------------------------------------------------------------*/
+#define REPL_LOG_SIZE (8 * MAX_BULK_LEN) // bytes of mutation log kept
+#define REPL_BATCH_SIZE (64 * 1024)     // most log bytes sent per write
+#define REPL_RETRY_SEC 1                // follower reconnect interval
+#define REPL_STALL_SEC 10               // follower may block writes this long
+/*---------------------------------------------------------------------------*/
+/*
+ * replication stream, primary to follower, one record per line:
+ *   SET <key> <value>   key holds value (sent for inserts and updates)
+ *   PUT <key> <len>     key holds the bulk value in the next len bytes,
+ *                       which are followed by a line feed
+ *   ZIP <key> <len> <raw_len> <bulk>
+ *                       same as PUT for a value stored compressed, which
+ *                       is raw_len bytes long before compression; bulk
+ *                       is 1 when it was stored with bulk framing
+ *   DEL <key>           key was deleted
+ *   SYNCED              the initial snapshot is complete
+ * a follower first receives every entry of the table as SET, PUT or ZIP
+ * records and then the log from the position registered before the
+ * snapshot started.
+ * records are idempotent, so writes seen by both converge.
+ *
+ * an address is a unix socket path when it contains '/' or starts with
+ * '@' (abstract), otherwise "host:port" or just "port".
+ */
+/*---------------------------------------------------------------------------*/
+struct skvs_repl;
+/*---------------------------------------------------------------------------*/
+/**
+ * logs every write to ctx and serves followers connecting to addr.
+ * must be called before the workers start.
+ * returns NULL when any internal errors occur.
+ * returns the replication handle on success.
+ */
+struct skvs_repl *skvs_repl_primary(struct skvs_ctx *ctx, const char *addr);
+/*---------------------------------------------------------------------------*/
+/**
+ * makes ctx a read-only replica of the primary at addr. the table is
+ * resynchronized from scratch whenever the connection is re-established.
+ * returns NULL when any internal errors occur.
+ * returns the replication handle on success.
+ */
+struct skvs_repl *skvs_repl_follow(struct skvs_ctx *ctx, const char *addr);
+/*---------------------------------------------------------------------------*/
+/**
+ * stops replication threads, closes their sockets and frees repl.
+ */
+void skvs_repl_stop(struct skvs_repl *repl);
+/*---------------------------------------------------------------------------*/
+#endif // _SKVSREPL_H
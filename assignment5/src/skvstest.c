@@ -0,0 +1,659 @@
+/*---------------------------------------------------------------------------*/
+/* skvstest.c                                                                */
+/* Author: Kim Sungjin                                                       */
+/*                                                                           */
+/* Concurrency stress test for the hash table. Worker threads run seeded    */
+/* random CREATE/READ/UPDATE/DELETE mixes on a few hot keys while yielding   */
+/* at random points, every operation is recorded with logical invocation     */
+/* and response times, and each key's history is then checked for            */
+/* linearizability against a sequential model (Wing & Gong with Lowe's       */
+/* memoization). The run also reports ops/sec, so it doubles as a            */
+/* microbenchmark; build it with `make tsan` to run under ThreadSanitizer.   */
+/* With -R the table is resized back and forth while the workers run.        */
+/*---------------------------------------------------------------------------*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sched.h>
+#include <getopt.h>
+#include <time.h>
+#include <unistd.h>
+#include "hashtable.h"
+/*---------------------------------------------------------------------------*/
+#define DEFAULT_THREADS 8
+#define DEFAULT_OPS 500
+#define DEFAULT_KEYS 8
+#define DEFAULT_ROUNDS 20
+#define DEFAULT_TEST_HASH_SIZE 4 // few buckets so that keys share locks
+#define DEFAULT_YIELD 20         // percent of operations preceded by a yield
+#define STALL_SECONDS 10         // no progress this long means a deadlock
+/*---------------------------------------------------------------------------*/
+enum OP
+{
+    OP_INSERT,
+    OP_SEARCH,
+    OP_UPDATE,
+    OP_DELETE,
+    OP_COUNT
+};
+static const char *g_op_names[OP_COUNT] = {"CREATE", "READ", "UPDATE",
+                                           "DELETE"};
+/*---------------------------------------------------------------------------*/
+/* one completed operation. values are encoded as "v<id>", id 0 = absent */
+struct record
+{
+    int op;
+    int key;
+    long arg;  // value id written by CREATE/UPDATE
+    long out;  // value id returned by READ
+    int ret;   // return value of the hash_* call
+    uint64_t call;
+    uint64_t resp;
+};
+/*---------------------------------------------------------------------------*/
+struct tester
+{
+    pthread_t tid;
+    int idx;
+    unsigned int seed;
+    struct record *hist;
+    long nhist;
+};
+/*---------------------------------------------------------------------------*/
+static hashtable_t *g_table;
+static int g_threads = DEFAULT_THREADS;
+static long g_ops = DEFAULT_OPS;
+static int g_keys = DEFAULT_KEYS;
+static int g_yield = DEFAULT_YIELD;
+static int g_check = 1;
+static int g_resize = 0;    // resize the table during each round
+static int g_resizing;      // the resizer runs until this is cleared
+
+static uint64_t g_clock;    // logical clock ordering calls and responses
+static long g_progress;     // completed operations, read by the watchdog
+static pthread_barrier_t g_start;
+/*---------------------------------------------------------------------------*/
+static double now_sec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+/*---------------------------------------------------------------------------*/
+static inline uint64_t tick(void)
+{
+    return __atomic_fetch_add(&g_clock, 1, __ATOMIC_SEQ_CST);
+}
+/*---------------------------------------------------------------------------*/
+/* perturbs the schedule: yield the CPU or spin for a random while */
+static inline void perturb(unsigned int *seed)
+{
+    int r = rand_r(seed) % 100;
+    volatile int spin;
+
+    if (r < g_yield)
+    {
+        sched_yield();
+    }
+    else if (r < g_yield + 10)
+    {
+        for (spin = rand_r(seed) % 1000; spin > 0; spin--)
+            ;
+    }
+}
+/*---------------------------------------------------------------------------*/
+static void *run_tester(void *arg)
+{
+    struct tester *t = arg;
+    hash_cache_t *cache = hash_cache_create();
+    char key[MAX_KEY_LEN + 1], value[32];
+    const char *found;
+    struct record *r, scratch;
+    long i;
+
+    if (cache == NULL)
+    {
+        fprintf(stderr, "Failed to allocate read cache\n");
+        exit(EXIT_FAILURE);
+    }
+    pthread_barrier_wait(&g_start);
+
+    for (i = 0; i < g_ops; i++)
+    {
+        r = g_check ? &t->hist[t->nhist++] : &scratch;
+        r->op = rand_r(&t->seed) % OP_COUNT;
+        r->key = rand_r(&t->seed) % g_keys;
+        r->arg = (long)t->idx * g_ops + i + 1; // unique over the run
+        r->out = 0;
+        snprintf(key, sizeof(key), "k%d", r->key);
+        snprintf(value, sizeof(value), "v%ld", r->arg);
+
+        if (g_yield)
+        {
+            perturb(&t->seed);
+        }
+
+        if (g_check)
+        {
+            r->call = tick();
+        }
+        switch (r->op)
+        {
+        case OP_INSERT:
+            r->ret = hash_insert(g_table, key, value);
+            break;
+        case OP_SEARCH:
+            /* the cached path copies the value under the lock, so the
+             * result cannot be freed by a concurrent writer */
+            r->ret = hash_search_cached(g_table, cache, key, &found);
+            if (r->ret > 0)
+            {
+                r->out = atol(found + 1);
+            }
+            break;
+        case OP_UPDATE:
+            r->ret = hash_update(g_table, key, value);
+            break;
+        case OP_DELETE:
+            r->ret = hash_delete(g_table, key);
+            break;
+        }
+        if (g_check)
+        {
+            r->resp = tick();
+        }
+        __atomic_add_fetch(&g_progress, 1, __ATOMIC_RELAXED);
+    }
+
+    hash_cache_destroy(cache);
+    return NULL;
+}
+/*---------------------------------------------------------------------------*/
+/* resizes the table between a few sizes, small ones included, so that
+ * operations race with buckets being moved */
+static void *run_resizer(void *arg)
+{
+    static const size_t sizes[] = {1, 7, 64, 3, 16};
+    size_t base = *(size_t *)arg;
+    int i;
+
+    for (i = 0; __atomic_load_n(&g_resizing, __ATOMIC_RELAXED); i++)
+    {
+        if (hash_resize(g_table, i % 2 ? sizes[i / 2 % 5] : base) < 0)
+        {
+            fprintf(stderr, "hash_resize failed\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    return NULL;
+}
+/*---------------------------------------------------------------------------*/
+/* applies op to the sequential model of one key whose current value id is
+ * *state (0 = absent). returns 1 when the recorded result is possible. */
+static int model_apply(const struct record *r, long *state)
+{
+    switch (r->op)
+    {
+    case OP_INSERT:
+        if (*state == 0)
+        {
+            if (r->ret != 1)
+                return 0;
+            *state = r->arg;
+            return 1;
+        }
+        return r->ret == 0;
+    case OP_SEARCH:
+        if (*state == 0)
+            return r->ret == 0;
+        return r->ret == 1 && r->out == *state;
+    case OP_UPDATE:
+        if (*state == 0)
+            return r->ret == 0;
+        if (r->ret != 1)
+            return 0;
+        *state = r->arg;
+        return 1;
+    case OP_DELETE:
+        if (*state == 0)
+            return r->ret == 0;
+        if (r->ret != 1)
+            return 0;
+        *state = 0;
+        return 1;
+    }
+    return 0;
+}
+/*---------------------------------------------------------------------------*/
+/* memo of visited (linearized set, state) configurations */
+struct memo
+{
+    uint64_t *bits;  // slots * words
+    long *states;
+    char *used;
+    size_t slots;
+    size_t count;
+    int words;
+};
+/*---------------------------------------------------------------------------*/
+static uint64_t memo_hash(const uint64_t *bits, int words, long state)
+{
+    uint64_t h = 1469598103934665603ULL ^ (uint64_t)state;
+    int i;
+
+    for (i = 0; i < words; i++)
+    {
+        h ^= bits[i];
+        h *= 1099511628211ULL;
+        h ^= h >> 29;
+    }
+    return h;
+}
+/*---------------------------------------------------------------------------*/
+static void memo_init(struct memo *m, int words, size_t slots)
+{
+    m->words = words;
+    m->slots = slots;
+    m->count = 0;
+    m->bits = calloc(slots * words, sizeof(uint64_t));
+    m->states = calloc(slots, sizeof(long));
+    m->used = calloc(slots, 1);
+    if (!m->bits || !m->states || !m->used)
+    {
+        fprintf(stderr, "Out of memory for linearizability check\n");
+        exit(EXIT_FAILURE);
+    }
+}
+/*---------------------------------------------------------------------------*/
+static void memo_free(struct memo *m)
+{
+    free(m->bits);
+    free(m->states);
+    free(m->used);
+}
+/*---------------------------------------------------------------------------*/
+/* inserts a configuration. returns 0 when it was already visited. */
+static int memo_add(struct memo *m, const uint64_t *bits, long state)
+{
+    struct memo grown;
+    size_t i, slot;
+
+    if (2 * (m->count + 1) > m->slots)
+    {
+        memo_init(&grown, m->words, 2 * m->slots);
+        for (i = 0; i < m->slots; i++)
+        {
+            if (m->used[i])
+            {
+                memo_add(&grown, &m->bits[i * m->words], m->states[i]);
+            }
+        }
+        memo_free(m);
+        *m = grown;
+    }
+
+    slot = memo_hash(bits, m->words, state) & (m->slots - 1);
+    while (m->used[slot])
+    {
+        if (m->states[slot] == state &&
+            memcmp(&m->bits[slot * m->words], bits,
+                   m->words * sizeof(uint64_t)) == 0)
+        {
+            return 0;
+        }
+        slot = (slot + 1) & (m->slots - 1);
+    }
+    m->used[slot] = 1;
+    m->states[slot] = state;
+    memcpy(&m->bits[slot * m->words], bits, m->words * sizeof(uint64_t));
+    m->count++;
+    return 1;
+}
+/*---------------------------------------------------------------------------*/
+/* call and return events of one key, doubly linked in time order */
+struct event
+{
+    uint64_t time;
+    int rec;      // index into the key history
+    int is_call;
+    int match;    // for a call, the index of its return event
+    int prev;
+    int next;
+};
+/*---------------------------------------------------------------------------*/
+static int event_cmp(const void *a, const void *b)
+{
+    const struct event *x = a, *y = b;
+
+    return x->time < y->time ? -1 : x->time > y->time;
+}
+/*---------------------------------------------------------------------------*/
+static void lift(struct event *ev, int e)
+{
+    int m = ev[e].match;
+
+    ev[ev[e].prev].next = ev[e].next;
+    ev[ev[e].next].prev = ev[e].prev;
+    ev[ev[m].prev].next = ev[m].next;
+    if (ev[m].next >= 0)
+        ev[ev[m].next].prev = ev[m].prev;
+}
+/*---------------------------------------------------------------------------*/
+static void unlift(struct event *ev, int e)
+{
+    int m = ev[e].match;
+
+    if (ev[m].next >= 0)
+        ev[ev[m].next].prev = m;
+    ev[ev[m].prev].next = m;
+    ev[ev[e].next].prev = e;
+    ev[ev[e].prev].next = e;
+}
+/*---------------------------------------------------------------------------*/
+/* checks that the n operations on one key are linearizable.
+ * returns 1 when they are, 0 otherwise. */
+static int check_key(struct record **ops, int n)
+{
+    struct event *ev;
+    struct memo memo;
+    uint64_t *bits;
+    int *stack_ev;
+    long *stack_state;
+    long state = 0, next_state;
+    int *ret_of;
+    int i, e, top = 0, words, ok = 1;
+
+    if (n == 0)
+    {
+        return 1;
+    }
+
+    /* event 0 is the list head */
+    ev = calloc(2 * n + 1, sizeof(struct event));
+    ret_of = calloc(n, sizeof(int));
+    for (i = 0; i < n; i++)
+    {
+        ev[1 + 2 * i] = (struct event){ops[i]->call, i, 1, 0, 0, 0};
+        ev[2 + 2 * i] = (struct event){ops[i]->resp, i, 0, 0, 0, 0};
+    }
+    qsort(ev + 1, 2 * n, sizeof(struct event), event_cmp);
+    for (i = 1; i <= 2 * n; i++)
+    {
+        if (!ev[i].is_call)
+            ret_of[ev[i].rec] = i;
+    }
+    for (i = 0; i <= 2 * n; i++)
+    {
+        if (i > 0 && ev[i].is_call)
+            ev[i].match = ret_of[ev[i].rec];
+        ev[i].prev = i - 1;
+        ev[i].next = i < 2 * n ? i + 1 : -1;
+    }
+
+    words = (n + 63) / 64;
+    bits = calloc(words, sizeof(uint64_t));
+    stack_ev = calloc(n, sizeof(int));
+    stack_state = calloc(n, sizeof(long));
+    memo_init(&memo, words, 1024);
+
+    e = ev[0].next;
+    while (ev[0].next >= 0)
+    {
+        if (ev[e].is_call)
+        {
+            next_state = state;
+            if (model_apply(ops[ev[e].rec], &next_state))
+            {
+                bits[ev[e].rec / 64] |= 1ULL << (ev[e].rec % 64);
+                if (memo_add(&memo, bits, next_state))
+                {
+                    stack_ev[top] = e;
+                    stack_state[top++] = state;
+                    state = next_state;
+                    lift(ev, e);
+                    e = ev[0].next;
+                    continue;
+                }
+                bits[ev[e].rec / 64] &= ~(1ULL << (ev[e].rec % 64));
+            }
+            e = ev[e].next;
+        }
+        else
+        {
+            /* an operation returned before any order could explain it */
+            if (top == 0)
+            {
+                ok = 0;
+                break;
+            }
+            e = stack_ev[--top];
+            state = stack_state[top];
+            bits[ev[e].rec / 64] &= ~(1ULL << (ev[e].rec % 64));
+            unlift(ev, e);
+            e = ev[e].next;
+        }
+    }
+
+    memo_free(&memo);
+    free(stack_ev);
+    free(stack_state);
+    free(bits);
+    free(ret_of);
+    free(ev);
+    return ok;
+}
+/*---------------------------------------------------------------------------*/
+static void dump_key(struct record **ops, int n, int key)
+{
+    int i;
+
+    fprintf(stderr, "history of k%d:\n", key);
+    for (i = 0; i < n; i++)
+    {
+        fprintf(stderr, "  [%6lu, %6lu] %-6s v%-6ld -> ret %d v%ld\n",
+                (unsigned long)ops[i]->call, (unsigned long)ops[i]->resp,
+                g_op_names[ops[i]->op],
+                ops[i]->op == OP_INSERT || ops[i]->op == OP_UPDATE
+                    ? ops[i]->arg : 0,
+                ops[i]->ret,
+                ops[i]->out);
+    }
+}
+/*---------------------------------------------------------------------------*/
+/* splits the recorded histories by key and checks each of them.
+ * linearizability is local, so per-key checks cover the whole table.
+ * returns the number of keys that failed. */
+static int check_histories(struct tester *testers)
+{
+    struct record **ops = malloc(g_threads * g_ops * sizeof(*ops));
+    int key, t, n, failed = 0;
+    long i;
+
+    for (key = 0; key < g_keys; key++)
+    {
+        n = 0;
+        for (t = 0; t < g_threads; t++)
+        {
+            for (i = 0; i < testers[t].nhist; i++)
+            {
+                if (testers[t].hist[i].key == key)
+                    ops[n++] = &testers[t].hist[i];
+            }
+        }
+        if (!check_key(ops, n))
+        {
+            fprintf(stderr, "k%d: history is not linearizable\n", key);
+            dump_key(ops, n, key);
+            failed++;
+        }
+    }
+
+    free(ops);
+    return failed;
+}
+/*---------------------------------------------------------------------------*/
+static void *watchdog(void *arg)
+{
+    long last = -1, now;
+    int idle = 0;
+
+    while (1)
+    {
+        sleep(1);
+        now = __atomic_load_n(&g_progress, __ATOMIC_RELAXED);
+        idle = now == last ? idle + 1 : 0;
+        last = now;
+        if (idle >= STALL_SECONDS)
+        {
+            fprintf(stderr, "No progress for %d seconds after %ld "
+                    "operations: deadlock?\n", STALL_SECONDS, now);
+            exit(EXIT_FAILURE);
+        }
+    }
+    return NULL;
+}
+/*---------------------------------------------------------------------------*/
+int main(int argc, char *argv[])
+{
+    struct tester *testers;
+    pthread_t wd, resizer;
+    size_t hash_size = DEFAULT_TEST_HASH_SIZE;
+    unsigned int seed = (unsigned int)time(NULL);
+    int rounds = DEFAULT_ROUNDS;
+    int opt, round, i, failed = 0;
+    long total = 0;
+    double start, elapsed = 0;
+
+    while ((opt = getopt(argc, argv, "t:n:k:r:s:S:y:Rbh")) != -1)
+    {
+        switch (opt)
+        {
+        case 't':
+            g_threads = atoi(optarg);
+            break;
+        case 'n':
+            g_ops = atol(optarg);
+            break;
+        case 'k':
+            g_keys = atoi(optarg);
+            break;
+        case 'r':
+            rounds = atoi(optarg);
+            break;
+        case 's':
+            seed = (unsigned int)strtoul(optarg, NULL, 10);
+            break;
+        case 'S':
+            hash_size = atoi(optarg);
+            break;
+        case 'y':
+            g_yield = atoi(optarg);
+            break;
+        case 'R':
+            g_resize = 1;
+            break;
+        case 'b':
+            /* benchmark only: no history, no logical clock, no yields */
+            g_check = 0;
+            g_yield = 0;
+            break;
+        case 'h':
+        default:
+            printf("Usage: %s [-t threads (%d)] [-n ops_per_thread (%d)] "
+                   "[-k keys (%d)] [-r rounds (%d)] [-s seed] "
+                   "[-S hash_size (%d)] [-y yield_percent (%d)] "
+                   "[-R resize while running] [-b benchmark only]\n",
+                   argv[0], DEFAULT_THREADS, DEFAULT_OPS, DEFAULT_KEYS,
+                   DEFAULT_ROUNDS, DEFAULT_TEST_HASH_SIZE, DEFAULT_YIELD);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (g_threads <= 0 || g_ops <= 0 || g_keys <= 0 || rounds <= 0 ||
+        hash_size <= 0)
+    {
+        fprintf(stderr, "Invalid test parameters\n");
+        exit(EXIT_FAILURE);
+    }
+
+    printf("seed %u, %d threads x %ld ops, %d keys, %zu buckets%s, "
+           "%d rounds\n", seed, g_threads, g_ops, g_keys, hash_size,
+           g_resize ? " (resizing)" : "", rounds);
+
+    testers = calloc(g_threads, sizeof(struct tester));
+    for (i = 0; i < g_threads; i++)
+    {
+        testers[i].hist = g_check ? calloc(g_ops, sizeof(struct record))
+                                  : NULL;
+    }
+    pthread_create(&wd, NULL, watchdog, NULL);
+    pthread_detach(wd);
+
+    for (round = 0; round < rounds && !failed; round++)
+    {
+        /* every tester may wait for one bucket, and so may the resizer */
+        g_table = hash_init(hash_size, 0, g_threads + g_resize);
+        if (g_table == NULL)
+        {
+            fprintf(stderr, "hash_init failed\n");
+            exit(EXIT_FAILURE);
+        }
+        g_clock = 0;
+        pthread_barrier_init(&g_start, NULL, g_threads + 1);
+        for (i = 0; i < g_threads; i++)
+        {
+            testers[i].idx = i;
+            testers[i].seed = seed + round * g_threads + i;
+            testers[i].nhist = 0;
+            pthread_create(&testers[i].tid, NULL, run_tester, &testers[i]);
+        }
+
+        pthread_barrier_wait(&g_start);
+        start = now_sec();
+        if (g_resize)
+        {
+            g_resizing = 1;
+            pthread_create(&resizer, NULL, run_resizer, &hash_size);
+        }
+        for (i = 0; i < g_threads; i++)
+        {
+            pthread_join(testers[i].tid, NULL);
+        }
+        elapsed += now_sec() - start;
+        if (g_resize)
+        {
+            __atomic_store_n(&g_resizing, 0, __ATOMIC_RELAXED);
+            pthread_join(resizer, NULL);
+        }
+        total += g_threads * g_ops;
+        pthread_barrier_destroy(&g_start);
+
+        if (g_check)
+        {
+            failed = check_histories(testers);
+            if (failed)
+            {
+                fprintf(stderr, "round %d (seed %u) failed\n", round, seed);
+            }
+        }
+        hash_destroy(g_table);
+    }
+
+    printf("%ld ops in %.3f s: %.0f ops/sec%s\n", total, elapsed,
+           total / elapsed, g_check ? " (with history recording)" : "");
+    if (g_check)
+    {
+        printf(failed ? "FAILED: non-linearizable history\n"
+                      : "PASSED: all histories linearizable\n");
+    }
+
+    for (i = 0; i < g_threads; i++)
+    {
+        free(testers[i].hist);
+    }
+    free(testers);
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
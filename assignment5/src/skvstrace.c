@@ -0,0 +1,158 @@
+/*---------------------------------------------------------------------------*/
+/* skvstrace.c                                                               */
+/* Author: Kim Sungjin                                                       */
+/*---------------------------------------------------------------------------*/
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include "skvstrace.h"
+#include "common.h"
+/*---------------------------------------------------------------------------*/
+__thread struct skvs_trace *t_trace_active;
+/* ring whose sampled response waits for the next write */
+static __thread struct skvs_trace *t_trace_write;
+/*---------------------------------------------------------------------------*/
+static const char *g_stage_names[TRACE_STAGE_COUNT] = {
+    "request",
+    "parse",
+    "table",
+    "lock wait",
+    "write"};
+/*---------------------------------------------------------------------------*/
+void skvs_trace_end(int stage, uint64_t start)
+{
+    struct skvs_trace *trace = t_trace_active;
+    struct skvs_trace_event *ev;
+
+    if (start == 0 || trace == NULL)
+    {
+        return;
+    }
+    ev = &trace->events[trace->head & (TRACE_RING_SIZE - 1)];
+    ev->start = start;
+    ev->dur = skvs_trace_now() - start;
+    ev->req = trace->req;
+    ev->stage = stage;
+    /* an exporter only reads events below head */
+    __atomic_store_n(&trace->head, trace->head + 1, __ATOMIC_RELEASE);
+}
+/*---------------------------------------------------------------------------*/
+struct skvs_trace *skvs_trace_create(void)
+{
+    TRACE_PRINT();
+    struct skvs_trace *trace = calloc(1, sizeof(struct skvs_trace));
+
+    if (trace == NULL)
+    {
+        DEBUG_PRINT("Failed to allocate trace ring");
+        return NULL;
+    }
+    trace->tid = syscall(SYS_gettid);
+    return trace;
+}
+/*---------------------------------------------------------------------------*/
+uint64_t skvs_trace_request_begin(struct skvs_trace *trace,
+                                  unsigned int every)
+{
+    t_trace_active = NULL;
+    if (trace == NULL || every == 0 || trace->reqs++ % every != 0)
+    {
+        return 0;
+    }
+    trace->req++;
+    t_trace_active = trace;
+    return skvs_trace_now();
+}
+/*---------------------------------------------------------------------------*/
+void skvs_trace_request_end(uint64_t start)
+{
+    if (start == 0)
+    {
+        return;
+    }
+    skvs_trace_end(TRACE_STAGE_REQUEST, start);
+    t_trace_write = t_trace_active;
+    t_trace_active = NULL;
+}
+/*---------------------------------------------------------------------------*/
+uint64_t skvs_trace_write_begin(void)
+{
+    if (t_trace_write == NULL)
+    {
+        return 0;
+    }
+    t_trace_active = t_trace_write;
+    t_trace_write = NULL;
+    return skvs_trace_now();
+}
+/*---------------------------------------------------------------------------*/
+void skvs_trace_write_end(uint64_t start)
+{
+    skvs_trace_end(TRACE_STAGE_WRITE, start);
+    t_trace_active = NULL;
+}
+/*---------------------------------------------------------------------------*/
+/* writes the events of one ring that survive the copy.
+ * returns the number of events written in total. */
+static size_t trace_export_ring(struct skvs_trace *trace, FILE *out,
+                                struct skvs_trace_event *copy, size_t n)
+{
+    struct skvs_trace_event *ev;
+    unsigned long head, first, now, i, skip = 0;
+    pid_t pid = getpid();
+
+    head = __atomic_load_n(&trace->head, __ATOMIC_ACQUIRE);
+    first = head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0;
+    for (i = first; i < head; i++)
+    {
+        copy[i - first] = trace->events[i & (TRACE_RING_SIZE - 1)];
+    }
+    /* the owner kept recording; drop the slots it overwrote meanwhile,
+     * and the one it may be writing now */
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    now = __atomic_load_n(&trace->head, __ATOMIC_RELAXED) + 1;
+    if (now > first + TRACE_RING_SIZE)
+    {
+        skip = now - TRACE_RING_SIZE - first;
+    }
+
+    for (i = skip; i < head - first; i++)
+    {
+        ev = &copy[i];
+        fprintf(out, "%s{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,"
+                "\"dur\":%.3f,\"pid\":%d,\"tid\":%d,"
+                "\"args\":{\"req\":%u}}",
+                n > 0 ? ",\n" : "", g_stage_names[ev->stage],
+                ev->start / 1000.0, ev->dur / 1000.0, (int)pid,
+                trace->tid, ev->req);
+        n++;
+    }
+    return n;
+}
+/*---------------------------------------------------------------------------*/
+int skvs_trace_export(struct skvs_trace *list, FILE *out)
+{
+    TRACE_PRINT();
+    struct skvs_trace_event *copy;
+    struct skvs_trace *trace;
+    size_t n = 0;
+
+    copy = malloc(TRACE_RING_SIZE * sizeof(*copy));
+    if (copy == NULL)
+    {
+        DEBUG_PRINT("Failed to allocate trace copy");
+        return -1;
+    }
+
+    fprintf(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+    for (trace = list; trace; trace = trace->next)
+    {
+        n = trace_export_ring(trace, out, copy, n);
+    }
+    fprintf(out, "\n]}\n");
+    free(copy);
+
+    return ferror(out) ? -1 : 0;
+}
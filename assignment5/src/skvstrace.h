@@ -0,0 +1,113 @@
+/*---------------------------------------------------------------------------*/
+/* skvstrace.h                                                               */
+/* Author: Kim Sungjin                                                       */
+/*---------------------------------------------------------------------------*/
+#ifndef _SKVSTRACE_H
+#define _SKVSTRACE_H
+/*---------------------------------------------------------------------------*/
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+/*---------------------------------------------------------------------------*/
+#define TRACE_RING_SIZE 4096 // events kept per thread (power of 2)
+/*---------------------------------------------------------------------------*/
+/*
+ * sampled request tracing. one request in every n is traced: its stages
+ * are timestamped and kept in a ring owned by the serving thread, so
+ * recording takes no lock. requests that are not sampled cost one
+ * thread-local test per stage.
+ * stages nest: a request contains parse and table, table contains lock
+ * waits. the write of the batch holding a sampled response is recorded
+ * after the request.
+ */
+/*---------------------------------------------------------------------------*/
+enum TRACE_STAGE
+{
+    TRACE_STAGE_REQUEST, // one request in skvs_serve()
+    TRACE_STAGE_PARSE,   // parsing the request line
+    TRACE_STAGE_TABLE,   // the hash table operation
+    TRACE_STAGE_LOCK,    // waiting for a bucket lock
+    TRACE_STAGE_WRITE,   // the socket write carrying the response
+    TRACE_STAGE_COUNT
+};
+/*---------------------------------------------------------------------------*/
+struct skvs_trace_event
+{
+    uint64_t start; // CLOCK_MONOTONIC ns
+    uint32_t dur;   // ns
+    uint32_t req;   // sampled request number of the thread
+    int stage;
+};
+/*---------------------------------------------------------------------------*/
+/* trace ring of one thread; only its owner records into it */
+struct skvs_trace
+{
+    struct skvs_trace_event events[TRACE_RING_SIZE];
+    unsigned long head; // events ever recorded, published with release
+    unsigned long reqs; // requests seen, sampled or not
+    uint32_t req;       // number of the last sampled request
+    int tid;
+    struct skvs_trace *next;
+};
+/*---------------------------------------------------------------------------*/
+/* ring of the sampled request the calling thread is serving, or NULL */
+extern __thread struct skvs_trace *t_trace_active;
+/*---------------------------------------------------------------------------*/
+static inline uint64_t skvs_trace_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+/*---------------------------------------------------------------------------*/
+/**
+ * returns the start time of a stage when the current request is sampled.
+ * returns 0 otherwise.
+ */
+static inline uint64_t skvs_trace_begin(void)
+{
+    return t_trace_active ? skvs_trace_now() : 0;
+}
+/*---------------------------------------------------------------------------*/
+/**
+ * records a stage begun at start, unless start is 0.
+ */
+void skvs_trace_end(int stage, uint64_t start);
+/*---------------------------------------------------------------------------*/
+/**
+ * allocates a trace ring for the calling thread.
+ * returns NULL when any internal errors occur.
+ */
+struct skvs_trace *skvs_trace_create(void);
+/*---------------------------------------------------------------------------*/
+/**
+ * samples one request in every `every` served by the owner of trace.
+ * returns the start time of a sampled request, 0 otherwise.
+ */
+uint64_t skvs_trace_request_begin(struct skvs_trace *trace,
+                                  unsigned int every);
+/*---------------------------------------------------------------------------*/
+/**
+ * ends the request begun at start, and marks its response as the one
+ * the next skvs_trace_write_begin() on this thread belongs to.
+ */
+void skvs_trace_request_end(uint64_t start);
+/*---------------------------------------------------------------------------*/
+/**
+ * brackets a socket write. only writes carrying a sampled response are
+ * recorded; skvs_trace_write_begin() returns 0 for the others.
+ */
+uint64_t skvs_trace_write_begin(void);
+void skvs_trace_write_end(uint64_t start);
+/*---------------------------------------------------------------------------*/
+/**
+ * writes the events of every ring in the list as Chrome trace JSON,
+ * which chrome://tracing and Perfetto load. rings may be recording
+ * meanwhile; events overwritten during the export are left out.
+ * returns -1 when any internal errors occur.
+ * returns 0 on success.
+ */
+int skvs_trace_export(struct skvs_trace *list, FILE *out);
+/*---------------------------------------------------------------------------*/
+#endif // _SKVSTRACE_H